@@ -41,6 +41,7 @@ public:
         auto operator !() const { return !m_mdl; }
 
         auto get() const { return m_mdl; }
+        auto managed() const { return !m_tail; } // false if MDL of the caller is used, @see Mdl(MDL*)
 
         auto vaddr() const { return m_mdl ? MmGetMdlVirtualAddress(m_mdl) : nullptr; }
         auto size() const { return m_mdl ? MmGetMdlByteCount(m_mdl) : 0; }
@@ -63,7 +64,6 @@ private:
         MDL *release();
         void reset(_In_opt_ MDL *mdl, _In_opt_ MDL *tail);
 
-        auto managed() const { return !m_tail; }
         bool nonmanaged() const { return m_tail; }
 
         bool locked() const { return m_mdl->MdlFlags & MDL_PAGES_LOCKED; }
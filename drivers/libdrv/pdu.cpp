@@ -3,7 +3,6 @@
  */
 
 #include "pdu.h"
-#include <usbip\proto.h>
 
 #include <intrin.h>
 #include <wdm.h>
@@ -11,10 +10,64 @@
 namespace
 {
 
+/*
+ * x64 kernel can use XMM registers without KeSaveExtendedProcessorState, YMM registers (AVX/AVX2) can't.
+ * Saving of extended state costs more than it saves for 16KB (1024 isoch descriptors), so AVX2 is not used.
+ */
+#if defined(_M_X64)
+
+inline auto has_ssse3()
+{
+	return ExIsProcessorFeaturePresent(PF_SSSE3_INSTRUCTIONS_AVAILABLE);
+}
+
+/*
+ * Reverse bytes of each UINT32 in 128-bit vector.
+ */
+inline auto byteswap_ulong_mask()
+{
+	return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+}
+
+inline void byteswap_ssse3(_Inout_updates_(cnt) usbip_iso_packet_descriptor *d, _In_ size_t cnt)
+{
+	static_assert(sizeof(*d) == sizeof(__m128i));
+	auto mask = byteswap_ulong_mask();
+
+	for (auto v = reinterpret_cast<__m128i*>(d), end = v + cnt; v != end; ++v) {
+		auto val = _mm_loadu_si128(v);
+		_mm_storeu_si128(v, _mm_shuffle_epi8(val, mask));
+	}
+}
+
+/*
+ * usbip_header_cmd_submit and usbip_header_ret_submit have the same layout:
+ * usbip_header_basic and five UINT32 are byteswapped, setup[8] is not.
+ */
+inline void byteswap_submit_ssse3(_Inout_ usbip_header &hdr)
+{
+	static_assert(offsetof(usbip_header, u.cmd_submit.setup) == 2*sizeof(__m128i) + 2*sizeof(UINT32));
+	static_assert(sizeof(usbip_header_basic) + sizeof(usbip_header_ret_submit) == offsetof(usbip_header, u.cmd_submit.setup));
+
+	auto mask = byteswap_ulong_mask();
+	auto v = reinterpret_cast<__m128i*>(&hdr);
+
+	for (auto end = v + 2; v != end; ++v) {
+		auto val = _mm_loadu_si128(v);
+		_mm_storeu_si128(v, _mm_shuffle_epi8(val, mask));
+	}
+
+	for (auto val = reinterpret_cast<UINT32*>(v), end = val + 2; val != end; ++val) {
+		*val = RtlUlongByteSwap(*val);
+	}
+}
+
+#endif // _M_X64
+
 void byteswap(usbip_header_basic &r) 
 {
         UINT32* v[]{ &r.command, &r.seqnum, &r.devid, &r.direction, &r.ep };
-        static_assert(sizeof(*v[0]) == sizeof(unsigned long));
+        static_assert(sizeof(*v[0]) == sizeof(ULONG));
 
         for (auto val: v) {
 		*val = RtlUlongByteSwap(*val); // _byteswap_ulong
@@ -23,11 +76,11 @@ void byteswap(usbip_header_basic &r)
 
 void byteswap(usbip_header_cmd_submit &r) 
 {
-	static_assert(sizeof(r.transfer_flags) == sizeof(unsigned long));
+	static_assert(sizeof(r.transfer_flags) == sizeof(ULONG));
 	r.transfer_flags = RtlUlongByteSwap(r.transfer_flags);
 
         INT32 *v[] {&r.transfer_buffer_length, &r.start_frame, &r.number_of_packets, &r.interval};
-        static_assert(sizeof(*v[0]) == sizeof(unsigned long));
+        static_assert(sizeof(*v[0]) == sizeof(ULONG));
 
 	for (auto val: v) {
 		*val = RtlUlongByteSwap(*val);
@@ -37,7 +90,7 @@ void byteswap(usbip_header_cmd_submit &r)
 void byteswap(usbip_header_ret_submit &r) 
 {
         INT32 *v[] {&r.status, &r.actual_length, &r.start_frame, &r.number_of_packets, &r.error_count};
-        static_assert(sizeof(*v[0]) == sizeof(unsigned long));
+        static_assert(sizeof(*v[0]) == sizeof(ULONG));
 
 	for (auto val: v) {
 		*val = RtlUlongByteSwap(*val);
@@ -46,13 +99,13 @@ void byteswap(usbip_header_ret_submit &r)
 
 inline void byteswap(usbip_header_cmd_unlink &r) 
 {
-	static_assert(sizeof(r.seqnum) == sizeof(unsigned long));
+	static_assert(sizeof(r.seqnum) == sizeof(ULONG));
 	r.seqnum = RtlUlongByteSwap(r.seqnum);
 }
 
 inline void byteswap(usbip_header_ret_unlink &r) 
 {
-	static_assert(sizeof(r.status) == sizeof(unsigned long));
+	static_assert(sizeof(r.status) == sizeof(ULONG));
 	r.status = RtlUlongByteSwap(r.status);
 }
 
@@ -61,6 +114,14 @@ inline void byteswap(usbip_header_ret_unlink &r)
 
 void byteswap_header(usbip_header &hdr, swap_dir dir) 
 {
+#if defined(_M_X64)
+	if (auto cmd = dir == swap_dir::net2host ? RtlUlongByteSwap(hdr.base.command) : hdr.base.command;
+	    (cmd == USBIP_CMD_SUBMIT || cmd == USBIP_RET_SUBMIT) && has_ssse3()) {
+		byteswap_submit_ssse3(hdr);
+		return;
+	}
+#endif
+
 	if (dir == swap_dir::net2host) {
 		byteswap(hdr.base);
 	}
@@ -87,10 +148,17 @@ void byteswap_header(usbip_header &hdr, swap_dir dir)
 
 void byteswap(usbip_iso_packet_descriptor *d, size_t cnt) 
 {
+#if defined(_M_X64)
+	if (has_ssse3()) {
+		byteswap_ssse3(d, cnt);
+		return;
+	}
+#endif
+
 	for (size_t i = 0; i < cnt; ++i, ++d) {
 
 		UINT32 *v[] {&d->offset, &d->length, &d->actual_length, &d->status};
-		static_assert(sizeof(*v[0]) == sizeof(unsigned long));
+		static_assert(sizeof(*v[0]) == sizeof(ULONG));
 
 		for (auto val: v) {
 			*val = RtlUlongByteSwap(*val);
@@ -150,3 +218,34 @@ size_t get_payload_size(const usbip_header &hdr)
 {
 	return get_total_size(hdr) - sizeof(hdr);
 }
+
+void set_cmd_submit_header(
+	usbip_header &hdr, seqnum_t seqnum, UINT32 devid, usbip_dir dir, UINT32 ep,
+	UINT32 transfer_flags, INT32 transfer_buffer_length, INT32 interval)
+{
+	auto &b = hdr.base;
+	b.command = USBIP_CMD_SUBMIT;
+	b.seqnum = seqnum;
+	b.devid = devid;
+	b.direction = dir;
+	b.ep = ep;
+
+	auto &r = hdr.u.cmd_submit;
+	r = {};
+	r.transfer_flags = transfer_flags;
+	r.transfer_buffer_length = transfer_buffer_length;
+	r.number_of_packets = number_of_packets_non_isoch;
+	r.interval = interval;
+}
+
+void set_cmd_unlink_header(usbip_header &hdr, seqnum_t seqnum, UINT32 devid, seqnum_t seqnum_unlink)
+{
+	auto &b = hdr.base;
+	b.command = USBIP_CMD_UNLINK;
+	b.seqnum = seqnum;
+	b.devid = devid;
+	b.direction = USBIP_DIR_OUT;
+	b.ep = 0;
+
+	hdr.u.cmd_unlink.seqnum = seqnum_unlink;
+}
@@ -4,8 +4,7 @@
 
 #pragma once
 
-struct usbip_header;
-struct usbip_iso_packet_descriptor;
+#include <usbip/proto.h> // is also built by tools/
 
 enum class swap_dir { host2net, net2host };
 void byteswap_header(usbip_header &hdr, swap_dir dir);
@@ -20,3 +19,13 @@ size_t get_isoc_descr(usbip_iso_packet_descriptor* &isoc, usbip_header &hdr);
 
 size_t get_payload_size(const usbip_header &hdr);
 size_t get_total_size(const usbip_header &hdr);
+
+/*
+ * Header of CMD_SUBMIT for non-isoch transfer, setup packet is zeroed.
+ * These functions do not depend on the driver's context, tools/loadgen uses them as well.
+ */
+void set_cmd_submit_header(
+	usbip_header &hdr, seqnum_t seqnum, UINT32 devid, usbip_dir dir, UINT32 ep,
+	UINT32 transfer_flags, INT32 transfer_buffer_length, INT32 interval);
+
+void set_cmd_unlink_header(usbip_header &hdr, seqnum_t seqnum, UINT32 devid, seqnum_t seqnum_unlink);
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "pdu_stream.h"
+
+#include <wdm.h>
+
+namespace
+{
+
+/*
+ * The drivers encode direction in the lowest bit of seqnum, @see next_seqnum.
+ */
+constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
+constexpr auto extract_dir(seqnum_t seqnum) { return usbip_dir(seqnum & 1); }
+
+} // namespace
+
+
+bool take_header(recv_buffer &rx, usbip_header &hdr, ULONG &received)
+{
+	NT_ASSERT(received < sizeof(hdr));
+
+	auto cnt = ULONG(sizeof(hdr)) - received;
+	if (cnt > rx.size()) {
+		cnt = rx.size();
+	}
+
+	RtlCopyMemory(reinterpret_cast<UCHAR*>(&hdr) + received, rx.ptr(), cnt);
+	rx.head += cnt;
+
+	if ((received += cnt) < sizeof(hdr)) {
+		return false;
+	}
+
+	received = 0;
+	return true;
+}
+
+ULONG compact(recv_buffer &rx)
+{
+	if (auto len = rx.size(); len && rx.head) {
+		RtlMoveMemory(rx.data, rx.ptr(), len);
+	}
+
+	rx.tail = rx.size();
+	rx.head = 0;
+
+	return rx.SIZE - rx.tail;
+}
+
+ret_header_status validate_ret_header(usbip_header &hdr)
+{
+	byteswap_header(hdr, swap_dir::net2host);
+
+	auto &base = hdr.base;
+
+	switch (base.command) {
+	case USBIP_RET_SUBMIT: {
+		auto &ret = hdr.u.ret_submit;
+		if (ret.number_of_packets == number_of_packets_non_isoch) {
+			ret.number_of_packets = 0;
+		} else if (!is_valid_number_of_packets(ret.number_of_packets)) {
+			return RET_HDR_BAD_NUMBER_OF_PACKETS;
+		}
+	}	break;
+	case USBIP_RET_UNLINK:
+		break;
+	default:
+		return RET_HDR_BAD_COMMAND;
+	}
+
+	if (!extract_num(base.seqnum)) {
+		return RET_HDR_BAD_SEQNUM;
+	}
+
+	base.direction = extract_dir(base.seqnum);
+	return RET_HDR_OK;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "pdu.h"
+
+struct _MDL;
+
+/*
+ * Framing of the stream of server's responses (USBIP_RET_SUBMIT, USBIP_RET_UNLINK).
+ * These functions do not depend on WSK, tools/bench replays streams through them.
+ */
+
+/*
+ * Data received from a server that are not parsed yet.
+ * Unparsed remainder of the bulk receive is always shorter than usbip_header, @see compact.
+ */
+struct recv_buffer
+{
+	enum : ULONG { SIZE = 16*1024 }; // the rest of a longer payload is read directly into URB buffer
+	UCHAR *data; // nonpaged, SIZE bytes; not owned if mdl is NULL
+	_MDL *mdl; // describes data
+
+	ULONG head; // offset of the first unparsed byte
+	ULONG tail; // offset past the last received byte
+
+	auto size() const { return tail - head; }
+	auto ptr() const { return data + head; }
+};
+
+/*
+ * Copies usbip_header from the stream, the header can be split among several receives.
+ * @param received bytes of the header that are already copied, it is zeroed when the header is complete
+ * @return true if the header is complete
+ */
+bool take_header(recv_buffer &rx, usbip_header &hdr, ULONG &received);
+
+/*
+ * Moves unparsed data to the beginning of the buffer before the next receive.
+ * @return free space at the end of the buffer
+ */
+ULONG compact(recv_buffer &rx);
+
+enum ret_header_status { RET_HDR_OK, RET_HDR_BAD_COMMAND, RET_HDR_BAD_NUMBER_OF_PACKETS, RET_HDR_BAD_SEQNUM };
+
+/*
+ * Converts a header to host byte order and checks it. On success,
+ * base.direction is restored from seqnum (it is always zero in server's response),
+ * number_of_packets of non-isoch transfer is zeroed, so get_payload_size can be used.
+ */
+ret_header_status validate_ret_header(usbip_header &hdr);
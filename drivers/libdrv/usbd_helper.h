@@ -92,3 +92,10 @@ constexpr auto is_isoch(_In_ const URB &urb)
 	return  f == URB_FUNCTION_ISOCH_TRANSFER || 
 		f == URB_FUNCTION_ISOCH_TRANSFER_USING_CHAINED_MDL;
 }
+
+constexpr auto is_control(_In_ const URB &urb)
+{
+	auto f = urb.UrbHeader.Function;
+	return  f == URB_FUNCTION_CONTROL_TRANSFER || 
+		f == URB_FUNCTION_CONTROL_TRANSFER_EX;
+}
@@ -7,6 +7,7 @@
 #include "wait_timeout.h"
 
 #include <ntstrsafe.h>
+#include <usbip\happy_eyeballs.h>
 
 namespace
 {
@@ -38,6 +39,7 @@ public:
         auto operator !() const { return !m_irp; }
 
         auto irp() const { NT_ASSERT(*this); return m_irp; }
+        auto event() { return &m_completion_event; } // is set if the request was pending
 
         _IRQL_requires_max_(APC_LEVEL)
         PAGED NTSTATUS wait_for_completion(_Inout_ NTSTATUS &status);
@@ -310,6 +312,171 @@ PAGED void wait_invokers(_Inout_ wsk::SOCKET &s)
         NT_ASSERT(!(s.invoke_cnt & s.COUNT_MASK));
 }
 
+/*
+ * @see wsk::race_connect
+ */
+struct connection_attempt
+{
+        wsk::SOCKET *sock{};
+        NTSTATUS status = STATUS_UNSUCCESSFUL; // STATUS_PENDING if in progress
+        socket_async_context ctx;
+};
+
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void start_connect(
+        _Inout_ connection_attempt &a, 
+        _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
+        _In_ const ADDRINFOEXW &ai, _In_ wsk::addrinfo_f f, _Inout_opt_ void *ctx)
+{
+        PAGED_CODE();
+        auto &sock = a.sock;
+
+        if (!a.ctx) {
+                a.status = STATUS_INSUFFICIENT_RESOURCES;
+                return;
+        }
+
+        if (auto err = socket(sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), static_cast<USHORT>(ai.ai_socktype),
+                              ai.ai_protocol, Flags, SocketContext, Dispatch)) {
+                NT_ASSERT(!sock);
+                a.status = err;
+                return;
+        }
+
+        if (auto err = f(sock, ai, ctx)) {
+                a.status = err;
+        } else {
+                a.status = sock->invoke(sock->Connection->WskConnect, sock->Self, ai.ai_addr, 0, a.ctx.irp());
+        }
+
+        if (NT_ERROR(a.status)) {
+                NT_VERIFY(NT_SUCCESS(close(sock)));
+                sock = nullptr;
+        }
+}
+
+/*
+ * @param timeout wait CONNECTION_ATTEMPT_DELAY or infinitely
+ * @return index of completed attempt or usbip::ATTEMPT_DELAY_EXPIRED
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED int wait_any(_Inout_ connection_attempt *v, _In_ int cnt, _In_ bool timeout)
+{
+        PAGED_CODE();
+
+        void *events[usbip::MAX_CONNECTION_ATTEMPTS];
+        int attempts[ARRAYSIZE(events)];
+        ULONG n = 0;
+
+        for (int i = 0; i < cnt; ++i) {
+                if (auto &a = v[i]; a.status == STATUS_PENDING) {
+                        events[n] = a.ctx.event();
+                        attempts[n++] = i;
+                }
+        }
+
+        NT_ASSERT(n);
+        KWAIT_BLOCK wait_blocks[ARRAYSIZE(events)];
+
+        auto delay = make_timeout(usbip::CONNECTION_ATTEMPT_DELAY*wdm::msec, wdm::period::relative);
+
+        auto st = KeWaitForMultipleObjects(n, events, WaitAny, Executive, KernelMode, false, 
+                                           timeout ? &delay : nullptr, wait_blocks);
+
+        if (st == STATUS_TIMEOUT) {
+                return usbip::ATTEMPT_DELAY_EXPIRED;
+        }
+
+        NT_ASSERT(st >= STATUS_WAIT_0 && st < STATUS_WAIT_0 + n);
+        auto i = attempts[st - STATUS_WAIT_0];
+
+        auto &a = v[i];
+        a.status = a.ctx.irp()->IoStatus.Status;
+
+        if (NT_ERROR(a.status)) {
+                NT_VERIFY(NT_SUCCESS(close(a.sock)));
+                a.sock = nullptr;
+        }
+
+        return i;
+}
+
+/*
+ * Sockets must not be closed while WskConnect is in progress.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void cancel_connect(_Inout_ connection_attempt &a)
+{
+        PAGED_CODE();
+
+        if (a.status == STATUS_PENDING) {
+                IoCancelIrp(a.ctx.irp());
+                a.ctx.wait_for_completion(a.status);
+        }
+
+        if (auto sock = a.sock) {
+                NT_VERIFY(NT_SUCCESS(close(sock)));
+                a.sock = nullptr;
+        }
+}
+
+/*
+ * @see usbip::race
+ */
+class connector
+{
+public:
+        connector(_In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
+                  _In_ const ADDRINFOEXW* const *addrs, _In_ wsk::addrinfo_f f, _Inout_opt_ void *ctx) :
+                m_flags(Flags), m_socket_ctx(SocketContext), m_dispatch(Dispatch), m_addrs(addrs), m_f(f), m_ctx(ctx) {}
+
+        _IRQL_requires_max_(APC_LEVEL)
+        PAGED ~connector()
+        {
+                PAGED_CODE();
+                for (auto &a: m_v) {
+                        cancel_connect(a);
+                }
+        }
+
+        connector(const connector&) = delete;
+        connector& operator=(const connector&) = delete;
+
+        _IRQL_requires_max_(APC_LEVEL)
+        PAGED auto start(_In_ int idx)
+        {
+                PAGED_CODE();
+                auto &a = m_v[idx];
+                start_connect(a, m_flags, m_socket_ctx, m_dispatch, *m_addrs[idx], m_f, m_ctx);
+
+                return a.status == STATUS_PENDING ? usbip::attempt_status::pending :
+                       NT_SUCCESS(a.status) ? usbip::attempt_status::connected : usbip::attempt_status::failed;
+        }
+
+        _IRQL_requires_max_(APC_LEVEL)
+        PAGED auto wait(_In_ int started, _In_ bool start_next) { return wait_any(m_v, started, start_next); }
+
+        auto succeeded(_In_ int idx) const { return NT_SUCCESS(m_v[idx].status); }
+
+        auto release(_In_ int idx)
+        {
+                auto &a = m_v[idx];
+                auto sock = a.sock;
+                a.sock = nullptr;
+                return sock;
+        }
+
+private:
+        ULONG m_flags;
+        void *m_socket_ctx;
+        const void *m_dispatch;
+        const ADDRINFOEXW* const *m_addrs;
+        wsk::addrinfo_f *m_f;
+        void *m_ctx;
+
+        connection_attempt m_v[usbip::MAX_CONNECTION_ATTEMPTS];
+};
+
 } // namespace
 
 
@@ -679,6 +846,22 @@ PAGED auto wsk::for_each(
         return nullptr;
 }
 
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto wsk::race_connect(
+        _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
+        _In_ const ADDRINFOEXW *head, _In_ addrinfo_f f, _Inout_opt_ void *ctx) -> SOCKET*
+{
+        PAGED_CODE();
+
+        const ADDRINFOEXW *addrs[usbip::MAX_CONNECTION_ATTEMPTS];
+        auto cnt = usbip::interleave_families(addrs, head);
+
+        connector c(Flags, SocketContext, Dispatch, addrs, f, ctx);
+
+        auto i = usbip::race(c, cnt);
+        return i < 0 ? nullptr : c.release(i);
+}
+
 /*
  * Error if optval is ULONG, one byte is written actually.
  */
@@ -120,6 +120,19 @@ PAGED SOCKET *for_each(
         _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch, // for FN_WSK_SOCKET
         _In_ const ADDRINFOEXW *head, _In_ addrinfo_f f, _Inout_opt_ void *ctx);
 
+/*
+ * Happy Eyeballs, RFC 8305.
+ * Connection attempts to the addresses overlap, the next one is started after CONNECTION_ATTEMPT_DELAY 
+ * or as soon as the previous one has failed. Address families are interleaved.
+ * 
+ * @param f is called for each socket before connect, f.e. to set options and bind
+ * @return the first connected socket, others are closed
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED SOCKET *race_connect(
+        _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch, // for FN_WSK_SOCKET
+        _In_ const ADDRINFOEXW *head, _In_ addrinfo_f f, _Inout_opt_ void *ctx);
+
 enum { RECEIVE_EVENT_FLAGS_BUFBZ = 64 };
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "addrinfo_cache.h"
+#include "trace.h"
+#include "addrinfo_cache.tmh"
+
+#include "driver.h"
+
+#include <libdrv\wait_timeout.h>
+#include <libdrv\wsk_cpp.h>
+
+namespace
+{
+
+using namespace usbip;
+
+struct cached_addr
+{
+        int family;
+        int socktype;
+        int protocol;
+        ULONG addrlen;
+        SOCKADDR_INET addr;
+};
+
+/*
+ * Result of getaddrinfo, single allocation.
+ */
+struct addrinfo_list
+{
+        ADDRINFOEXW ai[addrinfo_cache::MAX_ADDRS]; // must be the first member, @see usbip::free
+        SOCKADDR_INET addrs[ARRAYSIZE(ai)];
+};
+
+} // namespace
+
+
+struct usbip::addrinfo_entry
+{
+        LONGLONG expires; // KeQueryInterruptTime()
+        NTSTATUS status; // of WskGetAddressInfo, the entry is negative if it is an error
+
+        UNICODE_STRING node_name; // buffers follow this struct
+        UNICODE_STRING service_name;
+
+        ULONG cnt;
+        cached_addr addrs[addrinfo_cache::MAX_ADDRS];
+};
+
+
+namespace
+{
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto matches(
+        _In_ const addrinfo_entry &e, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        PAGED_CODE();
+
+        return RtlEqualUnicodeString(&e.node_name, &node_name, true) && 
+               RtlEqualUnicodeString(&e.service_name, &service_name, false);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto expired(_In_ const addrinfo_entry &e)
+{
+        PAGED_CODE();
+        return LONGLONG(KeQueryInterruptTime()) >= e.expires;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void free(_In_opt_ addrinfo_entry *e)
+{
+        PAGED_CODE();
+
+        if (e) {
+                ExFreePoolWithTag(e, pooltag);
+        }
+}
+
+/*
+ * @param ai result of WskGetAddressInfo
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto make_entry(
+        _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name, 
+        _In_ NTSTATUS status, _In_opt_ const ADDRINFOEXW *ai)
+{
+        PAGED_CODE();
+
+        auto size = sizeof(addrinfo_entry) + node_name.Length + service_name.Length;
+
+        auto e = (addrinfo_entry*)ExAllocatePool2(POOL_FLAG_PAGED, size, pooltag);
+        if (!e) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", size);
+                return e;
+        }
+
+        auto copy = [] (auto &dst, auto &src, auto buf)
+        {
+                dst.Buffer = reinterpret_cast<PWCH>(buf);
+                dst.MaximumLength = src.Length;
+                RtlCopyUnicodeString(&dst, &src);
+        };
+
+        auto buf = reinterpret_cast<char*>(e + 1);
+        copy(e->node_name, node_name, buf);
+        copy(e->service_name, service_name, buf + node_name.Length);
+
+        for (auto a = NT_SUCCESS(status) ? ai : nullptr; a && e->cnt < ARRAYSIZE(e->addrs); a = a->ai_next) {
+                if (a->ai_addrlen > sizeof(cached_addr::addr)) {
+                        continue;
+                }
+
+                auto &r = e->addrs[e->cnt++];
+
+                r.family = a->ai_family;
+                r.socktype = a->ai_socktype;
+                r.protocol = a->ai_protocol;
+                r.addrlen = ULONG(a->ai_addrlen);
+                RtlCopyMemory(&r.addr, a->ai_addr, a->ai_addrlen);
+        }
+
+        if (NT_SUCCESS(status) && !e->cnt) {
+                status = STATUS_NOT_FOUND;
+        }
+
+        e->status = status;
+
+        auto ttl = NT_SUCCESS(status) ? addrinfo_cache::TTL : addrinfo_cache::NEGATIVE_TTL;
+        e->expires = KeQueryInterruptTime() + ttl*wdm::second;
+
+        return e;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto make_result(_Out_ ADDRINFOEXW* &result, _In_ const addrinfo_entry &e)
+{
+        PAGED_CODE();
+        NT_ASSERT(NT_SUCCESS(e.status));
+
+        auto r = (addrinfo_list*)ExAllocatePool2(POOL_FLAG_PAGED, sizeof(addrinfo_list), pooltag);
+        if (!r) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(addrinfo_list));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (ULONG i = 0; i < e.cnt; ++i) {
+                auto &src = e.addrs[i];
+                auto &ai = r->ai[i];
+
+                ai.ai_family = src.family;
+                ai.ai_socktype = src.socktype;
+                ai.ai_protocol = src.protocol;
+                ai.ai_addrlen = src.addrlen;
+
+                r->addrs[i] = src.addr;
+                ai.ai_addr = reinterpret_cast<SOCKADDR*>(&r->addrs[i]);
+
+                ai.ai_next = i + 1 < e.cnt ? &r->ai[i + 1] : nullptr;
+        }
+
+        result = r->ai;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * @return true if the entry is found, status of the lookup is returned in status
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto lookup(
+        _Inout_ addrinfo_cache &cache, _Out_ ADDRINFOEXW* &result, _Out_ NTSTATUS &status,
+        _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        PAGED_CODE();
+
+        result = nullptr;
+        auto found = false;
+
+        ExAcquireFastMutex(&cache.lock);
+
+        for (auto e: cache.entries) {
+                if (e && matches(*e, node_name, service_name) && !expired(*e)) {
+                        status = NT_SUCCESS(e->status) ? make_result(result, *e) : e->status;
+                        found = true;
+                        break;
+                }
+        }
+
+        ExReleaseFastMutex(&cache.lock);
+        return found;
+}
+
+/*
+ * An entry for the same name, an expired one or the one that expires first is replaced.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void insert(_Inout_ addrinfo_cache &cache, _In_ addrinfo_entry *e)
+{
+        PAGED_CODE();
+        addrinfo_entry *old{};
+
+        ExAcquireFastMutex(&cache.lock);
+        {
+                auto victim = &cache.entries[0];
+
+                for (auto &cur: cache.entries) {
+                        if (!cur || matches(*cur, e->node_name, e->service_name)) {
+                                victim = &cur;
+                                break;
+                        } else if (cur->expires < (*victim)->expires) {
+                                victim = &cur;
+                        }
+                }
+
+                old = *victim;
+                *victim = e;
+        }
+        ExReleaseFastMutex(&cache.lock);
+
+        free(old);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::init(_Out_ addrinfo_cache &cache)
+{
+        RtlZeroMemory(&cache, sizeof(cache));
+        ExInitializeFastMutex(&cache.lock);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void usbip::clear(_Inout_ addrinfo_cache &cache)
+{
+        PAGED_CODE();
+
+        TraceDbg("hits %I64d, misses %I64d", cache.hits, cache.misses);
+
+        for (auto &e: cache.entries) {
+                ::free(e);
+                e = nullptr;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS usbip::getaddrinfo(
+        _Inout_ addrinfo_cache &cache, _Out_ ADDRINFOEXW* &result,
+        _In_ UNICODE_STRING &node_name, _In_ UNICODE_STRING &service_name, _In_ ADDRINFOEXW &hints)
+{
+        PAGED_CODE();
+
+        if (NTSTATUS st; lookup(cache, result, st, node_name, service_name)) {
+                InterlockedIncrement64(&cache.hits);
+                TraceDbg("%!USTR!:%!USTR! -> %!STATUS! (cached)", &node_name, &service_name, st);
+                return st;
+        }
+
+        InterlockedIncrement64(&cache.misses);
+
+        ADDRINFOEXW *ai{};
+        auto st = wsk::getaddrinfo(ai, &node_name, &service_name, &hints);
+
+        auto e = make_entry(node_name, service_name, st, ai);
+        wsk::free(ai);
+
+        if (!e) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        st = e->status;
+        if (NT_SUCCESS(st)) {
+                st = make_result(result, *e);
+        }
+
+        TraceDbg("%!USTR!:%!USTR! -> %!STATUS!, %lu address(es)", &node_name, &service_name, e->status, e->cnt);
+        insert(cache, e);
+
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void usbip::free(_In_opt_ ADDRINFOEXW *result)
+{
+        PAGED_CODE();
+
+        if (result) {
+                static_assert(!offsetof(addrinfo_list, ai));
+                ExFreePoolWithTag(result, pooltag);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void usbip::invalidate(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        PAGED_CODE();
+        addrinfo_entry *old{};
+
+        ExAcquireFastMutex(&cache.lock);
+
+        for (auto &e: cache.entries) {
+                if (e && matches(*e, node_name, service_name)) {
+                        old = e;
+                        e = nullptr;
+                        break;
+                }
+        }
+
+        ExReleaseFastMutex(&cache.lock);
+
+        if (old) {
+                TraceDbg("%!USTR!:%!USTR!", &node_name, &service_name);
+                ::free(old);
+        }
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <wsk.h>
+
+namespace usbip
+{
+
+struct addrinfo_entry;
+
+/*
+ * Results of WskGetAddressInfo are shared by attaches to the same server, 
+ * including retries of persistent devices.
+ * WSK does not provide TTL of DNS records, fixed lifetimes are used.
+ */
+struct addrinfo_cache
+{
+        enum { 
+                MAX_ENTRIES = 16, 
+                MAX_ADDRS = 16, // per entry, the rest are ignored
+                TTL = 60, // seconds
+                NEGATIVE_TTL = 10 // for failed lookups
+        };
+
+        FAST_MUTEX lock;
+        addrinfo_entry *entries[MAX_ENTRIES];
+
+        LONG64 hits; // lookups saved
+        LONG64 misses;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ addrinfo_cache &cache);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void clear(_Inout_ addrinfo_cache &cache);
+
+/*
+ * @param result must be released by free()
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS getaddrinfo(
+        _Inout_ addrinfo_cache &cache, _Out_ ADDRINFOEXW* &result,
+        _In_ UNICODE_STRING &node_name, _In_ UNICODE_STRING &service_name, _In_ ADDRINFOEXW &hints);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void free(_In_opt_ ADDRINFOEXW *result);
+
+/*
+ * Must be called if none of the addresses can be connected, the server could change its address.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void invalidate(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name);
+
+} // namespace usbip
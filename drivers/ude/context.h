@@ -4,14 +4,23 @@
 
 #pragma once
 
+#include "wsk_context.h"
+#include "descriptor_cache.h"
+#include "addrinfo_cache.h"
+#include "statistics.h"
+#include "latency.h"
+#include "flight_recorder.h"
+
 #include <libdrv\codeseg.h>
 #include <libdrv\ch9.h>
 #include <libdrv\wdf_cpp.h>
+#include <libdrv\pdu_stream.h>
 
 #include <usbip\proto.h>
 
 #include <wdfusb.h>
 #include <UdeCx.h>
+#include <wsk.h>
 
 #include <initguid.h>
 #include <usbip\vhci.h>
@@ -52,6 +61,10 @@ struct vhci_ctx
 
         _KTHREAD *attach_thread;
         KEVENT attach_thread_stop;
+        EX_RUNDOWN_REF attach_rundown; // held by attach threads while they plug in a device
+
+        addrinfo_cache addrinfo; // shared by all attaches
+        flight_recorder recorder; // PDUs of all devices
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(vhci_ctx, get_vhci_ctx)
 
@@ -63,6 +76,7 @@ inline auto get_device(_In_ vhci_ctx *ctx)
 
 struct wsk_context;
 struct device_ctx;
+struct endpoint_ctx;
 
 /*
  * Context extention for device_ctx. 
@@ -88,6 +102,7 @@ struct device_ctx_ext
         //
         
         vhci::imported_device_properties dev; // for ioctl::get_imported_devices
+        USB_DEVICE_DESCRIPTOR descriptor; // partially, from op_import_reply.udev, @see descriptor_cache.cpp
 };
 
 /*
@@ -103,11 +118,30 @@ struct device_ctx
 
         WDFDEVICE vhci; // parent, virtual (emulated) host controller interface
 
-        WDFQUEUE queue; // requests that are waiting for USBIP_RET_SUBMIT from a server
-        KEVENT queue_purged;
+        KEVENT queue_purged; // all requests are canceled, @see detach
+
+        enum { INFLIGHT_BUCKETS = 256 }; // power of two, @see device_queue.cpp, get_bucket
+        LIST_ENTRY inflight[INFLIGHT_BUCKETS]; // requests that are waiting for USBIP_RET_SUBMIT, by seqnum, request_ctx::entry
+        KSPIN_LOCK inflight_lock;
+        EX_RUNDOWN_REF inflight_rundown; // held by each request from insert_inflight till its completion
+
+        KSPIN_LOCK send_lock;
+        LIST_ENTRY send_queue; // wsk_context::entry, waiting for completion of WskSend in progress
+        bool send_busy; // WskSend is in progress
+        LONG send_next_calls; // @see device_ioctl.cpp, send_next
+
+        wsk_context_cache wsk_cache;
 
         UDECXUSBENDPOINT ep0; // default control pipe
-        KSPIN_LOCK endpoint_list_lock; // for endpoint_ctx::entry
+
+        enum { ENDPOINT_SLOTS = 32, PIPE_BUCKETS = 64 }; // @see endpoint_list.cpp
+        endpoint_ctx *endpoints[ENDPOINT_SLOTS]; // IN/OUT x 16 by bEndpointAddress, except ep0
+        KSPIN_LOCK endpoint_list_lock; // for writers of endpoints[] and endpoint_ctx::next
+        UCHAR pipe_index[PIPE_BUCKETS]; // hash of endpoint_ctx::PipeHandle -> endpoints[] index + 1
+
+        descriptor_cache descriptors;
+        device_statistics stats;
+        device_latency latency;
 
         int port; // vhci_ctx.devices[port - 1]
         seqnum_t seqnum; // @see next_seqnum
@@ -118,7 +152,14 @@ struct device_ctx
         WDFWORKITEM recv_hdr;
         using received_fn = NTSTATUS (wsk_context&);
         received_fn *received;
-        size_t receive_size;
+        size_t receive_size; // zero if any number of bytes is acceptable
+        recv_buffer rxbuf;
+
+        // for WSK_EVENT_RECEIVE, @see start_receive
+        bool recv_event; // if false, recv_hdr reads data into rxbuf
+        ULONG hdr_received; // bytes of usbip_header copied from data indications
+        recv_buffer indicated; // a part of WSK_DATA_INDICATION that is being parsed
+        WSK_BUF payload; // the rest of payload to copy, Mdl is NULL if payload is drained
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(device_ctx, get_device_ctx)
 
@@ -128,12 +169,6 @@ inline auto get_device(_In_ device_ctx *ctx)
         return static_cast<UDECXUSBDEVICE>(WdfObjectContextGetObject(ctx));
 }
 
-WDF_DECLARE_CONTEXT_TYPE(UDECXUSBDEVICE); // WdfObjectGet_UDECXUSBDEVICE
-inline auto& get_device(_In_ WDFQUEUE queue) // for device_ctx.queue
-{
-        return *WdfObjectGet_UDECXUSBDEVICE(queue);
-}
-
 /*
  * Context space for UDECXUSBENDPOINT.
  */
@@ -146,13 +181,15 @@ struct endpoint_ctx
         // UCHAR interface_number; // interface to which it belongs
         // UCHAR alternate_setting;
 
-        USBD_PIPE_HANDLE PipeHandle;
-        LIST_ENTRY entry; // list head if default control pipe, protected by device_ctx::endpoint_list_lock
+        USBD_PIPE_HANDLE PipeHandle; // @see set_pipe_handle
+        LIST_ENTRY inflight; // request_ctx::endp_entry, protected by device_ctx::inflight_lock
+
+        endpoint_ctx *next; // outdated endpoint with the same address, protected by device_ctx::endpoint_list_lock
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(endpoint_ctx, get_endpoint_ctx)
 
 WDF_DECLARE_CONTEXT_TYPE(UDECXUSBENDPOINT); // WdfObjectGet_UDECXUSBENDPOINT
-inline auto& get_endpoint(_In_ WDFQUEUE queue) // use get_device() for device_ctx.queue
+inline auto& get_endpoint(_In_ WDFQUEUE queue)
 {
         return *WdfObjectGet_UDECXUSBENDPOINT(queue);
 }
@@ -168,6 +205,9 @@ struct request_ctx
         seqnum_t seqnum;
         request_status status;
         UDECXUSBENDPOINT endpoint;
+        LONG64 sent; // get_timestamp() when the request was inserted into device_ctx::inflight
+        LIST_ENTRY entry; // device_ctx::inflight[], protected by device_ctx::inflight_lock
+        LIST_ENTRY endp_entry; // endpoint_ctx::inflight, protected by device_ctx::inflight_lock
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(request_ctx, get_request_ctx)
 
@@ -0,0 +1,732 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_cache.h"
+#include "trace.h"
+#include "descriptor_cache.tmh"
+
+#include "driver.h"
+#include "context.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\lock.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <ntstrsafe.h>
+
+struct usbip::descriptor_entry
+{
+        USHORT wValue; // descriptor type and index
+        USHORT wIndex; // LANGID for string descriptor
+        USHORT length; // of data
+        bool complete; // data is the whole descriptor, a longer request will get the same data
+        bool persisted; // loaded from the registry and was not revalidated, @see revalidate
+        UCHAR data[ANYSIZE_ARRAY];
+};
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * Layout of REG_BINARY value is the sequence of these headers, each is followed by its data.
+ */
+struct persisted_entry
+{
+        USHORT wValue;
+        USHORT wIndex;
+        USHORT length;
+        UCHAR complete;
+        UCHAR reserved;
+};
+constexpr ULONG persisted_entry_size = sizeof(persisted_entry);
+static_assert(persisted_entry_size == 8);
+
+const auto descriptors_key_name = L"Descriptors";
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto matches(_In_ const descriptor_entry &e, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        return e.wValue == pkt.wValue.W && e.wIndex == pkt.wIndex.W;
+}
+
+/*
+ * Configuration and BOS descriptors have wTotalLength, the rest have bLength only.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_complete(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ const UCHAR *data, _In_ ULONG length)
+{
+        if (length < pkt.wLength) { // short packet
+                return true;
+        }
+
+        auto &hdr = *reinterpret_cast<const USB_COMMON_DESCRIPTOR*>(data);
+        if (length < sizeof(hdr)) {
+                return false;
+        }
+
+        switch (pkt.wValue.HiByte) {
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                static_assert(offsetof(USB_CONFIGURATION_DESCRIPTOR, wTotalLength) == offsetof(USB_BOS_DESCRIPTOR, wTotalLength));
+                return length >= sizeof(USB_BOS_DESCRIPTOR) && 
+                       length >= reinterpret_cast<const USB_BOS_DESCRIPTOR*>(data)->wTotalLength;
+        }
+
+        return length >= hdr.bLength;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_In_opt_ descriptor_entry *e)
+{
+        if (e) {
+                ExFreePoolWithTag(e, pooltag);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+descriptor_entry *make_entry(
+        _In_ USHORT wValue, _In_ USHORT wIndex, _In_reads_bytes_(length) const void *data, _In_ USHORT length, 
+        _In_ bool complete)
+{
+        auto e = (descriptor_entry*)ExAllocatePool2(POOL_FLAG_NON_PAGED, offsetof(descriptor_entry, data) + length, pooltag);
+        if (!e) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %d bytes", length);
+                return e;
+        }
+
+        e->wValue = wValue;
+        e->wIndex = wIndex;
+        e->length = length;
+        e->complete = complete;
+        e->persisted = false;
+        RtlCopyMemory(e->data, data, length);
+
+        return e;
+}
+
+/*
+ * @param cached device descriptor saved in the registry
+ * @param udev fields from op_import_reply.udev, @see import_remote_device
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto is_same_device(_In_ const USB_DEVICE_DESCRIPTOR &cached, _In_ const USB_DEVICE_DESCRIPTOR &udev)
+{
+        PAGED_CODE();
+
+        return  cached.bLength == sizeof(cached) && 
+                cached.bDescriptorType == USB_DEVICE_DESCRIPTOR_TYPE &&
+                cached.idVendor == udev.idVendor &&
+                cached.idProduct == udev.idProduct &&
+                cached.bcdDevice == udev.bcdDevice &&
+                cached.bDeviceClass == udev.bDeviceClass &&
+                cached.bDeviceSubClass == udev.bDeviceSubClass &&
+                cached.bDeviceProtocol == udev.bDeviceProtocol &&
+                cached.bNumConfigurations == udev.bNumConfigurations;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto open_descriptors_key(_In_ bool create, _In_ ACCESS_MASK access = KEY_QUERY_VALUE)
+{
+        PAGED_CODE();
+
+        wdf::Registry params;
+        wdf::Registry key;
+
+        if (WDFKEY h; 
+            auto err = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), create ? KEY_CREATE_SUB_KEY : KEY_READ, 
+                                                          WDF_NO_OBJECT_ATTRIBUTES, &h)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfDriverOpenParametersRegistryKey %!STATUS!", err);
+                return key;
+        } else {
+                params.reset(h);
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, descriptors_key_name);
+
+        WDFKEY h{};
+        auto err = create ? 
+                WdfRegistryCreateKey(params.get(), &name, KEY_SET_VALUE, REG_OPTION_NON_VOLATILE, nullptr, 
+                                     WDF_NO_OBJECT_ATTRIBUTES, &h) :
+                WdfRegistryOpenKey(params.get(), &name, access, WDF_NO_OBJECT_ATTRIBUTES, &h);
+
+        if (NT_SUCCESS(err)) {
+                key.reset(h);
+        } else if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                Trace(TRACE_LEVEL_ERROR, "Open '%!USTR!', create %d, %!STATUS!", &name, create, err);
+        }
+
+        return key;
+}
+
+/*
+ * "host,service,busid,vid:pid:bcdDevice"
+ * @return buffer of the name
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto make_value_name(_Out_ UNICODE_STRING &name, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        name = UNICODE_STRING{};
+        wdf::ObjectDelete mem;
+
+        auto &d = ext.descriptor;
+        const USHORT len = ext.node_name.Length + ext.service_name.Length + ext.busid.Length + 32*sizeof(WCHAR);
+
+        if (WDFMEMORY h; 
+            auto err = WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES, PagedPool, pooltag, len, &h, 
+                                       reinterpret_cast<PVOID*>(&name.Buffer))) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate %!STATUS!", err);
+                return mem;
+        } else {
+                mem.reset(h);
+                name.MaximumLength = len;
+        }
+
+        if (auto err = RtlUnicodeStringPrintf(&name, L"%wZ,%wZ,%wZ,%04x:%04x:%04x", 
+                                              &ext.node_name, &ext.service_name, &ext.busid, 
+                                              d.idVendor, d.idProduct, d.bcdDevice)) {
+                Trace(TRACE_LEVEL_ERROR, "RtlUnicodeStringPrintf %!STATUS!", err);
+                name = UNICODE_STRING{};
+                mem.reset();
+        }
+
+        return mem;
+}
+
+/*
+ * Saved descriptors were not revalidated, they must not be loaded again.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void remove_value(_In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto key = open_descriptors_key(false, KEY_SET_VALUE);
+        if (!key) {
+                return;
+        }
+
+        UNICODE_STRING name;
+        auto name_buf = make_value_name(name, ext);
+        if (!name_buf) {
+                return;
+        }
+
+        if (auto err = WdfRegistryRemoveValue(key.get(), &name)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryRemoveValue('%!USTR!') %!STATUS!", &name, err);
+                }
+        } else {
+                TraceDbg("'%!USTR!' removed", &name);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto is_device_descriptor(_In_ USHORT wValue, _In_ USHORT wIndex)
+{
+        return wValue == USB_DEVICE_DESCRIPTOR_TYPE << 8 && !wIndex;
+}
+
+/*
+ * @return zero if there is no device descriptor in the cache
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_persisted_size(_In_ descriptor_cache &cache)
+{
+        auto has_device_descriptor = false;
+        ULONG size = 0;
+
+        wdm::Lock lck(cache.lock);
+
+        for (auto e: cache.entries) {
+                if (e && !e->persisted) {
+                        has_device_descriptor |= is_device_descriptor(e->wValue, e->wIndex);
+                        size += persisted_entry_size + e->length;
+                }
+        }
+
+        return has_device_descriptor ? size : 0;
+}
+
+/*
+ * @return number of bytes written, entries that do not fit are skipped
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto serialize(_Out_writes_bytes_(size) UCHAR *buf, _In_ ULONG size, _In_ descriptor_cache &cache)
+{
+        ULONG len = 0;
+        wdm::Lock lck(cache.lock);
+
+        for (auto e: cache.entries) {
+                if (!(e && !e->persisted && len + persisted_entry_size + e->length <= size)) {
+                        continue;
+                }
+
+                persisted_entry hdr { 
+                        .wValue = e->wValue, 
+                        .wIndex = e->wIndex, 
+                        .length = e->length, 
+                        .complete = e->complete 
+                };
+
+                RtlCopyMemory(buf + len, &hdr, persisted_entry_size);
+                len += persisted_entry_size;
+
+                RtlCopyMemory(buf + len, e->data, e->length);
+                len += e->length;
+        }
+
+        return len;
+}
+
+/*
+ * Must be called under descriptor_cache::lock.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find_probe(_In_ descriptor_cache &cache, _In_ UINT32 seqnum)
+{
+        for (auto &p: cache.probes) {
+                if (p.seqnum == seqnum) {
+                        return &p;
+                }
+        }
+
+        return static_cast<descriptor_probe*>(nullptr);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void assign(
+        _Inout_ descriptor_cache &cache, _In_ descriptor_entry* const (&entries)[descriptor_cache::MAX_ENTRIES],
+        _In_ UCHAR iSerialNumber)
+{
+        wdm::Lock lck(cache.lock);
+
+        for (auto &cur: cache.entries) {
+                NT_ASSERT(!cur); // load is called for the new device
+                cur = entries[&cur - cache.entries];
+        }
+
+        cache.iSerialNumber = iSerialNumber;
+}
+
+/*
+ * Must be called under descriptor_cache::lock.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto is_unrevalidated_serial(_In_ const descriptor_cache &cache, _In_ const descriptor_entry &e)
+{
+        return e.persisted && cache.iSerialNumber && 
+               e.wValue == (USB_STRING_DESCRIPTOR_TYPE << 8 | cache.iSerialNumber);
+}
+
+/*
+ * @param iSerialNumber of the parsed device descriptor
+ * @return number of parsed entries or zero if data are malformed or the device descriptor does not match
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto parse(
+        _Out_ descriptor_entry* (&entries)[descriptor_cache::MAX_ENTRIES], _Out_ UCHAR &iSerialNumber,
+        _In_reads_bytes_(size) const UCHAR *data, _In_ size_t size, _In_ const USB_DEVICE_DESCRIPTOR &udev)
+{
+        PAGED_CODE();
+
+        RtlZeroMemory(entries, sizeof(entries));
+        iSerialNumber = 0;
+
+        ULONG cnt = 0;
+        auto valid = false; // device descriptor is found and matches udev
+
+        for (persisted_entry hdr; cnt < ARRAYSIZE(entries) && size >= sizeof(hdr); ++cnt) {
+
+                RtlCopyMemory(&hdr, data, sizeof(hdr));
+                data += sizeof(hdr);
+                size -= sizeof(hdr);
+
+                if (!hdr.length || hdr.length > size) {
+                        valid = false;
+                        break;
+                }
+
+                if (is_device_descriptor(hdr.wValue, hdr.wIndex)) {
+                        USB_DEVICE_DESCRIPTOR dd{};
+                        RtlCopyMemory(&dd, data, min(hdr.length, sizeof(dd)));
+                        if (!(valid = is_same_device(dd, udev))) {
+                                break;
+                        }
+                        iSerialNumber = dd.iSerialNumber;
+                }
+
+                auto e = make_entry(hdr.wValue, hdr.wIndex, data, hdr.length, hdr.complete);
+                if (!e) {
+                        valid = false;
+                        break;
+                }
+
+                e->persisted = true;
+                entries[cnt] = e;
+
+                data += hdr.length;
+                size -= hdr.length;
+        }
+
+        if (valid && !size) {
+                return cnt;
+        }
+
+        for (auto &e: entries) {
+                free(e);
+                e = nullptr;
+        }
+
+        return 0;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::init(_Out_ descriptor_cache &cache)
+{
+        RtlZeroMemory(&cache, sizeof(cache));
+        KeInitializeSpinLock(&cache.lock);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::invalidate(_Inout_ descriptor_cache &cache)
+{
+        descriptor_entry *entries[ARRAYSIZE(cache.entries)]{};
+        int cnt = 0;
+        {
+                wdm::Lock lck(cache.lock);
+
+                for (auto &cur: cache.entries) {
+                        if (cur && !cur->persisted && cur->wValue >> 8 == USB_CONFIGURATION_DESCRIPTOR_TYPE) {
+                                entries[cnt++] = cur;
+                                cur = nullptr;
+                        }
+                }
+        }
+
+        for (auto e: entries) {
+                free(e);
+        }
+
+        TraceDbg("%d configuration descriptor(s) removed", cnt);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::clear(_Inout_ descriptor_cache &cache)
+{
+        descriptor_entry *entries[ARRAYSIZE(cache.entries)];
+        {
+                wdm::Lock lck(cache.lock);
+                RtlCopyMemory(entries, cache.entries, sizeof(entries));
+                RtlZeroMemory(cache.entries, sizeof(cache.entries));
+                RtlZeroMemory(cache.probes, sizeof(cache.probes)); // responses will be drained
+        }
+
+        for (auto e: entries) {
+                free(e);
+        }
+
+        TraceDbg("hits %I64d, misses %I64d", ReadNoFence64(&cache.hits), ReadNoFence64(&cache.misses));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::is_cacheable(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (!(pkt.bmRequestType.B == (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) && 
+              pkt.bRequest == USB_REQUEST_GET_DESCRIPTOR && pkt.wLength)) {
+                return false;
+        }
+
+        switch (pkt.wValue.HiByte) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_STRING_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return true;
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::get_descriptor(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _Out_writes_bytes_(length) void *buffer, _Inout_ ULONG &length)
+{
+        NT_ASSERT(is_cacheable(pkt));
+        NT_ASSERT(length <= pkt.wLength);
+        {
+                wdm::Lock lck(cache.lock);
+
+                for (auto e: cache.entries) {
+                        if (e && matches(*e, pkt) && (e->complete || e->length >= length) && 
+                            !is_unrevalidated_serial(cache, *e)) {
+                                length = min(length, e->length);
+                                RtlCopyMemory(buffer, e->data, length);
+
+                                InterlockedIncrement64(&cache.hits);
+                                return true;
+                        }
+                }
+        }
+
+        InterlockedIncrement64(&cache.misses);
+        return false;
+}
+
+/*
+ * A longer response replaces shorter one for the same descriptor.
+ * Any response replaces the descriptor loaded from the registry, this is how it is revalidated.
+ * If the cache is full, the response is not saved.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::put_descriptor(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length)
+{
+        NT_ASSERT(is_cacheable(pkt));
+
+        if (!length || length > pkt.wLength) {
+                return;
+        }
+
+        auto complete = is_complete(pkt, static_cast<const UCHAR*>(data), length);
+
+        auto e = make_entry(pkt.wValue.W, pkt.wIndex.W, data, static_cast<USHORT>(length), complete);
+        if (!e) {
+                return;
+        }
+
+        descriptor_entry *victim{};
+        {
+                wdm::Lock lck(cache.lock);
+                descriptor_entry **slot{};
+
+                for (auto &cur: cache.entries) {
+                        if (!cur) {
+                                if (!slot) {
+                                        slot = &cur;
+                                }
+                        } else if (matches(*cur, pkt)) {
+                                auto keep = !cur->persisted && (cur->complete || cur->length >= length);
+                                slot = keep ? nullptr : &cur;
+                                break;
+                        }
+                }
+
+                if (slot) {
+                        victim = *slot;
+                        *slot = e;
+                        e = nullptr;
+                }
+        }
+
+        free(victim);
+        free(e); // was not inserted
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::get_persisted(
+        _In_ descriptor_cache &cache, 
+        _Out_writes_to_(descriptor_cache::MAX_ENTRIES, return) USB_DEFAULT_PIPE_SETUP_PACKET *pkts)
+{
+        ULONG cnt = 0;
+        wdm::Lock lck(cache.lock);
+
+        for (auto e: cache.entries) {
+                if (e && e->persisted) {
+                        pkts[cnt++] = USB_DEFAULT_PIPE_SETUP_PACKET {
+                                .bmRequestType{.B = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE},
+                                .bRequest = USB_REQUEST_GET_DESCRIPTOR,
+                                .wValue{.W = e->wValue},
+                                .wIndex{.W = e->wIndex},
+                                .wLength = e->length,
+                        };
+                }
+        }
+
+        return cnt;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::add_probe(_Inout_ descriptor_cache &cache, _In_ UINT32 seqnum, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        NT_ASSERT(seqnum);
+        wdm::Lock lck(cache.lock);
+
+        if (auto p = find_probe(cache, 0)) {
+                *p = { .seqnum = seqnum, .pkt = pkt };
+        }
+}
+
+/*
+ * A changed entry is removed before the response is put, so it can't be returned meanwhile.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::revalidate(
+        _Inout_ descriptor_cache &cache, _In_ UINT32 seqnum, _In_ INT32 status, 
+        _In_reads_bytes_opt_(length) const void *data, _In_ ULONG length)
+{
+        if (!seqnum) {
+                return false;
+        }
+
+        USB_DEFAULT_PIPE_SETUP_PACKET pkt;
+        descriptor_entry *victim{};
+
+        auto ok = !status && data && length;
+        {
+                wdm::Lock lck(cache.lock);
+
+                auto p = find_probe(cache, seqnum);
+                if (!p) {
+                        return false;
+                }
+
+                pkt = p->pkt;
+                *p = descriptor_probe{};
+
+                for (auto &cur: cache.entries) {
+                        if (!(cur && matches(*cur, pkt) && cur->persisted)) { // or was replaced by live traffic
+                                continue;
+                        } else if (ok && cur->length == length && RtlEqualMemory(cur->data, data, length)) {
+                                cur->persisted = false;
+                        } else {
+                                victim = cur;
+                                cur = nullptr;
+                        }
+                        break;
+                }
+        }
+
+        if (!victim) {
+                return true;
+        }
+
+        free(victim);
+
+        Trace(TRACE_LEVEL_WARNING, "%!usb_descriptor_type!, index %d, LangId %#x: status %d, length %lu, %s", 
+                pkt.wValue.HiByte, pkt.wValue.LowByte, pkt.wIndex.W, status, length, ok ? "replaced" : "removed");
+
+        if (ok) {
+                put_descriptor(cache, pkt, data, length);
+        }
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::load(_Inout_ descriptor_cache &cache, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto key = open_descriptors_key(false);
+        if (!key) {
+                return;
+        }
+
+        UNICODE_STRING name;
+        auto name_buf = make_value_name(name, ext);
+        if (!name_buf) {
+                return;
+        }
+
+        wdf::ObjectDelete mem;
+        ULONG type{};
+
+        if (WDFMEMORY h; 
+            auto err = WdfRegistryQueryMemory(key.get(), &name, PagedPool, WDF_NO_OBJECT_ATTRIBUTES, &h, &type)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryMemory('%!USTR!') %!STATUS!", &name, err);
+                }
+                return;
+        } else {
+                mem.reset(h);
+        }
+
+        size_t size{};
+        auto data = static_cast<const UCHAR*>(WdfMemoryGetBuffer(mem.get<WDFMEMORY>(), &size));
+
+        descriptor_entry *entries[ARRAYSIZE(cache.entries)];
+        UCHAR iSerialNumber;
+
+        auto cnt = type == REG_BINARY ? parse(entries, iSerialNumber, data, size, ext.descriptor) : 0;
+
+        if (!cnt) {
+                Trace(TRACE_LEVEL_INFORMATION, "'%!USTR!' is discarded, type %lu, size %Iu", &name, type, size);
+                return;
+        }
+
+        assign(cache, entries, iSerialNumber);
+        TraceDbg("'%!USTR!', %lu descriptor(s) loaded", &name, cnt);
+}
+
+/*
+ * The device descriptor is required by load, the value is removed without it.
+ * Entries loaded from the registry are skipped until revalidate confirms them.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::save(_Inout_ descriptor_cache &cache, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto size = get_persisted_size(cache);
+        if (!size) {
+                remove_value(ext);
+                return;
+        }
+
+        auto buf = (UCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, size, pooltag); // is written under spin lock
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", size);
+                return;
+        }
+
+        auto len = serialize(buf, size, cache);
+
+        if (UNICODE_STRING name; auto name_buf = make_value_name(name, ext)) {
+                if (auto key = open_descriptors_key(true); !key) {
+                        //
+                } else if (auto err = WdfRegistryAssignValue(key.get(), &name, REG_BINARY, len, buf)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryAssignValue('%!USTR!') %!STATUS!", &name, err);
+                } else {
+                        TraceDbg("'%!USTR!', %lu bytes saved", &name, len);
+                }
+        }
+
+        ExFreePoolWithTag(buf, pooltag);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <usbspec.h>
+
+namespace usbip
+{
+
+struct descriptor_entry;
+struct device_ctx_ext;
+
+/*
+ * GET_DESCRIPTOR that was sent by the driver to revalidate an entry loaded from the registry.
+ */
+struct descriptor_probe
+{
+        UINT32 seqnum; // zero if the slot is free
+        USB_DEFAULT_PIPE_SETUP_PACKET pkt;
+};
+
+/*
+ * Responses on standard GET_DESCRIPTOR for device, configuration, string and BOS descriptors.
+ * Repeated requests are completed without a round trip to a server.
+ * The content survives reattach of the same device, @see load, save, revalidate.
+ */
+struct descriptor_cache
+{
+        enum { MAX_ENTRIES = 32 };
+
+        KSPIN_LOCK lock;
+        descriptor_entry *entries[MAX_ENTRIES];
+        descriptor_probe probes[MAX_ENTRIES];
+        UCHAR iSerialNumber; // of the device descriptor loaded from the registry, @see get_descriptor
+
+        LONG64 hits;
+        LONG64 misses;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ descriptor_cache &cache);
+
+/*
+ * Must be called on SET_CONFIGURATION and port reset, they can affect configuration descriptors only.
+ * Entries loaded from the registry and probes are kept, responses of the probes will revalidate them.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void invalidate(_Inout_ descriptor_cache &cache);
+
+/*
+ * Frees all entries, must be called when the device is destroyed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void clear(_Inout_ descriptor_cache &cache);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool is_cacheable(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt);
+
+/*
+ * The serial number is not returned until it is revalidated, other device with the same ids could be attached.
+ * 
+ * @param length in: size of the buffer, out: bytes copied
+ * @return true if the request was answered from the cache
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool get_descriptor(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _Out_writes_bytes_(length) void *buffer, _Inout_ ULONG &length);
+
+/*
+ * @param data response of a server on the request
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void put_descriptor(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length);
+
+/*
+ * @param pkts GET_DESCRIPTOR requests that re-read the entries loaded from the registry
+ * @return number of requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG get_persisted(
+        _In_ descriptor_cache &cache, 
+        _Out_writes_to_(descriptor_cache::MAX_ENTRIES, return) USB_DEFAULT_PIPE_SETUP_PACKET *pkts);
+
+/*
+ * Must be called before the request is sent, its response is passed to revalidate.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void add_probe(_Inout_ descriptor_cache &cache, _In_ UINT32 seqnum, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt);
+
+/*
+ * The entry becomes revalidated if the response is the same, it is replaced by the response otherwise.
+ * The entry is removed if the request failed or the payload is not available.
+ * 
+ * @param data the whole payload of RET_SUBMIT or NULL
+ * @return false if seqnum is not of a probe
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool revalidate(
+        _Inout_ descriptor_cache &cache, _In_ UINT32 seqnum, _In_ INT32 status, 
+        _In_reads_bytes_opt_(length) const void *data, _In_ ULONG length);
+
+/*
+ * Populate empty cache with descriptors saved on previous detach of the same remote device.
+ * They are discarded if the device descriptor does not match op_import_reply.udev.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void load(_Inout_ descriptor_cache &cache, _In_ const device_ctx_ext &ext);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void save(_Inout_ descriptor_cache &cache, _In_ const device_ctx_ext &ext);
+
+} // namespace usbip
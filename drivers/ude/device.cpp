@@ -53,11 +53,17 @@ PAGED void NTAPI device_destroy(_In_ WDFOBJECT Object)
         PAGED_CODE();
 
         auto device = static_cast<UDECXUSBDEVICE>(Object);
-        auto &ext = get_device_ctx(device)->ext;
+        auto &dev = *get_device_ctx(device);
+        auto &ext = dev.ext;
 
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!USTR!:%!USTR!/%!USTR!", 
                 ptr04x(device), &ext->node_name, &ext->service_name, &ext->busid);
 
+        drain_wsk_context_cache(dev.wsk_cache); // children, including recv_hdr, are already destroyed
+        clear(dev.descriptors);
+        usbip::free(dev.stats);
+        usbip::free(dev.latency);
+
         free(ext);
         ext = nullptr;
 }
@@ -145,13 +151,9 @@ _IRQL_requires_same_
 void endpoint_purge(_In_ UDECXUSBENDPOINT endpoint)
 {
         auto &endp = *get_endpoint_ctx(endpoint);
-        auto &dev = *get_device_ctx(endp.device);
-
         TraceDbg("dev %04x, endp %04x, queue %04x", ptr04x(endp.device), ptr04x(endpoint), ptr04x(endp.queue));
 
-        while (auto request = device::dequeue_request(dev, endpoint)) {
-                device::send_cmd_unlink_and_cancel(endp.device, request);
-        }
+        device::send_cmd_unlink_and_cancel_all(endpoint);
 
         auto purge_complete = [] ([[maybe_unused]] auto queue, auto ctx) // EVT_WDF_IO_QUEUE_STATE
         { 
@@ -310,7 +312,7 @@ PAGED NTSTATUS endpoint_add(_In_ UDECXUSBDEVICE device, _In_ UDECX_USB_ENDPOINT_
         auto &endp = *get_endpoint_ctx(endpoint);
 
         endp.device = device;
-        InitializeListHead(&endp.entry);
+        InitializeListHead(&endp.inflight);
 
         auto &dev = *get_device_ctx(device);
 
@@ -472,10 +474,7 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE dev, _Inout_ device_ctx &ctx)
                 return err;
         }
 
-        if (auto err = device::create_queue(dev)) {
-                return err;
-        }
-
+        device::init_queue(ctx);
         return STATUS_SUCCESS;
 }
 
@@ -508,12 +507,17 @@ PAGED void detach(_In_ UDECXUSBDEVICE device, _In_ bool plugout_and_delete)
         PAGED_CODE();
 
         auto &dev = *get_device_ctx(device);
-        WdfIoQueuePurgeSynchronously(dev.queue);
+        device::cancel_all_inflight(dev);
+
+        stop_receive(dev);
+        save(dev.descriptors, *dev.ext); // put_descriptor can't be called anymore
 
         if (close_socket(dev.ext->sock)) {
                 Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection closed", ptr04x(device));
         }
 
+        device::wait_all_inflight(dev); // as WdfIoQueuePurgeSynchronously did
+
         if (auto port = vhci::reclaim_roothub_port(device)) {
                 Trace(TRACE_LEVEL_INFORMATION, "port %d released", port);
         }
@@ -623,6 +627,21 @@ PAGED NTSTATUS usbip::device::create(_Out_ UDECXUSBDEVICE &dev, _In_ WDFDEVICE v
         KeInitializeEvent(&ctx.queue_purged, NotificationEvent, false);
         KeInitializeSpinLock(&ctx.endpoint_list_lock);
 
+        KeInitializeSpinLock(&ctx.send_lock);
+        InitializeListHead(&ctx.send_queue);
+
+        init_wsk_context_cache(ctx.wsk_cache);
+        usbip::init(ctx.descriptors); // local init hides it
+        load(ctx.descriptors, *ext); // enumeration will not wait for a server if descriptors were saved
+
+        if (auto err = usbip::init(ctx.stats)) {
+                return err;
+        }
+
+        if (auto err = usbip::init(ctx.latency)) {
+                return err;
+        }
+
         if (auto err = init_device(dev, ctx)) {
                 return err;
         }
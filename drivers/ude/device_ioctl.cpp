@@ -14,6 +14,7 @@
 #include "network.h"
 #include "ioctl.h"
 #include "wsk_receive.h"
+#include "endpoint_list.h"
 
 #include "filter_request.h"
 #include <ude_filter\request.h>
@@ -26,6 +27,7 @@
 #include <libdrv\usb_util.h>
 #include <libdrv\dbgcommon.h>
 #include <libdrv\usbd_helper.h>
+#include <libdrv\lock.h>
 
 namespace
 {
@@ -40,20 +42,19 @@ using namespace usbip;
  *
  * To avoid copying of URB's transfer buffer, it must not be completed until this handler will be called.
  * This means that:
- * 1.EvtIoCanceledOnQueue must not complete IRP if it's called before send_complete because WskSend can still access
+ * 1.EvtRequestCancel must not complete IRP if it's called before send_complete because WskSend can still access
  *   IRP transfer buffer.
  * 2.WskReceive must not complete IRP if it's called before send_complete because send_complete modifies request_context.status.
- * 3.EvtIoCanceledOnQueue and WskReceive are mutually exclusive because IRP is dequeued from the CSQ.
- * 4.Thus, send_complete can run concurrently with EvtIoCanceledOnQueue or WskReceive.
+ * 3.EvtRequestCancel and WskReceive are mutually exclusive because IRP is removed from device_ctx::inflight
+ *   and unmarked cancelable under the same lock.
+ * 4.Thus, send_complete can run concurrently with EvtRequestCancel or WskReceive.
  * 
  * @see wsk_receive.cpp, complete 
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS send_complete(
-        _In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+void complete_sent(_In_ wsk_context_ptr &ctx, _In_ const IO_STATUS_BLOCK &st)
 {
-        wsk_context_ptr ctx(static_cast<wsk_context*>(Context), true);
         auto request = ctx->request;
 
         request_ctx *req_ctx;
@@ -70,10 +71,8 @@ NTSTATUS send_complete(
                 old_status = REQ_NO_HANDLE;
         }
 
-        auto &st = wsk_irp->IoStatus;
-
-        TraceWSK("wsk irp %04x, seqnum %u, %!STATUS!, Information %Iu, %!request_status!", 
-                  ptr04x(wsk_irp), seqnum, st.Status, st.Information, old_status);
+        TraceWSK("seqnum %u, %!STATUS!, Information %Iu, %!request_status!", 
+                  seqnum, st.Status, st.Information, old_status);
 
         if (!request) {
                 // nothing to do
@@ -92,16 +91,221 @@ NTSTATUS send_complete(
         } else if (old_status == REQ_CANCELED) {
                 complete(request, STATUS_CANCELLED);
         }
+}
+
+/*
+ * Restore MDL chain of the context that was tied with the next one.
+ * @see dequeue_batch
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void untie(_Inout_ wsk_context &ctx)
+{
+        auto next = ctx.next->mdl_hdr.get();
+        ctx.next = nullptr;
+
+        for (auto mdl = ctx.mdl_hdr.get(); mdl; mdl = mdl->Next) {
+                if (mdl->Next == next) {
+                        mdl->Next = nullptr;
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_next(_Inout_ device_ctx &dev);
+
+/*
+ * One WskSend can carry several contexts linked by wsk_context::next, wsk_irp of the first one is used.
+ * Each request is completed as if it was sent separately.
+ */
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_complete(
+        _In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+        auto ctx = static_cast<wsk_context*>(Context);
+        auto &dev = *ctx->dev;
 
-        if (auto dev = ctx->dev; st.Status == STATUS_FILE_FORCED_CLOSED && !dev->unplugged) {
-                auto hdev = get_device(dev);
+        auto st = wsk_irp->IoStatus; // wsk_irp will be reused after the first context is freed
+        TraceWSK("wsk irp %04x, %!STATUS!, Information %Iu", ptr04x(wsk_irp), st.Status, st.Information);
+
+        while (ctx) {
+                auto next = ctx->next;
+                if (next) {
+                        untie(*ctx);
+                }
+
+                wsk_context_ptr ptr(ctx, true);
+                complete_sent(ptr, st);
+
+                ctx = next;
+        }
+
+        if (st.Status == STATUS_FILE_FORCED_CLOSED && !dev.unplugged) {
+                auto hdev = get_device(&dev);
                 TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(hdev), st.Status);
                 device::async_plugout_and_delete(hdev);
         }
 
+        send_next(dev);
         return StopCompletion;
 }
 
+/*
+ * @param buf can describe several contexts linked by wsk_context::next
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send(_Inout_ device_ctx &dev, _In_ wsk_context &ctx, _In_ WSK_BUF &buf)
+{
+        auto wsk_irp = ctx.wsk_irp; // do not access ctx or wsk_irp after send
+        IoSetCompletionRoutine(wsk_irp, send_complete, &ctx, true, true, true);
+
+        auto sock = dev.sock();
+        if (!sock) { // closed by detach while contexts were waiting in send_queue
+                wsk_irp->IoStatus.Status = STATUS_FILE_FORCED_CLOSED;
+                wsk_irp->IoStatus.Information = 0;
+                send_complete(nullptr, wsk_irp, &ctx);
+                return;
+        }
+
+        auto st = send(sock, &buf, WSK_FLAG_NODELAY, wsk_irp);
+        NT_ASSERT(st != STATUS_NOT_SUPPORTED); // send_complete will not be called for this status only
+
+        if (st == STATUS_PENDING) {
+                TraceWSK("wsk irp %04x, %Iu bytes", ptr04x(wsk_irp), buf.Length);
+        } else {
+                TraceDbg("wsk irp %04x, %Iu bytes, %!STATUS!", ptr04x(wsk_irp), buf.Length, st);
+        }
+}
+
+/*
+ * @return true if the caller must send the context itself because WskSend is not in progress
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto enqueue(_Inout_ device_ctx &dev, _In_ wsk_context &ctx)
+{
+        wdm::Lock lck(dev.send_lock);
+
+        if (dev.send_busy) {
+                InsertTailList(&dev.send_queue, &ctx.entry);
+                return false;
+        }
+
+        dev.send_busy = true;
+        return true;
+}
+
+/*
+ * Contexts are sent in the same order they were queued. MDL chains are tied together,
+ * only the last context in a batch can have MDL chain that is longer than its usbip PDU,
+ * WSK_BUF.Length will cut extra length.
+ *
+ * The tail of a chain can be URB.TransferBufferMDL (or a chain of it) that belongs to a client driver,
+ * the next context must not be tied to it. Such context also ends a batch.
+ *
+ * @return the first context of a batch, the rest are linked by wsk_context::next
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+wsk_context *dequeue_batch(_Inout_ device_ctx &dev, _Out_ WSK_BUF &buf)
+{
+        enum : ULONG { MAX_LENGTH = 64*1024 }; // a batch can exceed it by the size of the last PDU
+
+        buf = {};
+        wsk_context *head{};
+
+        wdm::Lock lck(dev.send_lock);
+
+        for (wsk_context *prev{}; !IsListEmpty(&dev.send_queue) && buf.Length < MAX_LENGTH; ) {
+
+                auto entry = RemoveHeadList(&dev.send_queue);
+                auto ctx = CONTAINING_RECORD(entry, wsk_context, entry);
+
+                auto len = get_total_size(ctx->hdr);
+                bool exact = size(ctx->mdl_hdr) == len;
+                bool owned = ctx->is_isoc || !ctx->mdl_buf || ctx->mdl_buf.managed(); // the tail of MDL chain
+
+                byteswap_header(ctx->hdr, swap_dir::host2net);
+
+                if (prev) {
+                        tail(prev->mdl_hdr)->Next = ctx->mdl_hdr.get();
+                        prev->next = ctx;
+                } else {
+                        head = ctx;
+                        buf.Mdl = ctx->mdl_hdr.get();
+                }
+
+                buf.Length += len;
+                prev = ctx;
+
+                if (!(exact && owned)) {
+                        break;
+                }
+        }
+
+        if (!head) {
+                dev.send_busy = false;
+        }
+
+        return head;
+}
+
+/*
+ * WskSend is called from the completion routine of previous WskSend.
+ * If WskSend completes synchronously, send_complete calls this function again on the same stack.
+ * The nested call does not send, it only increments the counter and the outer call sends the next batch,
+ * so the stack depth does not grow with the number of queued contexts.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_next(_Inout_ device_ctx &dev)
+{
+        if (InterlockedIncrement(&dev.send_next_calls) > 1) {
+                return; // the outer call will send
+        }
+
+        do {
+                WSK_BUF buf;
+                if (auto ctx = dequeue_batch(dev, buf)) {
+                        send(dev, *ctx, buf);
+                }
+        } while (InterlockedDecrement(&dev.send_next_calls));
+}
+
+/*
+ * Contexts are appended to send_queue at once, dequeue_batch will gather them into one WSK_BUF.
+ * @param batch contexts linked by wsk_context::entry
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send(_Inout_ device_ctx &dev, _Inout_ LIST_ENTRY &batch)
+{
+        if (IsListEmpty(&batch)) {
+                return;
+        }
+
+        bool idle;
+        {
+                wdm::Lock lck(dev.send_lock);
+
+                auto first = batch.Flink;
+                RemoveEntryList(&batch); // the rest is a list without head
+                AppendTailList(&dev.send_queue, first);
+
+                idle = !dev.send_busy;
+                dev.send_busy = true;
+        }
+
+        if (idle) {
+                send_next(dev);
+        }
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer)
@@ -147,6 +351,8 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _In_ de
                         ptr04x(ctx->request), buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, log_setup));
         }
 
+        record_pdu(get_vhci_ctx(dev.vhci)->recorder, dev.port, true, ctx->hdr, buf.Length, ctx->mdl_buf.get());
+
         if (auto request = ctx->request) { // can be WDF_NO_HANDLE
                 auto &req = *get_request_ctx(request); // FIXME: is not zeroed?
 
@@ -158,26 +364,25 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _In_ de
                 NT_ASSERT(endpoint);
                 req.endpoint = endpoint;
 
-                if (auto err = WdfRequestForwardToIoQueue(request, dev.queue)) {
-                        Trace(TRACE_LEVEL_ERROR, "WdfRequestForwardToIoQueue %!STATUS!", err);
+                req.sent = get_timestamp();
+
+                auto addr = get_endpoint_ctx(endpoint)->descriptor.bEndpointAddress;
+                auto &cmd = ctx->hdr.u.cmd_submit; // the request can be completed right after insert_inflight
+                on_submit(dev.stats, addr, is_transfer_dir_out(ctx->hdr) ? ULONG(cmd.transfer_buffer_length) : 0);
+
+                if (auto err = device::insert_inflight(dev, request)) { // can be canceled right after that
+                        on_complete(dev.stats, addr, err); // the caller completes it
                         return err;
                 }
         }
 
-        byteswap_header(ctx->hdr, swap_dir::host2net);
-
-        auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
-
-        auto st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
-        NT_ASSERT(st != STATUS_NOT_SUPPORTED); // send_complete will not be called for this status only
-
-        if (st == STATUS_PENDING) {
-                TraceWSK("wsk irp %04x, %Iu bytes", ptr04x(wsk_irp), buf.Length);
+        if (auto &c = *ctx.release(); enqueue(dev, c)) {
+                byteswap_header(c.hdr, swap_dir::host2net);
+                send(dev, c, buf);
         } else {
-                TraceDbg("wsk irp %04x, %Iu bytes, %!STATUS!", ptr04x(wsk_irp), buf.Length, st);
+                TraceWSK("ctx %04x queued, %Iu bytes", ptr04x(&c), buf.Length);
         }
-        
+
         return STATUS_PENDING;
 }
 
@@ -195,7 +400,7 @@ auto control_transfer(
         auto &r = urb.UrbControlTransferEx;
 
         if (r.PipeHandle && endp.PipeHandle != r.PipeHandle) { // r.PipeHandle is null if USBD_DEFAULT_PIPE_TRANSFER
-                endp.PipeHandle = r.PipeHandle;
+                set_pipe_handle(endp, r.PipeHandle);
         }
 
         if (!filter::is_request(r)) {
@@ -226,6 +431,21 @@ auto control_transfer(
                 return STATUS_INVALID_PARAMETER;
         }
 
+        if (is_cacheable(pkt)) {
+                UCHAR *buf{};
+                ULONG len{};
+
+                if (NT_SUCCESS(UdecxUrbRetrieveBuffer(request, &buf, &len)) && 
+                    (len = min(len, buf_len), get_descriptor(dev.descriptors, pkt, buf, len))) {
+                        TraceUrb("req %04x <- %lu bytes from descriptor cache", ptr04x(request), len);
+                        UdecxUrbSetBytesCompleted(request, len);
+                        return STATUS_SUCCESS;
+                }
+        } else if (pkt.bmRequestType.B == (USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE) && 
+                   pkt.bRequest == USB_REQUEST_SET_CONFIGURATION) { // filter::unpack_request can produce it
+                invalidate(dev.descriptors);
+        }
+
         wsk_context_ptr ctx(&dev, request);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
@@ -255,7 +475,7 @@ auto bulk_or_interrupt_transfer(
         auto &r = urb.UrbBulkOrInterruptTransfer;
 
         if (endp.PipeHandle != r.PipeHandle) {
-                endp.PipeHandle = r.PipeHandle;
+                set_pipe_handle(endp, r.PipeHandle);
         }
 
         {
@@ -322,7 +542,7 @@ auto isoch_transfer(
         auto &r = urb.UrbIsochronousTransfer;
 
         if (endp.PipeHandle != r.PipeHandle) {
-                endp.PipeHandle = r.PipeHandle;
+                set_pipe_handle(endp, r.PipeHandle);
         }
 
         {
@@ -428,6 +648,47 @@ auto send_ep0_out(
         return ::send(dev.ep0, ctx, dev, true);
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+
+        if (auto old_status = atomic_set_status(req, REQ_CANCELED); old_status == REQ_SEND_COMPLETE) {
+                complete(request, STATUS_CANCELLED);
+        } else {
+                NT_ASSERT(old_status != REQ_RECV_COMPLETE);
+        }
+}
+
+/*
+ * @param batch wsk_context::entry list to append to
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void make_cmd_unlink(_Inout_ LIST_ENTRY &batch, _In_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE));
+        if (!ctx) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(get_device(&dev)), seqnum);
+                return;
+        }
+
+        set_cmd_unlink_usbip_header(ctx->hdr, dev, seqnum);
+
+        WSK_BUF buf;
+        NT_VERIFY(!prepare_wsk_buf(buf, *ctx, nullptr));
+        {
+                char str[DBG_USBIP_HDR_BUFSZ];
+                TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "-> %Iu%s", 
+                            buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, false));
+        }
+
+        record_pdu(get_vhci_ctx(dev.vhci)->recorder, dev.port, true, ctx->hdr, buf.Length);
+
+        InsertTailList(&batch, &ctx.release()->entry);
+}
+
 } // namespace
 
 
@@ -462,15 +723,96 @@ void usbip::device::send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_
         } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
                 set_cmd_unlink_usbip_header(ctx->hdr, dev, req.seqnum);
                 ::send(WDF_NO_HANDLE, ctx, dev, false); // ignore error
+                on_unlink(dev.stats, get_endpoint_ctx(req.endpoint)->descriptor.bEndpointAddress);
         } else {
                 Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), req.seqnum);
         }
 
-        if (auto old_status = atomic_set_status(req, REQ_CANCELED); old_status == REQ_SEND_COMPLETE) {
-                complete(request, STATUS_CANCELLED);
-        } else {
-                NT_ASSERT(old_status != REQ_RECV_COMPLETE);
+        cancel(request);
+}
+
+/*
+ * Endpoint purge is linear in the number of its requests, @see endpoint_ctx::inflight.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::send_cmd_unlink_and_cancel_all(_In_ UDECXUSBENDPOINT endpoint)
+{
+        auto &endp = *get_endpoint_ctx(endpoint);
+        auto device = endp.device;
+        auto &dev = *get_device_ctx(device);
+
+        LIST_ENTRY batch;
+        InitializeListHead(&batch);
+
+        int cnt = 0;
+
+        for ( ; auto request = dequeue_request(dev, endpoint); ++cnt) {
+                if (!dev.unplugged) {
+                        make_cmd_unlink(batch, dev, get_request_ctx(request)->seqnum);
+                        on_unlink(dev.stats, endp.descriptor.bEndpointAddress);
+                }
+                cancel(request);
+        }
+
+        TraceDbg("dev %04x, endp %04x, %d request(s) canceled", ptr04x(device), ptr04x(endpoint), cnt);
+        ::send(dev, batch);
+}
+
+/*
+ * GET_DESCRIPTOR-s do not have requests, they are sent by one WskSend.
+ * Responses are matched by seqnum, @see wsk_receive.cpp, revalidate_descriptor.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::revalidate_descriptors(_In_ UDECXUSBDEVICE device)
+{
+        auto &dev = *get_device_ctx(device);
+
+        USB_DEFAULT_PIPE_SETUP_PACKET pkts[descriptor_cache::MAX_ENTRIES];
+        auto cnt = get_persisted(dev.descriptors, pkts);
+        if (!cnt) {
+                return;
         }
+
+        auto &ep0 = *get_endpoint_ctx(dev.ep0);
+        const ULONG TransferFlags = USBD_DEFAULT_PIPE_TRANSFER | USBD_SHORT_TRANSFER_OK | USBD_TRANSFER_DIRECTION_IN;
+
+        LIST_ENTRY batch;
+        InitializeListHead(&batch);
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                auto &pkt = pkts[i];
+
+                wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE));
+                if (!ctx) {
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, wsk_context_ptr error", ptr04x(device));
+                        break;
+                }
+
+                if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, ep0.descriptor, TransferFlags, pkt.wLength, 
+                                                           setup_dir::in())) {
+                        Trace(TRACE_LEVEL_ERROR, "set_cmd_submit_usbip_header %!STATUS!", err);
+                        break;
+                }
+
+                get_submit_setup(ctx->hdr) = pkt;
+                add_probe(dev.descriptors, ctx->hdr.base.seqnum, pkt);
+
+                WSK_BUF buf;
+                NT_VERIFY(!prepare_wsk_buf(buf, *ctx, nullptr));
+                {
+                        char str[DBG_USBIP_HDR_BUFSZ];
+                        TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "-> %Iu%s", 
+                                    buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, true));
+                }
+
+                record_pdu(get_vhci_ctx(dev.vhci)->recorder, dev.port, true, ctx->hdr, buf.Length);
+                InsertTailList(&batch, &ctx.release()->entry);
+        }
+
+        TraceDbg("dev %04x, %lu descriptor(s) to revalidate", ptr04x(device), cnt);
+        ::send(dev, batch);
 }
 
 _IRQL_requires_same_
@@ -530,6 +872,8 @@ NTSTATUS usbip::device::set_configuration(
 {
         TraceDbg("dev %04x, ConfigurationValue %d", ptr04x(device), ConfigurationValue);
 
+        invalidate(get_device_ctx(device)->descriptors);
+
         auto r = make_set_configuration(ConfigurationValue);
         return send_ep0_out(device, request, r);
 }
@@ -577,6 +921,7 @@ NTSTATUS usbip::device::reset_port(_In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUE
         auto port = static_cast<USHORT>(dev.port); // meaningless for a server which ignores it
 
         TraceDbg("dev %04x, port %d", ptr04x(device), port);
+        invalidate(dev.descriptors);
 
         auto r = make_reset_port(port);
         return send_ep0_out(device, request, r);
@@ -17,6 +17,21 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_ WDFREQUEST request);
 
+/*
+ * Cancel all requests of the endpoint, CMD_UNLINK-s are sent by one WskSend.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_cmd_unlink_and_cancel_all(_In_ UDECXUSBENDPOINT endpoint);
+
+/*
+ * Descriptors loaded from the registry complete enumeration requests without round trips.
+ * They are read again in background after the device is plugged in, @see descriptor_cache.h, revalidate.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void revalidate_descriptors(_In_ UDECXUSBDEVICE device);
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 USB_DEFAULT_PIPE_SETUP_PACKET make_set_configuration(_In_ UCHAR ConfigurationValue);
@@ -9,66 +9,163 @@
 #include "context.h"
 #include "device_ioctl.h"
 
+#include <libdrv\lock.h>
+
 namespace
 {
 
 using namespace usbip;
 
+/*
+ * Seqnums are sequential, the lowest bits of the number are evenly distributed.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto matches(_In_ WDFREQUEST request, _In_ const device::request_search &crit)
+inline auto get_bucket(_In_ device_ctx &dev, _In_ seqnum_t seqnum)
 {
-        auto &req = *get_request_ctx(request);
-        return crit.use_endp? crit.endpoint == req.endpoint : 
-                              crit.seqnum == req.seqnum;
+        static_assert(!(device_ctx::INFLIGHT_BUCKETS & (device_ctx::INFLIGHT_BUCKETS - 1)));
+        return dev.inflight + (extract_num(seqnum) & (device_ctx::INFLIGHT_BUCKETS - 1));
+}
+
+/*
+ * RemoveEntryList works if entry was just InitializeListHead-ed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void remove(_Inout_ LIST_ENTRY *entry)
+{
+        RemoveEntryList(entry);
+        InitializeListHead(entry);
+}
+
+/*
+ * Must be called under device_ctx::inflight_lock, as well as WdfRequestUnmarkCancelable (like KMDF echo sample does).
+ * The request is removed from the indexes, cancel_inflight owns it if it was canceled concurrently.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST remove_and_unmark(_Inout_ request_ctx &req)
+{
+        remove(&req.entry);
+        remove(&req.endp_entry);
+
+        auto request = static_cast<WDFREQUEST>(WdfObjectContextGetObject(&req));
+
+        switch (auto st = WdfRequestUnmarkCancelable(request)) {
+        case STATUS_SUCCESS:
+                return request;
+        case STATUS_CANCELLED: // cancel_inflight is called or will be called soon
+                break;
+        default:
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestUnmarkCancelable %!STATUS!", st);
+        }
+
+        return WDF_NO_HANDLE;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto dequeue_request(_In_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        auto head = get_bucket(dev, seqnum);
+        wdm::Lock lck(dev.inflight_lock);
+
+        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+                if (auto req = CONTAINING_RECORD(entry, request_ctx, entry); req->seqnum == seqnum) {
+                        return remove_and_unmark(*req);
+                }
+        }
+
+        return WDFREQUEST(WDF_NO_HANDLE);
 }
 
-_Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
+/*
+ * Requests that were canceled concurrently are skipped.
+ * UdeCx stops the queue of the endpoint before the purge, new requests can't be inserted meanwhile.
+ * @param bucket head is device_ctx::inflight[] if true, endpoint_ctx::inflight otherwise
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void NTAPI canceled_on_queue(_In_ WDFQUEUE queue, _In_ WDFREQUEST request)
+auto dequeue_request(_In_ device_ctx &dev, _In_ LIST_ENTRY *head, _In_ bool bucket = false)
 {
-        auto dev = get_device(queue);
-        TraceDbg("dev %04x, request %04x", ptr04x(dev), ptr04x(request));
+        wdm::Lock lck(dev.inflight_lock);
 
-        device::send_cmd_unlink_and_cancel(dev, request);
+        while (!IsListEmpty(head)) {
+                auto req = bucket ? CONTAINING_RECORD(head->Flink, request_ctx, entry) :
+                                    CONTAINING_RECORD(head->Flink, request_ctx, endp_entry);
+                if (auto request = remove_and_unmark(*req)) {
+                        return request;
+                }
+        }
+
+        return WDFREQUEST(WDF_NO_HANDLE);
+}
+
+/*
+ * A request can be canceled as soon as it is marked cancelable, even before it is sent.
+ * @see device_ioctl.cpp, complete_sent
+ */
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI cancel_inflight(_In_ WDFREQUEST request)
+{
+        auto device = get_endpoint_ctx(get_request_ctx(request)->endpoint)->device;
+        TraceDbg("dev %04x, request %04x", ptr04x(device), ptr04x(request));
+
+        auto &dev = *get_device_ctx(device);
+        {
+                wdm::Lock lck(dev.inflight_lock);
+                remove(&get_request_ctx(request)->entry);
+                remove(&get_request_ctx(request)->endp_entry);
+        }
+
+        device::send_cmd_unlink_and_cancel(device, request);
 }
 
 } // namespace
 
 
 _IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS usbip::device::create_queue(_In_ UDECXUSBDEVICE dev)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::init_queue(_Inout_ device_ctx &dev)
 {
-        PAGED_CODE();
-        auto &ctx = *get_device_ctx(dev);
-
-        WDF_IO_QUEUE_CONFIG cfg;
-        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchManual);
-        cfg.PowerManaged = WdfFalse;
-        cfg.EvtIoCanceledOnQueue = canceled_on_queue;
-
-        WDF_OBJECT_ATTRIBUTES attr;
-        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, UDECXUSBDEVICE);
-//      attr.SynchronizationScope = WdfSynchronizationScopeQueue; // EvtIoCanceledOnQueue is used only
-        attr.ParentObject = dev;
-
-        attr.EvtCleanupCallback = [] (auto obj) 
-        { 
-                auto queue = static_cast<WDFQUEUE>(obj);
-                TraceDbg("dev %04x, queue %04x cleanup", ptr04x(get_device(queue)), ptr04x(queue)); 
-        };
-
-        if (auto err = WdfIoQueueCreate(ctx.vhci, &cfg, &attr, &ctx.queue)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
-                return err;
+        KeInitializeSpinLock(&dev.inflight_lock);
+        ExInitializeRundownProtection(&dev.inflight_rundown);
+
+        for (auto &head: dev.inflight) {
+                InitializeListHead(&head);
         }
+}
 
-        get_device(ctx.queue) = dev;
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::insert_inflight(_In_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        NT_ASSERT(is_valid_seqnum(req.seqnum));
+
+        auto head = get_bucket(dev, req.seqnum);
+        auto endp_head = &get_endpoint_ctx(req.endpoint)->inflight;
+
+        wdm::Lock lck(dev.inflight_lock);
+
+        if (dev.unplugged) { // cancel_all_inflight is called or will be called soon, like for a purged WDFQUEUE
+                return STATUS_DEVICE_DOES_NOT_EXIST;
+        }
 
-        TraceDbg("dev %04x, queue %04x", ptr04x(dev), ptr04x(ctx.queue));
-        return STATUS_SUCCESS;
+        NT_VERIFY(ExAcquireRundownProtection(&dev.inflight_rundown)); // wait_all_inflight is called after unplug only
+
+        auto st = WdfRequestMarkCancelableEx(request, cancel_inflight); // does not call it under the lock
+        if (NT_SUCCESS(st)) {
+                InsertTailList(head, &req.entry);
+                InsertTailList(endp_head, &req.endp_entry);
+        } else {
+                TraceDbg("request %04x, WdfRequestMarkCancelableEx %!STATUS!", ptr04x(request), st);
+                ExReleaseRundownProtection(&dev.inflight_rundown);
+        }
+
+        return st;
 }
 
 _IRQL_requires_same_
@@ -77,43 +174,37 @@ WDFREQUEST usbip::device::dequeue_request(_In_ device_ctx &dev, _In_ const reque
 {
         NT_ASSERT(crit.endpoint); // largest in union
 
-        if (!dev.queue) {
-                return WDF_NO_HANDLE;
+        return crit.use_endp ? ::dequeue_request(dev, &get_endpoint_ctx(crit.endpoint)->inflight) :
+                               ::dequeue_request(dev, crit.seqnum);
+}
+
+/*
+ * Used instead of WdfIoQueuePurgeSynchronously, CMD_UNLINK is not sent for unplugged device.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::cancel_all_inflight(_In_ device_ctx &dev)
+{
+        NT_ASSERT(dev.unplugged);
+        auto device = get_device(&dev);
+        int cnt = 0;
+
+        for (auto &head: dev.inflight) {
+                while (auto request = ::dequeue_request(dev, &head, true)) {
+                        send_cmd_unlink_and_cancel(device, request);
+                        ++cnt;
+                }
         }
 
-        for (WDFREQUEST prev{}, cur; ; prev = cur) {
+        TraceDbg("dev %04x, %d request(s) canceled", ptr04x(device), cnt);
+}
 
-                auto st = WdfIoQueueFindRequest(dev.queue, prev, WDF_NO_HANDLE, nullptr, &cur);
-                if (prev) {
-                        WdfObjectDereference(prev);
-                }
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+void usbip::device::wait_all_inflight(_In_ device_ctx &dev)
+{
+        NT_ASSERT(dev.unplugged);
 
-                switch (st) {
-                case STATUS_SUCCESS:
-                        if (matches(cur, crit)) {
-                                st = WdfIoQueueRetrieveFoundRequest(dev.queue, cur, &prev);
-                                WdfObjectDereference(cur);
-
-                                switch (st) {
-                                case STATUS_SUCCESS:
-                                        return prev;
-                                case STATUS_NOT_FOUND: // cur was canceled and removed from queue
-                                        cur = WDF_NO_HANDLE; // restart the loop
-                                        break;
-                                default:
-                                        Trace(TRACE_LEVEL_ERROR, "WdfIoQueueRetrieveFoundRequest %!STATUS!", st);
-                                        return WDF_NO_HANDLE;
-                                }
-                        }
-                        break;
-                case STATUS_NOT_FOUND: // prev was canceled and removed from queue
-                        NT_ASSERT(!cur); // restart the loop
-                        break;
-                case STATUS_NO_MORE_ENTRIES: // not found
-                        return WDF_NO_HANDLE;
-                default:
-                        Trace(TRACE_LEVEL_ERROR, "WdfIoQueueFindRequest %!STATUS!", st);
-                        return WDF_NO_HANDLE;
-                }
-        }
+        ExWaitForRundownProtectionRelease(&dev.inflight_rundown);
+        TraceDbg("dev %04x, all requests completed", ptr04x(get_device(&dev)));
 }
@@ -21,9 +21,12 @@ namespace usbip
 namespace usbip::device
 {
 
+/*
+ * In-flight requests are not kept in a WDFQUEUE, they are owned by the driver and marked cancelable.
+ */
 _IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS create_queue(_In_ UDECXUSBDEVICE dev);
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init_queue(_Inout_ device_ctx &dev);
 
 struct request_search
 {
@@ -40,12 +43,36 @@ struct request_search
 };
 
 /*
- * @param queue device_ctx.queue 
+ * Marks the request cancelable and inserts it into the indexes.
+ * @return error if the request is already canceled or the device is unplugged, the caller must complete it
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS insert_inflight(_In_ device_ctx &dev, _In_ WDFREQUEST request);
+
+/*
+ * Search by seqnum is O(1), the index device_ctx.inflight is used.
+ * Search by endpoint is O(1) too, the first request from endpoint_ctx.inflight is taken.
+ * The request is unmarked cancelable, a canceled one is never returned.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 WDFREQUEST dequeue_request(_In_ device_ctx &dev, _In_ const request_search &crit);
 
-// @see WdfIoQueueRetrieveNextRequest
+/*
+ * Cancels all requests of unplugged device.
+ * A canceled request that is still being sent is completed by send_complete, @see wait_all_inflight.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_all_inflight(_In_ device_ctx &dev);
+
+/*
+ * Waits for the completion of all requests that were inserted by insert_inflight.
+ * Pending sends are finished by closing the socket, so call it after that.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+void wait_all_inflight(_In_ device_ctx &dev);
 
 } // namespace usbip::device
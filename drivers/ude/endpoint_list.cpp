@@ -15,52 +15,163 @@ using namespace usbip;
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto get_endpoint_list_head(_In_ device_ctx &dev)
+inline auto get_slot(_In_ const endpoint_ctx &endp)
 {
-        auto ep0 = get_endpoint_ctx(dev.ep0);
-        return &ep0->entry;
+        return usbip::get_slot(endp.descriptor.bEndpointAddress);
+}
+
+/*
+ * Pipe handles are pointers, the lowest bits are always zero.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto get_bucket(_In_ USBD_PIPE_HANDLE handle)
+{
+        static_assert(!(device_ctx::PIPE_BUCKETS & (device_ctx::PIPE_BUCKETS - 1)));
+
+        auto h = reinterpret_cast<uintptr_t>(handle);
+        return ((h >> 4) ^ (h >> 12)) & (device_ctx::PIPE_BUCKETS - 1);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto read_slot(_In_ device_ctx &dev, _In_ ULONG slot)
+{
+        NT_ASSERT(slot < ARRAYSIZE(dev.endpoints));
+        return static_cast<endpoint_ctx*>(ReadPointerAcquire(reinterpret_cast<void* volatile*>(dev.endpoints + slot)));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void write_slot(_In_ device_ctx &dev, _In_ ULONG slot, _In_opt_ endpoint_ctx *endp)
+{
+        NT_ASSERT(slot < ARRAYSIZE(dev.endpoints));
+        InterlockedExchangePointer(reinterpret_cast<void* volatile*>(dev.endpoints + slot), endp);
+}
+
+/*
+ * Outdated endpoints of the slot are rarely present, the walk is done under the lock.
+ * The first one is already checked by the caller.
+ */
+template<typename F>
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find_outdated(_In_ device_ctx &dev, _In_ ULONG slot, _In_ const F &pred)
+{
+        endpoint_ctx *found{};
+        wdm::Lock lck(dev.endpoint_list_lock);
+
+        if (auto head = dev.endpoints[slot]) {
+                for (auto endp = head->next; endp; endp = endp->next) {
+                        if (pred(*endp)) {
+                                found = endp;
+                                break;
+                        }
+                }
+        }
+
+        return found;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_same(_In_ const endpoint_ctx &endp, _In_ const USBD_PIPE_INFORMATION &pipe)
+{
+        auto &d = endp.descriptor;
+
+        return  d.bEndpointAddress == pipe.EndpointAddress &&
+                d.wMaxPacketSize == pipe.MaximumPacketSize &&
+                d.bInterval == pipe.Interval &&
+                usb_endpoint_type(d) == pipe.PipeType;
 }
 
 } // namespace
 
 
+/*
+ * Outdated, but still not removed endpoint with the same address is kept in the chain of the slot,
+ * it can still be found by its pipe handle or descriptor.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::insert_endpoint_list(_In_ endpoint_ctx &endp)
 {
-        NT_ASSERT(IsListEmpty(&endp.entry));
+        auto &dev = *get_device_ctx(endp.device);
+        auto slot = get_slot(endp);
 
-        if (auto &dev = *get_device_ctx(endp.device); auto head = get_endpoint_list_head(dev)) {
-                wdm::Lock lck(dev.endpoint_list_lock);
-                InsertHeadList(head, &endp.entry); // outdated, but still not removed endpoints will be at end
-        }
+        wdm::Lock lck(dev.endpoint_list_lock);
+
+        endp.next = dev.endpoints[slot];
+        write_slot(dev, slot, &endp);
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::remove_endpoint_list(_In_ endpoint_ctx &endp)
 {
-        auto e = &endp.entry;
+        auto dev = get_device_ctx(endp.device);
+        if (!dev) {
+                return;
+        }
+
+        auto slot = get_slot(endp);
+        wdm::Lock lck(dev->endpoint_list_lock);
 
-        if (auto dev = get_device_ctx(endp.device)) {
-                wdm::Lock lck(dev->endpoint_list_lock);
-                RemoveEntryList(e); // works if entry was just InitializeListHead-ed
+        if (dev->endpoints[slot] == &endp) {
+                write_slot(*dev, slot, endp.next);
+        } else for (auto cur = dev->endpoints[slot]; cur; cur = cur->next) {
+                if (cur->next == &endp) {
+                        cur->next = endp.next;
+                        break;
+                }
         }
 
-        InitializeListHead(e);
+        endp.next = nullptr;
 }
 
+/*
+ * Data race for pipe_index[] is harmless, an entry is verified by find_endpoint.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ const compare_endpoint &compare) -> endpoint_ctx*
+void usbip::set_pipe_handle(_Inout_ endpoint_ctx &endp, _In_ USBD_PIPE_HANDLE handle)
 {
-        auto head = get_endpoint_list_head(dev);
+        endp.PipeHandle = handle;
 
-        wdm::Lock lck(dev.endpoint_list_lock);
+        if (auto &dev = *get_device_ctx(endp.device); handle) {
+                auto slot = get_slot(endp);
+                if (read_slot(dev, slot) == &endp) {
+                        WriteUCharNoFence(dev.pipe_index + get_bucket(handle), UCHAR(slot + 1));
+                }
+        }
+}
 
-        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
-                auto endp = CONTAINING_RECORD(entry, endpoint_ctx, entry);
-                if (compare(*endp)) {
+/*
+ * Collision in pipe_index[] is resolved by the walk of endpoints[], 
+ * outdated endpoints are searched last.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ USBD_PIPE_HANDLE handle) -> endpoint_ctx*
+{
+        NT_ASSERT(handle);
+
+        if (auto i = ReadUCharNoFence(dev.pipe_index + get_bucket(handle))) {
+                if (auto endp = read_slot(dev, i - 1); endp && endp->PipeHandle == handle) {
+                        return endp;
+                }
+        }
+
+        for (ULONG slot = 0; slot < ARRAYSIZE(dev.endpoints); ++slot) {
+                if (auto endp = read_slot(dev, slot); endp && endp->PipeHandle == handle) {
+                        return endp;
+                }
+        }
+
+        auto pred = [handle] (auto &endp) { return endp.PipeHandle == handle; };
+
+        for (ULONG slot = 0; slot < ARRAYSIZE(dev.endpoints); ++slot) {
+                if (auto endp = find_outdated(dev, slot, pred)) {
                         return endp;
                 }
         }
@@ -68,12 +179,17 @@ auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ const compare_endpoint &com
         return nullptr;
 }
 
-bool usbip::compare_endpoint_descr::operator() (const endpoint_ctx &endp) const
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ const USBD_PIPE_INFORMATION &pipe) -> endpoint_ctx*
 {
-        auto &d = endp.descriptor;
+        auto slot = usbip::get_slot(pipe.EndpointAddress);
 
-        return  d.bEndpointAddress == pipe.EndpointAddress &&
-                d.wMaxPacketSize == pipe.MaximumPacketSize &&
-                d.bInterval == pipe.Interval &&
-                usb_endpoint_type(d) == pipe.PipeType;
+        if (auto endp = read_slot(dev, slot); !endp) {
+                return nullptr;
+        } else if (is_same(*endp, pipe)) {
+                return endp;
+        }
+
+        return find_outdated(dev, slot, [&pipe] (auto &endp) { return is_same(endp, pipe); });
 }
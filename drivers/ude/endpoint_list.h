@@ -9,28 +9,24 @@
 namespace usbip
 {
 
-struct compare_endpoint
-{
-        // virtual ~compare_endpoint() {} // unresolved "void operator delete(void *,unsigned __int64)"
-        virtual bool operator() (const endpoint_ctx &endp) const = 0;
-};
-
-struct compare_endpoint_handle : compare_endpoint
-{
-        explicit compare_endpoint_handle(USBD_PIPE_HANDLE h) : handle(h) { NT_ASSERT(handle); }
-        constexpr bool operator() (const endpoint_ctx &endp) const override { return endp.PipeHandle == handle; }
-
-        USBD_PIPE_HANDLE handle;
-};
-
-struct compare_endpoint_descr : compare_endpoint
+/*
+ * IN and OUT endpoints with the same number have different slots.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr auto get_slot(_In_ UCHAR bEndpointAddress)
 {
-        compare_endpoint_descr(const USBD_PIPE_INFORMATION &p) : pipe(p) {}
-        bool operator()(const endpoint_ctx &endp) const override;
+        static_assert(device_ctx::ENDPOINT_SLOTS == 2*(USB_ENDPOINT_ADDRESS_MASK + 1));
 
-        USBD_PIPE_INFORMATION pipe;
-};
+        auto num = bEndpointAddress & USB_ENDPOINT_ADDRESS_MASK;
+        return USB_ENDPOINT_DIRECTION_IN(bEndpointAddress) ? num | (USB_ENDPOINT_ADDRESS_MASK + 1) : num;
+}
 
+/*
+ * Writers publish endpoints with interlocked operations, readers do not take locks.
+ * The lock is taken to find an outdated endpoint that is still not removed.
+ * The default control pipe is not inserted.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void insert_endpoint_list(_In_ endpoint_ctx &endp);
@@ -39,8 +35,22 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void remove_endpoint_list(_In_ endpoint_ctx &endp);
 
+/*
+ * Updates endpoint_ctx::PipeHandle and the index by pipe handle.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_pipe_handle(_Inout_ endpoint_ctx &endp, _In_ USBD_PIPE_HANDLE handle);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+endpoint_ctx *find_endpoint(_In_ device_ctx &dev, _In_ USBD_PIPE_HANDLE handle);
+
+/*
+ * @return endpoint with the same address and descriptor
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-endpoint_ctx *find_endpoint(_In_ device_ctx &dev, _In_ const compare_endpoint &compare);
+endpoint_ctx *find_endpoint(_In_ device_ctx &dev, _In_ const USBD_PIPE_INFORMATION &pipe);
 
 } // namespace usbip
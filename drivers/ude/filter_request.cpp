@@ -26,12 +26,12 @@ void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFO
 {
         for (ULONG i = 0; i < intf.NumberOfPipes; ++i) {
 
-                if (auto &p = intf.Pipes[i]; auto endp = find_endpoint(dev, compare_endpoint_descr(p))) {
+                if (auto &p = intf.Pipes[i]; auto endp = find_endpoint(dev, p)) {
                         TraceDbg("interface %d.%d, pipe[%lu] {%s, addr %#x} -> PipeHandle %04x (was %04x)",
                                 intf.InterfaceNumber, intf.AlternateSetting, i, usbd_pipe_type_str(p.PipeType), 
                                 p.EndpointAddress, ptr04x(p.PipeHandle), ptr04x(endp->PipeHandle));
 
-                        endp->PipeHandle = p.PipeHandle;
+                        set_pipe_handle(*endp, p.PipeHandle);
                         // endp->interface_number = intf.InterfaceNumber;
                         // endp->alternate_setting = intf.AlternateSetting;
                 } else {
@@ -47,7 +47,7 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 auto clear_endpoint_stall(
         _In_ device_ctx &dev, _Inout_ USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _Inout_ _URB_PIPE_REQUEST &r)
 {
-        if (auto endp = find_endpoint(dev, compare_endpoint_handle(r.PipeHandle))) {
+        if (auto endp = find_endpoint(dev, r.PipeHandle)) {
                 auto addr = endp->descriptor.bEndpointAddress;
                 pkt = device::make_clear_endpoint_stall(addr);
                 TraceDbg("PipeHandle %04x, bEndpointAddress %#x", ptr04x(r.PipeHandle), addr);
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "flight_recorder.h"
+#include "trace.h"
+#include "flight_recorder.tmh"
+
+#include "driver.h"
+
+#include <usbip\proto.h>
+#include <usbip\vhci.h>
+
+namespace
+{
+
+using namespace usbip;
+
+static_assert(sizeof(usbip_header) == sizeof(vhci::flight_record::header));
+
+/*
+ * @see read
+ */
+struct recorder_entry
+{
+        LONG64 seq; // odd while the record is being written, 2*(position + 1) if it is complete
+        vhci::flight_record rec;
+};
+
+} // namespace
+
+
+struct alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) usbip::recorder_cpu
+{
+        ULONG64 head; // position of the next record, modified by the owner CPU only
+        recorder_entry entries[flight_recorder::RECORDS];
+};
+
+namespace
+{
+
+/*
+ * @return true if the record is complete and was not overwritten while it was copied
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto read(_Out_ vhci::flight_record &dst, _In_ const recorder_entry &e)
+{
+        auto seq = ReadAcquire64(&e.seq);
+        if (!seq || seq & 1) {
+                return false;
+        }
+
+        dst = e.rec;
+        KeMemoryBarrier(); // the record must be read before the sequence number
+
+        return ReadNoFence64(&e.seq) == seq;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto get_mapped_address(_In_opt_ const MDL *mdl)
+{
+        return mdl && mdl->MdlFlags & (MDL_MAPPED_TO_SYSTEM_VA | MDL_SOURCE_IS_NONPAGED_POOL) ?
+                mdl->MappedSystemVa : nullptr;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::init(_Out_ flight_recorder &fr)
+{
+        PAGED_CODE();
+        fr = {};
+
+        auto cnt = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+        auto sz = cnt*sizeof(*fr.cpu);
+
+        fr.cpu = (recorder_cpu*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, sz, pooltag);
+        if (!fr.cpu) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes, recording is disabled", sz);
+                return;
+        }
+
+        fr.cpu_cnt = cnt;
+        TraceDbg("%lu processor(s), %Iu bytes", cnt, sz);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free(_Inout_ flight_recorder &fr)
+{
+        if (auto &cpu = fr.cpu) {
+                ExFreePoolWithTag(cpu, pooltag);
+                cpu = nullptr;
+        }
+
+        fr.cpu_cnt = 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::record_pdu(
+        _Inout_ flight_recorder &fr, _In_ int port, _In_ bool outgoing, _In_ const usbip_header &hdr, _In_ size_t length,
+        _In_reads_bytes_opt_(payload_len) const void *payload, _In_ size_t payload_len)
+{
+        if (!fr.cpu) {
+                return;
+        }
+
+        KIRQL irql;
+        KeRaiseIrql(DISPATCH_LEVEL, &irql); // the thread can't be preempted by another writer
+
+        auto idx = KeGetCurrentProcessorNumberEx(nullptr);
+        auto &ring = fr.cpu[idx < fr.cpu_cnt ? idx : idx % fr.cpu_cnt]; // hot-added processor
+
+        auto pos = ring.head++;
+        auto &e = ring.entries[pos % flight_recorder::RECORDS];
+
+        InterlockedExchange64(&e.seq, LONG64(2*pos + 1)); // full barrier, a reader sees it before the record is changed
+
+        auto &r = e.rec;
+        r.timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+        r.length = length < MAXULONG ? ULONG(length) : MAXULONG;
+        r.port = static_cast<UINT16>(port);
+        r.outgoing = outgoing;
+        RtlCopyMemory(r.header, &hdr, sizeof(r.header));
+
+        r.payload_len = payload ? static_cast<UINT8>(min(payload_len, sizeof(r.payload))) : 0;
+        if (r.payload_len) {
+                RtlCopyMemory(r.payload, payload, r.payload_len);
+        }
+
+        WriteRelease64(&e.seq, LONG64(2*pos + 2));
+        KeLowerIrql(irql);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::record_pdu(
+        _Inout_ flight_recorder &fr, _In_ int port, _In_ bool outgoing, _In_ const usbip_header &hdr, _In_ size_t length,
+        _In_opt_ const MDL *payload)
+{
+        auto addr = get_mapped_address(payload);
+        record_pdu(fr, port, outgoing, hdr, length, addr, addr ? MmGetMdlByteCount(payload) : 0);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::get_flight_records(
+        _Inout_ vhci::ioctl::get_flight_recorder &r, _In_ size_t max_cnt, _In_ const flight_recorder &fr)
+{
+        PAGED_CODE();
+
+        KeQueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&r.frequency));
+        r.timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+        KeQuerySystemTimePrecise(reinterpret_cast<LARGE_INTEGER*>(&r.system_time));
+
+        r.record_cnt = 0;
+
+        for (ULONG i = 0; i < fr.cpu_cnt; ++i) {
+                for (auto &e: fr.cpu[i].entries) {
+                        if (ReadNoFence64(&e.seq) <= 0) {
+                                // never written
+                        } else if (r.record_cnt == max_cnt) {
+                                return STATUS_BUFFER_TOO_SMALL;
+                        } else if (read(r.records[r.record_cnt], e)) {
+                                ++r.record_cnt;
+                        }
+                }
+        }
+
+        TraceDbg("%lu record(s)", r.record_cnt);
+        return STATUS_SUCCESS;
+}
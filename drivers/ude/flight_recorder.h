@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+
+struct usbip_header;
+
+namespace usbip::vhci::ioctl
+{
+        struct get_flight_recorder;
+}
+
+namespace usbip
+{
+
+struct recorder_cpu;
+
+/*
+ * Binary log of recent PDUs of all devices, it is always enabled.
+ * Unlike verbose WPP tracing, strings are not formatted, a header and a payload prefix are copied.
+ *
+ * Every CPU has its own ring buffer. A writer raises IRQL to DISPATCH_LEVEL, so a ring has a single writer
+ * and recording is wait-free. A reader checks the sequence number of a record and skips the records
+ * that are being overwritten, writers are not aware of readers.
+ */
+struct flight_recorder
+{
+        enum { RECORDS = 256 }; // per CPU
+
+        recorder_cpu *cpu; // nonpaged, cpu_cnt elements; NULL if recording is disabled
+        ULONG cpu_cnt;
+};
+
+/*
+ * Recording is disabled if memory can't be allocated.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init(_Out_ flight_recorder &fr);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_Inout_ flight_recorder &fr);
+
+/*
+ * @param hdr in host byte order
+ * @param length of the whole PDU
+ * @param payload the beginning of payload
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void record_pdu(
+        _Inout_ flight_recorder &fr, _In_ int port, _In_ bool outgoing, _In_ const usbip_header &hdr, _In_ size_t length,
+        _In_reads_bytes_opt_(payload_len) const void *payload = nullptr, _In_ size_t payload_len = 0);
+
+/*
+ * Payload prefix is recorded only if the buffer is already mapped to system address space.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void record_pdu(
+        _Inout_ flight_recorder &fr, _In_ int port, _In_ bool outgoing, _In_ const usbip_header &hdr, _In_ size_t length,
+        _In_opt_ const MDL *payload);
+
+/*
+ * @param max_cnt number of elements in r.records
+ * @return STATUS_BUFFER_TOO_SMALL if there are more records
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_flight_records(
+        _Inout_ vhci::ioctl::get_flight_recorder &r, _In_ size_t max_cnt, _In_ const flight_recorder &fr);
+
+} // namespace usbip
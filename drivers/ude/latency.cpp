@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "latency.h"
+#include "trace.h"
+#include "latency.tmh"
+
+#include "driver.h"
+
+#include <usbip\vhci.h>
+
+namespace
+{
+
+/*
+ * Values below SUB_BUCKETS are exact, every next power of two range has HALF buckets,
+ * so relative error does not exceed 1/HALF.
+ */
+enum : ULONG {
+        SUB_BITS = 6,
+        SUB_BUCKETS = 1UL << SUB_BITS,
+        HALF = SUB_BUCKETS/2,
+        MAX_BITS = 32, // microseconds, about 71 minutes
+        BUCKETS = (MAX_BITS - SUB_BITS + 1)*HALF + SUB_BUCKETS - HALF
+};
+
+constexpr ULONG64 MAX_VALUE = (1ULL << MAX_BITS) - 1;
+
+} // namespace
+
+
+struct usbip::latency_histogram
+{
+        LONG64 buckets[BUCKETS];
+        LONG64 sum; // of recorded values
+};
+
+namespace
+{
+
+using namespace usbip;
+
+static_assert(device_latency::TRANSFER_TYPES == ARRAYSIZE(vhci::ioctl::get_device_latency::transfers));
+static_assert(UsbdPipeTypeControl == 0);
+static_assert(UsbdPipeTypeIsochronous == 1);
+static_assert(UsbdPipeTypeBulk == 2);
+static_assert(UsbdPipeTypeInterrupt == 3);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto get_bucket(_In_ ULONG64 value)
+{
+        if (value < SUB_BUCKETS) {
+                return ULONG(value);
+        } else if (value > MAX_VALUE) {
+                value = MAX_VALUE;
+        }
+
+        ULONG msb;
+        NT_VERIFY(BitScanReverse64(&msb, value));
+
+        auto shift = msb - (SUB_BITS - 1); // leave SUB_BITS significant bits
+        return shift*HALF + ULONG(value >> shift);
+}
+
+/*
+ * @return the highest value that is equivalent to the value of the bucket
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr ULONG64 get_highest_value(_In_ ULONG bucket)
+{
+        if (bucket < SUB_BUCKETS) {
+                return bucket;
+        }
+
+        auto shift = bucket/HALF - 1;
+        ULONG64 top = bucket - shift*HALF;
+
+        return ((top + 1) << shift) - 1;
+}
+static_assert(get_highest_value(SUB_BUCKETS) == SUB_BUCKETS + 1);
+static_assert(get_highest_value(BUCKETS - 1) == MAX_VALUE);
+
+/*
+ * @param per_100k percentile multiplied by 1000, for example 99900 is p99.9
+ */
+constexpr auto get_rank(_In_ ULONG64 count, _In_ ULONG per_100k)
+{
+        enum { ONE = 100'000 };
+        return (count*per_100k + ONE - 1)/ONE; // ceil
+}
+
+/*
+ * Buckets are read twice without a lock, counts can only grow between the passes.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_percentiles(_Out_ vhci::latency_percentiles &r, _In_ const latency_histogram &h)
+{
+        r = {};
+
+        for (ULONG i = 0; i < BUCKETS; ++i) {
+                if (auto n = ReadNoFence64(&h.buckets[i]); n > 0) {
+                        r.count += n;
+                        r.max = get_highest_value(i);
+                }
+        }
+
+        if (!r.count) {
+                return;
+        }
+
+        r.mean = ReadNoFence64(&h.sum)/r.count;
+
+        struct {
+                ULONG per_100k;
+                UINT64 &value;
+        } const v[] = {
+                { 50'000, r.p50 },
+                { 90'000, r.p90 },
+                { 99'000, r.p99 },
+                { 99'900, r.p999 },
+        };
+
+        ULONG64 cumulative = 0;
+        int j = 0;
+
+        for (ULONG i = 0; i < BUCKETS && j < ARRAYSIZE(v); ++i) {
+                cumulative += ReadNoFence64(&h.buckets[i]);
+                for ( ; j < ARRAYSIZE(v) && cumulative >= get_rank(r.count, v[j].per_100k); ++j) {
+                        v[j].value = get_highest_value(i);
+                }
+        }
+
+        NT_ASSERT(j == ARRAYSIZE(v));
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init(_Out_ device_latency &lat)
+{
+        PAGED_CODE();
+        lat = {};
+
+        auto sz = device_latency::TRANSFER_TYPES*sizeof(*lat.hist);
+
+        lat.hist = (latency_histogram*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sz, pooltag);
+        if (!lat.hist) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KeQueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&lat.frequency));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free(_Inout_ device_latency &lat)
+{
+        if (auto &h = lat.hist) {
+                ExFreePoolWithTag(h, pooltag);
+                h = nullptr;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::record_latency(_Inout_ device_latency &lat, _In_ USBD_PIPE_TYPE type, _In_ LONG64 start)
+{
+        NT_ASSERT(lat.hist);
+        NT_ASSERT(type < device_latency::TRANSFER_TYPES);
+
+        auto ticks = get_timestamp() - start;
+        ULONG64 usec = ticks > 0 ? ticks*1'000'000ULL/lat.frequency : 0;
+
+        auto &h = lat.hist[type];
+
+        InterlockedIncrementNoFence64(&h.buckets[get_bucket(usec)]);
+        InterlockedAdd64NoFence(&h.sum, usec);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_latency(_Inout_ vhci::ioctl::get_device_latency &r, _In_ const device_latency &lat)
+{
+        for (int i = 0; i < device_latency::TRANSFER_TYPES; ++i) {
+                get_percentiles(r.transfers[i], lat.hist[i]);
+        }
+}
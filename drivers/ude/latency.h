@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <usb.h>
+
+namespace usbip::vhci::ioctl
+{
+        struct get_device_latency;
+}
+
+namespace usbip
+{
+
+struct latency_histogram;
+
+/*
+ * Round-trip time of URBs from insertion into device_ctx::inflight till completion,
+ * a log-linear histogram per transfer type (HDR-style).
+ *
+ * Recording is wait-free and does not allocate memory, it can be enabled always.
+ */
+struct device_latency
+{
+        enum { TRANSFER_TYPES = UsbdPipeTypeInterrupt + 1 }; // indexed by USBD_PIPE_TYPE
+
+        latency_histogram *hist; // nonpaged, TRANSFER_TYPES elements
+        LONG64 frequency; // of performance counter
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_Out_ device_latency &lat);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_Inout_ device_latency &lat);
+
+/*
+ * @return timestamp to pass to record_latency
+ */
+_IRQL_requires_max_(HIGH_LEVEL)
+inline auto get_timestamp()
+{
+        return KeQueryPerformanceCounter(nullptr).QuadPart;
+}
+
+/*
+ * @param start value of get_timestamp() when the request was sent
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void record_latency(_Inout_ device_latency &lat, _In_ USBD_PIPE_TYPE type, _In_ LONG64 start);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_latency(_Inout_ vhci::ioctl::get_device_latency &r, _In_ const device_latency &lat);
+
+} // namespace usbip
@@ -7,6 +7,8 @@
 #include "persistent.tmh"
 
 #include "context.h"
+#include "driver.h"
+#include "vhci_ioctl.h"
 
 #include <libdrv\strconv.h>
 #include <libdrv\wait_timeout.h>
@@ -81,41 +83,80 @@ PAGED auto parse_string(_Out_ vhci::ioctl::plugin_hardware &r, _In_ const UNICOD
                     r.busid, sizeof(r.busid), busid);
 }
 
+enum { DEFAULT_PARALLELISM = 4, MAX_PARALLELISM = 16 };
+
+/*
+ * Health of a server, "host,service". 
+ * While it is unreachable, its devices are not tried.
+ */
+struct server_state
+{
+        UNICODE_STRING name; // prefix of persistent_device::line
+
+        ULONG failures; // consecutive, the server was unreachable
+        USBIP_STATUS last_error;
+        LONGLONG rtt; // duration of the last successful attach
+        LONGLONG due; // KeQueryInterruptTime() of the next attempt
+};
+
+/*
+ * Device from persistent_devices_value_name.
+ */
+struct persistent_device
+{
+        UNICODE_STRING line; // "host,service,busid", the buffer is owned by WDFSTRING
+        ULONG server; // index in attach_round::servers
+
+        ULONG attempt; // consecutive failures while the server is reachable
+        LONGLONG due; // KeQueryInterruptTime() of the next attempt
+
+        bool done; // attached or must not be retried
+};
+
+/*
+ * Devices of the same server are attached sequentially by the same worker.
+ */
+struct attach_round
+{
+        vhci_ctx *ctx;
+        LARGE_INTEGER last_write; // of Parameters key, @see refresh
+
+        persistent_device devices[ARRAYSIZE(vhci_ctx::devices)];
+        ULONG cnt;
+
+        server_state servers[ARRAYSIZE(devices)];
+        ULONG server_cnt;
+
+        ULONG scheduled[ARRAYSIZE(servers)]; // indexes of servers to attach in this round
+        ULONG scheduled_cnt;
+        LONG next; // to be taken by a worker
+};
+
 /*
- * Target is self. 
+ * Exponential backoff with "equal jitter", the delay is in [d/2, d].
+ * Jitter prevents simultaneous retries of the servers that became unreachable at the same time.
+ * 
+ * @param failures consecutive
+ * @return in units of 100 nanoseconds
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto make_target(_In_ WDFDEVICE vhci)
+PAGED LONGLONG get_delay(_In_ ULONG failures)
 {
         PAGED_CODE();
-        wdf::ObjectDelete target;
+        enum { BASE = 2, MAX_DELAY = 30*60, MAX_SHIFT = 10 }; // seconds
 
-        if (WDFIOTARGET t; auto err = WdfIoTargetCreate(vhci, WDF_NO_OBJECT_ATTRIBUTES, &t)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetCreate %!STATUS!", err);
-                return target;
-        } else {
-                target.reset(t);
+        if (!failures) {
+                return 0;
         }
 
-        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
-
-        WDF_IO_TARGET_OPEN_PARAMS params;
-        WDF_IO_TARGET_OPEN_PARAMS_INIT_EXISTING_DEVICE(&params, fdo);
-
-        if (auto err = WdfIoTargetOpen(target.get<WDFIOTARGET>(), &params)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetOpen %!STATUS!", err);
-                target.reset();
-        }
+        auto secs = min(LONGLONG(BASE) << min(failures - 1, ULONG(MAX_SHIFT)), LONGLONG(MAX_DELAY));
+        auto half = secs*1000/2; // msec
 
-        return target;
-}
+        auto seed = static_cast<ULONG>(KeQueryInterruptTime());
+        auto jitter = RtlRandomEx(&seed) % (half + 1);
 
-constexpr auto get_delay(_In_ ULONG attempt, _In_ ULONG cnt)
-{
-        NT_ASSERT(cnt);
-        enum { UNIT = 10, MAX_DELAY = 30*60 }; // seconds
-        return attempt > 1 ? min(UNIT*attempt/cnt, MAX_DELAY) : 0; // first two attempts without a delay
+        return (half + jitter)*wdm::msec;
 }
 
 _IRQL_requires_same_
@@ -142,9 +183,9 @@ PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG seconds)
  * WskGetAddressInfo() can return STATUS_INTERNAL_ERROR(0xC00000E5), but after some delay it will succeed.
  * This can happen after reboot if dnscache(?) service is not ready yet.
  */
-constexpr auto can_retry(_In_ NTSTATUS status)
+constexpr auto can_retry(_In_ USBIP_STATUS status)
 {
-        switch (as_usbip_status(status)) {
+        switch (status) {
         case USBIP_ERROR_ADDRINFO:
         case USBIP_ERROR_CONNECT:
         case USBIP_ERROR_NETWORK:
@@ -155,37 +196,266 @@ constexpr auto can_retry(_In_ NTSTATUS status)
 }
 
 /*
- * @return true - do not try to connect to this device again
+ * Other devices of the server will fail the same way.
  */
+constexpr auto is_unreachable(_In_ USBIP_STATUS status)
+{
+        switch (status) {
+        case USBIP_ERROR_ADDRINFO:
+        case USBIP_ERROR_CONNECT:
+                return true;
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_server(_In_ const UNICODE_STRING &line)
+{
+        PAGED_CODE();
+
+        const auto sep = L',';
+        auto server = line;
+
+        if (auto pos = libdrv::strchr(line, sep); pos >= 0 && (pos = libdrv::strchr(line, sep, pos + 1)) >= 0) {
+                server.Length = USHORT(pos)*sizeof(*line.Buffer);
+                server.MaximumLength = server.Length;
+        }
+
+        return server;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto plugin_hardware(
-        _In_ const UNICODE_STRING &line, 
-        _In_ WDFIOTARGET target,
-        _Inout_ vhci::ioctl::plugin_hardware &req,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &input,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &output,
-        [[maybe_unused]] _In_ const ULONG outlen)
+PAGED auto plugin_hardware(_In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &line)
 {
         PAGED_CODE();
+        vhci::ioctl::plugin_hardware req{{ .size = sizeof(req) }};
 
         if (auto err = parse_string(req, line)) {
                 Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &line, err);
-                return true; // remove malformed string
+                return err; // remove malformed string
         }
 
         Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s", req.host, req.service, req.busid);
-        req.port = 0;
+        return vhci::plugin_hardware(vhci, req);
+}
+
+/*
+ * Devices that were postponed while the server was unreachable.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void retry_now(_Inout_ attach_round &r, _In_ ULONG server)
+{
+        PAGED_CODE();
 
-        if (ULONG_PTR BytesReturned; // send IOCTL to itself
-            auto err = WdfIoTargetSendIoctlSynchronously(target, WDF_NO_HANDLE, vhci::ioctl::PLUGIN_HARDWARE, 
-                                                         &input, &output, nullptr, &BytesReturned)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetSendIoctlSynchronously %!STATUS!", err);
-                return !can_retry(err);
+        for (ULONG i = 0; i < r.cnt; ++i) {
+                if (auto &d = r.devices[i]; d.server == server) {
+                        d.due = 0;
+                }
+        }
+}
+
+/*
+ * @return true if the server is reachable again and its devices must be retried at once
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto attach(_Inout_ attach_round &r, _Inout_ persistent_device &d)
+{
+        PAGED_CODE();
+
+        auto &srv = r.servers[d.server];
+        auto start = LONGLONG(KeQueryInterruptTime());
+
+        auto &rundown = r.ctx->attach_rundown;
+
+        if (!ExAcquireRundownProtection(&rundown)) { // PLUGOUT_HARDWARE is in progress
+                d.due = start + get_delay(++d.attempt);
+                TraceDbg("'%!USTR!' postponed by plugout, retry in %I64d msec.", &d.line, (d.due - start)/wdm::msec);
+                return false;
+        }
+
+        auto st = plugin_hardware(get_device(r.ctx), d.line);
+        ExReleaseRundownProtection(&rundown);
+
+        auto now = LONGLONG(KeQueryInterruptTime());
+        srv.last_error = as_usbip_status(st);
+
+        if (is_unreachable(srv.last_error)) {
+                srv.due = now + get_delay(++srv.failures);
+                TraceDbg("%!USTR! is unreachable, failures %lu, retry in %I64d msec.", 
+                          &srv.name, srv.failures, (srv.due - now)/wdm::msec);
+                return false;
+        }
+
+        auto recovered = srv.failures; // connected, even if the attach failed
+        srv.failures = 0;
+
+        if (NT_SUCCESS(st)) {
+                srv.rtt = now - start;
+                d.done = true;
+                TraceDbg("'%!USTR!' attached in %I64d msec.", &d.line, srv.rtt/wdm::msec);
+        } else if (!can_retry(srv.last_error)) {
+                TraceDbg("exclude %!USTR!", &d.line);
+                d.done = true;
         } else {
-                NT_ASSERT(BytesReturned == outlen);
-                return true;
+                d.due = now + get_delay(++d.attempt);
+                TraceDbg("'%!USTR!', attempt #%lu, retry in %I64d msec.", &d.line, d.attempt, (d.due - now)/wdm::msec);
         }
+
+        return recovered;
+}
+
+/*
+ * If the server is unreachable, the rest of its devices are not tried in this round.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void attach_server(_Inout_ attach_round &r, _In_ ULONG server)
+{
+        PAGED_CODE();
+        auto &srv = r.servers[server];
+
+        for (auto again = true; again; ) {
+                again = false;
+
+                for (ULONG i = 0; i < r.cnt && sleep(*r.ctx, 0); ++i) {
+                        auto &d = r.devices[i];
+
+                        if (d.done || d.server != server || d.due > LONGLONG(KeQueryInterruptTime())) {
+                                continue;
+                        }
+
+                        if (attach(r, d)) {
+                                TraceDbg("%!USTR! is reachable again, retry all its devices", &srv.name);
+                                retry_now(r, server);
+                                again = true;
+                        } else if (is_unreachable(srv.last_error)) {
+                                break;
+                        }
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void attach_servers(_Inout_ attach_round &r)
+{
+        PAGED_CODE();
+
+        for (LONG i; (i = InterlockedIncrement(&r.next) - 1) < LONG(r.scheduled_cnt); ) {
+                attach_server(r, r.scheduled[i]);
+        }
+}
+
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void attach_worker(_In_ void *ctx)
+{
+        PAGED_CODE();
+        KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+        auto &r = *static_cast<attach_round*>(ctx);
+        attach_servers(r);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED _KTHREAD *create_thread(_In_ WDFDEVICE vhci, _In_ KSTART_ROUTINE *routine, _In_ void *ctx)
+{
+        PAGED_CODE();
+
+        const auto access = THREAD_ALL_ACCESS;
+        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+
+        HANDLE handle;
+        if (auto err = IoCreateSystemThread(fdo, &handle, access, nullptr, nullptr, nullptr, routine, ctx)) {
+                Trace(TRACE_LEVEL_ERROR, "IoCreateSystemThread %!STATUS!", err);
+                return nullptr;
+        }
+
+        PVOID thread{};
+        NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode, &thread, nullptr)));
+
+        NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+        return static_cast<_KTHREAD*>(thread);
+}
+
+/*
+ * The calling thread is one of the workers.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void run(_Inout_ attach_round &r, _In_ ULONG parallelism)
+{
+        PAGED_CODE();
+        NT_ASSERT(parallelism && r.scheduled_cnt);
+
+        _KTHREAD *workers[MAX_PARALLELISM - 1]{};
+        auto vhci = get_device(r.ctx);
+
+        for (ULONG i = 0, cnt = min(parallelism, r.scheduled_cnt) - 1; i < cnt; ++i) {
+                workers[i] = create_thread(vhci, attach_worker, &r);
+        }
+
+        attach_servers(r);
+
+        for (auto thread: workers) {
+                if (!thread) {
+                        continue;
+                } else if (auto err = KeWaitForSingleObject(thread, Executive, KernelMode, false, nullptr)) {
+                        Trace(TRACE_LEVEL_ERROR, "KeWaitForSingleObject %!STATUS!", err);
+                }
+                ObDereferenceObject(thread);
+        }
+}
+
+/*
+ * A server is scheduled if it is due and has a device that is due.
+ * @param due the earliest time of the next attempt if nothing is scheduled
+ * @return false if all devices are done
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto schedule(_Inout_ attach_round &r, _Out_ LONGLONG &due)
+{
+        PAGED_CODE();
+
+        auto now = LONGLONG(KeQueryInterruptTime());
+        due = MAXLONGLONG;
+
+        r.scheduled_cnt = 0;
+        r.next = 0;
+
+        auto pending = false;
+
+        for (ULONG i = 0; i < r.server_cnt; ++i) {
+                auto &srv = r.servers[i];
+                auto srv_due = MAXLONGLONG;
+
+                for (ULONG j = 0; j < r.cnt; ++j) {
+                        if (auto &d = r.devices[j]; !d.done && d.server == i) {
+                                srv_due = min(srv_due, max(srv.due, d.due));
+                        }
+                }
+
+                if (srv_due == MAXLONGLONG) {
+                        continue;
+                }
+
+                pending = true;
+
+                if (srv_due <= now) {
+                        r.scheduled[r.scheduled_cnt++] = i;
+                } else {
+                        due = min(due, srv_due);
+                }
+        }
+
+        return pending;
 }
 
 _IRQL_requires_same_
@@ -206,6 +476,48 @@ PAGED auto open_parameters_key()
         return key;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_parallelism(_In_ WDFKEY key)
+{
+        PAGED_CODE();
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, persistent_parallelism_value_name);
+
+        ULONG val{};
+
+        if (auto err = WdfRegistryQueryULong(key, &name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &name, err);
+                }
+                val = DEFAULT_PARALLELISM;
+        }
+
+        return val ? min(val, ULONG(MAX_PARALLELISM)) : 1;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_last_write_time(_In_ WDFKEY key)
+{
+        PAGED_CODE();
+
+        struct {
+                KEY_BASIC_INFORMATION info;
+                WCHAR name[32]; // "Parameters"
+        } buf;
+
+        ULONG len;
+        if (auto st = ZwQueryKey(WdfRegistryWdmGetHandle(key), KeyBasicInformation, &buf, sizeof(buf), &len); 
+            NT_ERROR(st)) {
+                Trace(TRACE_LEVEL_ERROR, "ZwQueryKey %!STATUS!", st);
+                return LARGE_INTEGER{};
+        }
+
+        return buf.info.LastWriteTime;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
@@ -227,50 +539,102 @@ PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
 }
 
 /*
- * Remove from collection A items absent in collection B.
+ * Refreshing allows to remove devices that constantly fail to attach.
+ * The list is read again only if Parameters key was modified.
+ * 
+ * @return false if the list of devices can't be read
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void intersection(_In_ WDFCOLLECTION a, _In_ WDFCOLLECTION b)
+PAGED auto refresh(_Inout_ attach_round &r, _In_ WDFKEY key)
+{
+        PAGED_CODE();
+
+        if (auto t = get_last_write_time(key); t.QuadPart && t.QuadPart == r.last_write.QuadPart) {
+                return true;
+        } else {
+                r.last_write = t;
+        }
+
+        auto col = get_persistent_devices(key);
+        if (!col) {
+                return false;
+        }
+
+        for (ULONG i = 0; i < r.cnt; ++i) {
+                if (auto &d = r.devices[i]; !d.done && !contains(col.get<WDFCOLLECTION>(), d.line)) {
+                        TraceDbg("exclude %!USTR!", &d.line);
+                        d.done = true;
+                }
+        }
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void add_device(_Inout_ attach_round &r, _In_ WDFSTRING line)
 {
         PAGED_CODE();
 
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(a); i < cnt; ) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(a, i);
+        auto &d = r.devices[r.cnt++];
+        WdfStringGetUnicodeString(line, &d.line);
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
+        auto name = get_server(d.line);
 
-                if (contains(b, s)) {
-                        ++i;
-                } else {
-                        TraceDbg("exclude %!USTR!", &s);
-                        WdfCollectionRemoveItem(a, i);
-                        --cnt;
+        for (d.server = 0; d.server < r.server_cnt; ++d.server) {
+                if (RtlEqualUnicodeString(&r.servers[d.server].name, &name, true)) {
+                        return;
                 }
         }
+
+        r.servers[r.server_cnt++].name = name;
 }
 
-/*
- * Refreshing allows to remove devices that constantly fail to attach.
- */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED ULONG get_count(_In_ WDFCOLLECTION col, _In_ WDFKEY key, _In_ bool refresh)
+PAGED void plugin_persistent_devices(_Inout_ attach_round &r, _In_ WDFKEY key, _In_ WDFCOLLECTION devices)
 {
         PAGED_CODE();
+        r.last_write = get_last_write_time(key);
 
-        if (!refresh) {
-                //
-        } else if (auto newcol = get_persistent_devices(key)) {
-                intersection(col, newcol.get<WDFCOLLECTION>());
-        } else {
-                return 0;
+        for (ULONG i = 0, cnt = min(WdfCollectionGetCount(devices), ARRAYSIZE(r.devices)); i < cnt; ++i) {
+                add_device(r, (WDFSTRING)WdfCollectionGetItem(devices, i));
         }
 
-        return min(WdfCollectionGetCount(col), ARRAYSIZE(vhci_ctx::devices));
+        auto parallelism = get_parallelism(key);
+        TraceDbg("%lu device(s), %lu server(s), parallelism %lu", r.cnt, r.server_cnt, parallelism);
+
+        for (ULONG round = 0; sleep(*r.ctx, 0); ++round) {
+
+                if (round && !refresh(r, key)) {
+                        break;
+                }
+
+                LONGLONG due;
+                if (!schedule(r, due)) {
+                        break;
+                }
+
+                if (r.scheduled_cnt) {
+                        run(r, parallelism);
+                        continue;
+                }
+
+                auto now = LONGLONG(KeQueryInterruptTime());
+                auto secs = due > now ? ULONG((due - now + wdm::second - 1)/wdm::second) : 0;
+
+                TraceDbg("round #%lu, sleep %lu sec.", round, secs);
+                if (!sleep(*r.ctx, secs)) {
+                        break;
+                }
+        }
 }
 
+/*
+ * Devices are attached concurrently by up to persistent_parallelism_value_name workers, 
+ * a dead server is retried with exponential backoff.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
@@ -287,52 +651,16 @@ PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
                 return;
         }
 
-        auto vhci = get_device(&ctx);
-
-        auto target = make_target(vhci);
-        if (!target) {
+        auto r = (attach_round*)ExAllocatePool2(POOL_FLAG_PAGED, sizeof(attach_round), pooltag);
+        if (!r) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate attach_round");
                 return;
         }
 
-        vhci::ioctl::plugin_hardware req{{ .size = sizeof(req) }};
-
-        WDF_MEMORY_DESCRIPTOR input;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&input, &req, sizeof(req));
+        r->ctx = &ctx;
+        plugin_persistent_devices(*r, key.get(), devices.get<WDFCOLLECTION>());
 
-        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port);
-
-        WDF_MEMORY_DESCRIPTOR output;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&output, &req, outlen);
-
-        for (ULONG attempt = 0; true; ++attempt) {
-
-                auto cnt = get_count(devices.get<WDFCOLLECTION>(), key.get(), attempt);
-                if (!cnt) {
-                        break;
-                }
-
-                if (auto secs = get_delay(attempt, cnt)) {
-                        TraceDbg("attempt #%lu, %lu device(s), sleep %lu sec.", attempt, cnt, secs);
-                        if (!sleep(ctx, secs)) {
-                                break;
-                        }
-                }
-
-                for (ULONG i = 0; i < cnt && sleep(ctx, 0); ) {
-                        UNICODE_STRING str{};
-                        if (auto s = (WDFSTRING)WdfCollectionGetItem(devices.get<WDFCOLLECTION>(), i)) {
-                                WdfStringGetUnicodeString(s, &str);
-                        }
-
-                        if (plugin_hardware(str, target.get<WDFIOTARGET>(), req, input, output, outlen)) {
-                                TraceDbg("exclude %!USTR!", &str);
-                                WdfCollectionRemoveItem(devices.get<WDFCOLLECTION>(), i);
-                                --cnt;
-                        } else {
-                                ++i;
-                        }
-                }
-        }
+        ExFreePoolWithTag(r, pooltag);
 }
 
 /*
@@ -367,19 +695,7 @@ PAGED void usbip::plugin_persistent_devices(_In_ vhci_ctx *vhci)
 {
         PAGED_CODE();
 
-        const auto access = THREAD_ALL_ACCESS;
-        auto fdo = WdfDeviceWdmGetDeviceObject(get_device(vhci));
-
-        if (HANDLE handle; 
-            auto err = IoCreateSystemThread(fdo, &handle, access, nullptr, nullptr, 
-                                            nullptr, persistent_devices_thread, vhci)) {
-                Trace(TRACE_LEVEL_ERROR, "PsCreateSystemThread %!STATUS!", err);
-        } else {
-                PVOID thread;
-                NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode, 
-                                                               &thread, nullptr)));
-
-                NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+        if (auto thread = create_thread(get_device(vhci), persistent_devices_thread, vhci)) {
                 NT_VERIFY(!InterlockedExchangePointer(reinterpret_cast<PVOID*>(&vhci->attach_thread), thread));
                 TraceDbg("thread launched");
         }
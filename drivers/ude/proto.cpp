@@ -9,6 +9,7 @@
 #include "context.h"
 
 #include <libdrv\ch9.h>
+#include <libdrv\pdu.h>
 #include <libdrv\usbd_helper.h>
 
 namespace
@@ -62,22 +63,8 @@ NTSTATUS usbip::set_cmd_submit_usbip_header(
 
 	TransferFlags = fix_transfer_flags(TransferFlags, dir_out);
 
-	if (auto r = &hdr.base) {
-		r->command = USBIP_CMD_SUBMIT;
-		r->seqnum = next_seqnum(dev, !dir_out);
-		r->devid = dev.devid();
-		r->direction = dir_out ? USBIP_DIR_OUT : USBIP_DIR_IN;
-		r->ep = usb_endpoint_num(epd);
-	}
-
-	if (auto r = &hdr.u.cmd_submit) {
-		r->transfer_flags = to_linux_flags(TransferFlags, !dir_out);
-		r->transfer_buffer_length = TransferBufferLength;
-		r->start_frame = 0;
-		r->number_of_packets = number_of_packets_non_isoch;
-		r->interval = epd.bInterval;
-		RtlZeroMemory(r->setup, sizeof(r->setup));
-	}
+	set_cmd_submit_header(hdr, next_seqnum(dev, !dir_out), dev.devid(), dir_out ? USBIP_DIR_OUT : USBIP_DIR_IN,
+		usb_endpoint_num(epd), to_linux_flags(TransferFlags, !dir_out), TransferBufferLength, epd.bInterval);
 
 	return STATUS_SUCCESS;
 }
@@ -86,14 +73,6 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::set_cmd_unlink_usbip_header(
 	_Out_ usbip_header &hdr, _Inout_ device_ctx &dev, _In_ seqnum_t seqnum_unlink)
 {
-	auto &r = hdr.base;
-
-	r.command = USBIP_CMD_UNLINK;
-	r.devid = dev.devid();
-	r.direction = USBIP_DIR_OUT;
-	r.seqnum = next_seqnum(dev, r.direction);
-	r.ep = 0;
-
 	NT_ASSERT(is_valid_seqnum(seqnum_unlink));
-	hdr.u.cmd_unlink.seqnum = seqnum_unlink;
+	set_cmd_unlink_header(hdr, next_seqnum(dev, false), dev.devid(), seqnum_unlink);
 }
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "statistics.h"
+#include "trace.h"
+#include "statistics.tmh"
+
+#include "driver.h"
+#include "endpoint_list.h"
+
+#include <usbip\vhci.h>
+
+struct alignas(SYSTEM_CACHE_ALIGNMENT_SIZE) usbip::statistics_cpu
+{
+        enum counter { SUBMITTED, COMPLETED, CANCELLED, FAILED, BYTES_OUT, BYTES_IN, UNLINKED, DRAINED, COUNTERS };
+        LONG64 counters[device_statistics::SLOTS + 1][COUNTERS]; // + DEVICE_SLOT
+};
+
+namespace
+{
+
+using namespace usbip;
+using counter = statistics_cpu::counter;
+
+static_assert(device_statistics::SLOTS == device_ctx::ENDPOINT_SLOTS);
+static_assert(device_statistics::SLOTS == ARRAYSIZE(vhci::ioctl::get_device_statistics::endpoints));
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& this_cpu(_In_ device_statistics &stats)
+{
+        NT_ASSERT(stats.cpu);
+        auto idx = KeGetCurrentProcessorNumberEx(nullptr);
+        return stats.cpu[idx < stats.cpu_cnt ? idx : idx % stats.cpu_cnt]; // hot-added processor
+}
+
+/*
+ * A thread running at PASSIVE_LEVEL can migrate to another CPU, so update is interlocked anyway.
+ * It is cheap because a cache line of other CPU is touched rarely, fence is not required for a counter.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void add(_Inout_ device_statistics &stats, _In_ int slot, _In_ counter c, _In_ LONG64 val = 1)
+{
+        auto &cpu = this_cpu(stats);
+        InterlockedAdd64NoFence(&cpu.counters[slot][c], val);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void inc_inflight(_Inout_ LONG &inflight, _Inout_ LONG &peak)
+{
+        auto val = InterlockedIncrement(&inflight);
+
+        for (auto old = ReadNoFence(&peak); val > old; ) {
+                if (auto prev = InterlockedCompareExchange(&peak, val, old); prev == old) {
+                        break;
+                } else {
+                        old = prev;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void sum(_Out_ vhci::transfer_statistics &s, _In_ const device_statistics &stats, _In_ int slot)
+{
+        LONG64 v[statistics_cpu::COUNTERS]{};
+
+        for (ULONG i = 0; i < stats.cpu_cnt; ++i) {
+                auto &c = stats.cpu[i].counters[slot];
+                for (int j = 0; j < ARRAYSIZE(v); ++j) {
+                        v[j] += ReadNoFence64(&c[j]);
+                }
+        }
+
+        s = vhci::transfer_statistics {
+                .submitted = UINT64(v[statistics_cpu::SUBMITTED]),
+                .completed = UINT64(v[statistics_cpu::COMPLETED]),
+                .cancelled = UINT64(v[statistics_cpu::CANCELLED]),
+                .failed = UINT64(v[statistics_cpu::FAILED]),
+                .bytes_out = UINT64(v[statistics_cpu::BYTES_OUT]),
+                .bytes_in = UINT64(v[statistics_cpu::BYTES_IN]),
+                .unlinked = UINT64(v[statistics_cpu::UNLINKED]),
+                .drained = UINT64(v[statistics_cpu::DRAINED]),
+        };
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void accumulate(_Inout_ vhci::transfer_statistics &dst, _In_ const vhci::transfer_statistics &src)
+{
+        dst.submitted += src.submitted;
+        dst.completed += src.completed;
+        dst.cancelled += src.cancelled;
+        dst.failed += src.failed;
+        dst.bytes_out += src.bytes_out;
+        dst.bytes_in += src.bytes_in;
+        dst.unlinked += src.unlinked;
+        dst.drained += src.drained;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline UINT32 read_inflight(_In_ const LONG &val)
+{
+        auto n = ReadNoFence(&val);
+        return n > 0 ? n : 0;
+}
+
+/*
+ * Reverse of get_slot.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr UCHAR get_endpoint_address(_In_ int slot)
+{
+        UCHAR num = slot & USB_ENDPOINT_ADDRESS_MASK;
+        return slot > USB_ENDPOINT_ADDRESS_MASK ? num | USB_ENDPOINT_DIRECTION_MASK : num;
+}
+static_assert(get_endpoint_address(get_slot(0x81)) == 0x81);
+static_assert(get_endpoint_address(get_slot(0x0F)) == 0x0F);
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init(_Out_ device_statistics &stats)
+{
+        PAGED_CODE();
+        stats = {};
+
+        auto cnt = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+        stats.cpu = (statistics_cpu*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                                     cnt*sizeof(*stats.cpu), pooltag);
+        if (!stats.cpu) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate statistics for %lu processor(s)", cnt);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        stats.cpu_cnt = cnt;
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free(_Inout_ device_statistics &stats)
+{
+        if (auto &cpu = stats.cpu) {
+                ExFreePoolWithTag(cpu, pooltag);
+                cpu = nullptr;
+        }
+
+        stats.cpu_cnt = 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_submit(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress, _In_ ULONG bytes_out)
+{
+        auto slot = get_slot(bEndpointAddress);
+
+        add(stats, slot, statistics_cpu::SUBMITTED);
+        if (bytes_out) {
+                add(stats, slot, statistics_cpu::BYTES_OUT, bytes_out);
+        }
+
+        inc_inflight(stats.inflight[slot], stats.peak_inflight[slot]);
+        inc_inflight(stats.dev_inflight, stats.dev_peak_inflight);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_complete(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress, _In_ NTSTATUS status)
+{
+        auto slot = get_slot(bEndpointAddress);
+
+        auto c = status == STATUS_CANCELLED ? statistics_cpu::CANCELLED :
+                 NT_SUCCESS(status) ? statistics_cpu::COMPLETED :
+                 statistics_cpu::FAILED;
+
+        add(stats, slot, c);
+
+        InterlockedDecrement(&stats.inflight[slot]);
+        InterlockedDecrement(&stats.dev_inflight);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_data_in(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress, _In_ ULONG bytes_in)
+{
+        if (bytes_in) {
+                add(stats, get_slot(bEndpointAddress), statistics_cpu::BYTES_IN, bytes_in);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_unlink(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress)
+{
+        add(stats, get_slot(bEndpointAddress), statistics_cpu::UNLINKED);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_drain(_Inout_ device_statistics &stats, _In_ size_t bytes)
+{
+        add(stats, device_statistics::DEVICE_SLOT, statistics_cpu::DRAINED, bytes);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_statistics(_Inout_ vhci::ioctl::get_device_statistics &r, _In_ const device_statistics &stats)
+{
+        r.device = {};
+        r.endpoint_cnt = 0;
+
+        for (int slot = 0; slot < device_statistics::SLOTS; ++slot) {
+
+                vhci::transfer_statistics s;
+                sum(s, stats, slot);
+
+                s.inflight = read_inflight(stats.inflight[slot]);
+                s.peak_inflight = read_inflight(stats.peak_inflight[slot]);
+
+                if (s.submitted || s.unlinked) {
+                        accumulate(r.device, s);
+                        r.endpoints[r.endpoint_cnt++] = { .address = get_endpoint_address(slot), .stats = s };
+                }
+        }
+
+        vhci::transfer_statistics s;
+        sum(s, stats, device_statistics::DEVICE_SLOT);
+        accumulate(r.device, s);
+
+        r.device.inflight = read_inflight(stats.dev_inflight);
+        r.device.peak_inflight = read_inflight(stats.dev_peak_inflight);
+}
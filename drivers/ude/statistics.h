@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+
+namespace usbip::vhci::ioctl
+{
+        struct get_device_statistics;
+}
+
+namespace usbip
+{
+
+struct statistics_cpu;
+
+/*
+ * Counters of transfers per device and per endpoint, @see vhci::transfer_statistics.
+ *
+ * Monotonic counters are per-CPU, writers do not share cache lines and do not take locks.
+ * In-flight depth must be exact to track its peak, so it is shared.
+ */
+struct device_statistics
+{
+        enum {
+                SLOTS = 32, // @see device_ctx::ENDPOINT_SLOTS
+                DEVICE_SLOT = SLOTS // for counters that can't be attributed to an endpoint
+        };
+
+        statistics_cpu *cpu; // nonpaged, cpu_cnt elements
+        ULONG cpu_cnt;
+
+        LONG inflight[SLOTS];
+        LONG peak_inflight[SLOTS];
+
+        LONG dev_inflight;
+        LONG dev_peak_inflight;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_Out_ device_statistics &stats);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_Inout_ device_statistics &stats);
+
+/*
+ * URB was sent to a server.
+ * @param bytes_out the length of transfer buffer for OUT transfer
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_submit(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress, _In_ ULONG bytes_out);
+
+/*
+ * @param status STATUS_CANCELLED, success or an error
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_complete(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress, _In_ NTSTATUS status);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_data_in(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress, _In_ ULONG bytes_in);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_unlink(_Inout_ device_statistics &stats, _In_ UCHAR bEndpointAddress);
+
+/*
+ * Payload of a response for unlinked URB was discarded.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_drain(_Inout_ device_statistics &stats, _In_ size_t bytes);
+
+/*
+ * Sum of per-CPU counters, it is not an atomic snapshot of all counters.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_statistics(_Inout_ vhci::ioctl::get_device_statistics &r, _In_ const device_statistics &stats);
+
+} // namespace usbip
@@ -63,6 +63,10 @@ PAGED void vhci_cleanup(_In_ WDFOBJECT Object)
         TraceDbg("vhci %04x", ptr04x(vhci));
         
         attach_thread_join(vhci);
+
+        auto &ctx = *get_vhci_ctx(vhci);
+        clear(ctx.addrinfo);
+        free(ctx.recorder);
 }
 
 using init_func_t = NTSTATUS(WDFDEVICE);
@@ -77,6 +81,9 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
 
         KeInitializeSpinLock(&ctx.devices_lock);
         KeInitializeEvent(&ctx.attach_thread_stop, NotificationEvent, false);
+        ExInitializeRundownProtection(&ctx.attach_rundown);
+        init(ctx.addrinfo);
+        init(ctx.recorder);
 
         return STATUS_SUCCESS;
 }
@@ -136,6 +143,8 @@ NTSTATUS query_usb_capability(
 /*
  * If TargetState is WdfPowerDeviceD3Final, you should assume that the system is being turned off, 
  * the device is about to be removed, or a resource rebalance is in progress. 
+ * 
+ * Attach threads are joined first, otherwise they can plug in a device after all devices are detached.
  */
 _Function_class_(EVT_WDF_DEVICE_D0_EXIT)
 _IRQL_requires_same_
@@ -146,6 +155,7 @@ PAGED NTSTATUS NTAPI vhci_d0_exit(_In_ WDFDEVICE vhci, _In_ WDF_POWER_DEVICE_STA
         TraceDbg("TargetState %!WDF_POWER_DEVICE_STATE!", TargetState);
 
         if (TargetState == WdfPowerDeviceD3Final) {
+                attach_thread_join(vhci);
                 vhci::detach_all_devices(vhci, true);
         }
 
@@ -9,9 +9,11 @@
 #include "context.h"
 #include "vhci.h"
 #include "device.h"
+#include "device_ioctl.h"
 #include "network.h"
 #include "ioctl.h"
 #include "persistent.h"
+#include "wsk_receive.h"
 
 #include <usbip\proto_op.h>
 
@@ -145,12 +147,22 @@ PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
                 d->product = udev.idProduct;
         }
 
+        if (auto d = &ext.descriptor) {
+                d->idVendor = udev.idVendor;
+                d->idProduct = udev.idProduct;
+                d->bcdDevice = udev.bcdDevice;
+                d->bDeviceClass = udev.bDeviceClass;
+                d->bDeviceSubClass = udev.bDeviceSubClass;
+                d->bDeviceProtocol = udev.bDeviceProtocol;
+                d->bNumConfigurations = udev.bNumConfigurations;
+        }
+
         return USBIP_ERROR_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto getaddrinfo(_Out_ ADDRINFOEXW* &result, _In_ device_ctx_ext &ext)
+PAGED auto getaddrinfo(_Inout_ addrinfo_cache &cache, _Out_ ADDRINFOEXW* &result, _In_ device_ctx_ext &ext)
 {
         PAGED_CODE();
 
@@ -160,7 +172,7 @@ PAGED auto getaddrinfo(_Out_ ADDRINFOEXW* &result, _In_ device_ctx_ext &ext)
         hints.ai_socktype = SOCK_STREAM;
         hints.ai_protocol = IPPROTO_TCP; // zero isn't work
 
-        return wsk::getaddrinfo(result, &ext.node_name, &ext.service_name, &hints);
+        return usbip::getaddrinfo(cache, result, ext.node_name, ext.service_name, hints);
 }
 
 /*
@@ -210,7 +222,7 @@ PAGED auto set_options(wsk::SOCKET *sock)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
+PAGED auto prepare_socket(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
 {
         PAGED_CODE();
 
@@ -220,35 +232,37 @@ PAGED auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
 
         SOCKADDR_INET any{ static_cast<ADDRESS_FAMILY>(ai.ai_family) }; // see INADDR_ANY, IN6ADDR_ANY_INIT
 
-        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
-                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
-                return err;
-        }
-
-        auto err = connect(sock, ai.ai_addr);
+        auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any));
         if (err) {
-                Trace(TRACE_LEVEL_ERROR, "WskConnect %!STATUS!", err);
+                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
         }
         return err;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto connect(_Inout_ device_ctx_ext &ext)
+PAGED auto connect(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext)
 {
         PAGED_CODE();
+        auto &cache = get_vhci_ctx(vhci)->addrinfo;
 
         ADDRINFOEXW *ai{};
-        if (auto err = getaddrinfo(ai, ext)) {
+        if (auto err = getaddrinfo(cache, ai, ext)) {
                 Trace(TRACE_LEVEL_ERROR, "getaddrinfo %!STATUS!", err);
                 return USBIP_ERROR_ADDRINFO;
         }
 
         NT_ASSERT(!ext.sock);
-        ext.sock = wsk::for_each(WSK_FLAG_CONNECTION_SOCKET, &ext, nullptr, ai, try_connect, nullptr);
+        ext.sock = wsk::race_connect(WSK_FLAG_CONNECTION_SOCKET, &ext, &connection_dispatch, ai, prepare_socket, nullptr);
 
-        wsk::free(ai);
-        return ext.sock ? USBIP_ERROR_SUCCESS : USBIP_ERROR_CONNECT;
+        usbip::free(ai);
+
+        if (!ext.sock) {
+                invalidate(cache, ext.node_name, ext.service_name); // resolve again on next attempt
+                return USBIP_ERROR_CONNECT;
+        }
+
+        return USBIP_ERROR_SUCCESS;
 }
 
 _IRQL_requires_same_
@@ -308,9 +322,10 @@ PAGED auto start_device(_Out_ int &port, _In_ UDECXUSBDEVICE device)
         }
 
         if (auto dev = get_device_ctx(device)) {
-                sched_receive_usbip_header(*dev);
+                start_receive(*dev);
         }
 
+        device::revalidate_descriptors(device); // enumeration is not waiting for it
         return USBIP_ERROR_SUCCESS;
 }
 
@@ -329,7 +344,7 @@ PAGED auto plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::plugin_hard
                 return USBIP_ERROR_GENERAL;
         }
 
-        if (auto err = connect(*ext.ptr)) {
+        if (auto err = connect(vhci, *ext.ptr)) {
                 Trace(TRACE_LEVEL_ERROR, "Can't connect to %!USTR!:%!USTR!", &ext->node_name, &ext->service_name);
                 return err;
         }
@@ -408,7 +423,12 @@ PAGED auto plugout_hardware(_In_ WDFREQUEST request)
         TraceDbg("port %d", r->port);
         auto st = STATUS_SUCCESS;
 
-        if (auto vhci = get_vhci(request); r->port <= 0) {
+        auto vhci = get_vhci(request);
+
+        auto &rundown = get_vhci_ctx(vhci)->attach_rundown;
+        ExWaitForRundownProtectionRelease(&rundown); // attach threads can't plug in until it is reinitialized
+
+        if (r->port <= 0) {
                 vhci::detach_all_devices(vhci);
         } else if (!is_valid_port(r->port)) {
                 st = STATUS_INVALID_PARAMETER;
@@ -418,6 +438,7 @@ PAGED auto plugout_hardware(_In_ WDFREQUEST request)
                 st = STATUS_DEVICE_NOT_CONNECTED;
         }
 
+        ExReInitializeRundownProtection(&rundown);
         return st;
 }
 
@@ -501,6 +522,120 @@ PAGED auto driver_registry_path(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_device_statistics(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::get_device_statistics *r;
+
+        if (size_t length;
+            auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_device_statistics.size %lu != sizeof(get_device_statistics) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return as_ntstatus(USBIP_ERROR_ABI);
+        } else if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto vhci = get_vhci(request);
+
+        auto dev = vhci::get_device(vhci, r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto &ctx = *get_device_ctx(dev.get());
+        get_statistics(*r, ctx.stats);
+
+        r->descriptor_hits = ReadNoFence64(&ctx.descriptors.hits);
+        r->descriptor_misses = ReadNoFence64(&ctx.descriptors.misses);
+
+        get_wsk_context_stats(r->wsk_context);
+
+        auto &addrinfo = get_vhci_ctx(vhci)->addrinfo;
+        r->addrinfo_hits = ReadNoFence64(&addrinfo.hits);
+        r->addrinfo_misses = ReadNoFence64(&addrinfo.misses);
+
+        TraceDbg("port %d, %lu endpoint(s)", r->port, r->endpoint_cnt);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_device_latency(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::get_device_latency *r;
+
+        if (size_t length;
+            auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_device_latency.size %lu != sizeof(get_device_latency) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return as_ntstatus(USBIP_ERROR_ABI);
+        } else if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto dev = vhci::get_device(get_vhci(request), r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto &ctx = *get_device_ctx(dev.get());
+        get_latency(*r, ctx.latency);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_flight_recorder(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        size_t outlen;
+        vhci::ioctl::get_flight_recorder *r;
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &outlen)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_flight_recorder.size %lu != sizeof(get_flight_recorder) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return as_ntstatus(USBIP_ERROR_ABI);
+        }
+
+        auto records_size = outlen - offsetof(vhci::ioctl::get_flight_recorder, records);
+        auto max_cnt = records_size/sizeof(*r->records);
+
+        auto &ctx = *get_vhci_ctx(get_vhci(request));
+        if (auto err = get_flight_records(*r, max_cnt, ctx.recorder)) {
+                return err;
+        }
+
+        auto written = vhci::ioctl::get_flight_recorder_size(r->record_cnt);
+        NT_ASSERT(written <= outlen);
+        WdfRequestSetInformation(request, written);
+
+        return STATUS_SUCCESS;
+}
+
 /*
  * IRP_MJ_DEVICE_CONTROL
  * 
@@ -541,6 +676,15 @@ void device_control(
         case vhci::ioctl::DRIVER_REGISTRY_PATH:
                 st = driver_registry_path(Request);
                 break;
+        case vhci::ioctl::GET_DEVICE_STATISTICS:
+                st = get_device_statistics(Request);
+                break;
+        case vhci::ioctl::GET_DEVICE_LATENCY:
+                st = get_device_latency(Request);
+                break;
+        case vhci::ioctl::GET_FLIGHT_RECORDER:
+                st = get_flight_recorder(Request);
+                break;
         case IOCTL_USB_USER_REQUEST:
                 NT_ASSERT(!has_urb(Request));
                 if (USBUSER_REQUEST_HEADER *hdr; 
@@ -588,3 +732,13 @@ PAGED NTSTATUS usbip::vhci::create_default_queue(_In_ WDFDEVICE vhci)
         TraceDbg("%04x", ptr04x(queue));
         return STATUS_SUCCESS;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ ioctl::plugin_hardware &r)
+{
+        PAGED_CODE();
+
+        auto err = ::plugin_hardware(vhci, r);
+        return as_ntstatus(err);
+}
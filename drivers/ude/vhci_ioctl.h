@@ -14,4 +14,14 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS create_default_queue(_In_ WDFDEVICE vhci);
 
+namespace ioctl { struct plugin_hardware; }
+
+/*
+ * Default queue is sequential, call this function directly to attach devices concurrently.
+ * The caller must hold vhci_ctx::attach_rundown, PLUGOUT_HARDWARE waits for its release.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ ioctl::plugin_hardware &r);
+
 } // namespace usbip::vhci
@@ -6,7 +6,10 @@
 #include "trace.h"
 #include "wsk_context.tmh"
 
+#include "context.h"
+
 #include <libdrv/codeseg.h>
+#include <usbip\vhci.h>
 
 namespace
 {
@@ -15,7 +18,50 @@ using namespace usbip;
 
 ULONG g_tag;
 bool g_initialized;
-LOOKASIDE_LIST_EX g_lookaside;
+
+/*
+ * Size classes of isoc descriptors buffer, in packets.
+ * Buffer and its MDL are allocated once per object of a class.
+ */
+constexpr ULONG g_isoc_class[] { 0, 8, 32, 128, USBIP_MAX_ISO_PACKETS };
+static_assert(ARRAYSIZE(g_isoc_class) == wsk_context_stats::CLASS_CNT);
+static_assert(ARRAYSIZE(g_isoc_class) == vhci::wsk_context_statistics::CLASS_CNT);
+
+LOOKASIDE_LIST_EX g_lookaside[ARRAYSIZE(g_isoc_class)];
+wsk_context_stats g_stats;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_isoc_class(_In_ ULONG NumberOfPackets)
+{
+        UCHAR i = 0;
+        for ( ; i < ARRAYSIZE(g_isoc_class) - 1 && g_isoc_class[i] < NumberOfPackets; ++i);
+        return i;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS alloc_isoc(_Inout_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
+{
+        NT_ASSERT(NumberOfPackets);
+        ULONG isoc_len = NumberOfPackets*sizeof(*ctx.isoc);
+
+        auto isoc = (usbip_iso_packet_descriptor*)ExAllocatePool2(POOL_FLAG_NON_PAGED, isoc_len, g_tag);
+        if (!isoc) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (ctx.isoc) {
+                ctx.mdl_isoc.reset();
+                ExFreePoolWithTag(ctx.isoc, g_tag);
+        }
+
+        ctx.isoc = isoc;
+        ctx.isoc_alloc_cnt = NumberOfPackets;
+
+        ctx.mdl_isoc = Mdl(isoc, isoc_len);
+        return ctx.mdl_isoc.prepare_nonpaged();
+}
 
 _IRQL_requires_same_
 _Function_class_(free_function_ex)
@@ -24,7 +70,7 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
         auto ctx = static_cast<wsk_context*>(Buffer);
         NT_ASSERT(ctx);
 
-        TraceWSK("%04x, isoc[%Iu]", ptr04x(ctx), ctx->isoc_alloc_cnt);
+        TraceWSK("%04x, isoc[%lu]", ptr04x(ctx), ctx->isoc_alloc_cnt);
 
         ctx->mdl_hdr.reset();
         ctx->mdl_buf.reset();
@@ -48,12 +94,18 @@ void *allocate_function_ex(_In_ [[maybe_unused]] POOL_TYPE PoolType, _In_ SIZE_T
         NT_ASSERT(PoolType == NonPagedPoolNx);
         NT_ASSERT(Tag == g_tag);
 
+        auto isoc_class = UCHAR(list - g_lookaside);
+        NT_ASSERT(isoc_class < ARRAYSIZE(g_lookaside));
+
+        InterlockedIncrement64(&g_stats.miss[isoc_class]);
+
         auto ctx = (wsk_context*)ExAllocatePool2(POOL_FLAG_NON_PAGED, NumberOfBytes, Tag);
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", NumberOfBytes);
                 return nullptr;
         }
 
+        ctx->isoc_class = isoc_class;
         ctx->mdl_hdr = Mdl(&ctx->hdr, sizeof(ctx->hdr));
 
         if (auto err = ctx->mdl_hdr.prepare_nonpaged()) {
@@ -69,25 +121,74 @@ void *allocate_function_ex(_In_ [[maybe_unused]] POOL_TYPE PoolType, _In_ SIZE_T
                 return nullptr;
         }
 
-        TraceWSK("%04x", ptr04x(ctx));
+        if (auto cnt = g_isoc_class[isoc_class]; !cnt) {
+                //
+        } else if (auto err = alloc_isoc(*ctx, cnt)) {
+                Trace(TRACE_LEVEL_ERROR, "alloc_isoc(%lu) %!STATUS!", cnt, err);
+                free_function_ex(ctx, list);
+                return nullptr;
+        }
+
+        TraceWSK("%04x, isoc[%lu]", ptr04x(ctx), ctx->isoc_alloc_cnt);
         return ctx;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto pop(_Inout_ wsk_context_cache &cache, _In_ UCHAR isoc_class)
+{
+        auto entry = InterlockedPopEntrySList(&cache.list[isoc_class]);
+        if (!entry) {
+                return (wsk_context*)nullptr;
+        }
+
+        InterlockedDecrement(&cache.cnt[isoc_class]);
+        return CONTAINING_RECORD(entry, wsk_context, slist);
+}
+
+/*
+ * @return false if HIGH_WATER is reached
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto push(_Inout_ wsk_context_cache &cache, _In_ wsk_context *ctx)
+{
+        auto i = ctx->isoc_class;
+
+        if (InterlockedIncrement(&cache.cnt[i]) > wsk_context_cache::HIGH_WATER) {
+                InterlockedDecrement(&cache.cnt[i]);
+                return false;
+        }
+
+        InterlockedPushEntrySList(&cache.list[i], &ctx->slist);
+        return true;
+}
+
 /*
  * If use ExFreeToLookasideListEx in case of error, next ExAllocateFromLookasideListEx will return the same pointer.
  * free_function_ex is used instead in hope that next object in the LookasideList may have required buffer.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto alloc_wsk_context(_In_ ULONG NumberOfPackets)
+auto alloc_wsk_context(_Inout_ wsk_context_cache &cache, _In_ ULONG NumberOfPackets)
 {
-        auto ctx = (wsk_context*)ExAllocateFromLookasideListEx(&g_lookaside);
+        auto i = get_isoc_class(NumberOfPackets);
+        auto &list = g_lookaside[i];
+
+        InterlockedIncrement64(&g_stats.alloc[i]);
+        auto ctx = pop(cache, i);
+
+        if (ctx) {
+                InterlockedIncrement64(&g_stats.hit[i]);
+        } else {
+                ctx = (wsk_context*)ExAllocateFromLookasideListEx(&list);
+        }
 
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "ExAllocateFromLookasideListEx error");
         } else if (auto err = prepare_isoc(*ctx, NumberOfPackets)) {
                 Trace(TRACE_LEVEL_ERROR, "prepare_isoc(NumberOfPackets %lu) %!STATUS!", NumberOfPackets, err);
-                free_function_ex(ctx, &g_lookaside);
+                free_function_ex(ctx, &list);
                 ctx = nullptr;
         }
 
@@ -110,21 +211,38 @@ NTSTATUS usbip::init_wsk_context_list(_In_ ULONG tag)
         }
 
         g_tag = tag;
-        auto err = ExInitializeLookasideListEx(&g_lookaside, allocate_function_ex, free_function_ex, 
-                                               NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0);
 
-        g_initialized = !err;
-        return err;
+        for (ULONG i = 0; i < ARRAYSIZE(g_lookaside); ++i) {
+                if (auto err = ExInitializeLookasideListEx(&g_lookaside[i], allocate_function_ex, free_function_ex, 
+                                                           NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0)) {
+                        while (i) {
+                                ExDeleteLookasideListEx(&g_lookaside[--i]);
+                        }
+                        return err;
+                }
+        }
+
+        g_initialized = true;
+        return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::delete_wsk_context_list()
 {
-        if (g_initialized) {
-                ExDeleteLookasideListEx(&g_lookaside);
-                g_initialized = false;
+        if (!g_initialized) {
+                return;
         }
+
+        for (ULONG i = 0; i < ARRAYSIZE(g_lookaside); ++i) {
+                ExDeleteLookasideListEx(&g_lookaside[i]);
+
+                Trace(TRACE_LEVEL_INFORMATION, "isoc[%lu]: alloc %I64d, hit %I64d, miss %I64d", 
+                        g_isoc_class[i], g_stats.alloc[i], g_stats.hit[i], g_stats.miss[i]);
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "isoc realloc %I64d", g_stats.realloc);
+        g_initialized = false;
 }
 
 _IRQL_requires_same_
@@ -134,7 +252,7 @@ auto usbip::alloc_wsk_context(
 {
         NT_ASSERT(dev);
 
-        auto ctx = ::alloc_wsk_context(NumberOfPackets);
+        auto ctx = ::alloc_wsk_context(dev->wsk_cache, NumberOfPackets);
         if (ctx) {
                 ctx->dev = dev;
                 ctx->request = request;
@@ -145,6 +263,8 @@ auto usbip::alloc_wsk_context(
 
 /*
  * alloc_wsk_context sets dev, request, is_isoc. It's safe do not clear them.
+ * An object which isoc buffer was grown by prepare_isoc does not belong to its size class anymore.
+ * The cache of the device must be drained after all its objects are freed, @see drain_wsk_context_cache.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -154,55 +274,101 @@ void usbip::free(_In_opt_ wsk_context *ctx, _In_ bool reuse_irp)
                 return;
         }
 
+        auto &list = g_lookaside[ctx->isoc_class];
+
+        if (ctx->isoc_alloc_cnt != g_isoc_class[ctx->isoc_class]) {
+                free_function_ex(ctx, &list);
+                return;
+        }
+
         ctx->mdl_buf.reset();
 
         if (reuse_irp) {
                 IoReuseIrp(ctx->wsk_irp, STATUS_SUCCESS);
         }
 
-        ExFreeToLookasideListEx(&g_lookaside, ctx);
+        if (!push(ctx->dev->wsk_cache, ctx)) {
+                ExFreeToLookasideListEx(&list, ctx);
+        }
 }
 
+/*
+ * Pre-populate the cache with objects for non-isoch transfers, 
+ * IRP and MDL will not be allocated on URB path under bursts.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
+void usbip::init_wsk_context_cache(_Out_ wsk_context_cache &cache)
 {
-        NT_ASSERT(NumberOfPackets != number_of_packets_non_isoch);
-
-        ctx.is_isoc = NumberOfPackets;
-        if (!ctx.is_isoc) {
-                return STATUS_SUCCESS;
+        for (ULONG i = 0; i < ARRAYSIZE(cache.list); ++i) {
+                InitializeSListHead(&cache.list[i]);
+                cache.cnt[i] = 0;
         }
 
-        ULONG isoc_len = NumberOfPackets*sizeof(*ctx.isoc);
-
-        if (ctx.isoc_alloc_cnt < NumberOfPackets) {
-                auto isoc = (usbip_iso_packet_descriptor*)ExAllocatePool2(POOL_FLAG_NON_PAGED, isoc_len, g_tag);
-                if (!isoc) {
-                        return STATUS_INSUFFICIENT_RESOURCES;
+        for (int i = 0; i < wsk_context_cache::PREWARM; ++i) {
+                auto ctx = (wsk_context*)ExAllocateFromLookasideListEx(g_lookaside);
+                if (!ctx) {
+                        Trace(TRACE_LEVEL_ERROR, "ExAllocateFromLookasideListEx error, %d object(s) prewarmed", i);
+                        break;
                 }
+                NT_ASSERT(!ctx->isoc_class);
+                NT_VERIFY(push(cache, ctx));
+        }
+}
 
-                if (ctx.isoc) {
-                        ExFreePoolWithTag(ctx.isoc, g_tag);
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::drain_wsk_context_cache(_Inout_ wsk_context_cache &cache)
+{
+        for (UCHAR i = 0; i < ARRAYSIZE(cache.list); ++i) {
+                while (auto ctx = pop(cache, i)) {
+                        ExFreeToLookasideListEx(&g_lookaside[i], ctx);
                 }
+                NT_ASSERT(!cache.cnt[i]);
+        }
+}
 
-                ctx.isoc = isoc;
-                ctx.isoc_alloc_cnt = NumberOfPackets;
+/*
+ * MDL of isoc buffer is built once for its full size, ByteCount is adjusted to the number of packets.
+ * This is what NdisAdjustMdlLength does, the pages of nonpaged pool are already described by MDL.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
+{
+        NT_ASSERT(NumberOfPackets != number_of_packets_non_isoch);
 
-                ctx.mdl_isoc.reset();
+        ctx.is_isoc = NumberOfPackets;
+        if (!ctx.is_isoc) {
+                return STATUS_SUCCESS;
         }
 
-        if (ctx.mdl_isoc.size() != isoc_len) {
-                ctx.mdl_isoc = Mdl(ctx.isoc, isoc_len);
-                if (auto err = ctx.mdl_isoc.prepare_nonpaged()) {
+        if (ctx.isoc_alloc_cnt < NumberOfPackets || !ctx.mdl_isoc) {
+                InterlockedIncrement64(&g_stats.realloc);
+                if (auto err = alloc_isoc(ctx, NumberOfPackets)) {
                         return err;
                 }
-                NT_ASSERT(number_of_packets(ctx) == NumberOfPackets);
         }
 
+        ctx.mdl_isoc.get()->ByteCount = NumberOfPackets*sizeof(*ctx.isoc);
+        NT_ASSERT(number_of_packets(ctx) == NumberOfPackets);
+
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_wsk_context_stats(_Out_ vhci::wsk_context_statistics &st)
+{
+        for (ULONG i = 0; i < ARRAYSIZE(g_isoc_class); ++i) {
+                st.alloc[i] = ReadNoFence64(&g_stats.alloc[i]);
+                st.hit[i] = ReadNoFence64(&g_stats.hit[i]);
+                st.miss[i] = ReadNoFence64(&g_stats.miss[i]);
+        }
+
+        st.realloc = ReadNoFence64(&g_stats.realloc);
+}
+
 auto usbip::wsk_context_ptr::operator =(wsk_context_ptr&& ctx) -> wsk_context_ptr&
 {
         auto reuse = ctx.m_reuse;
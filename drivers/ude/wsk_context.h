@@ -9,6 +9,11 @@
 #include <usbip\proto.h>
 #include <libdrv\mdl_cpp.h>
 
+namespace usbip::vhci
+{
+        struct wsk_context_statistics;
+}
+
 namespace usbip
 {
 
@@ -22,6 +27,11 @@ struct wsk_context
 
         WDFREQUEST request; // can be WDF_NO_HANDLE
         Mdl mdl_buf; // describes URB_FROM_IRP()->TransferBuffer(MDL)
+        const UCHAR *isoc_data; // compacted isoch IN packets if they are not in transfer buffer
+
+        LIST_ENTRY entry; // device_ctx::send_queue
+        SLIST_ENTRY slist; // wsk_context_cache::list
+        wsk_context *next; // next context sent in the same WSK_BUF, @see device_ioctl.cpp
 
         // preallocated data
 
@@ -33,9 +43,33 @@ struct wsk_context
         Mdl mdl_isoc;
         usbip_iso_packet_descriptor *isoc;
         ULONG isoc_alloc_cnt;
+        UCHAR isoc_class; // index of lookaside list
         bool is_isoc;
 };
 
+/*
+ * Counters of lookaside lists, one list per size class of isoc buffer.
+ */
+struct wsk_context_stats
+{
+        enum { CLASS_CNT = 5 };
+        LONG64 alloc[CLASS_CNT]; // calls of alloc_wsk_context
+        LONG64 hit[CLASS_CNT]; // objects were taken from wsk_context_cache
+        LONG64 miss[CLASS_CNT]; // objects were allocated from the pool
+        LONG64 realloc; // prepare_isoc grew isoc buffer beyond its size class
+};
+
+/*
+ * Per-device cache of fully built objects, one stack per size class.
+ * Objects above HIGH_WATER are returned to lookaside lists.
+ */
+struct wsk_context_cache
+{
+        enum { PREWARM = 32, HIGH_WATER = 2*PREWARM }; // PREWARM is the expected depth of device's queue
+        SLIST_HEADER list[wsk_context_stats::CLASS_CNT];
+        LONG cnt[wsk_context_stats::CLASS_CNT]; // approximate depth of list
+};
+
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -59,6 +93,18 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets);
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init_wsk_context_cache(_Out_ wsk_context_cache &cache);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void drain_wsk_context_cache(_Inout_ wsk_context_cache &cache);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_wsk_context_stats(_Out_ vhci::wsk_context_statistics &st);
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 inline auto number_of_packets(_In_ const wsk_context &ctx)
@@ -16,7 +16,7 @@
 
 #include <libdrv\usbd_helper.h>
 #include <libdrv\dbgcommon.h>
-#include <libdrv\pdu.h>
+#include <libdrv\pdu_stream.h>
 
 namespace
 {
@@ -45,6 +45,108 @@ PAGED void NTAPI workitem_destroy(_In_ WDFOBJECT Object)
 		NT_ASSERT(!ctx->request); // must be completed and zeroed
 		free(ctx, true);
 	}
+
+	auto dev = static_cast<UDECXUSBDEVICE>(WdfObjectGetParentObject(wi));
+	auto &buf = get_device_ctx(dev)->rxbuf;
+
+	if (auto mdl = buf.mdl) {
+		IoFreeMdl(mdl);
+		buf.mdl = nullptr;
+	}
+
+	if (auto data = buf.data) {
+		ExFreePoolWithTag(data, pooltag);
+		buf.data = nullptr;
+	}
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto alloc(_Inout_ recv_buffer &buf)
+{
+	PAGED_CODE();
+	NT_ASSERT(!buf.data);
+
+	buf.data = (UCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, buf.SIZE, pooltag);
+	if (!buf.data) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", buf.SIZE);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	buf.mdl = IoAllocateMdl(buf.data, buf.SIZE, false, false, nullptr);
+	if (!buf.mdl) {
+		Trace(TRACE_LEVEL_ERROR, "IoAllocateMdl -> NULL");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	MmBuildMdlForNonPagedPool(buf.mdl);
+	buf.head = buf.tail = 0;
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Copy a part of a payload into the MDL chain of WSK_BUF.
+ * On return, WSK_BUF describes the rest of the payload.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS copy(_Inout_ WSK_BUF &buf, _In_ const UCHAR *src, _In_ ULONG len)
+{
+	NT_ASSERT(len <= buf.Length);
+
+	while (len) {
+
+		auto &mdl = buf.Mdl;
+		auto mdl_len = MmGetMdlByteCount(mdl);
+
+		auto dst = static_cast<UCHAR*>(MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+		if (!dst) {
+			Trace(TRACE_LEVEL_ERROR, "MmGetSystemAddressForMdlSafe -> NULL");
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		auto cnt = min(len, mdl_len - ULONG(buf.Offset));
+		RtlCopyMemory(dst + buf.Offset, src, cnt);
+
+		src += cnt;
+		buf.Length -= cnt;
+		len -= cnt;
+
+		if ((buf.Offset += cnt) == mdl_len) {
+			mdl = mdl->Next;
+			buf.Offset = 0;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * @return data that are received, but not parsed yet
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& unparsed(_In_ device_ctx &dev)
+{
+	return dev.recv_event ? dev.indicated : dev.rxbuf;
+}
+
+/*
+ * Copy already received part of a payload, @see copy.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto copy_buffered(_Inout_ WSK_BUF &buf, _Inout_ recv_buffer &rx)
+{
+	auto len = ULONG(min(buf.Length, rx.size()));
+
+	auto err = copy(buf, rx.ptr(), len);
+	if (!err) {
+		rx.head += len;
+	}
+
+	return err;
 }
 
 constexpr auto check(_In_ ULONG TransferBufferLength, _In_ int actual_length)
@@ -84,51 +186,75 @@ inline auto& get_ret_submit(_In_ const wsk_context &ctx)
  * See:
  * <linux>/drivers/usb/usbip/stub_tx.c, stub_send_ret_submit
  * <linux>/drivers/usb/usbip/usbip_common.c, usbip_pad_iso
+ *
+ * Descriptors are in network byte order. They are byteswapped, validated and packets are moved 
+ * to their offsets in a single backward pass. Adjacent packets with the same shift are moved at once,
+ * nothing is moved if the buffer has no gaps.
+ *
+ * @param data compacted packets, transfer buffer or a buffer with received data
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_ ULONG length, 
-	_In_ const usbip_iso_packet_descriptor *src)
+	_In_ const usbip_iso_packet_descriptor *src, _In_opt_ const UCHAR *data)
 {
 	NT_ASSERT(length <= r.TransferBufferLength);
 	auto dir_out = !buffer;
+	bool in_place = data == buffer;
+
+	struct { ULONG src; ULONG dst; ULONG len; } run{}; // packets that have to be moved
+	
+	auto move = [buffer, data, in_place] (auto &run)
+	{
+		if (!run.len) {
+			//
+		} else if (in_place) {
+			NT_ASSERT(run.dst > run.src);
+			RtlMoveMemory(buffer + run.dst, buffer + run.src, run.len);
+		} else {
+			RtlCopyMemory(buffer + run.dst, data + run.src, run.len);
+		}
+		run.len = 0;
+	};
 
 	for (auto i = LONG64(r.NumberOfPackets) - 1; i >= 0; --i) { // set dd.Status and dd.Length
 
 		auto sd = src + i;
 		auto dd = r.IsoPacket + i;
 
-		dd->Status = sd->status ? to_windows_status_isoch(sd->status) : USBD_STATUS_SUCCESS;
+		auto status = RtlUlongByteSwap(sd->status);
+		dd->Status = status ? to_windows_status_isoch(status) : USBD_STATUS_SUCCESS;
 
 		if (dir_out) {
 			continue; // dd->Length is not used for OUT transfers
 		}
 
-		if (!sd->actual_length) {
+		auto actual_length = RtlUlongByteSwap(sd->actual_length);
+		if (!actual_length) {
 			dd->Length = 0;
 			continue;
 		}
 
-		if (sd->actual_length > sd->length) {
-			Trace(TRACE_LEVEL_ERROR, "actual_length(%u) > length(%u)", sd->actual_length, sd->length);
+		if (auto len = RtlUlongByteSwap(sd->length); actual_length > len) {
+			Trace(TRACE_LEVEL_ERROR, "actual_length(%lu) > length(%lu)", actual_length, len);
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (sd->offset != dd->Offset) { // buffer is compacted, but offsets are intact
-			Trace(TRACE_LEVEL_ERROR, "src.offset(%u) != dst.Offset(%lu)", sd->offset, dd->Offset);
+		if (auto offset = RtlUlongByteSwap(sd->offset); offset != dd->Offset) { // buffer is compacted, but offsets are intact
+			Trace(TRACE_LEVEL_ERROR, "src.offset(%lu) != dst.Offset(%lu)", offset, dd->Offset);
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (length >= sd->actual_length) {
-			length -= sd->actual_length;
+		if (length >= actual_length) {
+			length -= actual_length;
 		} else {
-			Trace(TRACE_LEVEL_ERROR, "length(%lu) >= actual_length(%u)", length, sd->actual_length);
+			Trace(TRACE_LEVEL_ERROR, "length(%lu) >= actual_length(%lu)", length, actual_length);
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (dd->Offset + sd->actual_length > r.TransferBufferLength) {
-			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) + src.actual_length(%u) > r.TransferBufferLength(%lu)",
-				dd->Offset, sd->actual_length, r.TransferBufferLength);
+		if (dd->Offset + actual_length > r.TransferBufferLength) {
+			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) + src.actual_length(%lu) > r.TransferBufferLength(%lu)",
+				dd->Offset, actual_length, r.TransferBufferLength);
 			return STATUS_INVALID_PARAMETER;
 		}
 		
@@ -137,16 +263,27 @@ auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (dd->Offset > length) {
-			RtlMoveMemory(buffer + dd->Offset, buffer + length, sd->actual_length);
+		if (dd->Offset == length && in_place) {
+			//
+		} else if (run.len && run.src == length + actual_length && run.dst == dd->Offset + actual_length) {
+			run.src = length; // prepend to the run
+			run.dst = dd->Offset;
+			run.len += actual_length;
+		} else {
+			move(run);
+			run = { length, dd->Offset, actual_length };
 		}
 
-		dd->Length = sd->actual_length;
+		dd->Length = actual_length;
 	}
 
-	if (length && !dir_out) {
+	if (dir_out) {
+		// 
+	} else if (length) {
 		Trace(TRACE_LEVEL_ERROR, "SUM(actual_length) != actual_length, delta is %lu", length);
 		return STATUS_INVALID_PARAMETER; 
+	} else {
+		move(run);
 	}
 
 	return STATUS_SUCCESS;
@@ -173,8 +310,7 @@ auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &r
 	}
 
 	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
-		NT_ASSERT(r.NumberOfPackets == number_of_packets(ctx));
-		byteswap(ctx.isoc, cnt);
+		NT_ASSERT(r.NumberOfPackets == number_of_packets(ctx)); // fill_isoc_data will byteswap ctx.isoc
 	} else {
 		Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) != NumberOfPackets(%lu)", cnt, r.NumberOfPackets);
 		return STATUS_INVALID_PARAMETER;
@@ -191,7 +327,8 @@ auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &r
 		NT_ASSERT(length == r.TransferBufferLength);
 	}
 
-	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc);
+	auto data = ctx.isoc_data ? ctx.isoc_data : buffer;
+	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc, data);
 }
 
 /* 
@@ -239,6 +376,11 @@ auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const usbip_header_ret_submit
 			st = assign(TransferBufferLength, ret.actual_length); // DIR_OUT or !actual_length
 			UdecxUrbSetBytesCompleted(ctx.request, TransferBufferLength);
 		}
+
+		if (auto &pkt = get_setup_packet(urb.UrbControlTransferEx); 
+		    NT_SUCCESS(st) && !ret.status && is_control(urb) && is_cacheable(pkt)) {
+			put_descriptor(ctx.dev->descriptors, pkt, TransferBuffer, TransferBufferLength);
+		}
 	}
 
 	return st;
@@ -256,6 +398,11 @@ NTSTATUS ret_submit(_Inout_ wsk_context &ctx)
 		  ret.status ? STATUS_UNSUCCESSFUL : 
 		  STATUS_SUCCESS;
 
+	if (urb && NT_SUCCESS(st) && is_transfer_dir_in(ctx.hdr)) {
+		auto &endp = *get_endpoint_ctx(get_request_ctx(ctx.request)->endpoint);
+		on_data_in(ctx.dev->stats, endp.descriptor.bEndpointAddress, ULONG(ret.actual_length));
+	}
+
 	atomic_complete(ctx.request, st);
 	return RECV_NEXT_USBIP_HDR;
 }
@@ -376,9 +523,9 @@ NTSTATUS on_receive(
 	TraceWSK("req %04x, %!STATUS!, Information %Iu", ptr04x(ctx.request), ios.Status, ios.Information);
 
 	auto st = NT_ERROR(ios.Status) ? ios.Status :
-		  ios.Information == dev.receive_size ? dev.received(ctx) :
-		  ios.Information ? STATUS_RECEIVE_PARTIAL : 
-		  STATUS_CONNECTION_DISCONNECTED; // EOF
+		  !ios.Information ? STATUS_CONNECTION_DISCONNECTED : // EOF
+		  !dev.receive_size || ios.Information == dev.receive_size ? dev.received(ctx) :
+		  STATUS_RECEIVE_PARTIAL;
 
 	switch (st) {
 	case RECV_NEXT_USBIP_HDR:
@@ -409,15 +556,18 @@ NTSTATUS on_receive(
 
 /*
  * @param received will be called if requested number of bytes are received without error
+ * @param flags if WSK_FLAG_WAITALL is not set, any number of bytes is acceptable
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto receive(_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_context &ctx)
+auto receive(_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_context &ctx, 
+	_In_ ULONG flags = WSK_FLAG_WAITALL)
 {
 	auto &dev = *ctx.dev;
+	bool waitall = flags & WSK_FLAG_WAITALL;
 
-	NT_ASSERT(verify(buf, ctx.is_isoc));
-	dev.receive_size = buf.Length; // checked by verify()
+	NT_ASSERT(verify(buf, waitall && ctx.is_isoc));
+	dev.receive_size = waitall ? buf.Length : 0; // checked by verify()
 
 	NT_ASSERT(received);
 	dev.received = received;
@@ -427,7 +577,7 @@ auto receive(_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_
 
 	IoSetCompletionRoutine(irp, on_receive, &ctx, true, true, true);
 
-	auto st = receive(dev.sock(), &buf, WSK_FLAG_WAITALL, irp);
+	auto st = receive(dev.sock(), &buf, flags, irp);
 	NT_ASSERT(st != STATUS_NOT_SUPPORTED); // on_receive will not be called for this status only
 
 	if (st == STATUS_PENDING) {
@@ -443,7 +593,19 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 {
-	if (ULONG(length) != length) {
+	auto &rx = unparsed(*ctx.dev);
+	{
+		auto cnt = ULONG(min(length, rx.size()));
+		rx.head += cnt;
+		length -= cnt;
+	}
+
+	if (!length) {
+		return RECV_NEXT_USBIP_HDR;
+	} else if (auto &dev = *ctx.dev; dev.recv_event) { // will be skipped in data indications
+		dev.payload = WSK_BUF{ .Length = length };
+		return RECV_MORE_DATA_REQUIRED;
+	} else if (ULONG(length) != length) {
 		Trace(TRACE_LEVEL_ERROR, "Buffer size truncation: ULONG(%lu) != size_t(%Iu)", ULONG(length), length);
 		return STATUS_INVALID_PARAMETER;
 	}
@@ -466,6 +628,50 @@ NTSTATUS drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 	return receive(buf, free_drain_buffer, ctx);
 }
 
+/*
+ * The whole isoch IN payload is already received. Descriptors are read first and 
+ * packets are copied to their offsets in transfer buffer at once, memmove is not required.
+ * 
+ * A payload can't be received from a socket this way because descriptors follow packets.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS scatter_isoc(_Inout_ wsk_context &ctx, _Inout_ recv_buffer &rx, _In_ size_t length)
+{
+	auto &ret = get_ret_submit(ctx);
+
+	if (auto err = prepare_isoc(ctx, ret.number_of_packets)) { // sets ctx.is_isoc
+		Trace(TRACE_LEVEL_ERROR, "prepare_isoc %!STATUS!", err);
+		return err;
+	}
+
+	UCHAR *TransferBuffer{};
+	ULONG TransferBufferLength{};
+
+	if (auto err = UdecxUrbRetrieveBuffer(ctx.request, &TransferBuffer, &TransferBufferLength)) {
+		Trace(TRACE_LEVEL_ERROR, "UdecxUrbRetrieveBuffer %!STATUS!", err);
+		return err;
+	}
+
+	if (auto err = check(TransferBufferLength, ret.actual_length)) {
+		Trace(TRACE_LEVEL_ERROR, "TransferBufferLength(%lu), actual_length(%d)", TransferBufferLength, ret.actual_length);
+		return err;
+	}
+
+	auto isoc_len = ctx.mdl_isoc.size();
+	NT_ASSERT(ret.actual_length + isoc_len == length);
+
+	RtlCopyMemory(ctx.isoc, rx.ptr() + ret.actual_length, isoc_len);
+
+	ctx.isoc_data = rx.ptr();
+	rx.head += ULONG(length);
+
+	auto st = ret_submit(ctx);
+	ctx.isoc_data = nullptr;
+
+	return st;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
@@ -473,13 +679,54 @@ NTSTATUS recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 	auto &urb = get_urb(ctx.request); // only IOCTL_INTERNAL_USB_SUBMIT_URB has payload
 	WSK_BUF buf{ .Length = length };
 
+	if (auto cnt = get_ret_submit(ctx).number_of_packets; !cnt) {
+		//
+	} else if (!is_isoch(urb)) {
+		Trace(TRACE_LEVEL_ERROR, "%s, number_of_packets(%d)", urb_function_str(urb.UrbHeader.Function), cnt);
+		return STATUS_INVALID_PARAMETER;
+	} else if (auto &rx = unparsed(*ctx.dev); rx.size() >= length && is_transfer_dir_in(ctx.hdr)) {
+		return scatter_isoc(ctx, rx, length);
+	}
+
 	if (auto err = prepare_wsk_mdl(buf.Mdl, ctx, urb)) {
 		NT_ASSERT(err != RECV_MORE_DATA_REQUIRED);
 		Trace(TRACE_LEVEL_ERROR, "prepare_wsk_mdl %!STATUS!", err);
 		return err;
 	}
 
-	return receive(buf, ret_submit, ctx);
+	if (auto err = copy_buffered(buf, unparsed(*ctx.dev))) {
+		NT_ASSERT(err != RECV_MORE_DATA_REQUIRED);
+		return err;
+	}
+
+	if (!buf.Length) {
+		return ret_submit(ctx);
+	} else if (auto &dev = *ctx.dev; dev.recv_event) { // will be copied from data indications
+		dev.payload = buf;
+		return RECV_MORE_DATA_REQUIRED;
+	}
+
+	return receive(buf, ret_submit, ctx); // zero copy for the rest of the payload
+}
+
+/*
+ * RET_SUBMIT without a request can be the response on GET_DESCRIPTOR of device::revalidate_descriptors.
+ * The payload is not waited for if it was not received together with the header, the entry is removed.
+ * @return true if it is such response, its payload must be drained
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto revalidate_descriptor(_Inout_ device_ctx &dev, _In_ const usbip_header &hdr)
+{
+	if (hdr.base.command != USBIP_RET_SUBMIT) {
+		return false;
+	}
+
+	auto &rx = unparsed(dev);
+	auto len = get_payload_size(hdr);
+	auto data = rx.size() >= len ? rx.ptr() : nullptr;
+
+	return usbip::revalidate(dev.descriptors, hdr.base.seqnum, hdr.u.ret_submit.status, data, ULONG(len));
 }
 
 /*
@@ -507,9 +754,22 @@ NTSTATUS ret_command(_Inout_ wsk_context &ctx)
 			ptr04x(ctx.request), get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, false));
 	}
 
+	{
+		auto &dev = *ctx.dev;
+		auto &rx = unparsed(dev); // the beginning of payload if it is already received
+		auto prefix = min(size_t(rx.size()), get_payload_size(hdr));
+		record_pdu(get_vhci_ctx(dev.vhci)->recorder, dev.port, false, hdr, get_total_size(hdr), rx.ptr(), prefix);
+	}
+
+	auto probe = !ctx.request && revalidate_descriptor(*ctx.dev, hdr);
+
 	if (auto sz = get_payload_size(hdr); sz && !ctx.dev->unplugged) {
-		auto f = ctx.request ? recv_payload : drain_payload;
-		return f(ctx, sz);
+		if (ctx.request) {
+			return recv_payload(ctx, sz);
+		} else if (!probe) {
+			on_drain(ctx.dev->stats, sz);
+		}
+		return drain_payload(ctx, sz);
 	} else if (!ctx.request) {
 		//
 	} else if (!sz) [[likely]] {
@@ -526,70 +786,234 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto validate_header(_Inout_ usbip_header &hdr)
 {
-	byteswap_header(hdr, swap_dir::net2host);
-
-	auto &base = hdr.base;
-	auto cmd = static_cast<usbip_request_type>(base.command);
+	auto st = validate_ret_header(hdr);
 
-	switch (cmd) {
-	case USBIP_RET_SUBMIT: {
-		auto &ret = hdr.u.ret_submit;
-		if (ret.number_of_packets == number_of_packets_non_isoch) {
-			ret.number_of_packets = 0;
-		} else if (!is_valid_number_of_packets(ret.number_of_packets)) {
-			Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) is out of range", ret.number_of_packets);
-			return false;
-		}
-	}	break;
-	case USBIP_RET_UNLINK:
+	switch (st) {
+	case RET_HDR_OK:
+		break;
+	case RET_HDR_BAD_COMMAND:
+		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", 
+			static_cast<usbip_request_type>(hdr.base.command));
+		break;
+	case RET_HDR_BAD_NUMBER_OF_PACKETS:
+		Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) is out of range", hdr.u.ret_submit.number_of_packets);
+		break;
+	case RET_HDR_BAD_SEQNUM:
+		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", hdr.base.seqnum);
 		break;
-	default:
-		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", cmd);
-		return false;
 	}
 
-	auto ok = is_valid_seqnum(base.seqnum);
+	return st == RET_HDR_OK;
+}
 
-	if (ok) {
-		base.direction = extract_dir(base.seqnum); // always zero in server response
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", base.seqnum);
+
+/*
+ * Parse as many PDUs as received.
+ * Payloads are copied from the buffer, the rest of a payload that was not received yet 
+ * is read directly into URB buffer, @see recv_payload.
+ */
+_Function_class_(device_ctx::received_fn)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS recv_buffered(_Inout_ wsk_context &ctx)
+{
+	auto &dev = *ctx.dev;
+	auto &rx = dev.rxbuf;
+
+	rx.tail += ULONG(ctx.wsk_irp->IoStatus.Information);
+	NT_ASSERT(rx.tail <= rx.SIZE);
+
+	while (rx.size() >= sizeof(ctx.hdr) && !dev.unplugged) {
+
+		NT_ASSERT(!ctx.request); // must be completed and zeroed on every cycle
+		ctx.mdl_buf.reset();
+		ctx.is_isoc = false; // prepare_isoc sets it for RET_SUBMIT with payload
+
+		ULONG received = 0;
+		NT_VERIFY(take_header(rx, ctx.hdr, received));
+
+		if (!validate_header(ctx.hdr)) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		if (auto st = ret_command(ctx); st != RECV_NEXT_USBIP_HDR) {
+			return st;
+		}
 	}
 
-	return ok;
+	return RECV_NEXT_USBIP_HDR;
 }
 
-
 /*
  * A WSK application should not call new WSK functions in the context of the IoCompletion routine. 
  * Doing so may result in recursive calls and exhaust the kernel mode stack. 
  * When executing at IRQL = DISPATCH_LEVEL, this can also lead to starvation of other threads.
  *
  * For this reason work queue is used here, but reading of payload does not use it and it's OK.
+ * The work item is queued only when all buffered PDUs are parsed, not for every PDU.
  */
 _Function_class_(EVT_WDF_WORKITEM)
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL) // do not define as PAGED, lambda "received" must be resident
+_IRQL_requires_max_(DISPATCH_LEVEL)
 void NTAPI receive_usbip_header(_In_ WDFWORKITEM WorkItem)
 {
 	auto &ctx = *get_wsk_context(WorkItem);
 
 	NT_ASSERT(!ctx.request); // must be completed and zeroed on every cycle
 	ctx.mdl_buf.reset();
+	ctx.is_isoc = false;
+
+	auto &rx = ctx.dev->rxbuf;
+	NT_ASSERT(rx.size() < sizeof(ctx.hdr));
+
+	auto len = compact(rx);
 
-	ctx.mdl_hdr.next(nullptr);
-	WSK_BUF buf{ .Mdl = ctx.mdl_hdr.get(), .Length = sizeof(ctx.hdr) };
+	WSK_BUF buf{ .Mdl = rx.mdl, .Offset = rx.tail, .Length = len };
+	receive(buf, recv_buffered, ctx, 0);
+}
+
+/*
+ * @param src data from WSK_DATA_INDICATION
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS consume(_Inout_ wsk_context &ctx, _In_ const UCHAR *src, _In_ ULONG len)
+{
+	auto &dev = *ctx.dev;
 
-	auto received = [] (auto &ctx) // inherits PAGED from the function, can be called on DISPATCH_LEVEL
+	auto &rx = dev.indicated; // ret_command consumes it too, @see unparsed
+	rx = { .data = const_cast<UCHAR*>(src), .tail = len };
+
+	while (rx.size() && !dev.unplugged) {
+
+		if (auto &p = dev.payload; p.Length) {
+			if (p.Mdl) {
+				if (auto err = copy_buffered(p, rx)) {
+					return err;
+				}
+			} else { // drain
+				auto cnt = ULONG(min(rx.size(), p.Length));
+				p.Length -= cnt;
+				rx.head += cnt;
+			}
+
+			if (!p.Length && ctx.request) {
+				ret_submit(ctx);
+			}
+			continue;
+		}
+
+		if (!take_header(rx, ctx.hdr, dev.hdr_received)) {
+			NT_ASSERT(!rx.size());
+			break;
+		}
+
+		NT_ASSERT(!ctx.request); // must be completed and zeroed on every cycle
+		ctx.mdl_buf.reset();
+		ctx.is_isoc = false;
+
+		if (!validate_header(ctx.hdr)) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		if (auto st = ret_command(ctx); st != RECV_NEXT_USBIP_HDR && st != RECV_MORE_DATA_REQUIRED) {
+			return st;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS consume(_Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf)
+{
+	auto offset = ULONG(buf.Offset);
+
+	for (auto mdl = buf.Mdl, len = buf.Length; len; mdl = mdl->Next, offset = 0) {
+
+		auto src = static_cast<UCHAR*>(MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+		if (!src) {
+			Trace(TRACE_LEVEL_ERROR, "MmGetSystemAddressForMdlSafe -> NULL");
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		auto cnt = ULONG(min(len, MmGetMdlByteCount(mdl) - offset));
+
+		if (auto err = consume(ctx, src + offset, cnt)) {
+			return err;
+		}
+
+		len -= cnt;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Indicated data are never retained, they are copied and released on return. 
+ * The payload is copied straight into URB transfer buffer because it is known when usbip_header is parsed,
+ * so the number of copies is the same as for IRP-based receive.
+ *
+ * @param DataIndication is NULL if the socket is being closed
+ */
+_Function_class_(PFN_WSK_RECEIVE_EVENT)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI receive_event(
+	_In_opt_ PVOID SocketContext, _In_ ULONG Flags, _In_opt_ WSK_DATA_INDICATION *DataIndication, 
+	_In_ SIZE_T BytesIndicated, _Inout_ SIZE_T *BytesAccepted)
+{
+	auto &dev = *static_cast<device_ctx_ext*>(SocketContext)->ctx;
+	auto &ctx = *get_wsk_context(dev.recv_hdr);
 	{
-		return validate_header(ctx.hdr) ? ret_command(ctx) : STATUS_INVALID_PARAMETER;
-	};
+		char buf[wsk::RECEIVE_EVENT_FLAGS_BUFBZ];
+		TraceWSK("dev %04x, %Iu bytes, Flags%s", ptr04x(get_device(&dev)), BytesIndicated, 
+			  wsk::ReceiveEventFlags(buf, sizeof(buf), Flags));
+	}
+
+	auto st = DataIndication ? STATUS_SUCCESS : STATUS_CONNECTION_DISCONNECTED;
+
+	for (auto di = DataIndication; di && !st && !dev.unplugged; di = di->Next) {
+		st = consume(ctx, di->Buffer);
+	}
 
-	receive(buf, received, ctx);
+	if (!(st || dev.unplugged)) {
+		*BytesAccepted = BytesIndicated;
+		return STATUS_SUCCESS;
+	}
+
+	if (auto &req = ctx.request) {
+		atomic_complete(req, STATUS_CANCELLED);
+	}
+
+	if (!dev.unplugged) {
+		auto hdev = get_device(&dev);
+		TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(hdev), st);
+		device::async_plugout_and_delete(hdev);
+	}
+
+	return STATUS_DATA_NOT_ACCEPTED;
+}
+
+_Function_class_(PFN_WSK_DISCONNECT_EVENT)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI disconnect_event(_In_opt_ PVOID SocketContext, _In_ ULONG Flags)
+{
+	auto &dev = *static_cast<device_ctx_ext*>(SocketContext)->ctx;
+	auto hdev = get_device(&dev);
+
+	TraceDbg("dev %04x, Flags %#lx", ptr04x(hdev), Flags);
+	device::async_plugout_and_delete(hdev);
+
+	return STATUS_SUCCESS;
 }
 
 } // namespace
 
+const WSK_CLIENT_CONNECTION_DISPATCH usbip::connection_dispatch{ receive_event, disconnect_event };
+
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -597,6 +1021,9 @@ void usbip::complete(_In_ WDFREQUEST request, _In_ NTSTATUS status)
 {
 	auto &req = *get_request_ctx(request);
 
+	auto &endp = *get_endpoint_ctx(req.endpoint); // the request was sent, @see device_ioctl.cpp, send
+	auto &dev = *get_device_ctx(endp.device);
+
 	auto irp = WdfRequestWdmGetIrp(request);
 
 	auto info = irp->IoStatus.Information;
@@ -606,7 +1033,12 @@ void usbip::complete(_In_ WDFREQUEST request, _In_ NTSTATUS status)
 		if (status) {
 			TraceDbg("seqnum %u, %!STATUS!, Information %#Ix", req.seqnum, status, info);
 		}
+		on_complete(dev.stats, endp.descriptor.bEndpointAddress, status);
+		if (NT_SUCCESS(status)) {
+			record_latency(dev.latency, usb_endpoint_type(endp.descriptor), req.sent);
+		}
 		WdfRequestComplete(request, status);
+		ExReleaseRundownProtection(&dev.inflight_rundown); // @see device::insert_inflight
 		return;
 	}
 
@@ -622,11 +1054,17 @@ void usbip::complete(_In_ WDFREQUEST request, _In_ NTSTATUS status)
 			req.seqnum, get_usbd_status(urb_st), status, info);
 	}
 
+	on_complete(dev.stats, endp.descriptor.bEndpointAddress, 
+		    NT_SUCCESS(status) && USBD_ERROR(urb_st) ? STATUS_UNSUCCESSFUL : status);
+
 	if (NT_SUCCESS(status)) {
+		record_latency(dev.latency, usb_endpoint_type(endp.descriptor), req.sent); // including USBD errors
 		UdecxUrbComplete(request, urb_st);
 	} else {
 		UdecxUrbCompleteWithNtStatus(request, status);
 	}
+
+	ExReleaseRundownProtection(&dev.inflight_rundown);
 }
 
 _IRQL_requires_same_
@@ -651,6 +1089,10 @@ PAGED NTSTATUS usbip::init_receive_usbip_header(_In_ device_ctx &ctx)
 
 	TraceDbg("wsk workitem %04x", ptr04x(ctx.recv_hdr));
 
+	if (auto err = alloc(ctx.rxbuf)) {
+		return err;
+	}
+
 	if (auto ptr = alloc_wsk_context(&ctx, WDF_NO_HANDLE)) {
 		get_wsk_context(ctx.recv_hdr) = ptr;
 		return STATUS_SUCCESS;
@@ -658,3 +1100,53 @@ PAGED NTSTATUS usbip::init_receive_usbip_header(_In_ device_ctx &ctx)
 
 	return STATUS_INSUFFICIENT_RESOURCES;
 }
+
+/*
+ * Data indications save a receive IRP round trip per PDU.
+ * IRP-based receive is used if WSK_EVENT_RECEIVE can't be enabled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::start_receive(_In_ device_ctx &dev)
+{
+	PAGED_CODE();
+	NT_ASSERT(!dev.recv_event);
+
+	auto sock = dev.sock();
+	dev.recv_event = true; // receive_event can be called before event_callback_control returns
+
+	if (auto err = event_callback_control(sock, WSK_EVENT_RECEIVE | WSK_EVENT_DISCONNECT, false)) {
+		Trace(TRACE_LEVEL_ERROR, "event_callback_control %!STATUS!, IRP-based receive will be used", err);
+		dev.recv_event = false;
+		sched_receive_usbip_header(dev);
+	}
+}
+
+/*
+ * WskCloseSocket must not be called while event callbacks are in progress.
+ * A request can wait for the rest of its payload that will never be indicated.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::stop_receive(_In_ device_ctx &dev)
+{
+	PAGED_CODE();
+
+	if (!dev.recv_event) {
+		return;
+	}
+
+	if (auto sock = dev.sock()) {
+		if (auto err = event_callback_control(sock, WSK_EVENT_DISABLE | WSK_EVENT_RECEIVE, true)) {
+			Trace(TRACE_LEVEL_ERROR, "event_callback_control(WSK_EVENT_RECEIVE) %!STATUS!", err);
+		}
+
+		if (auto err = event_callback_control(sock, WSK_EVENT_DISABLE | WSK_EVENT_DISCONNECT, true)) {
+			Trace(TRACE_LEVEL_ERROR, "event_callback_control(WSK_EVENT_DISCONNECT) %!STATUS!", err);
+		}
+	}
+
+	if (auto ctx = get_wsk_context(dev.recv_hdr); ctx && ctx->request) {
+		atomic_complete(ctx->request, STATUS_CANCELLED);
+	}
+}
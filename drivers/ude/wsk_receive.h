@@ -6,6 +6,7 @@
 
 #include <libdrv\codeseg.h>
 #include <libdrv/wdf_cpp.h>
+#include <libdrv\wsk_cpp.h>
 
 namespace usbip
 {
@@ -30,4 +31,14 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS init_receive_usbip_header(_In_ device_ctx &ctx);
 
+extern const WSK_CLIENT_CONNECTION_DISPATCH connection_dispatch; // for WskSocket, SocketContext is device_ctx_ext*
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void start_receive(_In_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void stop_receive(_In_ device_ctx &dev);
+
 } // namespace usbip
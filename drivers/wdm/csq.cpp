@@ -9,6 +9,7 @@
 #include "dev.h"
 #include "irp.h"
 #include "internal_ioctl.h"
+#include "devconf.h"
 
 
 namespace
@@ -39,52 +40,112 @@ inline auto to_vpdo(IO_CSQ *csq)
 	return CONTAINING_RECORD(csq, vpdo_dev_t, irps_csq);
 }
 
+inline auto& seqnum_bucket(_In_ vpdo_dev_t &vpdo, _In_ seqnum_t seqnum)
+{
+	static_assert(!(vpdo_dev_t::IRPS_SEQNUM_BUCKETS & (vpdo_dev_t::IRPS_SEQNUM_BUCKETS - 1)));
+	return vpdo.irps_by_seqnum[extract_num(seqnum) & (vpdo_dev_t::IRPS_SEQNUM_BUCKETS - 1)];
+}
+
+/*
+ * One bucket per endpoint address (IN/OUT x 16), pipes do not collide.
+ */
+inline auto pipe_bucket(_In_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle)
+{
+	static_assert(vpdo_dev_t::IRPS_PIPE_BUCKETS == 2*(USB_ENDPOINT_ADDRESS_MASK + 1));
+
+	auto addr = get_endpoint_address(handle);
+	auto idx = (addr & USB_ENDPOINT_ADDRESS_MASK) | (USB_ENDPOINT_DIRECTION_IN(addr) ? USB_ENDPOINT_ADDRESS_MASK + 1 : 0);
+
+	return vpdo.irps_by_pipe + idx;
+}
+
 void InsertIrp(_In_ IO_CSQ *csq, _In_ IRP *irp)
 {
 	NT_ASSERT(is_valid_seqnum(get_seqnum(irp)));
-
 	auto vpdo = to_vpdo(csq);
-	InsertTailList(&vpdo->irps, list_entry(irp));
+
+	auto &head = seqnum_bucket(*vpdo, get_seqnum(irp));
+	get_next_irp(irp) = head;
+	head = irp;
+
+	InsertTailList(pipe_bucket(*vpdo, get_pipe_handle(irp)), list_entry(irp));
 
 	TraceCSQ("%04x", ptr4log(irp));
 }
 
-void RemoveIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+void RemoveIrp(_In_ IO_CSQ *csq, _In_ IRP *irp)
 {
 	TraceCSQ("%04x", ptr4log(irp));
+	auto vpdo = to_vpdo(csq);
+
+	for (auto cur = &seqnum_bucket(*vpdo, get_seqnum(irp)); *cur; cur = &get_next_irp(*cur)) {
+		if (*cur == irp) {
+			*cur = get_next_irp(irp);
+			break;
+		}
+	}
+	get_next_irp(irp) = nullptr;
+
 	auto entry = list_entry(irp);
 	RemoveEntryList(entry);
 	InitializeListHead(entry);
 }
 
-auto PeekNextIrp(_In_ IO_CSQ *csq, _In_ IRP *irp, _In_ PVOID context)
+/*
+ * IoCsqRemoveNextIrp always passes irp == NULL, but IO_CSQ contract allows to continue the search after given irp.
+ */
+auto peek_seqnum(_In_ vpdo_dev_t &vpdo, _In_opt_ IRP *irp, _In_ seqnum_t seqnum)
 {
-	auto vpdo = to_vpdo(csq);
-	auto head = &vpdo->irps;
+	auto cur = irp ? get_next_irp(irp) : seqnum_bucket(vpdo, seqnum);
 
-	auto ctx = static_cast<peek_context*>(context);
-	IRP *result{};
+	for ( ; cur && get_seqnum(cur) != seqnum; cur = get_next_irp(cur));
+	return cur;
+}
+
+auto peek_pipe(_In_ vpdo_dev_t &vpdo, _In_opt_ IRP *irp, _In_ USBD_PIPE_HANDLE handle)
+{
+	auto head = pipe_bucket(vpdo, handle);
 
 	for (auto entry = irp ? list_entry(irp)->Flink : head->Flink; entry != head; entry = entry->Flink) {
+		if (auto entry_irp = get_irp(entry); get_pipe_handle(entry_irp) == handle) {
+			return entry_irp;
+		}
+	}
 
-		auto entry_irp = get_irp(entry);
-		bool found = false;
+	return static_cast<IRP*>(nullptr);
+}
 
-		if (!ctx) {
-			found = true;
-		} else if (ctx->use_seqnum) {
-			found = !ctx->seqnum || ctx->seqnum == get_seqnum(entry_irp);
-		} else {
-			NT_ASSERT(ctx->handle);
-			found = ctx->handle == get_pipe_handle(entry_irp);
-		}
+auto peek_any(_In_ vpdo_dev_t &vpdo, _In_opt_ IRP *irp)
+{
+	auto first = irp ? pipe_bucket(vpdo, get_pipe_handle(irp)) : vpdo.irps_by_pipe;
+	auto last = vpdo.irps_by_pipe + ARRAYSIZE(vpdo.irps_by_pipe);
 
-		if (found) {
-			result = entry_irp;
-			break;
+	for (auto head = first; head != last; ++head) {
+		auto entry = irp && head == first ? list_entry(irp)->Flink : head->Flink;
+		if (entry != head) {
+			return get_irp(entry);
 		}
 	}
 
+	return static_cast<IRP*>(nullptr);
+}
+
+auto PeekNextIrp(_In_ IO_CSQ *csq, _In_ IRP *irp, _In_ PVOID context)
+{
+	auto &vpdo = *to_vpdo(csq);
+	auto ctx = static_cast<peek_context*>(context);
+
+	IRP *result{};
+
+	if (!ctx || (ctx->use_seqnum && !ctx->seqnum)) {
+		result = peek_any(vpdo, irp);
+	} else if (ctx->use_seqnum) {
+		result = peek_seqnum(vpdo, irp, ctx->seqnum);
+	} else {
+		NT_ASSERT(ctx->handle);
+		result = peek_pipe(vpdo, irp, ctx->handle);
+	}
+
 	if (!ctx) {
 		TraceCSQ("%04x", ptr4log(result));
 	} else if (!ctx->use_seqnum) {
@@ -131,7 +192,11 @@ PAGEABLE NTSTATUS init_queue(_Inout_ vpdo_dev_t &vpdo)
 {
 	PAGED_CODE();
 
-	InitializeListHead(&vpdo.irps);
+	for (auto &head: vpdo.irps_by_pipe) {
+		InitializeListHead(&head);
+	}
+	RtlZeroMemory(vpdo.irps_by_seqnum, sizeof(vpdo.irps_by_seqnum));
+
 	KeInitializeSpinLock(&vpdo.irps_lock);
 
 	return IoCsqInitialize(&vpdo.irps_csq,
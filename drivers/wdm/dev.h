@@ -4,6 +4,7 @@
 
 #include <libdrv\pageable.h>
 #include <libdrv\usbdsc.h>
+#include <libdrv\pdu_stream.h>
 
 #include <ntddk.h>
 #include <wmilib.h>
@@ -115,6 +116,13 @@ struct vpdo_dev_t : vdev_t
 
 	USB_CONFIGURATION_DESCRIPTOR *actconfig; // NULL if unconfigured
 
+	// descriptors read on plugin complete GET_DESCRIPTOR, @see internal_ioctl.cpp, find_fetched_descriptor
+	USB_CONFIGURATION_DESCRIPTOR *config0; // index 0, actconfig is replaced by SELECT_CONFIGURATION
+	ULONG fetched_strings; // bitmask of strings[] indexes
+	USHORT strings_lang_id; // of fetched strings except index 0
+	LONG64 descr_hits;
+	LONG64 descr_misses;
+
 	UCHAR current_intf_num;
 	UCHAR current_intf_alt;
 	ULONG current_frame_number;
@@ -128,11 +136,16 @@ struct vpdo_dev_t : vdev_t
 
 	using received_fn = NTSTATUS (wsk_context&);
 	received_fn *received;
-	size_t receive_size;
+	size_t receive_size; // zero if any number of bytes is acceptable
+	recv_buffer rxbuf; // @see wsk_receive.cpp, recv_buffered
 
 	IO_CSQ irps_csq;
-	LIST_ENTRY irps;
 	KSPIN_LOCK irps_lock;
+
+	// @see csq.cpp
+	enum { IRPS_SEQNUM_BUCKETS = 256, IRPS_PIPE_BUCKETS = 32 }; // powers of two
+	IRP *irps_by_seqnum[IRPS_SEQNUM_BUCKETS]; // singly linked via get_next_irp()
+	LIST_ENTRY irps_by_pipe[IRPS_PIPE_BUCKETS]; // IRP.Tail.Overlay.ListEntry
 };
 
 /*
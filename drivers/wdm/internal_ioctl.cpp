@@ -428,6 +428,75 @@ NTSTATUS class_other(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
         return control_vendor_class_request(vpdo, irp, urb, USB_TYPE_CLASS, USB_RECIP_OTHER);
 }
 
+/*
+ * Descriptors read by fetch_descriptors are not modified and freed until the device is removed.
+ * @param len bLength or wTotalLength of the descriptor
+ * @return the descriptor that completes the request
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+const void *find_fetched_descriptor(
+        _In_ const vpdo_dev_t &vpdo, _In_ const _URB_CONTROL_DESCRIPTOR_REQUEST &r, _Out_ USHORT &len)
+{
+        len = 0;
+
+        switch (auto idx = r.Index; r.DescriptorType) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+                if (!(idx || r.LanguageId)) {
+                        len = vpdo.descriptor.bLength;
+                        return &vpdo.descriptor;
+                }
+                break;
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+                if (auto cd = vpdo.config0; cd && !(idx || r.LanguageId)) {
+                        len = cd->wTotalLength;
+                        return cd;
+                }
+                break;
+        case USB_STRING_DESCRIPTOR_TYPE:
+                if (idx < ARRAYSIZE(vpdo.strings) && vpdo.fetched_strings & (1UL << idx) && 
+                    r.LanguageId == (idx ? vpdo.strings_lang_id : 0)) {
+                        auto sd = vpdo.strings[idx];
+                        len = sd->bLength;
+                        return sd;
+                }
+                break;
+        }
+
+        return nullptr;
+}
+
+/*
+ * Completes GET_DESCRIPTOR without a round trip to a server if the descriptor was read on plugin.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_fetched_descriptor(_Inout_ vpdo_dev_t &vpdo, _Inout_ URB &urb)
+{
+        auto &r = urb.UrbControlDescriptorRequest;
+        USHORT len;
+
+        auto dsc = r.TransferBufferLength ? find_fetched_descriptor(vpdo, r, len) : nullptr;
+
+        void *buf = !dsc ? nullptr : 
+                    r.TransferBufferMDL ? MmGetSystemAddressForMdlSafe(r.TransferBufferMDL, LowPagePriority | MdlMappingNoExecute) : 
+                    r.TransferBuffer;
+
+        if (!buf) {
+                InterlockedIncrement64(&vpdo.descr_misses);
+                return false;
+        }
+
+        r.TransferBufferLength = min(r.TransferBufferLength, ULONG(len));
+        RtlCopyMemory(buf, dsc, r.TransferBufferLength);
+
+        urb.UrbHeader.Status = USBD_STATUS_SUCCESS;
+        InterlockedIncrement64(&vpdo.descr_hits);
+
+        TraceUrb("%!usb_descriptor_type!, Index %d, %lu bytes from fetched descriptor", 
+                  r.DescriptorType, r.Index, r.TransferBufferLength);
+
+        return true;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
 NTSTATUS control_descriptor_request(vpdo_dev_t &vpdo, IRP *irp, URB &urb, bool dir_in, UCHAR recipient)
@@ -438,6 +507,10 @@ NTSTATUS control_descriptor_request(vpdo_dev_t &vpdo, IRP *irp, URB &urb, bool d
                 urb_function_str(r.Hdr.Function), r.TransferBufferLength, r.TransferBufferLength,
                 r.Index, r.DescriptorType, r.LanguageId);
 
+        if (dir_in && recipient == USB_RECIP_DEVICE && get_fetched_descriptor(vpdo, urb)) {
+                return STATUS_SUCCESS;
+        }
+
         auto ctx = new_wsk_context(vpdo, irp);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
@@ -69,6 +69,16 @@ inline auto& get_pipe_handle(_In_ IRP *irp)
 	return *static_cast<USBD_PIPE_HANDLE*>(irp->Tail.Overlay.DriverContext + 1);
 }
 
+/*
+ * Next IRP in the same bucket of vpdo_dev_t.irps_by_seqnum.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_next_irp(_In_ IRP *irp)
+{
+	NT_ASSERT(irp);
+	return *reinterpret_cast<IRP**>(irp->Tail.Overlay.DriverContext + 2);
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 inline auto atomic_set_status(_In_ IRP *irp, _In_ irp_status_t status)
 {
@@ -40,11 +40,11 @@ NTSTATUS make_transfer_buffer_mdl(_Out_ Mdl &mdl, _In_ ULONG mdl_size, _In_ bool
 _IRQL_requires_max_(DISPATCH_LEVEL)
 inline auto verify(_In_ const WSK_BUF &buf, _In_ bool exact)
 {
-	if (buf.Offset || !buf.Length) {
+	if (!(buf.Mdl && buf.Length && buf.Offset < MmGetMdlByteCount(buf.Mdl))) {
 		return false;
 	}
 
-	auto sz = size(buf.Mdl);
+	auto sz = size(buf.Mdl) - buf.Offset;
 	return exact ? buf.Length == sz : buf.Length <= sz;
 }
 
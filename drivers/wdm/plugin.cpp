@@ -204,6 +204,10 @@ PAGEABLE auto create_vpdo(vpdo_dev_t* &vpdo, vhub_dev_t *vhub, const ioctl_usbip
                 return make_error(ERR_GENERAL);
         }
 
+        if (alloc_recv_buffer(*vpdo)) {
+                return make_error(ERR_GENERAL);
+        }
+
         if (init(*vpdo, r)) {
                 return make_error(ERR_GENERAL);
         }
@@ -293,126 +297,238 @@ PAGEABLE auto init_req_get_descr(
         return true;
 }
 
+/*
+ * Lengths of speculative GET_DESCRIPTOR requests, short responses are accepted.
+ * This saves a round trip to read the header of a descriptor to learn its length.
+ */
+enum : USHORT { 
+        SPECULATIVE_CONFIG_LEN = 4096, 
+        SPECULATIVE_STRING_LEN = MAXUCHAR // bLength is UCHAR
+};
+
+union string_descr_buf
+{
+        USB_STRING_DESCRIPTOR sd;
+        UCHAR buf[SPECULATIVE_STRING_LEN];
+};
+
+/*
+ * @see read_descriptors
+ */
+struct descr_request
+{
+        UCHAR type;
+        UCHAR index;
+        USHORT lang_id; // Zero or Language ID for string descriptor
+
+        usbip::memory pool; // of buf
+        void *buf;
+        USHORT len; // in: size of buf, out: actual length
+
+        seqnum_t seqnum; // zero if was not sent or already received
+        INT32 status; // of USBIP_RET_SUBMIT
+};
+
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_descr_hdr(vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, _Inout_ USHORT &TransferBufferLength)
+PAGEABLE auto send_req_get_descr(vpdo_dev_t &vpdo, _Inout_ descr_request &r)
 {
         PAGED_CODE();
 
         usbip_header hdr{};
-        if (!init_req_get_descr(hdr, vpdo, type, index, lang_id, TransferBufferLength)) {
+        if (!init_req_get_descr(hdr, vpdo, r.type, r.index, r.lang_id, r.len)) {
                 return ERR_GENERAL;
         }
 
+        r.seqnum = hdr.base.seqnum;
+
         char buf[DBG_USBIP_HDR_BUFSZ];
         TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "OUT %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
 
         byteswap_header(hdr, swap_dir::host2net);
 
         if (auto err = send(vpdo.sock, usbip::memory::stack, &hdr, sizeof(hdr))) {
-                Trace(TRACE_LEVEL_ERROR, "Send header of %!usb_descriptor_type! %!STATUS!", type, err);
+                Trace(TRACE_LEVEL_ERROR, "Send header of %!usb_descriptor_type! %!STATUS!", r.type, err);
                 return ERR_NETWORK;
         }
 
+        return ERR_NONE;
+}
+
+/*
+ * Receive USBIP_RET_SUBMIT and its payload into the buffer of the request with the same seqnum.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto recv_ret_get_descr(vpdo_dev_t &vpdo, _Inout_updates_(cnt) descr_request *reqs, _In_ int cnt)
+{
+        PAGED_CODE();
+
+        usbip_header hdr{};
         if (auto err = recv(vpdo.sock, usbip::memory::stack, &hdr, sizeof(hdr))) {
-                Trace(TRACE_LEVEL_ERROR, "Recv header of %!usb_descriptor_type! %!STATUS!", type, err);
+                Trace(TRACE_LEVEL_ERROR, "Recv header %!STATUS!", err);
                 return ERR_NETWORK;
         }
 
         byteswap_header(hdr, swap_dir::net2host);
+
+        char buf[DBG_USBIP_HDR_BUFSZ];
         TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "IN %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
 
         auto &b = hdr.base;
-        if (!(b.command == USBIP_RET_SUBMIT && extract_num(b.seqnum) == vpdo.seqnum)) {
+        if (!(b.command == USBIP_RET_SUBMIT && is_valid_seqnum(b.seqnum))) {
                 return ERR_PROTOCOL;
         }
 
+        descr_request *r{};
+        for (int i = 0; i < cnt && !r; ++i) {
+                if (reqs[i].seqnum == b.seqnum) {
+                        r = reqs + i;
+                }
+        }
+
         auto &ret = hdr.u.ret_submit;
-        auto actual_length = static_cast<USHORT>(ret.actual_length);
 
-        if (actual_length <= TransferBufferLength) {
-                TransferBufferLength = actual_length;
-        } else {
-                TransferBufferLength = 0;
-                return ERR_GENERAL;
+        if (!r) {
+                Trace(TRACE_LEVEL_ERROR, "Unexpected seqnum %u", b.seqnum);
+                return ERR_PROTOCOL;
+        } else if (!(ret.actual_length >= 0 && ret.actual_length <= r->len)) {
+                Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, actual_length %d > %d", r->type, ret.actual_length, r->len);
+                return ERR_PROTOCOL;
+        }
+
+        r->seqnum = 0;
+        r->status = ret.status;
+        r->len = static_cast<USHORT>(ret.actual_length);
+
+        if (!r->len) {
+                //
+        } else if (auto err = recv(vpdo.sock, r->pool, r->buf, r->len)) {
+                Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, length %d -> %!STATUS!", r->type, r->len, err);
+                return ERR_NETWORK;
         }
 
-        return ret.status ? ERR_GENERAL : ERR_NONE;
+        return ERR_NONE;
 }
 
+/*
+ * All requests are sent before the first response is received, so it takes a single round trip.
+ * A request completed with nonzero status is not an error of this function.
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_descr(
-        vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, usbip::memory pool, _Out_ void *dest, _Inout_ USHORT &len)
+PAGEABLE auto read_descriptors(vpdo_dev_t &vpdo, _Inout_updates_(cnt) descr_request *reqs, _In_ int cnt)
 {
         PAGED_CODE();
 
-        if (auto err = read_descr_hdr(vpdo, type, index, lang_id, len)) {
-                return err;
+        for (int i = 0; i < cnt; ++i) {
+                if (auto err = send_req_get_descr(vpdo, reqs[i])) {
+                        return err;
+                }
         }
 
-        if (auto err = recv(vpdo.sock, pool, dest, len)) {
-                Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, length %d -> %!STATUS!", type, len, err);
-                return ERR_NETWORK;
+        for (int i = 0; i < cnt; ++i) {
+                if (auto err = recv_ret_get_descr(vpdo, reqs, cnt)) {
+                        return err;
+                }
         }
 
         return ERR_NONE;
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_device_descr(vpdo_dev_t &vpdo)
+PAGEABLE auto alloc_config_descr(USHORT len)
 {
         PAGED_CODE();
         
-        USHORT len = sizeof(vpdo.descriptor);
-
-        if (auto err = read_descr(vpdo, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, usbip::memory::nonpaged, &vpdo.descriptor, len)) {
-                return err;
+        auto cd = (USB_CONFIGURATION_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, 
+                                                                 len, USBIP_VHCI_POOL_TAG);
+        if (!cd) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %d bytes", len);
         }
 
-        return len == sizeof(vpdo.descriptor) && is_valid(vpdo.descriptor) ? ERR_NONE : ERR_GENERAL;
+        return cd;
 }
 
+/*
+ * @param r response on speculative request that uses cd as the buffer
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_config_descr(
-        _Inout_ vpdo_dev_t &vpdo, _In_ usbip::memory pool, _Out_ USB_CONFIGURATION_DESCRIPTOR *cd, _Inout_ USHORT &len)
+PAGEABLE auto read_config_descr(vpdo_dev_t &vpdo, _In_ const descr_request &r, _In_ USB_CONFIGURATION_DESCRIPTOR *cd)
 {
         PAGED_CODE();
-        NT_ASSERT(len >= sizeof(*cd));
+        NT_ASSERT(!vpdo.actconfig);
+        NT_ASSERT(r.buf == cd);
+
+        if (!(!r.status && r.len >= sizeof(*cd) && is_valid(*cd))) {
+                Trace(TRACE_LEVEL_ERROR, "USB_CONFIGURATION_DESCRIPTOR expected, status %d, length %d", r.status, r.len);
+                return ERR_GENERAL;
+        }
+
+        log(*cd);
+        auto total = cd->wTotalLength;
+
+        if (r.len == total) {
+                if (!(vpdo.actconfig = alloc_config_descr(total))) {
+                        return ERR_GENERAL;
+                }
+                RtlCopyMemory(vpdo.actconfig, cd, total);
+                return ERR_NONE;
+        } else if (!(r.len == SPECULATIVE_CONFIG_LEN && total > r.len)) {
+                Trace(TRACE_LEVEL_ERROR, "wTotalLength %d, length %d", total, r.len);
+                return ERR_GENERAL;
+        }
+
+        TraceDbg("wTotalLength %d is greater than speculative length", total); // one more round trip
 
-        if (auto err = read_descr(vpdo, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, pool, cd, len)) {
+        if (!(vpdo.actconfig = alloc_config_descr(total))) {
+                return ERR_GENERAL;
+        }
+
+        descr_request full{ USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, usbip::memory::nonpaged, vpdo.actconfig, total };
+
+        if (auto err = read_descriptors(vpdo, &full, 1)) {
                 return err;
         }
 
-        return len >= sizeof(*cd) && is_valid(*cd) ? ERR_NONE : ERR_GENERAL;
+        return !full.status && full.len == total && is_valid(*vpdo.actconfig) && 
+                vpdo.actconfig->wTotalLength == total ? ERR_NONE : ERR_GENERAL;
 }
 
+/*
+ * Save a copy of the descriptor in vpdo.strings[idx], empty string is skipped.
+ * It will complete GET_DESCRIPTOR requests for this string, @see vpdo_dev_t::fetched_strings.
+ * @param len actual length of the response
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_config_descr(vpdo_dev_t &vpdo)
+PAGEABLE auto save_string_descr(vpdo_dev_t &vpdo, _In_ UCHAR idx, _In_ const USB_STRING_DESCRIPTOR &d, _In_ USHORT len)
 {
         PAGED_CODE();
 
-        USB_CONFIGURATION_DESCRIPTOR cd{};
-        USHORT len = sizeof(cd);
-
-        if (auto err = read_config_descr(vpdo, usbip::memory::stack, &cd, len)) {
-                return err;
+        if (!(len >= sizeof(USB_COMMON_DESCRIPTOR) && is_valid(d) && d.bLength <= len)) { // string length can be zero
+                Trace(TRACE_LEVEL_ERROR, "Index %d, USB_STRING_DESCRIPTOR expected, length %d", idx, len);
+                return ERR_GENERAL;
         }
 
-        log(cd);
-        len = cd.wTotalLength;
+        len = d.bLength;
+        if (len == sizeof(USB_COMMON_DESCRIPTOR)) {
+                TraceDbg("Index %d, skip empty string", idx);
+                return ERR_NONE;
+        }
 
-        NT_ASSERT(!vpdo.actconfig);
-        vpdo.actconfig = (USB_CONFIGURATION_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, 
-                                                                        len, USBIP_VHCI_POOL_TAG);
+        auto sz = len + sizeof(*d.bString); // + L'\0'
 
-        if (!vpdo.actconfig) {
+        auto sd = (USB_STRING_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, sz, USBIP_VHCI_POOL_TAG);
+        if (!sd) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
                 return ERR_GENERAL;
         }
 
-        if (auto err = read_config_descr(vpdo, usbip::memory::nonpaged, vpdo.actconfig, len)) {
-                return err;
-        }
+        RtlCopyMemory(sd, &d, len);
+        terminate_by_zero(*sd);
 
-        return len == cd.wTotalLength ? ERR_NONE : ERR_GENERAL;
+        NT_ASSERT(!vpdo.strings[idx]);
+        vpdo.strings[idx] = sd;
+        vpdo.fetched_strings |= 1UL << idx;
+
+        return ERR_NONE;
 }
 
 /*
@@ -420,78 +536,109 @@ PAGEABLE auto read_config_descr(vpdo_dev_t &vpdo)
  * But some devices return EPROTO and fail all requests after that with this error.
  * For this reason read existing strings only. 
  * String index 0 should return a list of supported languages (always exists?).
+ * 
+ * All strings are requested at once after the list of supported languages is read.
+ * @param langs response on request of the string with index 0
  */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_string_descriptors(vpdo_dev_t &vpdo)
+PAGEABLE auto read_string_descriptors(vpdo_dev_t &vpdo, _In_ const descr_request &langs)
 {
         PAGED_CODE();
 
+        if (langs.status) { 
+                return ERR_NONE; // EPIPE?
+        } else if (auto err = save_string_descr(vpdo, 0, *static_cast<USB_STRING_DESCRIPTOR*>(langs.buf), langs.len)) {
+                return err;
+        }
+
+        USHORT lang_id = 0;
+
+        if (auto sd = vpdo.strings[0]) {
+                TraceMsg("List of supported languages%!BIN!", WppBinary(sd, sd->bLength));
+                lang_id = *sd->bString; // Supported Language Code Zero, f.e. 0x0409 English - United States
+        }
+
+        vpdo.strings_lang_id = lang_id;
+
         auto &dd = vpdo.descriptor;
 
-        UCHAR indexes[] { 0, dd.iManufacturer, dd.iProduct, dd.iSerialNumber, 
+        UCHAR indexes[] { dd.iManufacturer, dd.iProduct, dd.iSerialNumber, 
                           vpdo.actconfig ? vpdo.actconfig->iConfiguration : UCHAR(0) };
 
-        for (USHORT lang_id = 0; auto &idx: indexes) {
+        auto dup = [&indexes] (auto &idx)
+        {
+                for (auto i = indexes; i != &idx; ++i) {
+                        if (*i == idx) {
+                                return true;
+                        }
+                }
+                return false;
+        };
+
+        descr_request reqs[ARRAYSIZE(indexes)];
+        int cnt = 0;
 
-                if (!idx && lang_id) {
+        for (auto &idx: indexes) {
+                if (!idx || dup(idx)) {
                         continue;
                 } else if (idx >= ARRAYSIZE(vpdo.strings)) {
                         TraceMsg("Can't save index %d in strings[%d]", idx, ARRAYSIZE(vpdo.strings));
                         continue;
                 }
 
-                USB_STRING_DESCRIPTOR hdr;
-                USHORT len = sizeof(hdr);
+                reqs[cnt++] = { USB_STRING_DESCRIPTOR_TYPE, idx, lang_id, usbip::memory::nonpaged };
+        }
 
-                if (auto err = read_descr(vpdo, USB_STRING_DESCRIPTOR_TYPE, idx, lang_id, usbip::memory::stack, &hdr, len)) {
-                        break; // EPIPE?
-                }
+        if (!cnt) {
+                return ERR_NONE;
+        }
 
-                if (!(len >= sizeof(USB_COMMON_DESCRIPTOR) && is_valid(hdr))) { // string length can be zero
-                        Trace(TRACE_LEVEL_ERROR, "USB_STRING_DESCRIPTOR expected, length %d", len);
-                        return ERR_GENERAL;
-                }
+        auto bufs = (string_descr_buf*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, 
+                                                        cnt*sizeof(*bufs), USBIP_VHCI_POOL_TAG);
+        if (!bufs) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", cnt*sizeof(*bufs));
+                return ERR_GENERAL;
+        }
 
-                len = hdr.bLength;
-                if (len == sizeof(USB_COMMON_DESCRIPTOR)) {
-                        TraceDbg("Index %d, skip empty string", idx);
-                        continue;
-                }
+        for (int i = 0; i < cnt; ++i) {
+                reqs[i].buf = bufs + i;
+                reqs[i].len = sizeof(*bufs);
+        }
 
-                auto sz = len + sizeof(*hdr.bString); // + L'\0'
+        auto err = read_descriptors(vpdo, reqs, cnt);
 
-                auto sd = (USB_STRING_DESCRIPTOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, sz, USBIP_VHCI_POOL_TAG);
-                if (!sd) {
-                        Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
-                        return ERR_GENERAL;
-                }
+        for (int i = 0; i < cnt && !err; ++i) {
+                auto &r = reqs[i];
 
-                if (len <= sizeof(hdr)) {
-                        RtlCopyMemory(sd, &hdr, len);
-                } else if (auto err = read_descr(vpdo, USB_STRING_DESCRIPTOR_TYPE, idx, lang_id, usbip::memory::nonpaged, sd, len)) {
-                        ExFreePoolWithTag(sd, USBIP_VHCI_POOL_TAG);
-                        return err;
+                if (r.status) {
+                        TraceDbg("Index %d, status %d", r.index, r.status); // EPIPE?
+                } else if (!(err = save_string_descr(vpdo, r.index, bufs[i].sd, r.len))) {
+                        if (auto sd = vpdo.strings[r.index]) {
+                                TraceMsg("Index %d, LangId %#x, '%!WSTR!'", r.index, lang_id, sd->bString);
+                        }
                 }
+        }
 
-                if (len == hdr.bLength && is_valid(*sd) && sd->bLength == len) {
-                        terminate_by_zero(*sd);
-                        NT_ASSERT(!vpdo.strings[idx]);
-                        vpdo.strings[idx] = sd;
-                } else {
-                        Trace(TRACE_LEVEL_ERROR, "length %d", len);
-                        ExFreePoolWithTag(sd, USBIP_VHCI_POOL_TAG);
-                        return ERR_GENERAL;
-                }
+        ExFreePoolWithTag(bufs, USBIP_VHCI_POOL_TAG);
+        return err;
+}
 
-                if (idx) {
-                        TraceMsg("Index %d, LangId %#x, '%!WSTR!'", idx, lang_id, sd->bString);
-                } else {
-                        TraceMsg("List of supported languages%!BIN!", WppBinary(sd, sd->bLength));
-                        lang_id = *sd->bString; // Supported Language Code Zero, f.e. 0x0409 English - United States
-                }
-        }
+/*
+ * The copy will complete GET_DESCRIPTOR requests for configuration descriptor with index 0.
+ * Failure is not an error, such requests will be sent to a server.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void save_config_descr(vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+        NT_ASSERT(!vpdo.config0);
 
-        return ERR_NONE;
+        auto &cd = *vpdo.actconfig;
+
+        if (auto ptr = alloc_config_descr(cd.wTotalLength)) {
+                RtlCopyMemory(ptr, &cd, cd.wTotalLength);
+                vpdo.config0 = ptr;
+        }
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -506,15 +653,37 @@ PAGEABLE void init(vpdo_dev_t &vpdo, const USB_DEVICE_DESCRIPTOR &d)
         vpdo.bDeviceProtocol = d.bDeviceProtocol;
 }
 
+/*
+ * Device and configuration descriptors, and the list of supported languages are read in a single round trip. 
+ * Strings are read in the second one.
+ * 
+ * Repeated GET_DESCRIPTOR requests of the hub driver and function drivers for these descriptors 
+ * are completed from the saved copies, @see internal_ioctl.cpp, find_fetched_descriptor.
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
+PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev, _Inout_ USB_CONFIGURATION_DESCRIPTOR *cd)
 {
         PAGED_CODE();
 
-        if (auto err = read_device_descr(vpdo)) {
+        string_descr_buf langs;
+
+        descr_request reqs[] {
+                { USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, usbip::memory::nonpaged, &vpdo.descriptor, sizeof(vpdo.descriptor) },
+                { USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, usbip::memory::nonpaged, cd, SPECULATIVE_CONFIG_LEN },
+                { USB_STRING_DESCRIPTOR_TYPE, 0, 0, usbip::memory::stack, &langs, sizeof(langs) },
+        };
+
+        if (auto err = read_descriptors(vpdo, reqs, ARRAYSIZE(reqs))) {
                 return err;
         }
 
+        auto &[dev, cfg, lang] = reqs;
+
+        if (!(!dev.status && dev.len == sizeof(vpdo.descriptor) && is_valid(vpdo.descriptor))) {
+                Trace(TRACE_LEVEL_ERROR, "USB_DEVICE_DESCRIPTOR expected, status %d, length %d", dev.status, dev.len);
+                return ERR_GENERAL;
+        }
+
         log(vpdo.descriptor);
 
         if (is_same_device(udev, vpdo.descriptor)) {
@@ -524,7 +693,7 @@ PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
                 return ERR_GENERAL;
         }
 
-        if (auto err = read_config_descr(vpdo)) {
+        if (auto err = read_config_descr(vpdo, cfg, cd)) {
                 if (auto &ptr = vpdo.actconfig) {
                         ExFreePoolWithTag(ptr, USBIP_VHCI_POOL_TAG);
                         ptr = nullptr;
@@ -539,13 +708,34 @@ PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
                 return ERR_GENERAL;
         }
 
-        if (auto err = read_string_descriptors(vpdo)) {
+        save_config_descr(vpdo);
+
+        if (auto err = read_string_descriptors(vpdo, lang)) {
                 return err;
         }
 
         return set_class_subclass_proto(vpdo);
 }
 
+/*
+ * @see fetch_descriptors
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
+{
+        PAGED_CODE();
+
+        auto cd = alloc_config_descr(SPECULATIVE_CONFIG_LEN);
+        if (!cd) {
+                return ERR_GENERAL;
+        }
+
+        auto err = fetch_descriptors(vpdo, udev, cd);
+
+        ExFreePoolWithTag(cd, USBIP_VHCI_POOL_TAG);
+        return err;
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE auto import_remote_device(vpdo_dev_t &vpdo)
 {
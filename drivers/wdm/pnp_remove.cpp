@@ -15,6 +15,7 @@
 #include "wmi.h"
 #include "vhub.h"
 #include "csq.h"
+#include "wsk_receive.h"
 
 namespace
 {
@@ -157,10 +158,19 @@ PAGEABLE void destroy(vpdo_dev_t &vpdo)
 		wi = nullptr;
 	}
 
+	free_recv_buffer(vpdo);
+
 	if (vpdo.actconfig) {
 		ExFreePoolWithTag(vpdo.actconfig, USBIP_VHCI_POOL_TAG);
                 vpdo.actconfig = nullptr;
 	}
+
+	if (vpdo.config0) {
+		ExFreePoolWithTag(vpdo.config0, USBIP_VHCI_POOL_TAG);
+		vpdo.config0 = nullptr;
+	}
+
+	TraceDbg("GET_DESCRIPTOR from fetched descriptors: hits %I64d, misses %I64d", vpdo.descr_hits, vpdo.descr_misses);
 }
 
 auto set_parent_null(_In_ vdev_t *child, _In_ vdev_t *parent)
@@ -9,6 +9,7 @@
 
 #include <libdrv\usbd_helper.h>
 #include <libdrv\dbgcommon.h>
+#include <libdrv\pdu_stream.h>
 
 #include "dev.h"
 #include "urbtransfer.h"
@@ -44,6 +45,58 @@ inline auto& get_ret_submit(_In_ const wsk_context &ctx)
 	return hdr.u.ret_submit;
 }
 
+/*
+ * Copy a part of a payload into the MDL chain of WSK_BUF.
+ * On return, WSK_BUF describes the rest of the payload.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS copy(_Inout_ WSK_BUF &buf, _In_ const UCHAR *src, _In_ ULONG len)
+{
+	NT_ASSERT(len <= buf.Length);
+
+	while (len) {
+
+		auto &mdl = buf.Mdl;
+		auto mdl_len = MmGetMdlByteCount(mdl);
+
+		auto dst = static_cast<UCHAR*>(MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+		if (!dst) {
+			Trace(TRACE_LEVEL_ERROR, "MmGetSystemAddressForMdlSafe -> NULL");
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		auto cnt = min(len, mdl_len - ULONG(buf.Offset));
+		RtlCopyMemory(dst + buf.Offset, src, cnt);
+
+		src += cnt;
+		buf.Length -= cnt;
+		len -= cnt;
+
+		if ((buf.Offset += cnt) == mdl_len) {
+			mdl = mdl->Next;
+			buf.Offset = 0;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Copy already received part of a payload, @see copy.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto copy_buffered(_Inout_ WSK_BUF &buf, _Inout_ recv_buffer &rx)
+{
+	auto len = ULONG(min(buf.Length, rx.size()));
+
+	auto err = copy(buf, rx.ptr(), len);
+	if (!err) {
+		rx.head += len;
+	}
+
+	return err;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto select_config(_In_ vpdo_dev_t &vpdo, _Inout_ _URB_SELECT_CONFIGURATION *r)
 {
@@ -728,9 +781,10 @@ NTSTATUS on_receive(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inex
 
 	auto ok = NT_SUCCESS(st.Status);
 
-	auto err = ok && st.Information == vpdo->receive_size ? vpdo->received(ctx) :
-		   ok ? STATUS_RECEIVE_PARTIAL : 
-		   st.Status; // has nonzero severity code
+	auto err = !ok ? st.Status : // has nonzero severity code
+		   !st.Information ? STATUS_CONNECTION_DISCONNECTED : // EOF
+		   !vpdo->receive_size || st.Information == vpdo->receive_size ? vpdo->received(ctx) :
+		   STATUS_RECEIVE_PARTIAL;
 
 	switch (err) {
 	case RECV_NEXT_USBIP_HDR:
@@ -759,15 +813,19 @@ NTSTATUS on_receive(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inex
 
 /*
  * @param received will be called if requested number of bytes are received without error
+ * @param flags if WSK_FLAG_WAITALL is not set, any number of bytes is acceptable
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void receive(_In_ WSK_BUF &buf, _In_ vpdo_dev_t::received_fn received, _In_ wsk_context &ctx)
+void receive(_In_ WSK_BUF &buf, _In_ vpdo_dev_t::received_fn received, _In_ wsk_context &ctx, 
+	_In_ ULONG flags = WSK_FLAG_WAITALL)
 {
-	NT_ASSERT(usbip::verify(buf, ctx.is_isoc));
+	bool waitall = flags & WSK_FLAG_WAITALL;
+
+	NT_ASSERT(usbip::verify(buf, waitall && ctx.is_isoc));
 	auto &vpdo = *ctx.vpdo;
 
-	vpdo.receive_size = buf.Length; // checked by verify()
+	vpdo.receive_size = waitall ? buf.Length : 0; // checked by verify()
 
 	NT_ASSERT(received);
 	vpdo.received = received;
@@ -777,7 +835,7 @@ void receive(_In_ WSK_BUF &buf, _In_ vpdo_dev_t::received_fn received, _In_ wsk_
 	auto wsk_irp = ctx.wsk_irp; // do not access ctx or wsk_irp after send
 	IoSetCompletionRoutine(wsk_irp, on_receive, &ctx, true, true, true);
 
-	auto err = receive(ctx.vpdo->sock, &buf, WSK_FLAG_WAITALL, wsk_irp);
+	auto err = receive(ctx.vpdo->sock, &buf, flags, wsk_irp);
 	NT_ASSERT(err != STATUS_NOT_SUPPORTED);
 
 	TraceWSK("wsk irp %04x, %!STATUS!", ptr4log(wsk_irp), err);
@@ -787,7 +845,16 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(vpdo_dev_t::received_fn)
 NTSTATUS drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 {
-	if (ULONG(length) != length) {
+	auto &rx = ctx.vpdo->rxbuf;
+	{
+		auto cnt = ULONG(min(length, rx.size()));
+		rx.head += cnt;
+		length -= cnt;
+	}
+
+	if (!length) {
+		return RECV_NEXT_USBIP_HDR;
+	} else if (ULONG(length) != length) {
 		Trace(TRACE_LEVEL_ERROR, "Buffer size truncation: ULONG(%lu) != size_t(%Iu)", ULONG(length), length);
 		return STATUS_INVALID_PARAMETER;
 	}
@@ -829,7 +896,16 @@ NTSTATUS recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 		return err;
 	}
 
-	receive(buf, ret_submit, ctx);
+	if (auto err = copy_buffered(buf, ctx.vpdo->rxbuf)) {
+		NT_ASSERT(err != RECV_MORE_DATA_REQUIRED);
+		return err;
+	}
+
+	if (!buf.Length) {
+		return ret_submit(ctx);
+	}
+
+	receive(buf, ret_submit, ctx); // zero copy for the rest of the payload
 	return RECV_MORE_DATA_REQUIRED;
 }
 
@@ -870,38 +946,66 @@ NTSTATUS ret_command(_Inout_ wsk_context &ctx)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto validate_header(_Inout_ usbip_header &hdr)
 {
-	byteswap_header(hdr, swap_dir::net2host);
-
-	auto &base = hdr.base;
-	auto cmd = static_cast<usbip_request_type>(base.command);
+	auto st = validate_ret_header(hdr);
 
-	switch (cmd) {
-	case USBIP_RET_SUBMIT: {
-		auto &ret = hdr.u.ret_submit;
-		if (ret.number_of_packets == number_of_packets_non_isoch) {
-			ret.number_of_packets = 0;
-		} else if (!is_valid_number_of_packets(ret.number_of_packets)) {
-			return false;
-		}
-	}	break;
-	case USBIP_RET_UNLINK:
+	switch (st) {
+	case RET_HDR_OK:
+		break;
+	case RET_HDR_BAD_COMMAND:
+		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", 
+			static_cast<usbip_request_type>(hdr.base.command));
+		break;
+	case RET_HDR_BAD_NUMBER_OF_PACKETS:
+		Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) is out of range", hdr.u.ret_submit.number_of_packets);
+		break;
+	case RET_HDR_BAD_SEQNUM:
+		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", hdr.base.seqnum);
 		break;
-	default:
-		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", cmd);
-		return false;
 	}
 
-	auto ok = is_valid_seqnum(base.seqnum);
+	return st == RET_HDR_OK;
+}
 
-	if (ok) {
-		base.direction = extract_dir(base.seqnum); // always zero in server response
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", base.seqnum);
+/*
+ * Parse as many PDUs as received.
+ * Payloads are copied from the buffer, the rest of a payload that was not received yet 
+ * is read directly into URB buffer, @see recv_payload.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Function_class_(vpdo_dev_t::received_fn)
+NTSTATUS recv_buffered(_Inout_ wsk_context &ctx)
+{
+	auto &vpdo = *ctx.vpdo;
+	auto &rx = vpdo.rxbuf;
+
+	rx.tail += ULONG(ctx.wsk_irp->IoStatus.Information);
+	NT_ASSERT(rx.tail <= rx.SIZE);
+
+	while (rx.size() >= sizeof(ctx.hdr) && !vpdo.unplugged) {
+
+		NT_ASSERT(!ctx.irp); // must be completed and zeroed on every cycle
+		ctx.mdl_buf.reset();
+		ctx.is_isoc = false; // prepare_isoc sets it for RET_SUBMIT with payload
+
+		ULONG received = 0;
+		NT_VERIFY(take_header(rx, ctx.hdr, received));
+
+		if (!validate_header(ctx.hdr)) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		if (auto st = ret_command(ctx); st != RECV_NEXT_USBIP_HDR) {
+			return st;
+		}
 	}
 
-	return ok;
+	return RECV_NEXT_USBIP_HDR;
 }
 
+/*
+ * Reads as many bytes as available (up to recv_buffer::SIZE) instead of usbip_header only,
+ * so back-to-back responses cost one receive IRP and one work item.
+ */
 _Function_class_(IO_WORKITEM_ROUTINE)
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
@@ -912,15 +1016,13 @@ void receive_usbip_header(_In_ DEVICE_OBJECT*, _In_opt_ void *Context)
 	NT_ASSERT(!ctx.irp); // must be completed and zeroed on every cycle
 	ctx.mdl_buf.reset();
 
-	ctx.mdl_hdr.next(nullptr);
-	WSK_BUF buf{ ctx.mdl_hdr.get(), 0, sizeof(ctx.hdr) };
+	auto &rx = ctx.vpdo->rxbuf;
+	NT_ASSERT(rx.size() < sizeof(ctx.hdr));
 
-	auto received = [] (auto &ctx)
-	{
-		return validate_header(ctx.hdr) ? ret_command(ctx) : STATUS_INVALID_PARAMETER;
-	};
+	auto len = compact(rx);
 
-	receive(buf, received, ctx);
+	WSK_BUF buf{ rx.mdl, rx.tail, len };
+	receive(buf, recv_buffered, ctx, 0);
 }
 
 } // namespace
@@ -942,6 +1044,7 @@ NTSTATUS WskDisconnectEvent(_In_opt_ PVOID SocketContext, _In_ ULONG Flags)
  * When executing at IRQL = DISPATCH_LEVEL, this can also lead to starvation of other threads.
  *
  * For this reason work queue is used here, but reading of payload does not use it and it's OK.
+ * A receive of the header reads as many PDUs as available, @see recv_buffered.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void sched_receive_usbip_header(_In_ wsk_context *ctx)
@@ -952,3 +1055,46 @@ void sched_receive_usbip_header(_In_ wsk_context *ctx)
 	const auto QueueType = static_cast<WORK_QUEUE_TYPE>(CustomPriorityWorkQueue + LOW_REALTIME_PRIORITY);
 	IoQueueWorkItem(vpdo->workitem, receive_usbip_header, QueueType, ctx);
 }
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS alloc_recv_buffer(_Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+
+	auto &buf = vpdo.rxbuf;
+	NT_ASSERT(!buf.data);
+
+	buf.data = (UCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, buf.SIZE, USBIP_VHCI_POOL_TAG);
+	if (!buf.data) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", buf.SIZE);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	buf.mdl = IoAllocateMdl(buf.data, buf.SIZE, false, false, nullptr);
+	if (!buf.mdl) {
+		Trace(TRACE_LEVEL_ERROR, "IoAllocateMdl -> NULL");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	MmBuildMdlForNonPagedPool(buf.mdl);
+	buf.head = buf.tail = 0;
+
+	return STATUS_SUCCESS;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_recv_buffer(_Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+	auto &buf = vpdo.rxbuf;
+
+	if (auto &mdl = buf.mdl) {
+		IoFreeMdl(mdl);
+		mdl = nullptr;
+	}
+
+	if (auto &data = buf.data) {
+		ExFreePoolWithTag(data, USBIP_VHCI_POOL_TAG);
+		data = nullptr;
+	}
+}
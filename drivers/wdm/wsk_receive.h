@@ -5,6 +5,7 @@
 #pragma once
 
 #include <ntdef.h>
+#include <libdrv\pageable.h>
 
 struct vpdo_dev_t;
 struct wsk_context;
@@ -14,3 +15,9 @@ NTSTATUS WskDisconnectEvent(_In_opt_ PVOID SocketContext, _In_ ULONG Flags);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void sched_receive_usbip_header(_In_ wsk_context *ctx);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS alloc_recv_buffer(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_recv_buffer(_Inout_ vpdo_dev_t &vpdo);
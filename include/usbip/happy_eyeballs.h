@@ -0,0 +1,103 @@
+#pragma once
+
+/*
+ * RFC 8305, Happy Eyeballs Version 2: Better Connectivity Using Concurrency.
+ * Shared by kernel (WSK) and user-mode (Winsock) connectors.
+ */
+
+namespace usbip
+{
+
+enum { 
+        CONNECTION_ATTEMPT_DELAY = 250, // msec, recommended value
+        MAX_CONNECTION_ATTEMPTS = 8 // the rest of addresses are not tried
+};
+
+/*
+ * RFC 8305, 4. Sorting Addresses.
+ * Address families are interleaved, the family of the first address is preferred.
+ * 
+ * @param T addrinfo or ADDRINFOEXW
+ * @return number of addresses stored in v
+ */
+template<typename T, int N>
+inline auto interleave_families(_Out_ const T* (&v)[N], _In_opt_ const T *head)
+{
+        int cnt = 0;
+        if (!head) {
+                return cnt;
+        }
+
+        auto family = head->ai_family;
+
+        auto next = [family] (auto ai, bool same) 
+        {
+                for ( ; ai && (ai->ai_family == family) != same; ai = ai->ai_next);
+                return ai;
+        };
+
+        const T *ai[] { head, next(head, false) }; // preferred family, others
+
+        for (int i = 0; (ai[0] || ai[1]) && cnt < N; i ^= 1) {
+                if (auto &cur = ai[i]) {
+                        v[cnt++] = cur;
+                        cur = next(cur->ai_next, !i);
+                }
+        }
+
+        return cnt;
+}
+
+enum class attempt_status { connected, pending, failed };
+enum { ATTEMPT_DELAY_EXPIRED = -1, ATTEMPTS_ABORTED = -2 };
+
+/*
+ * RFC 8305, 5. Establishing Connections.
+ * The next attempt is started after CONNECTION_ATTEMPT_DELAY or as soon as the previous one has failed,
+ * the first attempt that succeeds wins.
+ *
+ * Connector implements
+ * attempt_status start(int idx)
+ *      starts connection attempt to the address with the given index
+ * int wait(int started, bool start_next)
+ *      waits for completion of a pending attempt in [0, started), CONNECTION_ATTEMPT_DELAY if start_next
+ *      or infinitely otherwise, @return index of completed attempt, ATTEMPT_DELAY_EXPIRED or ATTEMPTS_ABORTED
+ * bool succeeded(int idx)
+ *      the result of the completed attempt that wait has returned
+ *
+ * @return index of connected attempt, -1 if all attempts have failed or were aborted
+ */
+template<typename Connector>
+int race(_Inout_ Connector &c, _In_ int cnt)
+{
+        for (int started = 0, pending = 0; started < cnt || pending; ) {
+
+                if (started < cnt) {
+                        switch (c.start(started++)) {
+                        case attempt_status::connected:
+                                return started - 1;
+                        case attempt_status::pending:
+                                ++pending;
+                                break;
+                        case attempt_status::failed:
+                                continue; // start the next one at once
+                        }
+                }
+
+                switch (auto i = c.wait(started, started < cnt)) {
+                case ATTEMPT_DELAY_EXPIRED:
+                        break;
+                case ATTEMPTS_ABORTED:
+                        return -1;
+                default:
+                        if (c.succeeded(i)) {
+                                return i;
+                        }
+                        --pending;
+                }
+        }
+
+        return -1;
+}
+
+} // namespace usbip
@@ -52,6 +52,75 @@ struct imported_device_properties
 
 struct imported_device : imported_device_location, imported_device_properties {};
 
+struct transfer_statistics
+{
+        UINT64 submitted; // URBs sent to a server
+        UINT64 completed; // successfully
+        UINT64 cancelled;
+        UINT64 failed; // by a server or on sending
+
+        UINT64 bytes_out; // transfer buffers sent
+        UINT64 bytes_in; // transfer buffers received
+
+        UINT64 unlinked; // USBIP_CMD_UNLINK sent
+        UINT64 drained; // payload bytes of responses for unlinked URBs, they are discarded
+
+        UINT32 inflight; // URBs that are waiting for USBIP_RET_SUBMIT
+        UINT32 peak_inflight;
+};
+
+struct endpoint_statistics
+{
+        UCHAR address; // bEndpointAddress, zero for default control pipe
+        transfer_statistics stats;
+};
+
+/*
+ * Counters of lookaside lists of the driver's I/O contexts, they are shared by all devices.
+ * Indexed by size class of isoch descriptors buffer: 0, 8, 32, 128, 1024 packets.
+ */
+struct wsk_context_statistics
+{
+        enum { CLASS_CNT = 5 };
+        UINT64 alloc[CLASS_CNT]; // contexts were requested
+        UINT64 hit[CLASS_CNT]; // taken from the cache of a device
+        UINT64 miss[CLASS_CNT]; // allocated from the pool
+        UINT64 realloc; // isoch descriptors buffer grew beyond its size class
+};
+
+/*
+ * Round-trip time of URBs in microseconds. 
+ * A percentile is the highest value that is equivalent to the value of its histogram bucket.
+ */
+struct latency_percentiles
+{
+        UINT64 count;
+        UINT64 mean;
+        UINT64 max;
+
+        UINT64 p50;
+        UINT64 p90;
+        UINT64 p99;
+        UINT64 p999;
+};
+
+/*
+ * Compact binary copy of USB/IP PDU, @see ioctl::get_flight_recorder.
+ * 
+ * Header is in host byte order. A server sets usbip_header_basic.direction to zero, 
+ * the driver restores it from seqnum, and sets number_of_packets of non-isoch RET_SUBMIT to zero.
+ */
+struct flight_record
+{
+        INT64 timestamp; // performance counter
+        UINT32 length; // of the whole PDU, can be greater than header and payload prefix
+        UINT16 port; // hub port of the device
+        UINT8 outgoing; // sent to a server if not zero
+        UINT8 payload_len; // bytes in payload
+        UCHAR header[48]; // usbip_header
+        UCHAR payload[32]; // prefix, if it was available
+};
+
 } // namespace usbip::vhci
 
 
@@ -63,6 +132,9 @@ enum class function { // 12 bit
         plugout_hardware, 
         get_imported_devices,
         driver_registry_path,
+        get_device_statistics,
+        get_device_latency,
+        get_flight_recorder,
 };
 
 constexpr auto make(function id)
@@ -76,6 +148,9 @@ enum {
         PLUGOUT_HARDWARE     = make(function::plugout_hardware),
         GET_IMPORTED_DEVICES = make(function::get_imported_devices),
         DRIVER_REGISTRY_PATH = make(function::driver_registry_path),
+        GET_DEVICE_STATISTICS = make(function::get_device_statistics),
+        GET_DEVICE_LATENCY = make(function::get_device_latency),
+        GET_FLIGHT_RECORDER = make(function::get_flight_recorder),
 };
 
 struct base
@@ -109,4 +184,53 @@ struct driver_registry_path : base
         WCHAR path[MAX_PATH]; // key name max size is 255
 };
 
+/*
+ * Drained bytes are not attributed to endpoints because a server does not set usbip_header_basic.ep 
+ * in responses, they are counted in device statistics only.
+ */
+struct get_device_statistics : base
+{
+        int port; // IN
+
+        transfer_statistics device; // OUT, sum of all endpoints
+        ULONG endpoint_cnt; // OUT, endpoints that were used
+        endpoint_statistics endpoints[32]; // IN/OUT x 16
+
+        UINT64 descriptor_hits; // OUT, GET_DESCRIPTOR completed from the cache of the device
+        UINT64 descriptor_misses; // OUT, sent to a server
+
+        wsk_context_statistics wsk_context; // OUT, driver-wide
+
+        UINT64 addrinfo_hits; // OUT, driver-wide, name resolutions saved by the cache
+        UINT64 addrinfo_misses; // OUT, driver-wide, WskGetAddressInfo calls
+};
+
+struct get_device_latency : base
+{
+        int port; // IN
+        latency_percentiles transfers[4]; // OUT, indexed by USBD_PIPE_TYPE: control, isoch, bulk, interrupt
+};
+
+/*
+ * Snapshot of PDUs that were recently sent and received by all devices. 
+ * Records are not sorted, use timestamp.
+ * 
+ * timestamp and system_time are taken at the same moment, they allow to convert timestamp of a record 
+ * to the wall-clock time.
+ */
+struct get_flight_recorder : base
+{
+        INT64 frequency; // OUT, of performance counter
+        INT64 timestamp; // OUT, performance counter
+        INT64 system_time; // OUT, 100-nanosecond intervals since January 1, 1601 (UTC)
+
+        ULONG record_cnt; // OUT
+        flight_record records[ANYSIZE_ARRAY];
+};
+
+constexpr auto get_flight_recorder_size(_In_ ULONG n)
+{
+        return offsetof(get_flight_recorder, records) + n*sizeof(*get_flight_recorder::records);
+}
+
 } // namespace usbip::vhci::ioctl
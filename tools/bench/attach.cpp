@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Attach latency with and without persisted descriptors, the model of drivers/ude/descriptor_cache.cpp.
+ *
+ * The emulator runs in-process, one-way latency of its link is set like "usbip_emulator -l".
+ * Attach time is measured from completion of OP_REQ_IMPORT till SET_CONFIGURATION,
+ * GET_DESCRIPTOR requests of USB hub driver are issued meanwhile.
+ *
+ * cold: every GET_DESCRIPTOR goes to the server, the responses are saved.
+ * warm: cacheable GET_DESCRIPTOR are completed from the saved responses, the rest go to the server.
+ *       Saved descriptors are revalidated in background, the requests are sent at once after import,
+ *       like device::revalidate_descriptors does. "revalidated" is the moment the last response is received,
+ *       "changed" is the number of responses that differ from the saved ones.
+ * stale: the saved serial number differs from the device's one, revalidation removes it,
+ *        next attach fetches it from the server.
+ */
+
+#include "bench.h"
+
+#include <client.h>
+#include <link.h>
+#include <session.h>
+#include <devices.h>
+#include <log.h>
+
+#include <libdrv/pdu.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::emulator;
+using namespace usbip::bench;
+using loadgen::client;
+
+using key_t = std::pair<UINT16, UINT16>; // wValue, wIndex
+
+/*
+ * Completeness of a response is checked like descriptor_cache.cpp, is_complete does.
+ */
+struct entry
+{
+	std::vector<UINT8> data;
+	bool complete;
+};
+
+using cache_t = std::map<key_t, entry>;
+
+inline auto get_descriptor(UINT8 type, UINT8 index, UINT16 lang_id, UINT16 length)
+{
+	return setup_packet {
+		.bmRequestType = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE,
+		.bRequest = USB_REQ_GET_DESCRIPTOR,
+		.wValue = UINT16(type << 8 | index),
+		.wIndex = lang_id,
+		.wLength = length
+	};
+}
+
+inline auto is_cacheable(const setup_packet &r)
+{
+	switch (r.bRequest == USB_REQ_GET_DESCRIPTOR ? r.wValue >> 8 : 0) {
+	case USB_DT_DEVICE:
+	case USB_DT_CONFIG:
+	case USB_DT_STRING:
+		return true;
+	}
+	return false;
+}
+
+auto is_complete(const setup_packet &r, const std::vector<UINT8> &data)
+{
+	if (data.size() < r.wLength) {
+		return true;
+	} else if (data.size() < 2) {
+		return false;
+	} else if (r.wValue >> 8 == USB_DT_CONFIG) {
+		return data.size() >= 4 && data.size() >= size_t(data[2] | data[3] << 8);
+	}
+	return data.size() >= data[0];
+}
+
+/*
+ * One connection, the driver's side of it.
+ */
+class session
+{
+public:
+	session(client &c, cache_t &cache, bool warm) : m_client(c), m_cache(cache), m_warm(warm) {}
+
+	bool revalidate();
+	bool submit(const setup_packet &r, std::vector<UINT8> &data);
+	bool wait_probes();
+
+	auto round_trips() const noexcept { return m_round_trips; }
+	auto changed() const noexcept { return m_changed; }
+
+private:
+	client &m_client;
+	cache_t &m_cache;
+	bool m_warm;
+
+	std::map<seqnum_t, key_t> m_probes;
+	int m_round_trips{};
+	int m_changed{};
+
+	seqnum_t send(const setup_packet &r);
+	bool recv(seqnum_t seqnum, std::vector<UINT8> *data);
+};
+
+seqnum_t session::send(const setup_packet &r)
+{
+	auto dir_in = bool(r.bmRequestType & USB_DIR_IN);
+	auto seqnum = m_client.next_seqnum(dir_in);
+
+	usbip_header hdr{};
+	set_cmd_submit_header(hdr, seqnum, m_client.devid(), dir_in ? USBIP_DIR_IN : USBIP_DIR_OUT, 0, 0,
+			      dir_in ? r.wLength : 0, 0);
+	memcpy(hdr.u.cmd_submit.setup, &r, sizeof(r));
+
+	byteswap_header(hdr, swap_dir::host2net);
+	return emulator::send(m_client.sock(), &hdr, sizeof(hdr)) ? seqnum : 0;
+}
+
+/*
+ * Responses of the probes that arrive meanwhile are compared with saved descriptors.
+ * @param seqnum of the request to wait for, zero to wait for the probes only
+ */
+bool session::recv(seqnum_t seqnum, std::vector<UINT8> *data)
+{
+	while (seqnum || !m_probes.empty()) {
+		usbip_header hdr{};
+		if (!emulator::recv(m_client.sock(), &hdr, sizeof(hdr))) {
+			log(log_level::error, "recv error");
+			return false;
+		}
+
+		byteswap_header(hdr, swap_dir::net2host);
+		auto &ret = hdr.u.ret_submit;
+
+		std::vector<UINT8> v(hdr.base.command == USBIP_RET_SUBMIT ? std::max(ret.actual_length, 0) : 0);
+		if (!(v.empty() || emulator::recv(m_client.sock(), v.data(), v.size()))) {
+			log(log_level::error, "recv error");
+			return false;
+		}
+
+		if (hdr.base.seqnum == seqnum) {
+			if (data) {
+				*data = ret.status ? std::vector<UINT8>{} : std::move(v);
+			}
+			return true;
+		}
+
+		if (auto i = m_probes.find(hdr.base.seqnum); i != m_probes.end()) {
+			if (auto e = m_cache.find(i->second); ret.status || e->second.data != v) {
+				++m_changed;
+				m_cache.erase(e); // it would be replaced by the next GET_DESCRIPTOR
+			}
+			m_probes.erase(i);
+		} else {
+			log(log_level::error, "unexpected response: command %u, seqnum %u", hdr.base.command, hdr.base.seqnum);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * @see device_ioctl.cpp, revalidate_descriptors
+ */
+bool session::revalidate()
+{
+	if (!m_warm) {
+		return true;
+	}
+
+	for (auto &[key, e]: m_cache) {
+		auto r = get_descriptor(UINT8(key.first >> 8), UINT8(key.first), key.second, UINT16(e.data.size()));
+		if (auto seqnum = send(r)) {
+			m_probes.emplace(seqnum, key);
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool session::submit(const setup_packet &r, std::vector<UINT8> &data)
+{
+	auto cacheable = is_cacheable(r);
+	key_t key(r.wValue, r.wIndex);
+
+	if (m_warm && cacheable) {
+		if (auto i = m_cache.find(key); i != m_cache.end()) {
+			if (auto &e = i->second; e.complete || e.data.size() >= r.wLength) {
+				data.assign(e.data.begin(), e.data.begin() + std::min(e.data.size(), size_t(r.wLength)));
+				return true;
+			}
+		}
+	}
+
+	auto seqnum = send(r);
+	++m_round_trips;
+
+	if (!(seqnum && recv(seqnum, &data))) {
+		return false;
+	}
+
+	if (cacheable && !data.empty()) {
+		auto &e = m_cache[key];
+		if (data.size() >= e.data.size()) {
+			e = { data, is_complete(r, data) };
+		}
+	}
+
+	return true;
+}
+
+bool session::wait_probes()
+{
+	return recv(0, nullptr);
+}
+
+/*
+ * The order of requests that USB hub driver issues for a high-speed device.
+ */
+bool enumerate(session &s)
+{
+	std::vector<UINT8> dev;
+	std::vector<UINT8> v;
+
+	if (!(s.submit(get_descriptor(USB_DT_DEVICE, 0, 0, 64), dev) &&
+	      s.submit(get_descriptor(USB_DT_DEVICE, 0, 0, 18), dev) && dev.size() == 18)) {
+		return false;
+	}
+
+	if (!(s.submit(get_descriptor(USB_DT_CONFIG, 0, 0, 9), v) && v.size() == 9)) {
+		return false;
+	}
+
+	auto total_length = UINT16(v[2] | v[3] << 8);
+
+	if (!(s.submit(get_descriptor(USB_DT_CONFIG, 0, 0, total_length), v) &&
+	      s.submit(get_descriptor(USB_DT_STRING, 0, 0, 255), v))) {
+		return false;
+	}
+
+	enum { iManufacturer = 14, iProduct, iSerialNumber };
+
+	for (auto idx: {iSerialNumber, iProduct, iManufacturer}) {
+		if (dev[idx] && !s.submit(get_descriptor(USB_DT_STRING, dev[idx], 0x0409, 255), v)) {
+			return false;
+		}
+	}
+
+	if (!s.submit(get_descriptor(USB_DT_DEVICE_QUALIFIER, 0, 0, 10), v)) { // STALL is OK
+		return false;
+	}
+
+	setup_packet set_config { .bRequest = USB_REQ_SET_CONFIGURATION, .wValue = 1 };
+	return s.submit(set_config, v);
+}
+
+struct result
+{
+	double attach; // ms
+	double revalidated;
+	int round_trips;
+	int changed;
+};
+
+auto to_ms(clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); }
+
+bool attach(const char *port, const char *busid, cache_t &cache, bool warm, result &r)
+{
+	client c;
+	if (!c.import("127.0.0.1", port, busid)) {
+		return false;
+	}
+
+	auto start = clock::now(); // import can wait for the release of the device by the previous connection
+	session s(c, cache, warm);
+
+	if (!(s.revalidate() && enumerate(s))) {
+		return false;
+	}
+
+	r.attach = to_ms(clock::now() - start);
+
+	if (!s.wait_probes()) {
+		return false;
+	}
+
+	r.revalidated = to_ms(clock::now() - start);
+	r.round_trips = s.round_trips();
+	r.changed = s.changed();
+
+	return true;
+}
+
+auto start_server(const devices_t &devices, const link_params &params)
+{
+	auto sock = listen("127.0.0.1", "0");
+	auto port = sock ? get_local_port(sock.get()) : 0;
+
+	if (port) {
+		std::thread([&devices, params] (socket_handle sock)
+		{
+			while (auto s = accept(sock.get())) {
+				std::thread(serve, std::move(s), std::cref(devices), params).detach();
+			}
+		}, std::move(sock)).detach();
+	}
+
+	return port;
+}
+
+/*
+ * A device with the same VID/PID and another serial number was plugged instead of the one that was saved.
+ */
+auto make_stale(cache_t cache)
+{
+	auto &dev = cache.at({USB_DT_DEVICE << 8, 0}).data;
+	auto &serial = cache.at({UINT16(USB_DT_STRING << 8 | dev.at(16)), 0x0409}).data;
+
+	serial.back() ^= 1;
+	return cache;
+}
+
+/*
+ * @param r the result with median attach time
+ */
+bool run(const char *port, const char *busid, bool warm, cache_t &cache, result &r)
+{
+	enum { REPEAT = 5 };
+	std::vector<result> v(REPEAT);
+
+	for (auto &i: v) {
+		if (!attach(port, busid, cache, warm, i)) {
+			return false;
+		}
+	}
+
+	std::ranges::sort(v, {}, &result::attach);
+	r = v[REPEAT/2];
+
+	return true;
+}
+
+} // namespace
+
+
+int main()
+{
+	max_log_level = log_level::error;
+
+	static devices_t devices;
+	devices.push_back(make_bulk_device("1-1"));
+	devices.push_back(make_hid_device("1-2"));
+	devices.push_back(make_audio_device("1-3"));
+
+	print_header("Attach latency, ms",
+		     "rtt ms  busid      cold  round trips      warm  round trips  revalidated  changed    stale\n"
+		     "                                                                                      changed/next",
+		     "drivers/ude/descriptor_cache.cpp");
+
+	for (auto rtt: {0ms, 1ms, 5ms, 20ms}) {
+
+		auto port = start_server(devices, link_params{ .latency = std::chrono::microseconds(rtt)/2 });
+		if (!port) {
+			std::fprintf(stderr, "can't start server\n");
+			return EXIT_FAILURE;
+		}
+
+		auto port_str = std::to_string(port);
+
+		for (auto busid: {"1-1", "1-2", "1-3"}) {
+			cache_t cache;
+			result cold{};
+			result warm{};
+
+			if (!(run(port_str.c_str(), busid, false, cache, cold) &&
+			      run(port_str.c_str(), busid, true, cache, warm))) {
+				std::fprintf(stderr, "attach %s failed\n", busid);
+				return EXIT_FAILURE;
+			}
+
+			auto stale = make_stale(cache);
+			result changed{};
+			result next{}; // the serial number is fetched again and saved
+
+			if (!(attach(port_str.c_str(), busid, stale, true, changed) &&
+			      attach(port_str.c_str(), busid, stale, true, next))) {
+				std::fprintf(stderr, "attach %s failed\n", busid);
+				return EXIT_FAILURE;
+			}
+
+			std::printf("%6lld  %5s  %8.2f  %11d  %8.2f  %11d  %11.2f  %7d  %7d/%d\n",
+				    static_cast<long long>(rtt.count()), busid, cold.attach, cold.round_trips,
+				    warm.attach, warm.round_trips, warm.revalidated, warm.changed,
+				    changed.changed, next.round_trips);
+		}
+	}
+}
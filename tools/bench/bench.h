@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+
+/*
+ * Microbenchmarks of the drivers' hot paths.
+ * Results are printed as a table, one line per configuration.
+ */
+namespace usbip::bench
+{
+
+using clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+/*
+ * Prevents the compiler from discarding a computation whose result is not used.
+ */
+template<typename T>
+inline void do_not_optimize(const T &val)
+{
+	asm volatile("" : : "r,m"(val) : "memory");
+}
+
+/*
+ * Calls f(iterations) with a growing number of iterations until it runs longer than min_time.
+ * @return nanoseconds per iteration
+ */
+template<typename F>
+double measure(F &&f, clock::duration min_time = 200ms)
+{
+	for (long n = 1; ; n *= 2) {
+		auto start = clock::now();
+		f(n);
+		auto elapsed = clock::now() - start;
+
+		if (elapsed >= min_time) {
+			return std::chrono::duration<double, std::nano>(elapsed).count()/n;
+		}
+	}
+}
+
+/*
+ * @param model_of the driver code that is re-implemented by the benchmark, nullptr if it runs the driver code
+ */
+inline void print_header(const char *title, const char *columns, const char *model_of = nullptr)
+{
+	std::printf("# %s\n", title);
+
+	if (model_of) {
+		std::printf("# user-mode model of %s, the driver code is not linked\n", model_of);
+	}
+
+	std::printf("%s\n", columns);
+}
+
+} // namespace usbip::bench
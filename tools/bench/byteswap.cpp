@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Byteswap of isoch packet descriptors and of CMD_SUBMIT header, drivers/libdrv/pdu.cpp.
+ *
+ * scalar: field by field through an array of pointers, the code before SSSE3 kernels.
+ * libdrv: byteswap and byteswap_header, SSSE3 kernel is selected at runtime if CPU has it.
+ */
+
+#include "bench.h"
+
+#include <libdrv/pdu.h>
+#include <wdm.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+__attribute__((noinline)) void byteswap_scalar(usbip_iso_packet_descriptor *d, size_t cnt)
+{
+	for (size_t i = 0; i < cnt; ++i, ++d) {
+
+		UINT32 *v[] {&d->offset, &d->length, &d->actual_length, &d->status};
+
+		for (auto val: v) {
+			*val = RtlUlongByteSwap(*val);
+		}
+	}
+}
+
+__attribute__((noinline)) void byteswap_scalar(usbip_header &hdr)
+{
+	auto &b = hdr.base;
+	UINT32 *base[]{ &b.command, &b.seqnum, &b.devid, &b.direction, &b.ep };
+
+	for (auto val: base) {
+		*val = RtlUlongByteSwap(*val);
+	}
+
+	auto &r = hdr.u.cmd_submit;
+	r.transfer_flags = RtlUlongByteSwap(r.transfer_flags);
+
+	INT32 *v[] {&r.transfer_buffer_length, &r.start_frame, &r.number_of_packets, &r.interval};
+
+	for (auto val: v) {
+		*val = RtlUlongByteSwap(*val);
+	}
+}
+
+auto make_packets(size_t cnt)
+{
+	std::vector<usbip_iso_packet_descriptor> v(cnt);
+
+	for (size_t i = 0; i < cnt; ++i) {
+		v[i] = { .offset = UINT32(i*3072), .length = 3072, .actual_length = 3000, .status = UINT32(i & 1) };
+	}
+
+	return v;
+}
+
+void check_equal(const void *a, const void *b, size_t len, const char *what)
+{
+	if (std::memcmp(a, b, len)) {
+		std::fprintf(stderr, "%s: results differ\n", what);
+		std::exit(EXIT_FAILURE);
+	}
+}
+
+} // namespace
+
+
+int main()
+{
+	print_header("Byteswap of isoch packet descriptors, ns/call",
+		     "packets   scalar   libdrv  speedup   GB/s (libdrv)");
+
+	for (size_t cnt = 8; cnt <= USBIP_MAX_ISO_PACKETS; cnt *= 2) {
+		auto a = make_packets(cnt);
+		auto b = a;
+
+		byteswap_scalar(a.data(), cnt);
+		byteswap(b.data(), cnt);
+		check_equal(a.data(), b.data(), cnt*sizeof(a[0]), "byteswap");
+
+		auto scalar = measure([&a, cnt] (long n)
+		{
+			for (long i = 0; i < n; ++i) {
+				byteswap_scalar(a.data(), cnt);
+				do_not_optimize(a.front());
+			}
+		});
+
+		auto libdrv = measure([&b, cnt] (long n)
+		{
+			for (long i = 0; i < n; ++i) {
+				byteswap(b.data(), cnt);
+				do_not_optimize(b.front());
+			}
+		});
+
+		std::printf("%7zu  %7.1f  %7.1f  %6.1fx  %8.1f\n", cnt, scalar, libdrv, scalar/libdrv,
+			    cnt*sizeof(a[0])/libdrv);
+	}
+
+	usbip_header hdr{};
+	hdr.base = { .command = USBIP_CMD_SUBMIT, .seqnum = 2, .devid = 0x10002, .direction = USBIP_DIR_OUT, .ep = 2 };
+	hdr.u.cmd_submit.transfer_buffer_length = 512;
+	hdr.u.cmd_submit.number_of_packets = number_of_packets_non_isoch;
+
+	auto a = hdr;
+	auto b = hdr;
+
+	byteswap_scalar(a);
+	byteswap_header(b, swap_dir::host2net);
+	check_equal(&a, &b, sizeof(a), "byteswap_header");
+
+	auto scalar = measure([&a] (long n)
+	{
+		for (long i = 0; i < n; ++i) {
+			byteswap_scalar(a);
+			do_not_optimize(a);
+		}
+	});
+
+	auto libdrv = measure([&b] (long n)
+	{
+		for (long i = 0; i < n; ++i) { // the direction is toggled, command must be in host byte order
+			byteswap_header(b, swap_dir::host2net);
+			byteswap_header(b, swap_dir::net2host);
+			do_not_optimize(b);
+		}
+	}) / 2;
+
+	std::printf("\n# CMD_SUBMIT byteswap_header, ns/call\n"
+		    " scalar   libdrv  speedup\n"
+		    "%7.1f  %7.1f  %6.1fx\n", scalar, libdrv, scalar/libdrv);
+}
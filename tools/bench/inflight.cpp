@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Lookup and removal of an in-flight request by seqnum, the model of drivers/ude/device_queue.cpp.
+ *
+ * queue: the request is found through the seqnum index and then is retrieved from a manual WDFQUEUE,
+ *        WdfIoQueueRetrieveFoundRequest walks the list of the queue to find it.
+ * index: the driver owns cancelable requests, removal from the index is all the work.
+ *
+ * RET_SUBMIT of one endpoint arrives in order (fifo), the mix of endpoints completes in any order (random).
+ */
+
+#include "bench.h"
+
+#include <wdm.h>
+
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+enum { INFLIGHT_BUCKETS = 256 }; // @see drivers/ude/context.h, device_ctx
+
+struct request
+{
+	UINT32 seqnum;
+	LIST_ENTRY queue_entry; // WDFQUEUE
+	LIST_ENTRY entry; // device_ctx::inflight[]
+};
+
+class inflight
+{
+public:
+	explicit inflight(bool use_queue) : m_use_queue(use_queue)
+	{
+		InitializeListHead(&m_queue);
+		for (auto &head: m_buckets) {
+			InitializeListHead(&head);
+		}
+	}
+
+	inflight(const inflight&) = delete;
+	inflight& operator=(const inflight&) = delete;
+
+	void insert(request &r)
+	{
+		InsertTailList(get_bucket(r.seqnum), &r.entry);
+		if (m_use_queue) {
+			InsertTailList(&m_queue, &r.queue_entry);
+		}
+	}
+
+	request* dequeue(UINT32 seqnum);
+
+	auto walked() const noexcept { return m_walked; }
+
+private:
+	bool m_use_queue;
+	LIST_ENTRY m_queue;
+	LIST_ENTRY m_buckets[INFLIGHT_BUCKETS];
+	UINT64 m_walked{}; // entries of m_queue
+
+	LIST_ENTRY* get_bucket(UINT32 seqnum) { return m_buckets + (seqnum & (INFLIGHT_BUCKETS - 1)); }
+};
+
+request* inflight::dequeue(UINT32 seqnum)
+{
+	auto head = get_bucket(seqnum);
+	request *req{};
+
+	for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+		if (auto r = CONTAINING_RECORD(entry, request, entry); r->seqnum == seqnum) {
+			req = r;
+			break;
+		}
+	}
+
+	if (!req) {
+		return nullptr;
+	}
+
+	RemoveEntryList(&req->entry);
+
+	if (m_use_queue) { // WdfIoQueueRetrieveFoundRequest
+		auto entry = m_queue.Flink;
+		for ( ; entry != &req->queue_entry; entry = entry->Flink, ++m_walked);
+		RemoveEntryList(entry);
+	}
+
+	return req;
+}
+
+/*
+ * Keeps depth requests in flight, every iteration completes one of them and submits a new one.
+ * @return nanoseconds per iteration
+ */
+auto run(bool use_queue, int depth, bool random_order, double &avg_walked)
+{
+	std::vector<request> pool(depth);
+	std::vector<request*> pending; // the order of completion if it is fifo
+	inflight q(use_queue);
+
+	UINT32 seqnum = 0;
+
+	for (auto &r: pool) {
+		r.seqnum = ++seqnum;
+		q.insert(r);
+		pending.push_back(&r);
+	}
+
+	std::mt19937 gen(depth);
+	std::vector<int> victims(1 << 16);
+
+	for (size_t i = 0; i < victims.size(); ++i) {
+		victims[i] = random_order ? int(gen() % depth) : int(i % depth);
+	}
+
+	UINT64 total = 0;
+
+	auto ns = measure([&] (long n)
+	{
+		for (long i = 0; i < n; ++i) {
+			auto victim = random_order ? pending[victims[i & (victims.size() - 1)]] : pending[i % depth];
+
+			auto r = q.dequeue(victim->seqnum);
+			r->seqnum = ++seqnum;
+			q.insert(*r);
+		}
+		total += n;
+	});
+
+	avg_walked = double(q.walked())/total;
+	return ns;
+}
+
+} // namespace
+
+
+int main()
+{
+	print_header("Lookup and removal of in-flight request by seqnum, ns/op",
+		     "depth   order    queue     index   speedup  walked",
+		     "drivers/ude/device_queue.cpp");
+
+	for (int depth = 1; depth <= 4096; depth *= 2) {
+		for (auto random_order: {false, true}) {
+			double walked{};
+			double dummy{};
+
+			auto queue = run(true, depth, random_order, walked);
+			auto index = run(false, depth, random_order, dummy);
+
+			std::printf("%5d  %6s  %7.1f  %8.1f  %7.1fx  %6.1f\n", depth, random_order ? "random" : "fifo",
+				    queue, index, queue/index, walked);
+		}
+	}
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Isoch IN completion, the model of drivers/ude/wsk_receive.cpp, fill_isoc_data.
+ * The server sends packets without gaps (compacted), they are moved to URB's offsets in place.
+ *
+ * two-pass: byteswap of all descriptors, then a backward pass that validates and moves every packet
+ *           that is not at its offset by RtlMoveMemory, the code before the fused pass.
+ * fused:    one backward pass that byteswaps only used fields, validates and moves runs of adjacent packets
+ *           with the same shift by one RtlMoveMemory, nothing is moved if the buffer has no gaps.
+ *
+ * Shapes of the packet sets are synthetic: UVC (webcam) with 3072-byte high-bandwidth packets and
+ * UAC (audio) with 1 ms packets.
+ */
+
+#include "bench.h"
+
+#include <libdrv/pdu.h>
+#include <wdm.h>
+
+#include <arpa/inet.h>
+
+#include <cstdlib>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+/*
+ * USBD_ISO_PACKET_DESCRIPTOR.
+ */
+struct iso_packet
+{
+	ULONG Offset;
+	ULONG Length;
+	LONG Status;
+};
+
+struct urb
+{
+	ULONG TransferBufferLength;
+	std::vector<iso_packet> IsoPacket;
+};
+
+constexpr LONG to_windows_status_isoch(UINT32 status) { return 0xC0000000 | status; }
+
+bool fill_two_pass(urb &r, UCHAR *buffer, ULONG length, usbip_iso_packet_descriptor *src)
+{
+	byteswap(src, r.IsoPacket.size());
+
+	for (auto i = LONG64(r.IsoPacket.size()) - 1; i >= 0; --i) {
+
+		auto sd = src + i;
+		auto dd = r.IsoPacket.data() + i;
+
+		dd->Status = sd->status ? to_windows_status_isoch(sd->status) : 0;
+
+		if (!sd->actual_length) {
+			dd->Length = 0;
+			continue;
+		}
+
+		if (sd->actual_length > sd->length || sd->offset != dd->Offset || length < sd->actual_length) {
+			return false;
+		}
+
+		length -= sd->actual_length;
+
+		if (dd->Offset + sd->actual_length > r.TransferBufferLength || dd->Offset < length) {
+			return false;
+		}
+
+		if (dd->Offset > length) {
+			RtlMoveMemory(buffer + dd->Offset, buffer + length, sd->actual_length);
+		}
+
+		dd->Length = sd->actual_length;
+	}
+
+	return !length;
+}
+
+bool fill_fused(urb &r, UCHAR *buffer, ULONG length, const usbip_iso_packet_descriptor *src)
+{
+	struct { ULONG src; ULONG dst; ULONG len; } run{};
+
+	auto move = [buffer] (auto &run)
+	{
+		if (run.len) {
+			RtlMoveMemory(buffer + run.dst, buffer + run.src, run.len);
+			run.len = 0;
+		}
+	};
+
+	for (auto i = LONG64(r.IsoPacket.size()) - 1; i >= 0; --i) {
+
+		auto sd = src + i;
+		auto dd = r.IsoPacket.data() + i;
+
+		auto status = RtlUlongByteSwap(sd->status);
+		dd->Status = status ? to_windows_status_isoch(status) : 0;
+
+		auto actual_length = RtlUlongByteSwap(sd->actual_length);
+		if (!actual_length) {
+			dd->Length = 0;
+			continue;
+		}
+
+		if (actual_length > RtlUlongByteSwap(sd->length) || RtlUlongByteSwap(sd->offset) != dd->Offset ||
+		    length < actual_length) {
+			return false;
+		}
+
+		length -= actual_length;
+
+		if (dd->Offset + actual_length > r.TransferBufferLength || dd->Offset < length) {
+			return false;
+		}
+
+		if (dd->Offset == length) {
+			//
+		} else if (run.len && run.src == length + actual_length && run.dst == dd->Offset + actual_length) {
+			run.src = length;
+			run.dst = dd->Offset;
+			run.len += actual_length;
+		} else {
+			move(run);
+			run = { length, dd->Offset, actual_length };
+		}
+
+		dd->Length = actual_length;
+	}
+
+	if (length) {
+		return false;
+	}
+
+	move(run);
+	return true;
+}
+
+/*
+ * Server's response: compacted data and descriptors in network byte order.
+ */
+struct shape
+{
+	const char *name;
+	urb r;
+	std::vector<usbip_iso_packet_descriptor> descr;
+	std::vector<UCHAR> data; // TransferBufferLength, packets are compacted
+	ULONG actual_length;
+};
+
+/*
+ * @param actual returns actual_length of i-th packet
+ */
+template<typename F>
+auto make_shape(const char *name, ULONG packets, ULONG packet_size, F &&actual)
+{
+	shape s{ .name = name };
+	s.r.TransferBufferLength = packets*packet_size;
+	s.data.resize(s.r.TransferBufferLength);
+
+	for (ULONG i = 0; i < packets; ++i) {
+		auto offset = i*packet_size;
+		s.r.IsoPacket.push_back({ .Offset = offset });
+
+		auto len = ULONG(actual(i));
+		s.descr.push_back({ .offset = htonl(offset), .length = htonl(packet_size), .actual_length = htonl(len) });
+
+		for (ULONG j = 0; j < len; ++j) {
+			s.data[s.actual_length + j] = UCHAR(i + j);
+		}
+		s.actual_length += len;
+	}
+
+	return s;
+}
+
+auto make_shapes()
+{
+	std::vector<shape> v;
+
+	// UVC, 3x1024 bytes per microframe
+	v.push_back(make_shape("uvc-32-full", 32, 3072, [] (auto) { return 3072; }));
+	v.push_back(make_shape("uvc-32-frame-end", 32, 3072, [] (auto i) { return i < 20 ? 3072 : i == 20 ? 1500 : 12; }));
+	v.push_back(make_shape("uvc-256-mjpeg", 256, 3072, [] (auto i) { return i % 7 ? 3072 : 2048 + i; }));
+	v.push_back(make_shape("uvc-1024-idle", 1024, 3072, [] (auto i) { return i % 64 ? 0 : 12; }));
+
+	// UAC, 48 kHz 16-bit stereo is 192 bytes per ms, 44.1 kHz is 176 or 180 bytes
+	v.push_back(make_shape("uac-8-48k", 8, 192, [] (auto) { return 192; }));
+	v.push_back(make_shape("uac-8-44.1k", 8, 192, [] (auto i) { return i % 10 == 9 ? 180 : 176; }));
+	v.push_back(make_shape("uac-64-44.1k", 64, 192, [] (auto i) { return i % 10 == 9 ? 180 : 176; }));
+	v.push_back(make_shape("uac-1024-44.1k", 1024, 192, [] (auto i) { return i % 10 == 9 ? 180 : 176; }));
+
+	return v;
+}
+
+/*
+ * Restores the server's response before each call, only the call is timed.
+ * @return the best mean of several rounds, ns
+ */
+template<typename F>
+auto run(const shape &s, F &&fill)
+{
+	enum { ROUNDS = 5 };
+
+	auto r = s.r;
+	auto buffer = s.data;
+	auto descr = s.descr;
+
+	double best = 0;
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		clock::duration elapsed{};
+		long n = 0;
+
+		for (auto stop = clock::now() + 50ms; clock::now() < stop; ++n) {
+			buffer = s.data;
+			descr = s.descr;
+
+			auto start = clock::now();
+			auto ok = fill(r, buffer.data(), s.actual_length, descr.data());
+			elapsed += clock::now() - start;
+
+			if (!ok) {
+				std::fprintf(stderr, "%s: invalid response\n", s.name);
+				std::exit(EXIT_FAILURE);
+			}
+			do_not_optimize(buffer.front());
+		}
+
+		auto ns = std::chrono::duration<double, std::nano>(elapsed).count()/n;
+		if (!round || ns < best) {
+			best = ns;
+		}
+	}
+
+	return std::pair(best, std::pair(buffer, r.IsoPacket));
+}
+
+bool operator ==(const iso_packet &a, const iso_packet &b)
+{
+	return a.Offset == b.Offset && a.Length == b.Length && a.Status == b.Status;
+}
+
+} // namespace
+
+
+int main()
+{
+	print_header("Isoch IN completion: byteswap, validation and moving of packets, ns/URB",
+		     "shape              packets  moved bytes  two-pass    fused  speedup",
+		     "drivers/ude/wsk_receive.cpp, fill_isoc_data");
+
+	for (auto &s: make_shapes()) {
+		auto [two_pass, res1] = run(s, fill_two_pass);
+		auto [fused, res2] = run(s, fill_fused);
+
+		if (res1 != res2) {
+			std::fprintf(stderr, "%s: results differ\n", s.name);
+			return EXIT_FAILURE;
+		}
+
+		ULONG moved = 0;
+		for (ULONG i = 0, off = 0; i < s.r.IsoPacket.size(); ++i) {
+			auto len = ntohl(s.descr[i].actual_length);
+			moved += s.r.IsoPacket[i].Offset != off ? len : 0;
+			off += len;
+		}
+
+		std::printf("%-17s  %7zu  %11lu  %8.0f  %7.0f  %6.1fx\n", s.name, s.r.IsoPacket.size(),
+			    static_cast<unsigned long>(moved), two_pass, fused, two_pass/fused);
+	}
+}
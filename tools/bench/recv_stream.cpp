@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Parsing of server's responses, the model of drivers/{ude,wdm}/wsk_receive.cpp.
+ * Synthetic streams or the ones from files are replayed through a socketpair.
+ *
+ * pdu:  usbip_header and then the payload are received separately with MSG_WAITALL,
+ *       two receives per PDU with payload.
+ * bulk: up to recv_buffer::SIZE bytes are received at once and all complete PDUs are parsed
+ *       by libdrv/pdu_stream.cpp, the buffered part of a payload is copied and its rest is received
+ *       directly into URB buffer.
+ */
+
+#include "bench.h"
+
+#include <libdrv/pdu_stream.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+struct stats
+{
+	UINT64 pdus;
+	UINT64 receives;
+	UINT64 bytes;
+};
+
+/*
+ * @return false on EOF or error
+ */
+bool recv_all(int sock, void *buf, size_t len, stats &st)
+{
+	for (auto p = static_cast<char*>(buf); len; ) {
+		auto n = recv(sock, p, len, MSG_WAITALL);
+		if (n <= 0) {
+			return false;
+		}
+		++st.receives;
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+void receive_pdu(int sock, std::vector<UCHAR> &urb_buf, stats &st)
+{
+	for (usbip_header hdr; recv_all(sock, &hdr, sizeof(hdr), st); ++st.pdus) {
+
+		if (validate_ret_header(hdr) != RET_HDR_OK) {
+			std::fprintf(stderr, "invalid header\n");
+			std::exit(EXIT_FAILURE);
+		}
+
+		if (auto sz = get_payload_size(hdr); sz && !recv_all(sock, urb_buf.data(), sz, st)) {
+			break;
+		}
+	}
+}
+
+void receive_bulk(int sock, std::vector<UCHAR> &urb_buf, stats &st)
+{
+	std::vector<UCHAR> data(recv_buffer::SIZE);
+	recv_buffer rx{ .data = data.data() };
+
+	for (usbip_header hdr; ; ) {
+
+		auto len = compact(rx);
+
+		auto n = recv(sock, rx.data + rx.tail, len, 0);
+		if (n <= 0) {
+			break;
+		}
+		++st.receives;
+		rx.tail += ULONG(n);
+
+		while (rx.size() >= sizeof(hdr)) {
+
+			ULONG received = 0;
+			take_header(rx, hdr, received);
+
+			if (validate_ret_header(hdr) != RET_HDR_OK) {
+				std::fprintf(stderr, "invalid header\n");
+				std::exit(EXIT_FAILURE);
+			}
+
+			++st.pdus;
+
+			auto sz = get_payload_size(hdr);
+			auto cnt = std::min(sz, size_t(rx.size()));
+
+			std::memcpy(urb_buf.data(), rx.ptr(), cnt);
+			rx.head += ULONG(cnt);
+
+			if (cnt < sz && !recv_all(sock, urb_buf.data() + cnt, sz - cnt, st)) { // zero copy
+				return;
+			}
+		}
+	}
+}
+
+auto read_file(const char *path)
+{
+	std::vector<UCHAR> v;
+
+	if (auto f = std::fopen(path, "rb")) {
+		UCHAR buf[64*1024];
+		for (size_t n; (n = std::fread(buf, 1, sizeof(buf), f)); ) {
+			v.insert(v.end(), buf, buf + n);
+		}
+		std::fclose(f);
+	} else {
+		std::fprintf(stderr, "fopen '%s', %s\n", path, std::strerror(errno));
+	}
+
+	return v;
+}
+
+/*
+ * @return the largest payload
+ */
+auto check_stream(const std::vector<UCHAR> &stream, UINT64 &pdus)
+{
+	size_t max_payload = 0;
+	pdus = 0;
+
+	for (size_t off = 0; off + sizeof(usbip_header) <= stream.size(); ++pdus) {
+		usbip_header hdr;
+		std::memcpy(&hdr, stream.data() + off, sizeof(hdr));
+
+		if (validate_ret_header(hdr) != RET_HDR_OK) {
+			return size_t(-1);
+		}
+
+		auto sz = get_payload_size(hdr);
+		max_payload = std::max(max_payload, sz);
+		off += sizeof(hdr) + sz;
+	}
+
+	return max_payload;
+}
+
+/*
+ * The server writes the stream in chunks, like TCP segments coalesced by the receiver.
+ * @return elapsed time
+ */
+template<typename F>
+auto replay(const std::vector<UCHAR> &stream, int repeat, size_t max_payload, F &&receive, stats &st)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		std::perror("socketpair");
+		std::exit(EXIT_FAILURE);
+	}
+
+	std::vector<UCHAR> urb_buf(std::max(max_payload, size_t(1)));
+	st = {};
+
+	auto start = clock::now();
+
+	std::thread writer([&stream, repeat, sock = sv[1]]
+	{
+		enum { CHUNK = 64*1024 };
+
+		for (int i = 0; i < repeat; ++i) {
+			for (size_t off = 0; off < stream.size(); ) {
+				auto n = send(sock, stream.data() + off, std::min(size_t(CHUNK), stream.size() - off), 0);
+				if (n <= 0) {
+					return;
+				}
+				off += n;
+			}
+		}
+
+		shutdown(sock, SHUT_WR);
+	});
+
+	receive(sv[0], urb_buf, st);
+	auto elapsed = clock::now() - start;
+
+	writer.join();
+	close(sv[0]);
+	close(sv[1]);
+
+	st.bytes = UINT64(stream.size())*repeat;
+	return std::chrono::duration<double, std::nano>(elapsed).count();
+}
+
+/*
+ * RET_SUBMIT-s of IN transfers with the same payload size, in network byte order.
+ */
+auto make_stream(int payload, int cnt)
+{
+	std::vector<UCHAR> v;
+
+	for (int i = 0; i < cnt; ++i) {
+		usbip_header hdr{};
+
+		auto &b = hdr.base;
+		b.command = USBIP_RET_SUBMIT;
+		b.seqnum = seqnum_t(((i + 1) << 1) | USBIP_DIR_IN);
+		b.direction = USBIP_DIR_IN;
+
+		auto &r = hdr.u.ret_submit;
+		r.actual_length = payload;
+		r.number_of_packets = number_of_packets_non_isoch;
+
+		byteswap_header(hdr, swap_dir::host2net);
+
+		auto p = reinterpret_cast<const UCHAR*>(&hdr);
+		v.insert(v.end(), p, p + sizeof(hdr));
+		v.resize(v.size() + payload);
+	}
+
+	return v;
+}
+
+/*
+ * @return false if the stream is invalid
+ */
+bool run(const char *name, const std::vector<UCHAR> &stream)
+{
+	UINT64 pdus{};
+
+	auto max_payload = check_stream(stream, pdus);
+	if (max_payload == size_t(-1) || !pdus) {
+		std::fprintf(stderr, "%s: not a stream of USBIP_RET_*\n", name);
+		return false;
+	}
+
+	enum : UINT64 { MIN_BYTES = 256*1024*1024 };
+	auto repeat = int(std::max(UINT64(1), MIN_BYTES/stream.size()));
+
+	stats pdu{};
+	auto pdu_ns = replay(stream, repeat, max_payload, receive_pdu, pdu);
+
+	stats bulk{};
+	auto bulk_ns = replay(stream, repeat, max_payload, receive_bulk, bulk);
+
+	if (pdu.pdus != pdus*repeat || bulk.pdus != pdus*repeat) {
+		std::fprintf(stderr, "%s: %llu PDUs expected, got %llu/%llu\n", name,
+			     static_cast<unsigned long long>(pdus*repeat),
+			     static_cast<unsigned long long>(pdu.pdus), static_cast<unsigned long long>(bulk.pdus));
+		return false;
+	}
+
+	auto n = double(pdus*repeat);
+
+	std::printf("%4.2f  %6.2f  %7.0f  %7.0f  %7.0f  %7.0f  %8llu  %s\n",
+		    pdu.receives/n, bulk.receives/n, pdu_ns/n, bulk_ns/n,
+		    pdu.bytes*1e3/pdu_ns, bulk.bytes*1e3/bulk_ns,
+		    static_cast<unsigned long long>(pdus), name);
+
+	return true;
+}
+
+} // namespace
+
+
+/*
+ * Without arguments, synthetic streams of bulk IN responses are parsed.
+ */
+int main(int argc, char *argv[])
+{
+	print_header("Parsing of streams of server's responses",
+		     "receives/PDU       ns/PDU              MB/s\n"
+		     " pdu    bulk      pdu     bulk      pdu     bulk      PDUs  stream");
+
+	if (argc < 2) {
+		for (auto payload: {0, 64, 512, 4096, 65536}) {
+			auto name = "RET_SUBMIT, payload " + std::to_string(payload);
+			if (!run(name.c_str(), make_stream(payload, 1024))) {
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	for (int i = 1; i < argc; ++i) {
+		if (!run(argv[i], read_file(argv[i]))) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
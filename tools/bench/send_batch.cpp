@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Coalescing of CMD_SUBMITs into one WskSend, the model of drivers/ude/device_ioctl.cpp, send_next.
+ * Bursts of 512-byte bulk OUT URBs are sent over loopback TCP to a server that discards them.
+ *
+ * A thread that models WSK does one writev per WskSend, the URBs are submitted by another thread one by one.
+ * single:    every URB is a separate WskSend.
+ * coalesced: the first URB is sent at once if WskSend is not in progress, URBs queued meanwhile
+ *            are gathered into one WskSend when it completes (up to 64K).
+ */
+
+#include "bench.h"
+
+#include <libdrv/pdu.h>
+
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+enum : INT32 { TRANSFER_SIZE = 512 };
+enum : size_t { MAX_LENGTH = 64*1024 }; // @see dequeue_batch
+enum { URBS = 200'000 };
+
+void check(bool ok, const char *what)
+{
+	if (!ok) {
+		std::perror(what);
+		std::exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * @return connected socket, the peer discards everything it receives
+ */
+auto connect_to_sink(std::thread &server)
+{
+	auto lsock = socket(AF_INET, SOCK_STREAM, 0);
+	check(lsock >= 0, "socket");
+
+	sockaddr_in addr{ .sin_family = AF_INET, .sin_addr = { htonl(INADDR_LOOPBACK) } };
+	socklen_t len = sizeof(addr);
+
+	check(!bind(lsock, reinterpret_cast<sockaddr*>(&addr), len), "bind");
+	check(!listen(lsock, 1), "listen");
+	check(!getsockname(lsock, reinterpret_cast<sockaddr*>(&addr), &len), "getsockname");
+
+	server = std::thread([lsock]
+	{
+		auto s = accept(lsock, nullptr, nullptr);
+		close(lsock);
+
+		std::vector<char> buf(256*1024);
+		while (recv(s, buf.data(), buf.size(), 0) > 0);
+
+		close(s);
+	});
+
+	auto sock = socket(AF_INET, SOCK_STREAM, 0);
+	check(sock >= 0, "socket");
+	check(!connect(sock, reinterpret_cast<sockaddr*>(&addr), len), "connect");
+
+	int on = 1;
+	check(!setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)), "TCP_NODELAY"); // WSK_FLAG_NODELAY
+
+	return sock;
+}
+
+struct result
+{
+	UINT64 sends; // WskSend calls
+	double urbs_per_sec;
+	double mb_per_sec;
+};
+
+class wsk
+{
+public:
+	wsk(int sock, bool coalesce) : m_sock(sock), m_coalesce(coalesce), m_thread([this] { run(); }) {}
+	~wsk();
+
+	void submit();
+	void wait_sent(UINT64 cnt);
+
+	auto sends() const { return m_sends; }
+
+private:
+	int m_sock;
+	bool m_coalesce;
+
+	std::mutex m_lock; // device_ctx::send_lock
+	std::condition_variable m_cv;
+
+	UINT64 m_queued{}; // device_ctx::send_queue
+	UINT64 m_sent{};
+	UINT64 m_sends{};
+	bool m_stop{};
+
+	std::thread m_thread;
+
+	void run();
+	void send(size_t cnt);
+};
+
+wsk::~wsk()
+{
+	{
+		std::lock_guard lck(m_lock);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	m_thread.join();
+}
+
+void wsk::submit()
+{
+	{
+		std::lock_guard lck(m_lock);
+		++m_queued;
+	}
+	m_cv.notify_all();
+}
+
+void wsk::wait_sent(UINT64 cnt)
+{
+	std::unique_lock lck(m_lock);
+	m_cv.wait(lck, [this, cnt] { return m_sent >= cnt; });
+}
+
+void wsk::run()
+{
+	const size_t max_batch = m_coalesce ? MAX_LENGTH/(sizeof(usbip_header) + TRANSFER_SIZE) : 1;
+
+	for (std::unique_lock lck(m_lock); ; ) {
+		m_cv.wait(lck, [this] { return m_queued || m_stop; });
+		if (!m_queued) {
+			break;
+		}
+
+		auto cnt = size_t(std::min(m_queued, UINT64(max_batch)));
+		m_queued -= cnt;
+
+		lck.unlock();
+		send(cnt);
+		lck.lock();
+
+		m_sent += cnt;
+		++m_sends;
+		m_cv.notify_all();
+	}
+}
+
+/*
+ * The MDL chain of each context is header and transfer buffer.
+ */
+void wsk::send(size_t cnt)
+{
+	static usbip_header hdr{};
+	static UINT8 data[TRANSFER_SIZE];
+
+	std::vector<iovec> v;
+	v.reserve(2*cnt);
+
+	for (size_t i = 0; i < cnt; ++i) {
+		v.push_back({ &hdr, sizeof(hdr) });
+		v.push_back({ data, sizeof(data) });
+	}
+
+	size_t total = cnt*(sizeof(hdr) + sizeof(data));
+
+	while (total) {
+		auto n = writev(m_sock, v.data(), int(v.size()));
+		check(n > 0, "writev");
+		total -= n;
+
+		for (auto i = v.begin(); n; ) { // partial write
+			auto k = std::min(size_t(n), i->iov_len);
+			i->iov_base = static_cast<char*>(i->iov_base) + k;
+			i->iov_len -= k;
+			n -= k;
+			if (!i->iov_len) {
+				i = v.erase(i);
+			}
+		}
+	}
+}
+
+auto run(bool coalesce, int burst)
+{
+	std::thread server;
+	auto sock = connect_to_sink(server);
+
+	result r{};
+	UINT64 submitted = 0;
+
+	auto start = clock::now();
+	{
+		wsk w(sock, coalesce);
+
+		while (submitted < URBS) {
+			for (int i = 0; i < burst; ++i) {
+				w.submit();
+			}
+			w.wait_sent(submitted += burst);
+		}
+
+		r.sends = w.sends();
+	}
+	auto sec = std::chrono::duration<double>(clock::now() - start).count();
+
+	close(sock);
+	server.join();
+
+	r.urbs_per_sec = submitted/sec;
+	r.mb_per_sec = submitted*TRANSFER_SIZE/sec/1e6;
+
+	return r;
+}
+
+} // namespace
+
+
+int main()
+{
+	print_header("Bursts of 512-byte bulk OUT URBs over loopback TCP",
+		     "burst   WskSend/URB        URB/s              MB/s\n"
+		     "       single  coalesced   single  coalesced  single  coalesced",
+		     "drivers/ude/device_ioctl.cpp, send_next");
+
+	for (int burst = 1; burst <= 256; burst *= 4) {
+		auto single = run(false, burst);
+		auto coalesced = run(true, burst);
+
+		auto urbs = double((URBS + burst - 1)/burst*burst);
+
+		std::printf("%5d  %6.2f  %9.3f  %8.0f  %9.0f  %6.1f  %9.1f\n", burst,
+			    single.sends/urbs, coalesced.sends/urbs,
+			    single.urbs_per_sec, coalesced.urbs_per_sec,
+			    single.mb_per_sec, coalesced.mb_per_sec);
+	}
+}
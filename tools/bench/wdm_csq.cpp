@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Lock hold time of IoCsqRemoveNextIrp, the model of drivers/wdm/csq.cpp.
+ *
+ * list:    all pending IRPs are in one list, PeekNextIrp walks it (before the seqnum and pipe indices).
+ * indexed: seqnum hash buckets and a list per endpoint address, like vpdo_dev_t.irps_by_seqnum/irps_by_pipe.
+ *
+ * IRPs are spread over four pipes. RET_SUBMIT completes a random IRP and a new one is submitted for the same pipe,
+ * abort_pipe removes all IRPs of one pipe. Hold time is measured from lock acquisition till its release.
+ */
+
+#include "bench.h"
+
+#include <wdm.h>
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+using seqnum_t = UINT32;
+
+constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; } // @see drivers/wdm/dev.h
+
+struct pipe
+{
+	UINT8 address; // bEndpointAddress
+};
+
+const pipe pipes[] { {0x81}, {0x02}, {0x83}, {0x84} };
+
+/*
+ * DriverContext[] and Tail.Overlay.ListEntry of IRP.
+ */
+struct irp
+{
+	seqnum_t seqnum;
+	const pipe *handle;
+	irp *next; // get_next_irp
+	LIST_ENTRY entry;
+};
+
+inline auto get_irp(LIST_ENTRY *entry) { return CONTAINING_RECORD(entry, irp, entry); }
+
+/*
+ * IO_CSQ callbacks, the lock is held by the caller.
+ */
+class list_queue
+{
+public:
+	list_queue() { InitializeListHead(&m_irps); }
+
+	void insert(irp *i) { InsertTailList(&m_irps, &i->entry); }
+	void remove(irp *i) { RemoveEntryList(&i->entry); }
+
+	irp* peek(seqnum_t seqnum) { return peek([seqnum] (auto i) { return i->seqnum == seqnum; }); }
+	irp* peek(const pipe *handle) { return peek([handle] (auto i) { return i->handle == handle; }); }
+
+private:
+	LIST_ENTRY m_irps;
+
+	template<typename F>
+	irp* peek(F &&match)
+	{
+		for (auto entry = m_irps.Flink; entry != &m_irps; entry = entry->Flink) {
+			if (auto i = get_irp(entry); match(i)) {
+				return i;
+			}
+		}
+		return nullptr;
+	}
+};
+
+class indexed_queue
+{
+public:
+	indexed_queue()
+	{
+		for (auto &head: m_by_pipe) {
+			InitializeListHead(&head);
+		}
+	}
+
+	void insert(irp *i)
+	{
+		auto &head = seqnum_bucket(i->seqnum);
+		i->next = head;
+		head = i;
+
+		InsertTailList(pipe_bucket(i->handle), &i->entry);
+	}
+
+	void remove(irp *i)
+	{
+		for (auto cur = &seqnum_bucket(i->seqnum); *cur; cur = &(*cur)->next) {
+			if (*cur == i) {
+				*cur = i->next;
+				break;
+			}
+		}
+		i->next = nullptr;
+
+		RemoveEntryList(&i->entry);
+		InitializeListHead(&i->entry);
+	}
+
+	irp* peek(seqnum_t seqnum)
+	{
+		auto cur = seqnum_bucket(seqnum);
+		for ( ; cur && cur->seqnum != seqnum; cur = cur->next);
+		return cur;
+	}
+
+	irp* peek(const pipe *handle)
+	{
+		auto head = pipe_bucket(handle);
+
+		for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+			if (auto i = get_irp(entry); i->handle == handle) {
+				return i;
+			}
+		}
+
+		return nullptr;
+	}
+
+private:
+	enum { SEQNUM_BUCKETS = 256, PIPE_BUCKETS = 32 };
+	irp *m_by_seqnum[SEQNUM_BUCKETS]{};
+	LIST_ENTRY m_by_pipe[PIPE_BUCKETS];
+
+	irp*& seqnum_bucket(seqnum_t seqnum) { return m_by_seqnum[extract_num(seqnum) & (SEQNUM_BUCKETS - 1)]; }
+
+	LIST_ENTRY* pipe_bucket(const pipe *handle)
+	{
+		auto addr = handle->address;
+		return m_by_pipe + ((addr & 0xF) | (addr & 0x80 ? 0x10 : 0));
+	}
+};
+
+class hold_time
+{
+public:
+	void add(clock::duration d) { m_samples.push_back(d); }
+
+	auto mean() const
+	{
+		clock::duration sum{};
+		for (auto d: m_samples) {
+			sum += d;
+		}
+		return ns(sum)/m_samples.size();
+	}
+
+	auto percentile(double p)
+	{
+		auto n = std::max(size_t(p*m_samples.size()/100), size_t(1)) - 1; // nearest-rank
+		std::nth_element(m_samples.begin(), m_samples.begin() + n, m_samples.end());
+		return ns(m_samples[n]);
+	}
+
+private:
+	std::vector<clock::duration> m_samples;
+	static double ns(clock::duration d) { return std::chrono::duration<double, std::nano>(d).count(); }
+};
+
+/*
+ * IoCsqRemoveNextIrp: AcquireLock, PeekNextIrp, RemoveIrp, ReleaseLock.
+ */
+template<typename Queue, typename Key>
+irp* remove_next(std::mutex &lock, Queue &q, Key key, hold_time &t)
+{
+	std::lock_guard lck(lock);
+	auto start = clock::now();
+
+	auto i = q.peek(key);
+	if (i) {
+		q.remove(i);
+	}
+
+	t.add(clock::now() - start);
+	return i;
+}
+
+template<typename Queue>
+struct result
+{
+	hold_time ret_submit;
+	hold_time abort_pipe;
+};
+
+template<typename Queue>
+void run(int depth, result<Queue> &r)
+{
+	enum { ROUNDS = 50, COMPLETIONS = 20'000 };
+
+	std::mutex lock; // irps_lock
+	Queue q;
+
+	std::vector<irp> pool(depth);
+	std::vector<irp*> pending(pool.size());
+	seqnum_t seqnum = 0;
+
+	auto submit = [&] (irp &i, const pipe *handle)
+	{
+		seqnum += 2; // direction is in the lowest bit
+		i = { .seqnum = seqnum, .handle = handle };
+
+		std::lock_guard lck(lock);
+		q.insert(&i);
+	};
+
+	for (size_t i = 0; i < pool.size(); ++i) {
+		submit(pool[i], pipes + i % std::size(pipes));
+		pending[i] = &pool[i];
+	}
+
+	std::mt19937 gen(depth);
+
+	for (int i = 0; i < COMPLETIONS; ++i) {
+		auto &victim = pending[gen() % pending.size()];
+		auto handle = victim->handle;
+
+		auto irp = remove_next(lock, q, victim->seqnum, r.ret_submit);
+		submit(*irp, handle);
+	}
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		auto handle = pipes + round % std::size(pipes);
+
+		std::vector<irp*> aborted;
+		while (auto irp = remove_next(lock, q, handle, r.abort_pipe)) {
+			aborted.push_back(irp);
+		}
+
+		for (auto irp: aborted) {
+			submit(*irp, handle);
+		}
+	}
+}
+
+} // namespace
+
+
+int main()
+{
+	print_header("Lock hold time of IoCsqRemoveNextIrp, ns",
+		     "depth         RET_SUBMIT mean/p99            abort_pipe mean/p99\n"
+		     "            list          indexed          list          indexed",
+		     "drivers/wdm/csq.cpp");
+
+	for (int depth = 1; depth <= 4096; depth *= 2) {
+		result<list_queue> list;
+		run(depth, list);
+
+		result<indexed_queue> indexed;
+		run(depth, indexed);
+
+		std::printf("%5d  %6.0f/%-6.0f  %6.0f/%-6.0f  %6.0f/%-6.0f  %6.0f/%-6.0f\n", depth,
+			    list.ret_submit.mean(), list.ret_submit.percentile(99),
+			    indexed.ret_submit.mean(), indexed.ret_submit.percentile(99),
+			    list.abort_pipe.mean(), list.abort_pipe.percentile(99),
+			    indexed.abort_pipe.mean(), indexed.abort_pipe.percentile(99));
+	}
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Subset of Windows SDK declarations that are used by portable sources (protocol headers, libdrv/pdu.cpp).
+ * This directory is in the include path only if the target is not Windows.
+ */
+
+#include "sal.h"
+
+#include <cstddef>
+#include <cstdint>
+
+using INT8 = std::int8_t;
+using INT16 = std::int16_t;
+using INT32 = std::int32_t;
+using INT64 = std::int64_t;
+
+using UINT8 = std::uint8_t;
+using UINT16 = std::uint16_t;
+using UINT32 = std::uint32_t;
+using UINT64 = std::uint64_t;
+
+using UCHAR = unsigned char;
+using USHORT = unsigned short;
+using ULONG = std::uint32_t; // LLP64
+using LONG = std::int32_t;
+using LONG64 = std::int64_t;
+using ULONG64 = std::uint64_t;
@@ -0,0 +1,15 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "basetsd.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+  #define _M_X64 1 // libdrv/pdu.cpp has SSSE3 kernels for it
+#endif
+
+inline auto _byteswap_ulong(UINT32 val) { return __builtin_bswap32(val); }
+inline auto _byteswap_ushort(UINT16 val) { return __builtin_bswap16(val); }
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Source code annotations are checked by MSVC only.
+ */
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_bytes_(size)
+#define _In_reads_bytes_opt_(size)
+#define _Out_writes_bytes_(size)
+#define _Inout_updates_(size)
+#define _Inout_updates_bytes_(size)
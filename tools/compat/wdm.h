@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Kernel routines that libdrv/pdu*.cpp and user-mode models of the drivers' data structures use.
+ */
+
+#include "intrin.h"
+#include <cassert>
+#include <cstring>
+
+#define RtlUlongByteSwap(val) _byteswap_ulong(val)
+#define NT_ASSERT(expr) assert(expr)
+
+#define RtlCopyMemory(dst, src, len) std::memcpy(dst, src, len)
+#define RtlMoveMemory(dst, src, len) std::memmove(dst, src, len)
+
+#if defined(_M_X64)
+  enum : ULONG { PF_SSSE3_INSTRUCTIONS_AVAILABLE = 36 };
+
+  inline bool ExIsProcessorFeaturePresent(ULONG feature)
+  {
+	return feature == PF_SSSE3_INSTRUCTIONS_AVAILABLE && __builtin_cpu_supports("ssse3");
+  }
+#endif
+
+struct LIST_ENTRY
+{
+	LIST_ENTRY *Flink;
+	LIST_ENTRY *Blink;
+};
+
+#define CONTAINING_RECORD(address, type, field) \
+	reinterpret_cast<type*>(reinterpret_cast<char*>(address) - offsetof(type, field))
+
+inline void InitializeListHead(LIST_ENTRY *head)
+{
+	head->Flink = head->Blink = head;
+}
+
+inline bool IsListEmpty(const LIST_ENTRY *head)
+{
+	return head->Flink == head;
+}
+
+inline bool RemoveEntryList(LIST_ENTRY *entry)
+{
+	auto next = entry->Flink;
+	auto prev = entry->Blink;
+
+	prev->Flink = next;
+	next->Blink = prev;
+
+	return next == prev;
+}
+
+inline void InsertTailList(LIST_ENTRY *head, LIST_ENTRY *entry)
+{
+	auto prev = head->Blink;
+
+	entry->Flink = head;
+	entry->Blink = prev;
+
+	prev->Flink = entry;
+	head->Blink = entry;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "devices.h"
+
+#include <cmath>
+#include <numbers>
+
+namespace
+{
+
+using namespace usbip::emulator;
+
+enum : UINT8 { EP_IN = 0x81, STREAMING_INTF = 1 };
+
+enum : UINT32 {
+	SAMPLE_RATE = 48'000,
+	CHANNELS = 2,
+	SAMPLE_SIZE = 2, // bytes, 16-bit PCM
+	BYTES_PER_FRAME = SAMPLE_RATE/1000*CHANNELS*SAMPLE_SIZE, // 1 ms
+};
+
+/*
+ * USB Device Class Definition for Audio Devices 1.0, A.9 Audio Class-Specific Request Codes.
+ */
+enum : UINT8 {
+	UAC_SET_CUR = 0x01,
+	UAC_GET_CUR = 0x81,
+	UAC_GET_MIN = 0x82,
+	UAC_GET_MAX = 0x83,
+	UAC_GET_RES = 0x84,
+};
+
+enum : UINT8 { UAC_AC_HEADER = 1, UAC_INPUT_TERMINAL, UAC_OUTPUT_TERMINAL }; // AudioControl descriptor subtypes
+enum : UINT8 { UAC_AS_GENERAL = 1, UAC_FORMAT_TYPE }; // AudioStreaming descriptor subtypes
+
+#define USB_LE24(val) UINT8((val) & 0xFF), UINT8(((val) >> 8) & 0xFF), UINT8(((val) >> 16) & 0xFF)
+
+class audio_device : public device
+{
+public:
+	explicit audio_device(std::string busid);
+
+private:
+	UINT8 m_samples[BYTES_PER_FRAME]; // 1 kHz sine, one period per frame
+	clock::time_point m_next_frame; // of the stream
+
+	void transfer(urb &u) override;
+	bool control(const setup_packet &r, urb &u) override;
+	void reset(int ep) override;
+};
+
+audio_device::audio_device(std::string busid) :
+	device(busid, USB_SPEED_FULL,
+	{
+		18, USB_DT_DEVICE, USB_LE16(bcdUSB20), 0, 0, 0, 64,
+		USB_LE16(VENDOR_ID), USB_LE16(0x0003), USB_LE16(0x0100),
+		1, 2, 3, 1
+	},
+	{
+		9, USB_DT_CONFIG, USB_LE16(0), 2, 1, 0, 0x80, 50,
+
+		// AudioControl
+		9, USB_DT_INTERFACE, 0, 0, 0, 1, 1, 0, 0,
+		9, USB_DT_CS_INTERFACE, UAC_AC_HEADER, USB_LE16(0x0100), USB_LE16(9 + 12 + 9), 1, STREAMING_INTF,
+		12, USB_DT_CS_INTERFACE, UAC_INPUT_TERMINAL, 1, USB_LE16(0x0201), 0, CHANNELS, USB_LE16(0x0003), 0, 0, // Microphone
+		9, USB_DT_CS_INTERFACE, UAC_OUTPUT_TERMINAL, 2, USB_LE16(0x0101), 0, 1, 0, // USB streaming, source is 1
+
+		// AudioStreaming, zero bandwidth
+		9, USB_DT_INTERFACE, STREAMING_INTF, 0, 0, 1, 2, 0, 0,
+
+		// AudioStreaming, operational
+		9, USB_DT_INTERFACE, STREAMING_INTF, 1, 1, 1, 2, 0, 0,
+		7, USB_DT_CS_INTERFACE, UAC_AS_GENERAL, 2, 1, USB_LE16(0x0001), // terminal link, delay, PCM
+		11, USB_DT_CS_INTERFACE, UAC_FORMAT_TYPE, 1, CHANNELS, SAMPLE_SIZE, 8*SAMPLE_SIZE, 1, USB_LE24(SAMPLE_RATE),
+		9, USB_DT_ENDPOINT, EP_IN, USB_ENDPOINT_XFER_ISOC | 0x04, USB_LE16(BYTES_PER_FRAME), 1, 0, 0, // async
+		7, USB_DT_CS_ENDPOINT, 1, 0x01, 0, USB_LE16(0), // EP_GENERAL, sampling frequency control
+	},
+	{ "USB/IP emulator", "Isochronous microphone", "AUDIO-" + busid })
+{
+	auto samples = reinterpret_cast<INT16*>(m_samples);
+	constexpr int cnt = BYTES_PER_FRAME/(CHANNELS*SAMPLE_SIZE);
+
+	for (int i = 0; i < cnt; ++i) {
+		auto val = INT16(8192*std::sin(2*std::numbers::pi*i/cnt));
+		for (UINT32 ch = 0; ch < CHANNELS; ++ch) {
+			*samples++ = val;
+		}
+	}
+}
+
+void audio_device::reset(int)
+{
+	m_next_frame = {};
+}
+
+/*
+ * Every packet is a frame of the stream, the packets of a request are delivered in real time.
+ * URB_ISO_ASAP is assumed, start_frame of a request is ignored.
+ */
+void audio_device::transfer(urb &u)
+{
+	if (!(u.dir_in && u.ep == (EP_IN & 0x0F) && u.iso.size())) {
+		u.status = -EPIPE_LNX;
+		return;
+	}
+
+	auto start = std::max(u.ready, m_next_frame); // the stream is restarted after a gap
+	auto dur = frame_duration();
+
+	m_next_frame = start + ssize(u.iso)*dur;
+	u.ready = m_next_frame;
+	u.start_frame = frame_number(start);
+
+	u.data.reserve(u.iso.size()*sizeof(m_samples));
+
+	for (auto &d: u.iso) {
+		auto len = std::min(d.length, UINT32(sizeof(m_samples)));
+		u.data.insert(u.data.end(), m_samples, m_samples + len);
+
+		d.actual_length = len;
+		d.status = 0;
+	}
+}
+
+/*
+ * The only control is sampling frequency of the endpoint, it can't be changed.
+ */
+bool audio_device::control(const setup_packet &r, urb &u)
+{
+	if ((r.bmRequestType & USB_TYPE_MASK) != USB_TYPE_CLASS) {
+		return false;
+	}
+
+	switch (r.bRequest) {
+	case UAC_SET_CUR:
+		break;
+	case UAC_GET_CUR:
+	case UAC_GET_MIN:
+	case UAC_GET_MAX:
+	case UAC_GET_RES: {
+		const UINT8 freq[] { USB_LE24(SAMPLE_RATE) };
+		assign(u, freq);
+	}	break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace
+
+
+std::unique_ptr<usbip::emulator::device> usbip::emulator::make_audio_device(std::string busid)
+{
+	return std::make_unique<audio_device>(std::move(busid));
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "devices.h"
+
+namespace
+{
+
+using namespace usbip::emulator;
+
+enum : UINT8 { EP_SOURCE = 0x81, EP_SINK = 0x02 };
+enum : UINT8 { MS_VENDOR_CODE = 0x20, MS_OS_STRING_INDEX = 0xEE };
+enum : UINT16 { MAX_PACKET_SIZE = 512 };
+
+class bulk_device : public device
+{
+public:
+	explicit bulk_device(std::string busid);
+
+private:
+	void transfer(urb &u) override;
+	bool control(const setup_packet &r, urb &u) override;
+	bool get_descriptor(const setup_packet &r, urb &u) override;
+
+	std::vector<UINT8> m_pattern;
+	const std::vector<UINT8>& get_pattern(size_t len);
+};
+
+bulk_device::bulk_device(std::string busid) :
+	device(busid, USB_SPEED_HIGH,
+	{
+		18, USB_DT_DEVICE, USB_LE16(bcdUSB20),
+		0, 0, 0, // bDeviceClass, bDeviceSubClass, bDeviceProtocol
+		64, // bMaxPacketSize0
+		USB_LE16(VENDOR_ID), USB_LE16(0x0001), USB_LE16(0x0100),
+		1, 2, 3, // iManufacturer, iProduct, iSerialNumber
+		1 // bNumConfigurations
+	},
+	{
+		9, USB_DT_CONFIG, USB_LE16(0), 1, 1, 0, 0x80, 50,
+
+		9, USB_DT_INTERFACE, 0, 0, 2, 0xFF, 0, 0, 0,
+		7, USB_DT_ENDPOINT, EP_SOURCE, USB_ENDPOINT_XFER_BULK, USB_LE16(MAX_PACKET_SIZE), 0,
+		7, USB_DT_ENDPOINT, EP_SINK, USB_ENDPOINT_XFER_BULK, USB_LE16(MAX_PACKET_SIZE), 0,
+	},
+	{ "USB/IP emulator", "Bulk source/sink", "BULK-" + busid })
+{}
+
+/*
+ * Data of bulk IN transfers, it is the same for each of them.
+ * Every byte is its offset modulo 63, like "pattern=1" of Linux gadget zero.
+ */
+const std::vector<UINT8>& bulk_device::get_pattern(size_t len)
+{
+	auto &v = m_pattern;
+
+	for (auto i = v.size(); i < len; ++i) {
+		v.push_back(UINT8(i % 63));
+	}
+
+	return v;
+}
+
+void bulk_device::transfer(urb &u)
+{
+	if (u.iso.size()) {
+		u.status = -EPIPE_LNX;
+	} else if (u.dir_in && u.ep == (EP_SOURCE & 0x0F)) {
+		auto len = size_t(u.transfer_buffer_length);
+		auto &v = get_pattern(len);
+		u.data.assign(v.begin(), v.begin() + len);
+	} else if (!u.dir_in && u.ep == EP_SINK) {
+		// u.actual_length is already set
+	} else {
+		u.status = -EPIPE_LNX;
+	}
+}
+
+/*
+ * Microsoft OS 1.0 Descriptors Specification, Extended Compat ID OS Feature Descriptor.
+ */
+bool bulk_device::control(const setup_packet &r, urb &u)
+{
+	enum { EXTENDED_COMPAT_ID = 4 };
+
+	if (r.bmRequestType != (USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE) ||
+	    r.bRequest != MS_VENDOR_CODE || r.wIndex != EXTENDED_COMPAT_ID) {
+		return false;
+	}
+
+	const UINT8 d[] {
+		40, 0, 0, 0, // dwLength
+		USB_LE16(0x0100), // bcdVersion
+		USB_LE16(EXTENDED_COMPAT_ID),
+		1, // bCount
+		0, 0, 0, 0, 0, 0, 0,
+
+		0, // bFirstInterfaceNumber
+		1,
+		'W', 'I', 'N', 'U', 'S', 'B', 0, 0, // compatibleID
+		0, 0, 0, 0, 0, 0, 0, 0, // subCompatibleID
+		0, 0, 0, 0, 0, 0
+	};
+
+	assign(u, d);
+	return true;
+}
+
+bool bulk_device::get_descriptor(const setup_packet &r, urb &u)
+{
+	if (r.wValue != (USB_DT_STRING << 8 | MS_OS_STRING_INDEX)) {
+		return false;
+	}
+
+	const UINT8 d[] {
+		18, USB_DT_STRING,
+		'M', 0, 'S', 0, 'F', 0, 'T', 0, '1', 0, '0', 0, '0', 0, // qwSignature
+		MS_VENDOR_CODE,
+		0 // bPad
+	};
+
+	assign(u, d);
+	return true;
+}
+
+} // namespace
+
+
+std::unique_ptr<usbip::emulator::device> usbip::emulator::make_bulk_device(std::string busid)
+{
+	return std::make_unique<bulk_device>(std::move(busid));
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "device.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+
+using namespace usbip::emulator;
+
+enum { DEVICE_DESC_LEN = 18, CONFIG_DESC_LEN = 9 };
+
+/*
+ * Calls f for each interface descriptor of a configuration.
+ */
+template<typename F>
+void for_each_interface(const std::vector<UINT8> &config, F &&f)
+{
+	for (size_t off = 0; off + 2 <= config.size() && config[off]; off += config[off]) {
+		if (config[off + 1] == USB_DT_INTERFACE && off + 9 <= config.size()) {
+			f(config.data() + off);
+		}
+	}
+}
+
+auto to_utf16(const std::string &s)
+{
+	std::vector<UINT8> v{ 0, USB_DT_STRING };
+
+	for (auto c: s) { // ASCII only
+		v.push_back(UINT8(c));
+		v.push_back(0);
+	}
+
+	v[0] = UINT8(std::min(v.size(), size_t(UINT8(-1) - 1)));
+	v.resize(v[0]);
+
+	return v;
+}
+
+auto make_device_qualifier(const std::vector<UINT8> &dev_desc)
+{
+	return std::vector<UINT8> {
+		10, USB_DT_DEVICE_QUALIFIER,
+		dev_desc[2], dev_desc[3], // bcdUSB
+		dev_desc[4], dev_desc[5], dev_desc[6], // bDeviceClass, bDeviceSubClass, bDeviceProtocol
+		dev_desc[7], // bMaxPacketSize0
+		dev_desc[17], // bNumConfigurations
+		0 // bReserved
+	};
+}
+
+} // namespace
+
+
+usbip::emulator::device::device(
+	std::string busid, usb_device_speed speed, std::vector<UINT8> dev_desc, std::vector<UINT8> config,
+	std::vector<std::string> strings) :
+	m_busid(std::move(busid)),
+	m_speed(speed),
+	m_dev_desc(std::move(dev_desc)),
+	m_config(std::move(config)),
+	m_strings(std::move(strings))
+{
+	assert(m_dev_desc.size() == DEVICE_DESC_LEN);
+	assert(m_config.size() >= CONFIG_DESC_LEN);
+
+	auto total = UINT16(m_config.size());
+	m_config[2] = UINT8(total); // wTotalLength
+	m_config[3] = UINT8(total >> 8);
+
+	m_altsetting.resize(m_config[4]); // bNumInterfaces
+}
+
+usbip_usb_device usbip::emulator::device::get_usb_device() const
+{
+	unsigned int busnum = 1;
+	unsigned int port = 1;
+	sscanf(m_busid.c_str(), "%u-%u", &busnum, &port);
+
+	usbip_usb_device d{};
+
+	snprintf(d.path, sizeof(d.path), "/sys/devices/platform/usbip-emulator/usb%u/%s", busnum, m_busid.c_str());
+	snprintf(d.busid, sizeof(d.busid), "%s", m_busid.c_str());
+
+	d.busnum = busnum;
+	d.devnum = port + 1; // the root hub is the first
+	d.speed = m_speed;
+
+	auto &dd = m_dev_desc;
+	d.idVendor = UINT16(dd[8] | dd[9] << 8);
+	d.idProduct = UINT16(dd[10] | dd[11] << 8);
+	d.bcdDevice = UINT16(dd[12] | dd[13] << 8);
+
+	d.bDeviceClass = dd[4];
+	d.bDeviceSubClass = dd[5];
+	d.bDeviceProtocol = dd[6];
+
+	d.bConfigurationValue = m_config[5]; // a client imports a configured device
+	d.bNumConfigurations = dd[17];
+	d.bNumInterfaces = m_config[4];
+
+	return d;
+}
+
+std::vector<usbip_usb_interface> usbip::emulator::device::get_interfaces() const
+{
+	std::vector<usbip_usb_interface> v;
+
+	for_each_interface(m_config, [&v] (auto d)
+	{
+		if (!d[3]) { // bAlternateSetting
+			v.push_back({ .bInterfaceClass = d[5], .bInterfaceSubClass = d[6], .bInterfaceProtocol = d[7] });
+		}
+	});
+
+	return v;
+}
+
+void usbip::emulator::device::release()
+{
+	m_configuration = 0;
+	std::ranges::fill(m_altsetting, 0);
+	reset(-1);
+
+	m_busy = false;
+}
+
+INT32 usbip::emulator::device::frame_number(clock::time_point t) const
+{
+	return INT32((t - m_start)/frame_duration());
+}
+
+usbip::emulator::clock::duration usbip::emulator::device::frame_duration() const
+{
+	using namespace std::chrono_literals;
+	return m_speed >= USB_SPEED_HIGH ? clock::duration(125us) : clock::duration(1ms);
+}
+
+void usbip::emulator::device::submit(urb &u)
+{
+	u.status = 0;
+	u.actual_length = u.dir_in ? 0 : INT32(u.data.size());
+	u.start_frame = 0;
+	u.error_count = 0;
+
+	if (u.ep) {
+		transfer(u);
+	} else if ((u.setup.bmRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD) {
+		standard(u);
+	} else if (!control(u.setup, u)) {
+		u.status = -EPIPE_LNX;
+	}
+
+	if (u.status && !u.iso.size()) {
+		u.actual_length = 0;
+		u.data.clear();
+	} else if (u.dir_in && ssize(u.data) > u.transfer_buffer_length) {
+		u.status = -EOVERFLOW_LNX;
+		u.data.resize(u.transfer_buffer_length);
+	}
+
+	if (u.dir_in) {
+		u.actual_length = INT32(u.data.size());
+	}
+}
+
+/*
+ * USB 2.0 spec, 9.4 Standard Device Requests.
+ */
+void usbip::emulator::device::standard(urb &u)
+{
+	auto &r = u.setup;
+	bool ok = true;
+
+	switch (r.bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		ok = get_standard_descriptor(u) || get_descriptor(r, u);
+		break;
+	case USB_REQ_SET_CONFIGURATION:
+		if (auto val = UINT8(r.wValue); (ok = !val || val == m_config[5])) { // bConfigurationValue
+			m_configuration = val;
+			std::ranges::fill(m_altsetting, 0);
+			reset(-1);
+		}
+		break;
+	case USB_REQ_GET_CONFIGURATION:
+		assign(u, &m_configuration, sizeof(m_configuration));
+		break;
+	case USB_REQ_SET_INTERFACE:
+		ok = set_interface(r.wIndex, r.wValue);
+		break;
+	case USB_REQ_GET_INTERFACE:
+		if ((ok = r.wIndex < m_altsetting.size())) {
+			assign(u, &m_altsetting[r.wIndex], 1);
+		}
+		break;
+	case USB_REQ_GET_STATUS: {
+		UINT8 status[2]{};
+		assign(u, status);
+	}	break;
+	case USB_REQ_CLEAR_FEATURE:
+		if ((r.bmRequestType & USB_RECIP_MASK) == USB_RECIP_ENDPOINT && r.wValue == USB_ENDPOINT_HALT) {
+			reset(r.wIndex & 0x0F);
+		}
+		break;
+	case USB_REQ_SET_FEATURE:
+	case USB_REQ_SET_ADDRESS:
+		break;
+	default:
+		ok = false;
+	}
+
+	if (!ok) {
+		u.status = -EPIPE_LNX;
+	}
+}
+
+bool usbip::emulator::device::get_standard_descriptor(urb &u)
+{
+	auto &r = u.setup;
+	if ((r.bmRequestType & USB_RECIP_MASK) != USB_RECIP_DEVICE) {
+		return false;
+	}
+
+	auto type = UINT8(r.wValue >> 8);
+	auto index = UINT8(r.wValue);
+
+	switch (type) {
+	case USB_DT_DEVICE:
+		assign(u, m_dev_desc);
+		break;
+	case USB_DT_CONFIG:
+		if (index) {
+			return false;
+		}
+		assign(u, m_config);
+		break;
+	case USB_DT_STRING:
+		if (!index) {
+			const UINT8 langid[] { 4, USB_DT_STRING, USB_LE16(0x0409) }; // English (United States)
+			assign(u, langid);
+		} else if (index <= m_strings.size()) {
+			assign(u, to_utf16(m_strings[index - 1]));
+		} else {
+			return false;
+		}
+		break;
+	case USB_DT_DEVICE_QUALIFIER:
+		if (m_speed != USB_SPEED_HIGH) {
+			return false;
+		}
+		assign(u, make_device_qualifier(m_dev_desc));
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+bool usbip::emulator::device::set_interface(int intf, int alt)
+{
+	bool found{};
+
+	for_each_interface(m_config, [intf, alt, &found] (auto d)
+	{
+		found = found || (d[2] == intf && d[3] == alt); // bInterfaceNumber, bAlternateSetting
+	});
+
+	if (found) {
+		m_altsetting[intf] = UINT8(alt);
+		reset(-1);
+	}
+
+	return found;
+}
+
+void usbip::emulator::assign(urb &u, const void *data, size_t len)
+{
+	auto cnt = std::min(len, size_t(std::max(u.transfer_buffer_length, 0)));
+	auto p = static_cast<const UINT8*>(data);
+
+	u.data.assign(p, p + cnt);
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/proto.h>
+#include <usbip/proto_op.h>
+#include <usbip/ch9.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace usbip::emulator
+{
+
+using clock = std::chrono::steady_clock;
+
+/*
+ * Linux error codes for usbip_header_ret_submit.status, they do not depend on the host OS.
+ * See: drivers/libdrv/usbd_helper.cpp
+ */
+enum {
+	ENOENT_LNX = 2,
+	EPIPE_LNX = 32,
+	EOVERFLOW_LNX = 75,
+	ECONNRESET_LNX = 104,
+};
+
+/*
+ * Linux URB transfer_flags.
+ */
+enum : UINT32 {
+	URB_SHORT_NOT_OK = 0x0001,
+	URB_ISO_ASAP = 0x0002,
+};
+
+/*
+ * Declarations from <uapi/linux/usb/ch9.h>
+ */
+enum : UINT8 {
+	USB_DIR_OUT = 0,
+	USB_DIR_IN = 0x80,
+
+	USB_TYPE_MASK = 0x03 << 5,
+	USB_TYPE_STANDARD = 0x00 << 5,
+	USB_TYPE_CLASS = 0x01 << 5,
+	USB_TYPE_VENDOR = 0x02 << 5,
+
+	USB_RECIP_MASK = 0x1F,
+	USB_RECIP_DEVICE = 0,
+	USB_RECIP_INTERFACE,
+	USB_RECIP_ENDPOINT,
+};
+
+enum : UINT8 {
+	USB_REQ_GET_STATUS = 0x00,
+	USB_REQ_CLEAR_FEATURE = 0x01,
+	USB_REQ_SET_FEATURE = 0x03,
+	USB_REQ_SET_ADDRESS = 0x05,
+	USB_REQ_GET_DESCRIPTOR = 0x06,
+	USB_REQ_GET_CONFIGURATION = 0x08,
+	USB_REQ_SET_CONFIGURATION = 0x09,
+	USB_REQ_GET_INTERFACE = 0x0A,
+	USB_REQ_SET_INTERFACE = 0x0B,
+};
+
+enum : UINT8 {
+	USB_DT_DEVICE = 0x01,
+	USB_DT_CONFIG = 0x02,
+	USB_DT_STRING = 0x03,
+	USB_DT_INTERFACE = 0x04,
+	USB_DT_ENDPOINT = 0x05,
+	USB_DT_DEVICE_QUALIFIER = 0x06,
+	USB_DT_CS_INTERFACE = 0x24,
+	USB_DT_CS_ENDPOINT = 0x25,
+};
+
+enum : UINT8 {
+	USB_ENDPOINT_XFER_CONTROL,
+	USB_ENDPOINT_XFER_ISOC,
+	USB_ENDPOINT_XFER_BULK,
+	USB_ENDPOINT_XFER_INT,
+};
+
+enum { USB_ENDPOINT_HALT = 0 }; // feature selector
+
+/*
+ * For descriptors that are written as byte arrays.
+ */
+#define USB_LE16(val) UINT8((val) & 0xFF), UINT8(((val) >> 8) & 0xFF)
+
+#include <PSHPACK1.H>
+
+/*
+ * Multi-byte fields are little-endian on the wire, the code assumes little-endian host.
+ */
+struct setup_packet
+{
+	UINT8 bmRequestType;
+	UINT8 bRequest;
+	UINT16 wValue;
+	UINT16 wIndex;
+	UINT16 wLength;
+};
+static_assert(sizeof(setup_packet) == sizeof(usbip_header_cmd_submit::setup));
+
+#include <POPPACK.H>
+
+/*
+ * CMD_SUBMIT and the result of its execution.
+ */
+struct urb
+{
+	seqnum_t seqnum;
+	int ep; // endpoint number
+	bool dir_in;
+	UINT32 transfer_flags;
+	setup_packet setup;
+	INT32 transfer_buffer_length;
+	INT32 interval;
+
+	std::vector<UINT8> data; // payload of OUT or the data that a device returns for IN (actual_length)
+	std::vector<usbip_iso_packet_descriptor> iso; // in host byte order, empty if it is not isoch transfer
+
+	INT32 status; // zero or negative Linux error code
+	INT32 actual_length; // of OUT
+	INT32 start_frame;
+	INT32 error_count;
+
+	/*
+	 * The moment the request arrived to the server.
+	 * A device sets the moment of completion if it is later.
+	 */
+	clock::time_point ready;
+};
+
+/*
+ * Emulated USB device, USB/IP server exports it.
+ * Requests are submitted by the thread of a single connection, a device is not thread-safe.
+ */
+class device
+{
+public:
+	virtual ~device() = default;
+
+	auto& busid() const noexcept { return m_busid; }
+
+	usbip_usb_device get_usb_device() const;
+	std::vector<usbip_usb_interface> get_interfaces() const;
+
+	/*
+	 * The device is imported by a client.
+	 */
+	bool acquire() noexcept { return !m_busy.exchange(true); }
+	void release();
+
+	/*
+	 * URB is completed synchronously, a device can postpone its completion by urb.ready.
+	 */
+	void submit(urb &u);
+
+protected:
+	device(std::string busid, usb_device_speed speed, std::vector<UINT8> dev_desc, std::vector<UINT8> config,
+	       std::vector<std::string> strings);
+
+	auto speed() const noexcept { return m_speed; }
+	auto configuration() const noexcept { return m_configuration; }
+	auto altsetting(int intf) const noexcept { return intf < std::ssize(m_altsetting) ? m_altsetting[intf] : 0; }
+
+	/*
+	 * Transfer to an endpoint other than default control pipe.
+	 */
+	virtual void transfer(urb &u) = 0;
+
+	/*
+	 * Class or vendor specific control request.
+	 * @return false to stall the request
+	 */
+	virtual bool control(const setup_packet&, urb&) { return false; }
+
+	/*
+	 * Descriptor that is not returned by GET_DESCRIPTOR of the device, a configuration or a string.
+	 */
+	virtual bool get_descriptor(const setup_packet&, urb&) { return false; }
+
+	/*
+	 * Configuration or interface setting was changed, halt of an endpoint is cleared,
+	 * the connection is closed.
+	 */
+	virtual void reset(int /*ep*/) {}
+
+	/*
+	 * Number of frames (1ms) or microframes (125us) since the device is imported.
+	 */
+	INT32 frame_number(clock::time_point t) const;
+	clock::duration frame_duration() const;
+
+private:
+	std::string m_busid;
+	usb_device_speed m_speed;
+
+	std::vector<UINT8> m_dev_desc;
+	std::vector<UINT8> m_config;
+	std::vector<std::string> m_strings;
+
+	UINT8 m_configuration{};
+	std::vector<UINT8> m_altsetting;
+	clock::time_point m_start = clock::now();
+
+	std::atomic<bool> m_busy;
+
+	void standard(urb &u);
+	bool get_standard_descriptor(urb &u);
+	bool set_interface(int intf, int alt);
+};
+
+/*
+ * Copy the part of data that fits to the buffer of IN transfer.
+ */
+void assign(urb &u, const void *data, size_t len);
+
+template<typename T>
+inline void assign(urb &u, const T &v)
+{
+	assign(u, std::data(v), std::size(v)*sizeof(*std::data(v)));
+}
+
+} // namespace usbip::emulator
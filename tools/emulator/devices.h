@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "device.h"
+#include <memory>
+
+namespace usbip::emulator
+{
+
+/*
+ * Vendor specific interface with bulk IN (source) and bulk OUT (sink) endpoints.
+ * Windows loads WinUSB for it, MS OS 1.0 descriptors are used.
+ */
+std::unique_ptr<device> make_bulk_device(std::string busid);
+
+/*
+ * Vendor defined HID, interrupt IN endpoint has a new report every frame.
+ */
+std::unique_ptr<device> make_hid_device(std::string busid);
+
+/*
+ * USB Audio Class 1.0 microphone, isoch IN endpoint streams 48 kHz 16-bit stereo PCM.
+ */
+std::unique_ptr<device> make_audio_device(std::string busid);
+
+/*
+ * Mass Storage Class, Bulk-Only Transport, SCSI transparent command set, RAM disk.
+ * @param disk_size in bytes, a multiple of block size
+ */
+std::unique_ptr<device> make_msc_device(std::string busid, UINT64 disk_size);
+
+/*
+ * idVendor of emulated devices, see https://pid.codes
+ */
+enum : UINT16 { VENDOR_ID = 0x1209 };
+
+} // namespace usbip::emulator
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "devices.h"
+
+namespace
+{
+
+using namespace usbip::emulator;
+
+enum : UINT8 { EP_IN = 0x81, INTERVAL = 1 }; // ms
+enum : UINT8 { USB_DT_HID = 0x21, USB_DT_REPORT = 0x22 };
+enum : UINT8 { REPORT_SIZE = 8 };
+
+/*
+ * Device Class Definition for HID 1.11, 7.2 Class-Specific Requests.
+ */
+enum : UINT8 {
+	HID_GET_REPORT = 0x01,
+	HID_GET_IDLE = 0x02,
+	HID_GET_PROTOCOL = 0x03,
+	HID_SET_REPORT = 0x09,
+	HID_SET_IDLE = 0x0A,
+	HID_SET_PROTOCOL = 0x0B,
+};
+
+/*
+ * Vendor defined usage page, so the reports are not interpreted by the OS (unlike mouse's ones).
+ * Input report is a counter, output report is ignored.
+ */
+const UINT8 report_descriptor[] {
+	0x06, USB_LE16(0xFF00), // Usage Page (Vendor Defined)
+	0x09, 0x01, // Usage (1)
+	0xA1, 0x01, // Collection (Application)
+	0x09, 0x02, //   Usage (2)
+	0x15, 0x00, //   Logical Minimum (0)
+	0x26, USB_LE16(0x00FF), //   Logical Maximum (255)
+	0x75, 0x08, //   Report Size (8)
+	0x95, REPORT_SIZE, //   Report Count
+	0x81, 0x02, //   Input (Data, Variable, Absolute)
+	0x09, 0x03, //   Usage (3)
+	0x95, REPORT_SIZE, //   Report Count
+	0x91, 0x02, //   Output (Data, Variable, Absolute)
+	0xC0 // End Collection
+};
+
+#define HID_DESCRIPTOR 9, USB_DT_HID, USB_LE16(0x0111), 0, 1, USB_DT_REPORT, USB_LE16(sizeof(report_descriptor))
+
+class hid_device : public device
+{
+public:
+	explicit hid_device(std::string busid);
+
+private:
+	UINT64 m_counter{};
+	static_assert(sizeof(m_counter) == REPORT_SIZE);
+
+	clock::time_point m_next_report;
+	UINT8 m_idle{};
+	UINT8 m_protocol = 1; // report
+
+	void transfer(urb &u) override;
+	bool control(const setup_packet &r, urb &u) override;
+	bool get_descriptor(const setup_packet &r, urb &u) override;
+
+	void get_report(urb &u) { assign(u, &m_counter, sizeof(m_counter)); }
+};
+
+hid_device::hid_device(std::string busid) :
+	device(busid, USB_SPEED_FULL,
+	{
+		18, USB_DT_DEVICE, USB_LE16(bcdUSB20), 0, 0, 0, 64,
+		USB_LE16(VENDOR_ID), USB_LE16(0x0002), USB_LE16(0x0100),
+		1, 2, 3, 1
+	},
+	{
+		9, USB_DT_CONFIG, USB_LE16(0), 1, 1, 0, 0x80, 50,
+
+		9, USB_DT_INTERFACE, 0, 0, 1, 3, 0, 0, 0, // HID, no subclass, no protocol
+		HID_DESCRIPTOR,
+		7, USB_DT_ENDPOINT, EP_IN, USB_ENDPOINT_XFER_INT, USB_LE16(REPORT_SIZE), INTERVAL,
+	},
+	{ "USB/IP emulator", "Vendor defined HID", "HID-" + busid })
+{}
+
+/*
+ * A report is available once per bInterval, a request waits for it.
+ */
+void hid_device::transfer(urb &u)
+{
+	if (!(u.dir_in && u.ep == (EP_IN & 0x0F) && u.iso.empty())) {
+		u.status = -EPIPE_LNX;
+		return;
+	}
+
+	u.ready = std::max(u.ready, m_next_report);
+	m_next_report = u.ready + INTERVAL*frame_duration();
+
+	++m_counter;
+	get_report(u);
+}
+
+bool hid_device::control(const setup_packet &r, urb &u)
+{
+	if ((r.bmRequestType & (USB_TYPE_MASK | USB_RECIP_MASK)) != (USB_TYPE_CLASS | USB_RECIP_INTERFACE)) {
+		return false;
+	}
+
+	switch (r.bRequest) {
+	case HID_GET_REPORT:
+		get_report(u);
+		break;
+	case HID_GET_IDLE:
+		assign(u, &m_idle, sizeof(m_idle));
+		break;
+	case HID_GET_PROTOCOL:
+		assign(u, &m_protocol, sizeof(m_protocol));
+		break;
+	case HID_SET_REPORT:
+		break;
+	case HID_SET_IDLE:
+		m_idle = UINT8(r.wValue >> 8);
+		break;
+	case HID_SET_PROTOCOL:
+		m_protocol = UINT8(r.wValue);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+bool hid_device::get_descriptor(const setup_packet &r, urb &u)
+{
+	if ((r.bmRequestType & USB_RECIP_MASK) != USB_RECIP_INTERFACE) {
+		return false;
+	}
+
+	switch (r.wValue >> 8) {
+	case USB_DT_REPORT:
+		assign(u, report_descriptor);
+		break;
+	case USB_DT_HID: {
+		const UINT8 d[] { HID_DESCRIPTOR };
+		assign(u, d);
+	}	break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace
+
+
+std::unique_ptr<usbip::emulator::device> usbip::emulator::make_hid_device(std::string busid)
+{
+	return std::make_unique<hid_device>(std::move(busid));
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "link.h"
+
+usbip::emulator::channel::channel(const link_params &params, std::mt19937_64::result_type seed) :
+	m_params(params),
+	m_rnd(seed),
+	m_lost(params.loss)
+{
+}
+
+auto usbip::emulator::channel::transmit(clock::time_point sent, size_t bytes) -> clock::time_point
+{
+	auto start = std::max(sent, m_free);
+	m_free = start;
+
+	if (auto bw = m_params.bandwidth) {
+		using namespace std::chrono;
+		m_free += duration_cast<clock::duration>(duration<double>(double(bytes)/bw));
+	}
+
+	if (m_params.loss > 0 && m_lost(m_rnd)) {
+		m_free += m_params.rto;
+	}
+
+	return m_free + m_params.latency;
+}
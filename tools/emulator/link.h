@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "device.h"
+#include <random>
+
+namespace usbip::emulator
+{
+
+/*
+ * Impairments of emulated network, they are applied to each connection.
+ */
+struct link_params
+{
+	clock::duration latency{}; // one-way delay, round-trip time is twice as much
+	UINT64 bandwidth{}; // bytes per second in each direction, zero means unlimited
+	double loss{}; // probability that a PDU is lost, [0, 1)
+	clock::duration rto = std::chrono::milliseconds(200); // TCP retransmission timeout
+};
+
+/*
+ * One direction of a connection.
+ *
+ * USB/IP runs over TCP, so a lost PDU is not missing, it is delayed by retransmission timeout.
+ * All PDUs that follow it are delayed too (head-of-line blocking).
+ */
+class channel
+{
+public:
+	channel(const link_params &params, std::mt19937_64::result_type seed);
+
+	/*
+	 * @param sent the moment PDU is ready for transmission
+	 * @return the moment PDU is received by the peer
+	 */
+	clock::time_point transmit(clock::time_point sent, size_t bytes);
+
+private:
+	link_params m_params;
+	clock::time_point m_free; // the moment the link can start transmission of next PDU
+
+	std::mt19937_64 m_rnd;
+	std::bernoulli_distribution m_lost;
+};
+
+} // namespace usbip::emulator
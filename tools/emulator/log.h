@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdio>
+
+namespace usbip::emulator
+{
+
+enum class log_level { error, info, debug };
+inline auto max_log_level = log_level::info;
+
+/*
+ * Messages are written to stderr.
+ */
+template<typename... Args>
+inline void log(log_level level, const char *fmt, Args... args)
+{
+	if (level <= max_log_level) {
+		std::fprintf(stderr, fmt, args...);
+		std::fputc('\n', stderr);
+	}
+}
+
+} // namespace usbip::emulator
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "devices.h"
+#include "log.h"
+#include "session.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <getopt.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::emulator;
+
+struct options
+{
+	const char *address{};
+	const char *port = tcp_port;
+
+	int count = 1; // of each kind
+	std::vector<std::string> kinds{ "bulk", "hid", "audio", "msc" };
+	UINT64 disk_size = 64*1024*1024;
+
+	link_params link;
+};
+
+void usage(const char *program)
+{
+	printf("USB/IP server that exports emulated devices, a stand-in for Linux servers in benchmarks.\n"
+	       "Usage: %s [options]\n"
+	       "  -a, --address ADDR      address to listen on, all by default\n"
+	       "  -p, --port PORT         TCP port, %s by default\n"
+	       "  -d, --devices LIST      comma separated kinds of devices: bulk,hid,audio,msc (all by default)\n"
+	       "  -n, --count N           number of devices of each kind, 1 by default\n"
+	       "  -s, --disk-size MIB     capacity of msc device, 64 by default\n"
+	       "  -l, --latency USEC      one-way network delay, round-trip time is twice as much\n"
+	       "  -b, --bandwidth MBIT    throughput of each direction of a connection, unlimited by default\n"
+	       "  -L, --loss PERCENT      PDUs that are lost and retransmitted\n"
+	       "  -r, --rto MSEC          TCP retransmission timeout for lost PDUs, 200 by default\n"
+	       "  -v, --verbose           log every request\n"
+	       "  -h, --help\n",
+	       program, tcp_port);
+}
+
+auto split(const char *s)
+{
+	std::vector<std::string> v;
+
+	for (auto p = s; *p; ) {
+		auto end = strchr(p, ',');
+		if (!end) {
+			end = p + strlen(p);
+		}
+		if (end != p) {
+			v.emplace_back(p, end);
+		}
+		p = *end ? end + 1 : end;
+	}
+
+	return v;
+}
+
+bool parse_options(options &opt, int argc, char *argv[])
+{
+	const option longopts[] {
+		{ "address", required_argument, nullptr, 'a' },
+		{ "port", required_argument, nullptr, 'p' },
+		{ "devices", required_argument, nullptr, 'd' },
+		{ "count", required_argument, nullptr, 'n' },
+		{ "disk-size", required_argument, nullptr, 's' },
+		{ "latency", required_argument, nullptr, 'l' },
+		{ "bandwidth", required_argument, nullptr, 'b' },
+		{ "loss", required_argument, nullptr, 'L' },
+		{ "rto", required_argument, nullptr, 'r' },
+		{ "verbose", no_argument, nullptr, 'v' },
+		{ "help", no_argument, nullptr, 'h' },
+		{}
+	};
+
+	using namespace std::chrono;
+
+	for (int c; (c = getopt_long(argc, argv, "a:p:d:n:s:l:b:L:r:vh", longopts, nullptr)) != -1; ) {
+		switch (c) {
+		case 'a':
+			opt.address = optarg;
+			break;
+		case 'p':
+			opt.port = optarg;
+			break;
+		case 'd':
+			opt.kinds = split(optarg);
+			break;
+		case 'n':
+			opt.count = atoi(optarg);
+			break;
+		case 's':
+			opt.disk_size = strtoull(optarg, nullptr, 10) << 20;
+			break;
+		case 'l':
+			opt.link.latency = duration_cast<clock::duration>(microseconds(strtoll(optarg, nullptr, 10)));
+			break;
+		case 'b':
+			opt.link.bandwidth = UINT64(strtod(optarg, nullptr)*1'000'000/8);
+			break;
+		case 'L':
+			opt.link.loss = strtod(optarg, nullptr)/100;
+			break;
+		case 'r':
+			opt.link.rto = duration_cast<clock::duration>(milliseconds(strtoll(optarg, nullptr, 10)));
+			break;
+		case 'v':
+			max_log_level = log_level::debug;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			return false;
+		}
+	}
+
+	if (optind != argc) {
+		log(log_level::error, "unexpected argument '%s'", argv[optind]);
+		return false;
+	}
+
+	if (opt.count <= 0 || opt.count > 99) {
+		log(log_level::error, "count must be in [1, 99]");
+		return false;
+	}
+
+	if (opt.link.loss < 0 || opt.link.loss >= 1) {
+		log(log_level::error, "loss must be in [0, 100)");
+		return false;
+	}
+
+	if (opt.link.latency.count() < 0 || opt.link.rto.count() < 0) {
+		log(log_level::error, "latency and rto can't be negative");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Bus id is "1-<port>", ports are numbered across all devices.
+ */
+bool make_devices(devices_t &devices, const options &opt)
+{
+	for (int i = 0; i < opt.count; ++i) {
+		for (auto &kind: opt.kinds) {
+
+			auto busid = "1-" + std::to_string(devices.size() + 1);
+
+			if (kind == "bulk") {
+				devices.push_back(make_bulk_device(busid));
+			} else if (kind == "hid") {
+				devices.push_back(make_hid_device(busid));
+			} else if (kind == "audio") {
+				devices.push_back(make_audio_device(busid));
+			} else if (kind == "msc") {
+				devices.push_back(make_msc_device(busid, opt.disk_size));
+			} else {
+				log(log_level::error, "unknown device kind '%s'", kind.c_str());
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	options opt;
+	if (!parse_options(opt, argc, argv)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	static devices_t devices; // threads of connections are detached
+	if (!make_devices(devices, opt)) {
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	auto sock = listen(opt.address, opt.port);
+	if (!sock) {
+		return EXIT_FAILURE;
+	}
+
+	for (auto &dev: devices) {
+		auto d = dev->get_usb_device();
+		log(log_level::info, "%s: %04x:%04x", d.busid, d.idVendor, d.idProduct);
+	}
+
+	log(log_level::info, "listening on %s:%s", opt.address ? opt.address : "*", opt.port);
+
+	while (auto s = accept(sock.get())) {
+		std::thread(serve, std::move(s), std::cref(devices), opt.link).detach();
+	}
+
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "devices.h"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+namespace
+{
+
+using namespace usbip::emulator;
+
+enum : UINT8 { EP_IN = 0x81, EP_OUT = 0x02 };
+enum : UINT16 { MAX_PACKET_SIZE = 512 };
+enum : UINT32 { BLOCK_SIZE = 512 };
+
+/*
+ * Universal Serial Bus Mass Storage Class Bulk-Only Transport 1.0.
+ */
+enum : UINT8 { BOT_GET_MAX_LUN = 0xFE, BOT_RESET = 0xFF };
+enum : UINT32 { CBW_SIGNATURE = 0x43425355, CSW_SIGNATURE = 0x53425355 };
+enum : UINT8 { CSW_PASSED, CSW_FAILED, CSW_PHASE_ERROR };
+
+#include <PSHPACK1.H>
+
+struct command_block_wrapper
+{
+	UINT32 dCBWSignature;
+	UINT32 dCBWTag;
+	UINT32 dCBWDataTransferLength;
+	UINT8 bmCBWFlags;
+	UINT8 bCBWLUN;
+	UINT8 bCBWCBLength;
+	UINT8 CBWCB[16];
+};
+static_assert(sizeof(command_block_wrapper) == 31);
+
+struct command_status_wrapper
+{
+	UINT32 dCSWSignature;
+	UINT32 dCSWTag;
+	UINT32 dCSWDataResidue;
+	UINT8 bCSWStatus;
+};
+static_assert(sizeof(command_status_wrapper) == 13);
+
+#include <POPPACK.H>
+
+/*
+ * SCSI Primary Commands, SCSI Block Commands.
+ */
+enum : UINT8 {
+	TEST_UNIT_READY = 0x00,
+	REQUEST_SENSE = 0x03,
+	INQUIRY = 0x12,
+	MODE_SENSE_6 = 0x1A,
+	START_STOP_UNIT = 0x1B,
+	PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1E,
+	READ_FORMAT_CAPACITIES = 0x23,
+	READ_CAPACITY_10 = 0x25,
+	READ_10 = 0x28,
+	WRITE_10 = 0x2A,
+	VERIFY_10 = 0x2F,
+	SYNCHRONIZE_CACHE_10 = 0x35,
+	MODE_SENSE_10 = 0x5A,
+};
+
+enum : UINT8 { NO_SENSE = 0x00, ILLEGAL_REQUEST = 0x05 }; // sense keys
+
+/*
+ * Additional sense code and qualifier.
+ */
+enum : UINT16 {
+	INVALID_COMMAND_OPERATION_CODE = 0x2000,
+	LBA_OUT_OF_RANGE = 0x2100,
+	INVALID_FIELD_IN_CDB = 0x2400,
+};
+
+inline auto get_be16(const UINT8 *p) { return UINT16(p[0] << 8 | p[1]); }
+inline auto get_be32(const UINT8 *p) { return UINT32(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]); }
+
+inline void put_be32(UINT8 *p, UINT32 val)
+{
+	p[0] = UINT8(val >> 24);
+	p[1] = UINT8(val >> 16);
+	p[2] = UINT8(val >> 8);
+	p[3] = UINT8(val);
+}
+
+/*
+ * BOT requires at least 12 hexadecimal digits, they must be unique for the same idVendor and idProduct.
+ */
+auto make_serial_number(const std::string &busid)
+{
+	char s[17];
+	snprintf(s, sizeof(s), "%016llX", static_cast<unsigned long long>(std::hash<std::string>{}(busid)));
+	return std::string(s);
+}
+
+class msc_device : public device
+{
+public:
+	msc_device(std::string busid, UINT64 disk_size);
+
+private:
+	enum class phase { command, data_in, data_out, status };
+	phase m_phase = phase::command;
+
+	std::vector<UINT8> m_disk;
+
+	command_block_wrapper m_cbw{};
+	command_status_wrapper m_csw{};
+
+	std::vector<UINT8> m_buf; // data of IN or OUT phase
+	size_t m_offset{}; // of data_in
+
+	UINT8 m_sense_key{};
+	UINT16 m_asc{};
+
+	void transfer(urb &u) override;
+	bool control(const setup_packet &r, urb &u) override;
+	void reset(int ep) override;
+
+	void command(urb &u);
+	void data_in(urb &u);
+	void data_out(urb &u);
+	void status(urb &u);
+
+	void execute();
+	void write();
+	bool get_range(UINT64 &offset, size_t &len);
+
+	void fail(UINT8 sense_key, UINT16 asc);
+	void inquiry();
+	void request_sense();
+	void read_capacity();
+	void read_format_capacities();
+	void mode_sense(bool ten);
+	void read();
+
+	auto block_cnt() const { return UINT32(m_disk.size()/BLOCK_SIZE); }
+	auto is_dir_in() const { return m_cbw.bmCBWFlags & USB_DIR_IN; }
+};
+
+msc_device::msc_device(std::string busid, UINT64 disk_size) :
+	device(busid, USB_SPEED_HIGH,
+	{
+		18, USB_DT_DEVICE, USB_LE16(bcdUSB20), 0, 0, 0, 64,
+		USB_LE16(VENDOR_ID), USB_LE16(0x0004), USB_LE16(0x0100),
+		1, 2, 3, 1
+	},
+	{
+		9, USB_DT_CONFIG, USB_LE16(0), 1, 1, 0, 0x80, 50,
+
+		9, USB_DT_INTERFACE, 0, 0, 2, 0x08, 0x06, 0x50, 0, // Mass Storage, SCSI, Bulk-Only
+		7, USB_DT_ENDPOINT, EP_IN, USB_ENDPOINT_XFER_BULK, USB_LE16(MAX_PACKET_SIZE), 0,
+		7, USB_DT_ENDPOINT, EP_OUT, USB_ENDPOINT_XFER_BULK, USB_LE16(MAX_PACKET_SIZE), 0,
+	},
+	{ "USB/IP emulator", "RAM disk", make_serial_number(busid) }),
+	m_disk(disk_size/BLOCK_SIZE*BLOCK_SIZE)
+{}
+
+void msc_device::reset(int)
+{
+	m_phase = phase::command;
+	m_buf.clear();
+	m_offset = 0;
+}
+
+bool msc_device::control(const setup_packet &r, urb &u)
+{
+	if ((r.bmRequestType & (USB_TYPE_MASK | USB_RECIP_MASK)) != (USB_TYPE_CLASS | USB_RECIP_INTERFACE)) {
+		return false;
+	}
+
+	switch (r.bRequest) {
+	case BOT_GET_MAX_LUN: {
+		UINT8 max_lun = 0;
+		assign(u, &max_lun, sizeof(max_lun));
+	}	break;
+	case BOT_RESET:
+		reset(-1);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * An endpoint is stalled if a request does not correspond to the current phase.
+ */
+void msc_device::transfer(urb &u)
+{
+	auto ep = u.ep | (u.dir_in ? USB_DIR_IN : USB_DIR_OUT);
+
+	if (u.iso.size()) {
+		u.status = -EPIPE_LNX;
+	} else if (ep == EP_OUT && m_phase == phase::command) {
+		command(u);
+	} else if (ep == EP_OUT && m_phase == phase::data_out) {
+		data_out(u);
+	} else if (ep == EP_IN && m_phase == phase::data_in) {
+		data_in(u);
+	} else if (ep == EP_IN && m_phase == phase::status) {
+		status(u);
+	} else {
+		u.status = -EPIPE_LNX;
+	}
+}
+
+void msc_device::command(urb &u)
+{
+	if (u.data.size() != sizeof(m_cbw)) {
+		u.status = -EPIPE_LNX;
+		return;
+	}
+
+	memcpy(&m_cbw, u.data.data(), sizeof(m_cbw));
+	if (m_cbw.dCBWSignature != CBW_SIGNATURE) {
+		u.status = -EPIPE_LNX;
+		return;
+	}
+
+	m_csw = {
+		.dCSWSignature = CSW_SIGNATURE,
+		.dCSWTag = m_cbw.dCBWTag,
+		.dCSWDataResidue = m_cbw.dCBWDataTransferLength,
+		.bCSWStatus = CSW_PASSED
+	};
+
+	m_buf.clear();
+	m_offset = 0;
+
+	auto len = m_cbw.dCBWDataTransferLength;
+
+	if (len && !is_dir_in()) {
+		m_phase = phase::data_out; // command will be executed when data is received
+		return;
+	}
+
+	execute();
+
+	if (m_buf.size() > len) {
+		m_buf.resize(len);
+	}
+
+	m_phase = len ? phase::data_in : phase::status;
+}
+
+/*
+ * If the device has less data than the host expects, the last transfer is short (can be zero length).
+ */
+void msc_device::data_in(urb &u)
+{
+	auto len = std::min(m_buf.size() - m_offset, size_t(u.transfer_buffer_length));
+
+	auto p = m_buf.data() + m_offset;
+	u.data.assign(p, p + len);
+
+	m_offset += len;
+	m_csw.dCSWDataResidue -= UINT32(len);
+
+	if (m_offset == m_buf.size()) {
+		m_phase = phase::status;
+	}
+}
+
+void msc_device::data_out(urb &u)
+{
+	auto len = std::min(u.data.size(), size_t(m_cbw.dCBWDataTransferLength - m_buf.size()));
+	m_buf.insert(m_buf.end(), u.data.begin(), u.data.begin() + len);
+
+	if (m_buf.size() == m_cbw.dCBWDataTransferLength) {
+		m_csw.dCSWDataResidue = 0;
+		execute();
+		m_phase = phase::status;
+	}
+}
+
+void msc_device::status(urb &u)
+{
+	assign(u, &m_csw, sizeof(m_csw));
+	m_phase = phase::command;
+}
+
+void msc_device::fail(UINT8 sense_key, UINT16 asc)
+{
+	m_sense_key = sense_key;
+	m_asc = asc;
+
+	m_buf.clear();
+	m_csw.bCSWStatus = CSW_FAILED;
+}
+
+void msc_device::execute()
+{
+	if (m_cbw.bCBWLUN) {
+		fail(ILLEGAL_REQUEST, INVALID_FIELD_IN_CDB);
+		return;
+	}
+
+	switch (m_cbw.CBWCB[0]) {
+	case TEST_UNIT_READY:
+	case START_STOP_UNIT:
+	case PREVENT_ALLOW_MEDIUM_REMOVAL:
+	case VERIFY_10:
+	case SYNCHRONIZE_CACHE_10:
+		break;
+	case REQUEST_SENSE:
+		request_sense();
+		break;
+	case INQUIRY:
+		inquiry();
+		break;
+	case MODE_SENSE_6:
+		mode_sense(false);
+		break;
+	case MODE_SENSE_10:
+		mode_sense(true);
+		break;
+	case READ_FORMAT_CAPACITIES:
+		read_format_capacities();
+		break;
+	case READ_CAPACITY_10:
+		read_capacity();
+		break;
+	case READ_10:
+		read();
+		break;
+	case WRITE_10:
+		write();
+		break;
+	default:
+		fail(ILLEGAL_REQUEST, INVALID_COMMAND_OPERATION_CODE);
+	}
+}
+
+void msc_device::inquiry()
+{
+	if (m_cbw.CBWCB[1] & 1) { // EVPD, vital product data pages are not supported
+		fail(ILLEGAL_REQUEST, INVALID_FIELD_IN_CDB);
+		return;
+	}
+
+	m_buf = {
+		0x00, // direct access block device
+		0x80, // removable
+		0x04, // SPC-2
+		0x02, // response data format
+		31, // additional length
+		0, 0, 0,
+		'U', 'S', 'B', '/', 'I', 'P', ' ', ' ', // vendor
+		'E', 'm', 'u', 'l', 'a', 't', 'e', 'd', ' ', 'd', 'i', 's', 'k', ' ', ' ', ' ', // product
+		'1', '.', '0', '0' // revision
+	};
+}
+
+void msc_device::request_sense()
+{
+	m_buf.assign(18, 0);
+
+	m_buf[0] = 0x70; // current errors, fixed format
+	m_buf[2] = m_sense_key;
+	m_buf[7] = 10; // additional sense length
+	m_buf[12] = UINT8(m_asc >> 8);
+	m_buf[13] = UINT8(m_asc);
+
+	m_sense_key = NO_SENSE;
+	m_asc = 0;
+}
+
+void msc_device::mode_sense(bool ten)
+{
+	if (ten) {
+		m_buf = { 0, 6, 0, 0, 0, 0, 0, 0 }; // mode data length, no block descriptors
+	} else {
+		m_buf = { 3, 0, 0, 0 };
+	}
+}
+
+void msc_device::read_capacity()
+{
+	m_buf.assign(8, 0);
+	put_be32(&m_buf[0], block_cnt() - 1); // last LBA
+	put_be32(&m_buf[4], BLOCK_SIZE);
+}
+
+void msc_device::read_format_capacities()
+{
+	m_buf.assign(12, 0);
+	m_buf[3] = 8; // capacity list length
+
+	put_be32(&m_buf[4], block_cnt());
+	put_be32(&m_buf[8], BLOCK_SIZE);
+	m_buf[8] = 0x02; // formatted media, overwrites the high byte of block length
+}
+
+bool msc_device::get_range(UINT64 &offset, size_t &len)
+{
+	auto &cb = m_cbw.CBWCB;
+
+	UINT64 lba = get_be32(cb + 2);
+	UINT64 cnt = get_be16(cb + 7);
+
+	if (lba + cnt > block_cnt()) {
+		fail(ILLEGAL_REQUEST, LBA_OUT_OF_RANGE);
+		return false;
+	}
+
+	offset = lba*BLOCK_SIZE;
+	len = size_t(cnt*BLOCK_SIZE);
+	return true;
+}
+
+void msc_device::read()
+{
+	UINT64 offset;
+	size_t len;
+
+	if (get_range(offset, len)) {
+		auto p = m_disk.data() + offset;
+		m_buf.assign(p, p + len);
+	}
+}
+
+/*
+ * The data that was received in data_out phase.
+ */
+void msc_device::write()
+{
+	UINT64 offset;
+	size_t len;
+
+	if (get_range(offset, len)) {
+		memcpy(m_disk.data() + offset, m_buf.data(), std::min(len, m_buf.size()));
+	}
+
+	m_buf.clear();
+}
+
+} // namespace
+
+
+std::unique_ptr<usbip::emulator::device> usbip::emulator::make_msc_device(std::string busid, UINT64 disk_size)
+{
+	return std::make_unique<msc_device>(std::move(busid), disk_size);
+}
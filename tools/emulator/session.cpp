@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "session.h"
+#include "log.h"
+
+#include <libdrv/pdu.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <sys/socket.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::emulator;
+
+enum { MAX_TRANSFER_BUFFER_LENGTH = 64*1024*1024 };
+
+/*
+ * RET_SUBMIT or RET_UNLINK in network byte order.
+ */
+struct pdu
+{
+	seqnum_t seqnum; // of RET_SUBMIT, zero for RET_UNLINK
+	std::vector<UINT8> buf;
+};
+
+/*
+ * Sends PDUs when their devices complete them and the network delivers them.
+ */
+class sender
+{
+public:
+	sender(int sock, const link_params &params);
+	~sender() { stop(); }
+
+	sender(const sender&) = delete;
+	sender& operator =(const sender&) = delete;
+
+	/*
+	 * @param ready the moment the device completes a request
+	 */
+	void submit(pdu &&p, clock::time_point ready);
+
+	/*
+	 * @return true if RET_SUBMIT was not sent yet, it will never be
+	 */
+	bool unlink(seqnum_t seqnum);
+
+	void stop();
+
+private:
+	int m_sock;
+	channel m_link;
+
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	bool m_stop{};
+
+	std::multimap<clock::time_point, pdu> m_pending; // by completion time
+	std::deque<std::pair<clock::time_point, pdu>> m_queue; // by arrival time, it grows monotonically
+
+	std::thread m_thread;
+
+	void run();
+};
+
+sender::sender(int sock, const link_params &params) :
+	m_sock(sock),
+	m_link(params, std::random_device{}()),
+	m_thread(&sender::run, this)
+{
+}
+
+void sender::stop()
+{
+	{
+		std::lock_guard lock(m_mtx);
+		m_stop = true;
+	}
+
+	m_cv.notify_one();
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void sender::submit(pdu &&p, clock::time_point ready)
+{
+	{
+		std::lock_guard lock(m_mtx);
+		m_pending.emplace(ready, std::move(p));
+	}
+
+	m_cv.notify_one();
+}
+
+bool sender::unlink(seqnum_t seqnum)
+{
+	std::lock_guard lock(m_mtx);
+
+	if (auto i = std::ranges::find(m_pending, seqnum, [] (auto &v) { return v.second.seqnum; });
+	    i != m_pending.end()) {
+		m_pending.erase(i);
+		return true;
+	}
+
+	if (auto i = std::ranges::find(m_queue, seqnum, [] (auto &v) { return v.second.seqnum; });
+	    i != m_queue.end()) {
+		m_queue.erase(i);
+		return true;
+	}
+
+	return false;
+}
+
+void sender::run()
+{
+	std::unique_lock lock(m_mtx);
+
+	while (!m_stop) {
+		auto now = clock::now();
+
+		for (auto i = m_pending.begin(); i != m_pending.end() && i->first <= now; i = m_pending.erase(i)) {
+			auto &[ready, p] = *i;
+			auto arrival = m_link.transmit(ready, p.buf.size());
+			m_queue.emplace_back(arrival, std::move(p));
+		}
+
+		if (!m_queue.empty() && m_queue.front().first <= now) {
+			auto p = std::move(m_queue.front().second);
+			m_queue.pop_front();
+
+			lock.unlock();
+			auto ok = send(m_sock, p.buf.data(), p.buf.size());
+			lock.lock();
+
+			if (!ok) {
+				log(log_level::debug, "send error, connection is closed");
+				shutdown(m_sock, SHUT_RDWR); // wake up the receiver
+				break;
+			}
+
+			continue;
+		}
+
+		auto deadline = clock::time_point::max();
+
+		if (!m_pending.empty()) {
+			deadline = m_pending.begin()->first;
+		}
+
+		if (!m_queue.empty()) {
+			deadline = std::min(deadline, m_queue.front().first);
+		}
+
+		if (deadline == clock::time_point::max()) {
+			m_cv.wait(lock);
+		} else {
+			m_cv.wait_until(lock, deadline);
+		}
+	}
+}
+
+template<typename T>
+inline void append(std::vector<UINT8> &v, const T *data, size_t cnt)
+{
+	auto p = reinterpret_cast<const UINT8*>(data);
+	v.insert(v.end(), p, p + cnt*sizeof(*data));
+}
+
+auto make_ret_submit(urb &u)
+{
+	usbip_header hdr{};
+
+	hdr.base.command = USBIP_RET_SUBMIT;
+	hdr.base.seqnum = u.seqnum; // devid, direction, ep are zeroes
+
+	auto &r = hdr.u.ret_submit;
+	r.status = u.status;
+	r.actual_length = u.actual_length;
+	r.start_frame = u.start_frame;
+	r.number_of_packets = INT32(u.iso.size());
+	r.error_count = u.error_count;
+
+	byteswap_header(hdr, swap_dir::host2net);
+	byteswap(u.iso.data(), u.iso.size());
+
+	pdu p{ .seqnum = u.seqnum };
+
+	auto &buf = p.buf;
+	buf.reserve(sizeof(hdr) + (u.dir_in ? u.data.size() : 0) + u.iso.size()*sizeof(u.iso[0]));
+
+	append(buf, &hdr, 1);
+	if (u.dir_in) {
+		append(buf, u.data.data(), u.data.size());
+	}
+	append(buf, u.iso.data(), u.iso.size());
+
+	return p;
+}
+
+auto make_ret_unlink(seqnum_t seqnum, INT32 status)
+{
+	usbip_header hdr{};
+
+	hdr.base.command = USBIP_RET_UNLINK;
+	hdr.base.seqnum = seqnum;
+	hdr.u.ret_unlink.status = status;
+
+	byteswap_header(hdr, swap_dir::host2net);
+
+	pdu p{};
+	append(p.buf, &hdr, 1);
+	return p;
+}
+
+/*
+ * @return false if the header is malformed
+ */
+bool recv_cmd_submit(int sock, usbip_header &hdr, urb &u)
+{
+	auto &cmd = hdr.u.cmd_submit;
+
+	auto np = cmd.number_of_packets;
+	if (np == number_of_packets_non_isoch) {
+		np = 0;
+	} else if (!is_valid_number_of_packets(np)) {
+		log(log_level::error, "seqnum %u: number_of_packets %d", hdr.base.seqnum, np);
+		return false;
+	}
+
+	if (cmd.transfer_buffer_length < 0 || cmd.transfer_buffer_length > MAX_TRANSFER_BUFFER_LENGTH) {
+		log(log_level::error, "seqnum %u: transfer_buffer_length %d", hdr.base.seqnum, cmd.transfer_buffer_length);
+		return false;
+	}
+
+	u = urb {
+		.seqnum = hdr.base.seqnum,
+		.ep = int(hdr.base.ep),
+		.dir_in = hdr.base.direction == USBIP_DIR_IN,
+		.transfer_flags = cmd.transfer_flags,
+		.transfer_buffer_length = cmd.transfer_buffer_length,
+		.interval = cmd.interval,
+	};
+
+	memcpy(&u.setup, cmd.setup, sizeof(u.setup));
+
+	if (!u.dir_in) {
+		u.data.resize(cmd.transfer_buffer_length);
+		if (!recv(sock, u.data.data(), u.data.size())) {
+			return false;
+		}
+	}
+
+	if (np) {
+		u.iso.resize(np);
+		if (!recv(sock, u.iso.data(), u.iso.size()*sizeof(u.iso[0]))) {
+			return false;
+		}
+		byteswap(u.iso.data(), u.iso.size());
+	}
+
+	return true;
+}
+
+/*
+ * Receive link is not a thread, a device executes a request at once.
+ * Its result is available after the moment the request would arrive.
+ */
+void run_device(int sock, device &dev, const link_params &params)
+{
+	channel rx(params, std::random_device{}());
+	sender tx(sock, params);
+
+	for (usbip_header hdr; recv(sock, &hdr, sizeof(hdr)); ) {
+
+		auto now = clock::now();
+		byteswap_header(hdr, swap_dir::net2host);
+
+		switch (hdr.base.command) {
+		case USBIP_CMD_SUBMIT:
+			if (urb u; !recv_cmd_submit(sock, hdr, u)) {
+				return;
+			} else {
+				u.ready = rx.transmit(now, get_total_size(hdr));
+				dev.submit(u);
+
+				log(log_level::debug, "seqnum %u, ep %d%s, status %d, actual_length %d", u.seqnum, u.ep,
+				    u.dir_in ? " IN" : "", u.status, u.actual_length);
+
+				auto ready = u.ready;
+				tx.submit(make_ret_submit(u), ready);
+			}
+			break;
+		case USBIP_CMD_UNLINK: {
+			auto victim = hdr.u.cmd_unlink.seqnum;
+			auto unlinked = tx.unlink(victim);
+
+			log(log_level::debug, "unlink seqnum %u: %s", victim, unlinked ? "unlinked" : "already completed");
+
+			auto ready = rx.transmit(now, sizeof(hdr));
+			tx.submit(make_ret_unlink(hdr.base.seqnum, unlinked ? -ECONNRESET_LNX : 0), ready);
+		}	break;
+		default:
+			log(log_level::error, "unexpected command %u", hdr.base.command);
+			return;
+		}
+	}
+}
+
+bool send_op_common(int sock, UINT16 code, op_status_t status)
+{
+	op_common r {
+		.version = USBIP_VERSION,
+		.code = code,
+		.status = status
+	};
+
+	PACK_OP_COMMON(true, &r);
+	return send(sock, &r, sizeof(r));
+}
+
+bool send_usb_device(int sock, const device &dev)
+{
+	auto d = dev.get_usb_device();
+	usbip_net_pack_usb_device(true, &d);
+	return send(sock, &d, sizeof(d));
+}
+
+void devlist(int sock, const devices_t &devices)
+{
+	if (!send_op_common(sock, OP_REP_DEVLIST, ST_OK)) {
+		return;
+	}
+
+	op_devlist_reply reply{ .ndev = UINT32(devices.size()) };
+	PACK_OP_DEVLIST_REPLY(true, &reply);
+
+	if (!send(sock, &reply, sizeof(reply))) {
+		return;
+	}
+
+	for (auto &dev: devices) {
+		if (!send_usb_device(sock, *dev)) {
+			return;
+		}
+
+		for (auto &intf: dev->get_interfaces()) {
+			auto r = intf;
+			usbip_net_pack_usb_interface(true, &r);
+			if (!send(sock, &r, sizeof(r))) {
+				return;
+			}
+		}
+	}
+}
+
+void import(int sock, const devices_t &devices, const link_params &params)
+{
+	op_import_request req{};
+	if (!recv(sock, &req, sizeof(req))) {
+		return;
+	}
+	PACK_OP_IMPORT_REQUEST(false, &req);
+
+	std::string busid(req.busid, strnlen(req.busid, sizeof(req.busid)));
+
+	auto i = std::ranges::find(devices, busid, [] (auto &dev) { return dev->busid(); });
+	auto dev = i != devices.end() ? i->get() : nullptr;
+
+	auto st = !dev ? ST_NODEV : dev->acquire() ? ST_OK : ST_DEV_BUSY;
+	if (st) {
+		log(log_level::info, "import %s: %s", busid.c_str(), st == ST_NODEV ? "no such device" : "device is busy");
+		send_op_common(sock, OP_REP_IMPORT, st);
+		return;
+	}
+
+	log(log_level::info, "%s is imported", busid.c_str());
+
+	if (send_op_common(sock, OP_REP_IMPORT, ST_OK) && send_usb_device(sock, *dev)) {
+		run_device(sock, *dev, params);
+	}
+
+	dev->release();
+	log(log_level::info, "%s is released", busid.c_str());
+}
+
+} // namespace
+
+
+void usbip::emulator::serve(socket_handle sock, const devices_t &devices, const link_params &params)
+{
+	op_common r{};
+	if (!recv(sock.get(), &r, sizeof(r))) {
+		return;
+	}
+	PACK_OP_COMMON(false, &r);
+
+	if (r.version != USBIP_VERSION) {
+		log(log_level::error, "version %#x != %#x", r.version, USBIP_VERSION);
+		return;
+	}
+
+	switch (r.code) {
+	case OP_REQ_DEVLIST:
+		devlist(sock.get(), devices);
+		break;
+	case OP_REQ_IMPORT:
+		import(sock.get(), devices, params);
+		break;
+	default:
+		log(log_level::error, "unexpected operation %#x", r.code);
+		send_op_common(sock.get(), OP_REP_UNSPEC, ST_ERROR);
+	}
+}
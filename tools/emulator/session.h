@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "device.h"
+#include "link.h"
+#include "socket.h"
+
+#include <memory>
+#include <vector>
+
+namespace usbip::emulator
+{
+
+using devices_t = std::vector<std::unique_ptr<device>>;
+
+/*
+ * Handles OP_REQ_DEVLIST or OP_REQ_IMPORT. 
+ * In the latter case, executes CMD_SUBMIT/CMD_UNLINK until the connection is closed.
+ */
+void serve(socket_handle sock, const devices_t &devices, const link_params &params);
+
+} // namespace usbip::emulator
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "socket.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace
+{
+
+using namespace usbip::emulator;
+
+auto bind_listen(const addrinfo &ai)
+{
+	socket_handle s(socket(ai.ai_family, ai.ai_socktype, ai.ai_protocol));
+	if (!s) {
+		return s;
+	}
+
+	int on = 1;
+	setsockopt(s.get(), SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (ai.ai_family == AF_INET6) {
+		int off = 0;
+		setsockopt(s.get(), IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // dual-stack
+	}
+
+	if (bind(s.get(), ai.ai_addr, ai.ai_addrlen) || ::listen(s.get(), SOMAXCONN)) {
+		s.close();
+	}
+
+	return s;
+}
+
+void set_nodelay(int fd)
+{
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+} // namespace
+
+
+void usbip::emulator::socket_handle::close() noexcept
+{
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+bool usbip::emulator::recv(int fd, void *buf, size_t len)
+{
+	for (auto p = static_cast<char*>(buf); len; ) {
+		auto ret = ::recv(fd, p, len, 0);
+		if (ret > 0) {
+			p += ret;
+			len -= ret;
+		} else if (!ret || errno != EINTR) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool usbip::emulator::send(int fd, const void *buf, size_t len)
+{
+	for (auto p = static_cast<const char*>(buf); len; ) {
+		auto ret = ::send(fd, p, len, 0);
+		if (ret >= 0) {
+			p += ret;
+			len -= ret;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * AF_INET6 goes first if address is not set, an IPv6 socket accepts IPv4 connections too.
+ */
+auto usbip::emulator::listen(const char *address, const char *port) -> socket_handle
+{
+	addrinfo hints {
+		.ai_flags = AI_PASSIVE,
+		.ai_family = address ? AF_UNSPEC : AF_INET6,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+	};
+
+	for (auto family: { hints.ai_family, AF_INET }) {
+
+		hints.ai_family = family;
+		addrinfo *result{};
+
+		if (auto err = getaddrinfo(address, port, &hints, &result)) {
+			log(log_level::error, "getaddrinfo %s:%s, %s", address ? address : "*", port, gai_strerror(err));
+			return {};
+		}
+
+		socket_handle s;
+		for (auto ai = result; ai && !s; ai = ai->ai_next) {
+			s = bind_listen(*ai);
+		}
+
+		freeaddrinfo(result);
+
+		if (s) {
+			return s;
+		} else if (address) {
+			break;
+		}
+	}
+
+	log(log_level::error, "listen %s:%s, %s", address ? address : "*", port, strerror(errno));
+	return {};
+}
+
+auto usbip::emulator::accept(int fd) -> socket_handle
+{
+	for (;;) {
+		if (socket_handle s(::accept(fd, nullptr, nullptr)); s) {
+			set_nodelay(s.get());
+			return s;
+		} else if (errno != EINTR && errno != ECONNABORTED) {
+			log(log_level::error, "accept %s", strerror(errno));
+			return s;
+		}
+	}
+}
+
+auto usbip::emulator::connect(const char *host, const char *port, int timeout_ms) -> socket_handle
+{
+	addrinfo hints {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+	};
+
+	addrinfo *result{};
+	if (auto err = getaddrinfo(host, port, &hints, &result)) {
+		log(log_level::error, "getaddrinfo %s:%s, %s", host, port, gai_strerror(err));
+		return {};
+	}
+
+	socket_handle s;
+
+	for (auto ai = result; ai && !s; ai = ai->ai_next) {
+		s = socket_handle(socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+		if (s && ::connect(s.get(), ai->ai_addr, ai->ai_addrlen)) {
+			s.close();
+		}
+	}
+
+	freeaddrinfo(result);
+
+	if (!s) {
+		log(log_level::error, "connect %s:%s, %s", host, port, strerror(errno));
+		return s;
+	}
+
+	set_nodelay(s.get());
+
+	if (timeout_ms) {
+		timeval tv{ .tv_sec = timeout_ms/1000, .tv_usec = timeout_ms%1000*1000 };
+		setsockopt(s.get(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+
+	return s;
+}
+
+int usbip::emulator::get_local_port(int fd)
+{
+	sockaddr_storage ss{};
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(fd, reinterpret_cast<sockaddr*>(&ss), &len)) {
+		return 0;
+	}
+
+	switch (ss.ss_family) {
+	case AF_INET:
+		return ntohs(reinterpret_cast<sockaddr_in&>(ss).sin_port);
+	case AF_INET6:
+		return ntohs(reinterpret_cast<sockaddr_in6&>(ss).sin6_port);
+	}
+
+	return 0;
+}
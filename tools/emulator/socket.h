@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+namespace usbip::emulator
+{
+
+/*
+ * POSIX socket descriptor.
+ */
+class socket_handle
+{
+public:
+	socket_handle() = default;
+	explicit socket_handle(int fd) noexcept : m_fd(fd) {}
+
+	~socket_handle() { close(); }
+
+	socket_handle(socket_handle &&h) noexcept : m_fd(h.release()) {}
+
+	socket_handle& operator =(socket_handle &&h) noexcept
+	{
+		if (this != &h) {
+			close();
+			m_fd = h.release();
+		}
+		return *this;
+	}
+
+	explicit operator bool() const noexcept { return m_fd >= 0; }
+	auto get() const noexcept { return m_fd; }
+
+	int release() noexcept { return std::exchange(m_fd, -1); }
+	void close() noexcept;
+
+private:
+	int m_fd = -1;
+};
+
+bool recv(int fd, void *buf, size_t len);
+bool send(int fd, const void *buf, size_t len);
+
+/*
+ * @param address if NULL, listen on all interfaces, IPv6 and IPv4 if possible
+ */
+socket_handle listen(const char *address, const char *port);
+
+socket_handle accept(int fd);
+
+/*
+ * @param timeout_ms of recv, infinite if zero
+ */
+socket_handle connect(const char *host, const char *port, int timeout_ms = 0);
+
+/*
+ * @return port of a bound socket, zero on error
+ */
+int get_local_port(int fd);
+
+} // namespace usbip::emulator
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "client.h"
+
+#include <log.h>
+#include <libdrv/pdu.h>
+
+#include <cstring>
+#include <thread>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::emulator;
+
+enum { RECV_TIMEOUT_MS = 10'000, IMPORT_ATTEMPTS = 50 };
+
+} // namespace
+
+
+/*
+ * A server releases the device of the previous connection asynchronously.
+ */
+bool usbip::loadgen::client::import(const char *host, const char *port, const std::string &busid)
+{
+	using namespace std::chrono_literals;
+
+	for (int i = 0; i < IMPORT_ATTEMPTS; ++i) {
+
+		m_sock = connect(host, port, RECV_TIMEOUT_MS);
+		if (!m_sock) {
+			return false;
+		}
+
+		op_status_t st{};
+		if (import(busid, st)) {
+			return true;
+		}
+
+		m_sock.close();
+
+		if (st != ST_DEV_BUSY) {
+			log(log_level::error, "import %s: op_status %d", busid.c_str(), st);
+			return false;
+		}
+
+		std::this_thread::sleep_for(20ms);
+	}
+
+	log(log_level::error, "import %s: device is busy", busid.c_str());
+	return false;
+}
+
+bool usbip::loadgen::client::import(const std::string &busid, op_status_t &status)
+{
+	struct {
+		op_common hdr;
+		op_import_request body;
+	} req{ .hdr = { .version = USBIP_VERSION, .code = OP_REQ_IMPORT, .status = ST_OK } };
+
+	strncpy(req.body.busid, busid.c_str(), sizeof(req.body.busid) - 1);
+
+	PACK_OP_COMMON(true, &req.hdr);
+	PACK_OP_IMPORT_REQUEST(true, &req.body);
+
+	if (!send(sock(), &req, sizeof(req))) {
+		status = ST_ERROR;
+		return false;
+	}
+
+	op_common r{};
+	if (!recv(sock(), &r, sizeof(r))) {
+		status = ST_ERROR;
+		return false;
+	}
+
+	PACK_OP_COMMON(false, &r);
+	status = static_cast<op_status_t>(r.status);
+
+	if (r.code != OP_REP_IMPORT) {
+		status = ST_ERROR;
+	}
+
+	if (status) {
+		return false;
+	}
+
+	usbip_usb_device d{};
+	if (!recv(sock(), &d, sizeof(d))) {
+		status = ST_ERROR;
+		return false;
+	}
+
+	usbip_net_pack_usb_device(false, &d);
+
+	m_devid = d.busnum << 16 | d.devnum;
+	m_seqnum = 0;
+
+	return true;
+}
+
+seqnum_t usbip::loadgen::client::next_seqnum(bool dir_in)
+{
+	while (true) {
+		if (seqnum_t num = ++m_seqnum << 1) {
+			return num | seqnum_t(dir_in);
+		}
+	}
+}
+
+bool usbip::loadgen::client::control(const setup_packet &r)
+{
+	usbip_header hdr{};
+
+	auto seqnum = next_seqnum(false);
+	set_cmd_submit_header(hdr, seqnum, m_devid, USBIP_DIR_OUT, 0, 0, 0, 0);
+	memcpy(hdr.u.cmd_submit.setup, &r, sizeof(r));
+
+	byteswap_header(hdr, swap_dir::host2net);
+
+	if (!(send(sock(), &hdr, sizeof(hdr)) && recv(sock(), &hdr, sizeof(hdr)))) {
+		return false;
+	}
+
+	byteswap_header(hdr, swap_dir::net2host);
+
+	if (hdr.base.command != USBIP_RET_SUBMIT || hdr.base.seqnum != seqnum) {
+		log(log_level::error, "unexpected response: command %u, seqnum %u", hdr.base.command, hdr.base.seqnum);
+		return false;
+	}
+
+	if (auto &ret = hdr.u.ret_submit; ret.status) {
+		log(log_level::error, "control request %#04x: status %d", r.bRequest, ret.status);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <device.h>
+#include <socket.h>
+
+#include <string>
+
+namespace usbip::loadgen
+{
+
+using emulator::clock;
+using emulator::setup_packet;
+using emulator::socket_handle;
+
+/*
+ * Connection to a USB/IP server with an imported device.
+ * PDUs are built and parsed by libdrv/pdu.cpp, the same code is used by the driver.
+ */
+class client
+{
+public:
+	/*
+	 * Connects to the server and imports the device, retries while it is busy.
+	 */
+	bool import(const char *host, const char *port, const std::string &busid);
+
+	auto sock() const noexcept { return m_sock.get(); }
+	auto devid() const noexcept { return m_devid; }
+
+	/*
+	 * Seqnum has direction in its first bit like in the driver.
+	 * @see drivers/ude/context.cpp, next_seqnum
+	 */
+	seqnum_t next_seqnum(bool dir_in);
+
+	/*
+	 * Synchronous control transfer without data stage.
+	 * Must be called before the pipeline is started.
+	 */
+	bool control(const setup_packet &r);
+
+	void close() { m_sock.close(); }
+
+private:
+	socket_handle m_sock;
+	UINT32 m_devid{};
+	seqnum_t m_seqnum{};
+
+	bool import(const std::string &busid, op_status_t &status);
+};
+
+} // namespace usbip::loadgen
@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "report.h"
+
+#include <devices.h>
+#include <log.h>
+#include <session.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+#include <getopt.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::emulator;
+using namespace usbip::loadgen;
+
+/*
+ * Endpoints and packet sizes of the devices of tools/emulator.
+ */
+enum : UINT32 { BULK_EP_IN = 1, BULK_EP_OUT = 2, HID_EP_IN = 1, AUDIO_EP_IN = 1 };
+enum : INT32 { HID_REPORT_SIZE = 8, AUDIO_PACKET_SIZE = 192, AUDIO_STREAMING_INTF = 1 };
+enum : INT32 { MAX_TRANSFER_SIZE = 64*1024*1024 };
+
+struct options
+{
+	const char *host{}; // builtin server if not set
+	const char *port = tcp_port;
+
+	std::vector<std::string> scenarios{ "bulk-in", "bulk-out", "bulk-mix", "interrupt", "isoch" };
+	std::vector<int> queue_depths{ 1, 8, 32 };
+	std::vector<int> sizes{ 4096, 65536, 1024*1024 };
+	int in_percent = 50; // of bulk-mix
+	int iso_packets = 8;
+
+	double warmup = 1; // seconds
+	double duration = 3;
+
+	const char *output{};
+	const char *label = "";
+	const char *record{}; // directory
+};
+
+/*
+ * Busids are the same as in the default layout of usbip_emulator, its devices are 1-1 bulk, 1-2 hid, 1-3 audio.
+ */
+struct scenario
+{
+	const char *name;
+	const char *busid;
+	bool sized; // transfer size is set by --size
+	int alt_intf; // SET_INTERFACE(alt_intf, 1) is issued if not negative
+};
+
+const scenario scenarios[] {
+	{ "bulk-in", "1-1", true, -1 },
+	{ "bulk-out", "1-1", true, -1 },
+	{ "bulk-mix", "1-1", true, -1 },
+	{ "interrupt", "1-2", false, -1 },
+	{ "isoch", "1-3", false, AUDIO_STREAMING_INTF },
+};
+
+auto find_scenario(const std::string &name)
+{
+	auto i = std::ranges::find(scenarios, name, [] (auto &s) { return s.name; });
+	return i != std::end(scenarios) ? i : nullptr;
+}
+
+auto make_mix(const scenario &s, const options &opt, INT32 size)
+{
+	std::vector<transfer> v;
+	std::string_view name(s.name);
+
+	if (name == "bulk-in") {
+		v.push_back({ .ep = BULK_EP_IN, .dir_in = true, .length = size });
+	} else if (name == "bulk-out") {
+		v.push_back({ .ep = BULK_EP_OUT, .dir_in = false, .length = size });
+	} else if (name == "bulk-mix") {
+		if (auto w = opt.in_percent) {
+			v.push_back({ .ep = BULK_EP_IN, .dir_in = true, .length = size, .weight = w });
+		}
+		if (auto w = 100 - opt.in_percent) {
+			v.push_back({ .ep = BULK_EP_OUT, .dir_in = false, .length = size, .weight = w });
+		}
+	} else if (name == "interrupt") {
+		v.push_back({ .ep = HID_EP_IN, .dir_in = true, .length = HID_REPORT_SIZE, .interval = 1 });
+	} else if (name == "isoch") {
+		v.push_back({ .ep = AUDIO_EP_IN, .dir_in = true, .length = opt.iso_packets*AUDIO_PACKET_SIZE,
+			      .number_of_packets = opt.iso_packets, .interval = 1 });
+	}
+
+	return v;
+}
+
+auto get_in_percent(const std::vector<transfer> &mix)
+{
+	int in = 0;
+	int total = 0;
+
+	for (auto &t: mix) {
+		total += t.weight;
+		in += t.dir_in ? t.weight : 0;
+	}
+
+	return total ? in*100/total : 0;
+}
+
+void usage(const char *program)
+{
+	printf("USB/IP client that keeps a queue of URBs in flight and measures throughput and latency.\n"
+	       "Usage: %s [options]\n"
+	       "  -r, --remote HOST       server to test, e.g. usbip_emulator with network impairments;\n"
+	       "                          builtin emulator on loopback TCP by default\n"
+	       "  -p, --port PORT         TCP port of the remote server, %s by default\n"
+	       "  -s, --scenarios LIST    comma separated: bulk-in,bulk-out,bulk-mix,interrupt,isoch (all by default)\n"
+	       "  -q, --queue-depth LIST  URBs in flight, 1,8,32 by default\n"
+	       "  -z, --size LIST         transfer sizes of bulk scenarios, suffixes K and M, 4K,64K,1M by default\n"
+	       "  -m, --mix PERCENT       share of IN URBs in bulk-mix, 50 by default\n"
+	       "  -i, --iso-packets N     packets per isoch URB, 8 by default\n"
+	       "  -w, --warmup SEC        time before measurement, 1 by default\n"
+	       "  -t, --duration SEC      measurement time of each run, 3 by default\n"
+	       "  -o, --output FILE       JSON report, stdout by default\n"
+	       "  -l, --label TEXT        e.g. release version, it is written to the report\n"
+	       "  -R, --record DIR        write server's responses of each run to DIR/SCENARIO-SIZE-DEPTH.bin\n"
+	       "  -v, --verbose\n"
+	       "  -h, --help\n",
+	       program, tcp_port);
+}
+
+auto split(const char *s)
+{
+	std::vector<std::string> v;
+
+	for (auto p = s; *p; ) {
+		auto end = strchr(p, ',');
+		if (!end) {
+			end = p + strlen(p);
+		}
+		if (end != p) {
+			v.emplace_back(p, end);
+		}
+		p = *end ? end + 1 : end;
+	}
+
+	return v;
+}
+
+/*
+ * @return false if a number is invalid or out of range
+ */
+bool parse_numbers(std::vector<int> &v, const char *s, int min, int max, bool suffix = false)
+{
+	v.clear();
+
+	for (auto &str: split(s)) {
+		char *end{};
+		auto val = strtoll(str.c_str(), &end, 10);
+
+		if (suffix && (*end == 'K' || *end == 'k')) {
+			val <<= 10;
+			++end;
+		} else if (suffix && (*end == 'M' || *end == 'm')) {
+			val <<= 20;
+			++end;
+		}
+
+		if (*end || val < min || val > max) {
+			log(log_level::error, "invalid value '%s', must be in [%d, %d]", str.c_str(), min, max);
+			return false;
+		}
+
+		v.push_back(int(val));
+	}
+
+	return !v.empty();
+}
+
+bool parse_options(options &opt, int argc, char *argv[])
+{
+	const option longopts[] {
+		{ "remote", required_argument, nullptr, 'r' },
+		{ "port", required_argument, nullptr, 'p' },
+		{ "scenarios", required_argument, nullptr, 's' },
+		{ "queue-depth", required_argument, nullptr, 'q' },
+		{ "size", required_argument, nullptr, 'z' },
+		{ "mix", required_argument, nullptr, 'm' },
+		{ "iso-packets", required_argument, nullptr, 'i' },
+		{ "warmup", required_argument, nullptr, 'w' },
+		{ "duration", required_argument, nullptr, 't' },
+		{ "output", required_argument, nullptr, 'o' },
+		{ "label", required_argument, nullptr, 'l' },
+		{ "record", required_argument, nullptr, 'R' },
+		{ "verbose", no_argument, nullptr, 'v' },
+		{ "help", no_argument, nullptr, 'h' },
+		{}
+	};
+
+	for (int c; (c = getopt_long(argc, argv, "r:p:s:q:z:m:i:w:t:o:l:R:vh", longopts, nullptr)) != -1; ) {
+		std::vector<int> v;
+
+		switch (c) {
+		case 'r':
+			opt.host = optarg;
+			break;
+		case 'p':
+			opt.port = optarg;
+			break;
+		case 's':
+			opt.scenarios = split(optarg);
+			break;
+		case 'q':
+			if (!parse_numbers(opt.queue_depths, optarg, 1, 1024)) {
+				return false;
+			}
+			break;
+		case 'z':
+			if (!parse_numbers(opt.sizes, optarg, 1, MAX_TRANSFER_SIZE, true)) {
+				return false;
+			}
+			break;
+		case 'm':
+			if (!parse_numbers(v, optarg, 0, 100)) {
+				return false;
+			}
+			opt.in_percent = v.front();
+			break;
+		case 'i':
+			if (!parse_numbers(v, optarg, 1, USBIP_MAX_ISO_PACKETS)) {
+				return false;
+			}
+			opt.iso_packets = v.front();
+			break;
+		case 'w':
+			opt.warmup = strtod(optarg, nullptr);
+			break;
+		case 't':
+			opt.duration = strtod(optarg, nullptr);
+			break;
+		case 'o':
+			opt.output = optarg;
+			break;
+		case 'l':
+			opt.label = optarg;
+			break;
+		case 'R':
+			opt.record = optarg;
+			break;
+		case 'v':
+			max_log_level = log_level::debug;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			return false;
+		}
+	}
+
+	if (optind != argc) {
+		log(log_level::error, "unexpected argument '%s'", argv[optind]);
+		return false;
+	}
+
+	for (auto &name: opt.scenarios) {
+		if (!find_scenario(name)) {
+			log(log_level::error, "unknown scenario '%s'", name.c_str());
+			return false;
+		}
+	}
+
+	if (opt.warmup < 0 || opt.duration <= 0) {
+		log(log_level::error, "warmup can't be negative, duration must be positive");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Emulated devices are served by the threads of this process.
+ * @return port to connect to, zero on error
+ */
+int start_builtin_server()
+{
+	static devices_t devices;
+
+	devices.push_back(make_bulk_device("1-1"));
+	devices.push_back(make_hid_device("1-2"));
+	devices.push_back(make_audio_device("1-3"));
+
+	auto sock = listen("127.0.0.1", "0");
+	if (!sock) {
+		return 0;
+	}
+
+	auto port = get_local_port(sock.get());
+
+	std::thread([] (socket_handle sock)
+	{
+		while (auto s = accept(sock.get())) {
+			std::thread(serve, std::move(s), std::cref(devices), link_params{}).detach();
+		}
+	}, std::move(sock)).detach();
+
+	return port;
+}
+
+auto to_duration(double sec)
+{
+	return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(sec));
+}
+
+bool configure(client &c, const scenario &s)
+{
+	setup_packet r{ .bRequest = USB_REQ_SET_CONFIGURATION, .wValue = 1 };
+	if (!c.control(r)) {
+		return false;
+	}
+
+	if (s.alt_intf >= 0) {
+		r = { .bmRequestType = USB_RECIP_INTERFACE, .bRequest = USB_REQ_SET_INTERFACE,
+		      .wValue = 1, .wIndex = UINT16(s.alt_intf) };
+		return c.control(r);
+	}
+
+	return true;
+}
+
+bool run(report &rep, const options &opt, const scenario &s, INT32 size, int depth)
+{
+	workload w {
+		.mix = make_mix(s, opt, size),
+		.queue_depth = depth,
+		.warmup = rep.warmup,
+		.duration = rep.duration
+	};
+
+	report_entry e {
+		.scenario = s.name,
+		.busid = s.busid,
+		.transfer_size = w.mix.front().length,
+		.number_of_packets = w.mix.front().number_of_packets,
+		.in_percent = get_in_percent(w.mix),
+		.queue_depth = depth
+	};
+
+	client c;
+	if (!(c.import(rep.host.c_str(), std::to_string(rep.port).c_str(), s.busid) && configure(c, s))) {
+		return false;
+	}
+
+	std::unique_ptr<FILE, decltype(&fclose)> record(nullptr, fclose);
+
+	if (opt.record) {
+		auto path = std::string(opt.record) + '/' + s.name + '-' + std::to_string(e.transfer_size) + '-' +
+			    std::to_string(depth) + ".bin";
+
+		record.reset(fopen(path.c_str(), "wb"));
+		if (!record) {
+			log(log_level::error, "fopen '%s', %s", path.c_str(), strerror(errno));
+			return false;
+		}
+		w.record = record.get();
+	}
+
+	if (!run(c, w, e.res)) {
+		log(log_level::error, "%s: transfer_size %d, queue_depth %d failed", s.name, e.transfer_size, depth);
+		return false;
+	}
+
+	auto &r = e.res;
+	auto sec = std::chrono::duration<double>(r.elapsed).count();
+
+	log(log_level::info, "%-9s  size %8d  depth %4d  %10.0f URB/s  %9.2f MB/s  errors %llu",
+	    s.name, e.transfer_size, depth, sec > 0 ? r.urbs/sec : 0, sec > 0 ? r.bytes/sec/1e6 : 0,
+	    static_cast<unsigned long long>(r.errors));
+
+	rep.entries.push_back(std::move(e));
+	return true;
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	options opt;
+	if (!parse_options(opt, argc, argv)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	report rep {
+		.label = opt.label,
+		.host = opt.host ? opt.host : "127.0.0.1",
+		.port = opt.host ? atoi(opt.port) : start_builtin_server(),
+		.builtin_server = !opt.host,
+		.warmup = to_duration(opt.warmup),
+		.duration = to_duration(opt.duration)
+	};
+
+	if (!rep.port) {
+		log(log_level::error, "invalid port");
+		return EXIT_FAILURE;
+	}
+
+	for (auto &name: opt.scenarios) {
+		auto &s = *find_scenario(name);
+
+		for (auto size: s.sized ? opt.sizes : std::vector<int>{ 0 }) {
+			for (auto depth: opt.queue_depths) {
+				if (!run(rep, opt, s, size, depth)) {
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
+	auto f = opt.output ? fopen(opt.output, "w") : stdout;
+	if (!f) {
+		log(log_level::error, "fopen '%s', %s", opt.output, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	auto ok = write_json(f, rep);
+
+	if (f != stdout) {
+		ok = !fclose(f) && ok;
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
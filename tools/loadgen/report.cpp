@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "report.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <numeric>
+
+namespace
+{
+
+using namespace usbip::loadgen;
+
+auto quote(const std::string &s)
+{
+	std::string r("\"");
+
+	for (unsigned char c: s) {
+		switch (c) {
+		case '"':
+			r += "\\\"";
+			break;
+		case '\\':
+			r += "\\\\";
+			break;
+		default:
+			if (c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				r += buf;
+			} else {
+				r += char(c);
+			}
+		}
+	}
+
+	return r += '"';
+}
+
+auto get_timestamp()
+{
+	auto t = time(nullptr);
+
+	tm tm{};
+	gmtime_r(&t, &tm);
+
+	char buf[32];
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	return std::string(buf);
+}
+
+inline double to_sec(clock::duration d)
+{
+	return std::chrono::duration<double>(d).count();
+}
+
+inline double to_usec(clock::duration d)
+{
+	return std::chrono::duration<double, std::micro>(d).count();
+}
+
+/*
+ * Nearest-rank method.
+ * @param v sorted
+ */
+auto percentile(const std::vector<clock::duration> &v, double p)
+{
+	auto rank = size_t(std::ceil(p/100*v.size()));
+	return v[std::clamp(rank, size_t(1), v.size()) - 1];
+}
+
+void write_latency(FILE *f, std::vector<clock::duration> v)
+{
+	fprintf(f, "\"latency_us\": {");
+
+	if (v.empty()) {
+		fprintf(f, "\"min\": null, \"mean\": null, \"p50\": null, \"p90\": null, \"p99\": null, \"p999\": null, "
+			   "\"max\": null}");
+		return;
+	}
+
+	std::ranges::sort(v);
+	auto sum = std::accumulate(v.begin(), v.end(), clock::duration());
+
+	fprintf(f, "\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+		   "\"max\": %.1f}",
+		to_usec(v.front()), to_usec(sum)/v.size(), to_usec(percentile(v, 50)), to_usec(percentile(v, 90)),
+		to_usec(percentile(v, 99)), to_usec(percentile(v, 99.9)), to_usec(v.back()));
+}
+
+void write_entry(FILE *f, const report_entry &e)
+{
+	auto &r = e.res;
+	auto sec = to_sec(r.elapsed);
+
+	fprintf(f, "    {\n"
+		   "      \"scenario\": %s,\n"
+		   "      \"busid\": %s,\n"
+		   "      \"transfer_size\": %d,\n"
+		   "      \"number_of_packets\": %d,\n"
+		   "      \"in_percent\": %d,\n"
+		   "      \"queue_depth\": %d,\n"
+		   "      \"urbs\": %llu,\n"
+		   "      \"errors\": %llu,\n"
+		   "      \"bytes\": %llu,\n"
+		   "      \"elapsed_s\": %.3f,\n"
+		   "      \"urbs_per_s\": %.1f,\n"
+		   "      \"mb_per_s\": %.3f,\n"
+		   "      ",
+		quote(e.scenario).c_str(), quote(e.busid).c_str(), e.transfer_size, e.number_of_packets,
+		e.in_percent, e.queue_depth,
+		static_cast<unsigned long long>(r.urbs), static_cast<unsigned long long>(r.errors),
+		static_cast<unsigned long long>(r.bytes), sec,
+		sec > 0 ? r.urbs/sec : 0, sec > 0 ? r.bytes/sec/1e6 : 0);
+
+	write_latency(f, r.latency);
+	fprintf(f, "\n    }");
+}
+
+} // namespace
+
+
+bool usbip::loadgen::write_json(FILE *f, const report &r)
+{
+	fprintf(f, "{\n"
+		   "  \"schema\": \"usbip-loadgen\",\n"
+		   "  \"schema_version\": %d,\n"
+		   "  \"label\": %s,\n"
+		   "  \"timestamp\": %s,\n"
+		   "  \"server\": {\"host\": %s, \"port\": %d, \"builtin\": %s},\n"
+		   "  \"warmup_s\": %.3f,\n"
+		   "  \"duration_s\": %.3f,\n"
+		   "  \"results\": [",
+		SCHEMA_VERSION, quote(r.label).c_str(), quote(get_timestamp()).c_str(),
+		quote(r.host).c_str(), r.port, r.builtin_server ? "true" : "false",
+		to_sec(r.warmup), to_sec(r.duration));
+
+	for (size_t i = 0; i < r.entries.size(); ++i) {
+		fprintf(f, "%s\n", i ? "," : "");
+		write_entry(f, r.entries[i]);
+	}
+
+	fprintf(f, "\n  ]\n}\n");
+	return !ferror(f) && !fflush(f);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "workload.h"
+
+#include <cstdio>
+#include <string>
+
+namespace usbip::loadgen
+{
+
+enum { SCHEMA_VERSION = 1 }; // increment if fields are renamed, removed or change meaning
+
+struct report_entry
+{
+	std::string scenario;
+	std::string busid;
+	INT32 transfer_size;
+	int number_of_packets;
+	int in_percent; // share of IN URBs in the mix
+	int queue_depth;
+	result res;
+};
+
+struct report
+{
+	std::string label; // release or build, set by a user
+	std::string host;
+	int port;
+	bool builtin_server;
+	clock::duration warmup;
+	clock::duration duration;
+
+	std::vector<report_entry> entries;
+};
+
+/*
+ * Writes the report as JSON, see README.md for its schema.
+ */
+bool write_json(FILE *f, const report &r);
+
+} // namespace usbip::loadgen
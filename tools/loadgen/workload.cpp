@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "workload.h"
+
+#include <log.h>
+#include <libdrv/pdu.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::emulator;
+using namespace usbip::loadgen;
+
+/*
+ * CMD_SUBMIT with payload in network byte order, URBs of a transfer differ by seqnum only.
+ */
+struct request
+{
+	const transfer *t;
+	std::vector<UINT8> pdu;
+	int current_weight; // smooth weighted round-robin
+};
+
+struct inflight
+{
+	const transfer *t;
+	clock::time_point sent;
+};
+
+using inflight_t = std::unordered_map<seqnum_t, inflight>;
+
+inline auto max_pdu_size(const transfer &t)
+{
+	return sizeof(usbip_header) + t.length + t.number_of_packets*sizeof(usbip_iso_packet_descriptor);
+}
+
+/*
+ * Isoch packets have equal length, the rest of transfer_buffer_length is not used.
+ */
+auto make_request(const transfer &t, UINT32 devid)
+{
+	usbip_header hdr{};
+
+	set_cmd_submit_header(hdr, 0, devid, t.dir_in ? USBIP_DIR_IN : USBIP_DIR_OUT, t.ep,
+		t.number_of_packets ? URB_ISO_ASAP : 0, t.length, t.interval);
+
+	if (t.number_of_packets) {
+		hdr.u.cmd_submit.number_of_packets = t.number_of_packets;
+	}
+
+	request r{ .t = &t };
+	r.pdu.resize(get_total_size(hdr));
+
+	auto &h = *reinterpret_cast<usbip_header*>(r.pdu.data());
+	h = hdr;
+
+	if (!t.dir_in) {
+		auto data = r.pdu.data() + sizeof(h);
+		for (INT32 i = 0; i < t.length; ++i) {
+			data[i] = UINT8(i % 63);
+		}
+	}
+
+	usbip_iso_packet_descriptor *d{};
+
+	if (auto cnt = get_isoc_descr(d, h)) {
+		auto len = UINT32(t.length/cnt);
+		for (size_t i = 0; i < cnt; ++i) {
+			d[i] = { .offset = UINT32(i*len), .length = len };
+		}
+		byteswap(d, cnt);
+	}
+
+	byteswap_header(h, swap_dir::host2net);
+	return r;
+}
+
+auto& next_request(std::vector<request> &v, int total_weight)
+{
+	auto best = &v.front();
+
+	for (auto &r: v) {
+		r.current_weight += r.t->weight;
+		if (r.current_weight > best->current_weight) {
+			best = &r;
+		}
+	}
+
+	best->current_weight -= total_weight;
+	return *best;
+}
+
+bool submit(client &c, request &r, inflight_t &urbs)
+{
+	auto seqnum = c.next_seqnum(r.t->dir_in);
+
+	auto &hdr = *reinterpret_cast<usbip_header*>(r.pdu.data());
+	hdr.base.seqnum = htonl(seqnum);
+
+	urbs.emplace(seqnum, inflight{ r.t, clock::now() });
+
+	if (!send(c.sock(), r.pdu.data(), r.pdu.size())) {
+		log(log_level::error, "send error");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * SUM(actual_length) of packets must be equal to actual_length, the data are compacted by a server.
+ */
+bool check_isoc(usbip_header &hdr)
+{
+	usbip_iso_packet_descriptor *d{};
+	auto cnt = get_isoc_descr(d, hdr);
+	byteswap(d, cnt);
+
+	UINT64 total = 0;
+
+	for (size_t i = 0; i < cnt; ++i) {
+		if (d[i].actual_length > d[i].length) {
+			log(log_level::error, "seqnum %u: packet %zu, actual_length %u > length %u",
+			    hdr.base.seqnum, i, d[i].actual_length, d[i].length);
+			return false;
+		}
+		total += d[i].actual_length;
+	}
+
+	if (total != UINT64(hdr.u.ret_submit.actual_length)) {
+		log(log_level::error, "seqnum %u: SUM(actual_length) %llu != actual_length %d",
+		    hdr.base.seqnum, static_cast<unsigned long long>(total), hdr.u.ret_submit.actual_length);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * @param buf for RET_SUBMIT and its payload, the data are not used
+ */
+bool receive(int sock, std::vector<UINT8> &buf, inflight_t &urbs, inflight &urb, usbip_header_ret_submit &ret,
+	     FILE *record)
+{
+	auto &hdr = *reinterpret_cast<usbip_header*>(buf.data());
+
+	if (!recv(sock, &hdr, sizeof(hdr))) {
+		log(log_level::error, "recv error, connection is closed or timed out");
+		return false;
+	}
+
+	if (record) {
+		fwrite(&hdr, sizeof(hdr), 1, record);
+	}
+
+	byteswap_header(hdr, swap_dir::net2host);
+
+	auto &b = hdr.base;
+	auto i = urbs.find(b.seqnum);
+
+	if (b.command != USBIP_RET_SUBMIT || i == urbs.end()) {
+		log(log_level::error, "unexpected response: command %u, seqnum %u", b.command, b.seqnum);
+		return false;
+	}
+
+	urb = i->second;
+	urbs.erase(i);
+
+	auto &t = *urb.t;
+	b.direction = t.dir_in ? USBIP_DIR_IN : USBIP_DIR_OUT; // is zero in server's response, get_isoc_descr uses it
+
+	ret = hdr.u.ret_submit;
+	auto np = ret.number_of_packets == number_of_packets_non_isoch ? 0 : ret.number_of_packets;
+
+	if (ret.actual_length < 0 || ret.actual_length > t.length || np < 0 || np > t.number_of_packets) {
+		log(log_level::error, "seqnum %u: actual_length %d, number_of_packets %d",
+		    b.seqnum, ret.actual_length, ret.number_of_packets);
+		return false;
+	}
+
+	auto size = get_payload_size(hdr);
+	if (sizeof(hdr) + size > buf.size()) {
+		log(log_level::error, "seqnum %u: payload size %zu", b.seqnum, size);
+		return false;
+	}
+
+	if (size && !recv(sock, &hdr + 1, size)) {
+		log(log_level::error, "recv error, connection is closed or timed out");
+		return false;
+	}
+
+	if (record && size) {
+		fwrite(&hdr + 1, size, 1, record);
+	}
+
+	return !np || check_isoc(hdr);
+}
+
+} // namespace
+
+
+bool usbip::loadgen::run(client &c, const workload &w, result &r)
+{
+	r = {};
+
+	std::vector<request> requests;
+	requests.reserve(w.mix.size());
+
+	int total_weight = 0;
+	size_t buf_size = 0;
+
+	for (auto &t: w.mix) {
+		requests.push_back(make_request(t, c.devid()));
+		total_weight += t.weight;
+		buf_size = std::max(buf_size, max_pdu_size(t));
+	}
+
+	std::vector<UINT8> buf(buf_size);
+	inflight_t urbs;
+
+	auto start = clock::now() + w.warmup;
+	auto stop = start + w.duration;
+	clock::time_point last_completed{};
+
+	for (int i = 0; i < w.queue_depth; ++i) {
+		if (!submit(c, next_request(requests, total_weight), urbs)) {
+			return false;
+		}
+	}
+
+	while (!urbs.empty()) {
+
+		inflight urb{};
+		usbip_header_ret_submit ret{};
+
+		if (!receive(c.sock(), buf, urbs, urb, ret, w.record)) {
+			return false;
+		}
+
+		auto now = clock::now();
+
+		if (urb.sent >= start && urb.sent < stop) {
+			if (ret.status || ret.error_count) {
+				++r.errors;
+			} else {
+				++r.urbs;
+				r.bytes += ret.actual_length;
+			}
+			r.latency.push_back(now - urb.sent);
+			last_completed = now;
+		}
+
+		if (now < stop && !submit(c, next_request(requests, total_weight), urbs)) {
+			return false;
+		}
+	}
+
+	if (last_completed > start) {
+		r.elapsed = last_completed - start;
+	}
+
+	return true;
+}
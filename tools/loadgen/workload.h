@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "client.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace usbip::loadgen
+{
+
+/*
+ * The kind of URB that a workload submits.
+ */
+struct transfer
+{
+	UINT32 ep; // endpoint number
+	bool dir_in;
+	INT32 length; // transfer_buffer_length, of all packets for isoch
+	int number_of_packets; // zero if it is not isoch
+	INT32 interval;
+	int weight = 1; // share in the mix
+};
+
+struct workload
+{
+	std::vector<transfer> mix;
+	int queue_depth; // URBs in flight
+	clock::duration warmup; // the results are not recorded
+	clock::duration duration;
+	FILE *record{}; // server's responses are written as received, @see tools/bench/recv_stream.cpp
+};
+
+struct result
+{
+	UINT64 urbs; // completed successfully
+	UINT64 errors; // completed with non-zero status
+	UINT64 bytes; // SUM(actual_length)
+	clock::duration elapsed;
+	std::vector<clock::duration> latency; // from CMD_SUBMIT to RET_SUBMIT, of each URB
+};
+
+/*
+ * Keeps queue_depth URBs in flight, a completed URB is replaced by the next one of the mix.
+ * The URBs submitted during the warmup are not recorded, elapsed time starts after it.
+ * @return false if the connection is broken or the server violates the protocol
+ */
+bool run(client &c, const workload &w, result &r);
+
+} // namespace usbip::loadgen
@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * RFC 8305 (Happy Eyeballs) of usbip/happy_eyeballs.h, interleave_families and race are used
+ * by wsk::race_connect of the driver and usbip::connect of libusbip, they differ in their connectors only.
+ *
+ * The scheduling of race is checked with a scripted connector.
+ * A connector of POSIX sockets checks it against loopback listeners, this is what the connectors
+ * of WSK and Winsock do with their sockets.
+ *
+ * A blackhole is a loopback listener with full accept queue, Linux drops SYN-s for it,
+ * so connect hangs like for an address whose route is blackholed.
+ * A refused address is a loopback port without a listener.
+ */
+
+#include <sal.h>
+#include <usbip/happy_eyeballs.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+
+using namespace usbip;
+
+using clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+int failures;
+
+void check(bool ok, const char *what)
+{
+	std::printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	failures += !ok;
+}
+
+/*
+ * Each attempt has a script: how start completes and how many waits pass before it completes,
+ * an infinite wait counts as many waits as it takes.
+ * The calls are logged as "s<idx>" for start and "w<started><d|i>" for wait with delay or infinite.
+ */
+struct scripted_attempt
+{
+	attempt_status start;
+	int waits; // until completion, a wait completes the first attempt whose count drops to zero
+	bool success;
+};
+
+class scripted_connector
+{
+public:
+	explicit scripted_connector(std::vector<scripted_attempt> v, int abort_on_wait = 0) :
+		m_v(std::move(v)), m_abort_on_wait(abort_on_wait) {}
+
+	attempt_status start(int idx)
+	{
+		m_log += " s" + std::to_string(idx);
+		m_started = idx + 1;
+		return m_v[idx].start;
+	}
+
+	int wait(int started, bool start_next)
+	{
+		m_log += " w" + std::to_string(started) + (start_next ? 'd' : 'i');
+
+		if (started != m_started) {
+			m_log += "!";
+		}
+
+		if (++m_waits == m_abort_on_wait) {
+			return ATTEMPTS_ABORTED;
+		}
+
+		do { // an infinite wait lasts until an attempt completes
+			bool pending = false;
+
+			for (int i = 0; i < started; ++i) {
+				if (auto &a = m_v[i]; a.start == attempt_status::pending && a.waits > 0) {
+					if (!--a.waits) {
+						return i;
+					}
+					pending = true;
+				}
+			}
+
+			if (!pending) {
+				m_log += " hang"; // nothing to wait for
+				return ATTEMPTS_ABORTED;
+			}
+
+		} while (!start_next);
+
+		return ATTEMPT_DELAY_EXPIRED;
+	}
+
+	bool succeeded(int idx) const { return m_v[idx].success; }
+
+	auto& log() const noexcept { return m_log; }
+
+private:
+	std::vector<scripted_attempt> m_v;
+	int m_abort_on_wait;
+	int m_started{};
+	int m_waits{};
+	std::string m_log;
+};
+
+auto run(scripted_connector &c, int cnt)
+{
+	auto ret = race(c, cnt);
+	std::printf("\t%d:%s\n", ret, c.log().c_str());
+	return ret;
+}
+
+void test_race_schedule()
+{
+	constexpr auto pending = attempt_status::pending;
+	constexpr auto failed = attempt_status::failed;
+	constexpr auto connected = attempt_status::connected;
+
+	{
+		scripted_connector c({ {connected} });
+		check(run(c, 1) == 0 && c.log() == " s0", "immediate connect wins without waiting");
+	}
+	{
+		scripted_connector c({ {pending, 3, true}, {pending, 1, true}, {pending, 5, true} });
+		check(run(c, 3) == 1 && c.log() == " s0 w1d s1 w2d", "the next attempt starts after delay, the first completed wins");
+	}
+	{
+		scripted_connector c({ {failed}, {failed}, {pending, 1, true} });
+		check(run(c, 3) == 2 && c.log() == " s0 s1 s2 w3i", "failed start starts the next one at once");
+	}
+	{
+		scripted_connector c({ {pending, 1, false}, {pending, 3, true} });
+		check(run(c, 2) == 1 && c.log() == " s0 w1d s1 w2i", "failed attempt starts the next one, the last is waited infinitely");
+	}
+	{
+		scripted_connector c({ {pending, 2, false}, {pending, 1, false} });
+		check(run(c, 2) == -1 && c.log() == " s0 w1d s1 w2i w2i", "race fails if all attempts have failed");
+	}
+	{
+		scripted_connector c({ {pending, 9, true}, {pending, 9, true} }, 2);
+		check(run(c, 2) == -1 && c.log() == " s0 w1d s1 w2i", "race stops if wait is aborted");
+	}
+	{
+		scripted_connector c({});
+		check(run(c, 0) == -1 && c.log().empty(), "race fails if there are no addresses");
+	}
+}
+
+void test_interleave_families()
+{
+	addrinfo v[5]{};
+	int families[] { AF_INET6, AF_INET6, AF_INET, AF_INET, AF_INET6 };
+
+	for (int i = 0; i < 5; ++i) {
+		v[i].ai_family = families[i];
+		v[i].ai_next = i + 1 < 5 ? v + i + 1 : nullptr;
+	}
+
+	const addrinfo *out[MAX_CONNECTION_ATTEMPTS];
+	auto cnt = interleave_families(out, v);
+
+	const addrinfo *expected[] { v, v + 2, v + 1, v + 3, v + 4 };
+	check(cnt == 5 && std::equal(out, out + cnt, expected), "families are interleaved, the first one is preferred");
+
+	const addrinfo *one[2];
+	check(interleave_families(one, v) == 2 && one[0] == v && one[1] == v + 2, "the number of addresses is limited");
+}
+
+class socket_handle
+{
+public:
+	socket_handle() = default;
+	explicit socket_handle(int fd) noexcept : m_fd(fd) {}
+
+	~socket_handle() { close(); }
+
+	socket_handle(socket_handle &&h) noexcept : m_fd(h.release()) {}
+
+	socket_handle& operator =(socket_handle &&h) noexcept
+	{
+		if (this != &h) {
+			close();
+			m_fd = h.release();
+		}
+		return *this;
+	}
+
+	explicit operator bool() const noexcept { return m_fd >= 0; }
+	auto get() const noexcept { return m_fd; }
+
+	int release() noexcept { return std::exchange(m_fd, -1); }
+	void close() noexcept { if (m_fd >= 0) ::close(release()); }
+
+private:
+	int m_fd = -1;
+};
+
+/*
+ * Connector of race for POSIX sockets, the counterpart of the connectors of WSK and Winsock.
+ */
+class posix_connector
+{
+public:
+	explicit posix_connector(const sockaddr_in *addrs) : m_addrs(addrs) {}
+
+	attempt_status start(int idx);
+	int wait(int started, bool start_next);
+	bool succeeded(int idx) const { return static_cast<bool>(m_v[idx]); }
+
+	auto release(int idx) { return std::move(m_v[idx]); }
+
+private:
+	const sockaddr_in *m_addrs;
+	socket_handle m_v[MAX_CONNECTION_ATTEMPTS];
+};
+
+attempt_status posix_connector::start(int idx)
+{
+	auto &s = m_v[idx] = socket_handle(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
+	auto &sa = m_addrs[idx];
+
+	if (!s) {
+		return attempt_status::failed;
+	} else if (!::connect(s.get(), reinterpret_cast<const sockaddr*>(&sa), sizeof(sa))) {
+		return attempt_status::connected;
+	} else if (errno == EINPROGRESS) {
+		return attempt_status::pending;
+	}
+
+	s.close();
+	return attempt_status::failed;
+}
+
+/*
+ * Failed attempt is closed.
+ */
+int posix_connector::wait(int started, bool start_next)
+{
+	pollfd fds[MAX_CONNECTION_ATTEMPTS];
+	int idx[std::size(fds)];
+	int n = 0;
+
+	for (int i = 0; i < started; ++i) {
+		if (m_v[i]) {
+			fds[n] = { .fd = m_v[i].get(), .events = POLLOUT };
+			idx[n++] = i;
+		}
+	}
+
+	int ret;
+	while ((ret = poll(fds, n, start_next ? CONNECTION_ATTEMPT_DELAY : -1)) < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		return ATTEMPTS_ABORTED;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (fds[i].revents) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+				m_v[idx[i]].close();
+			}
+
+			return idx[i];
+		}
+	}
+
+	return ATTEMPT_DELAY_EXPIRED;
+}
+
+auto make_addr(int port)
+{
+	sockaddr_in sa {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr = { htonl(INADDR_LOOPBACK) },
+	};
+	return sa;
+}
+
+int get_local_port(int fd)
+{
+	sockaddr_in sa{};
+	socklen_t len = sizeof(sa);
+	return getsockname(fd, reinterpret_cast<sockaddr*>(&sa), &len) ? 0 : ntohs(sa.sin_port);
+}
+
+/*
+ * @param backlog zero for a blackhole
+ */
+auto make_listener(int backlog)
+{
+	socket_handle s(socket(AF_INET, SOCK_STREAM, 0));
+	auto sa = make_addr(0);
+
+	if (!(s && !bind(s.get(), reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) && !::listen(s.get(), backlog))) {
+		s.close();
+	}
+
+	return s;
+}
+
+/*
+ * The port of a closed socket is not reused soon.
+ */
+auto get_refused_port()
+{
+	auto s = make_listener(1);
+	return s ? get_local_port(s.get()) : 0;
+}
+
+int get_peer_port(int fd)
+{
+	sockaddr_in sa{};
+	socklen_t len = sizeof(sa);
+	return getpeername(fd, reinterpret_cast<sockaddr*>(&sa), &len) ? 0 : ntohs(sa.sin_port);
+}
+
+/*
+ * Fills the accept queue of a blackhole, the next SYN will be dropped.
+ */
+auto fill_accept_queue(int port, std::vector<socket_handle> &v)
+{
+	auto sa = make_addr(port);
+
+	for (int i = 0; i < 2; ++i) {
+		auto &s = v.emplace_back(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
+		if (::connect(s.get(), reinterpret_cast<sockaddr*>(&sa), sizeof(sa))) {
+			pollfd fd{ .fd = s.get(), .events = POLLOUT };
+			if (poll(&fd, 1, 500) <= 0) { // is not accepted, the queue is full
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+auto to_ms(clock::duration d) { return std::chrono::duration_cast<std::chrono::milliseconds>(d).count(); }
+
+/*
+ * @return connected socket and elapsed time
+ */
+auto connect(std::initializer_list<int> ports)
+{
+	std::vector<sockaddr_in> addrs;
+	for (auto port: ports) {
+		addrs.push_back(make_addr(port));
+	}
+
+	posix_connector c(addrs.data());
+
+	auto start = clock::now();
+	auto i = race(c, int(addrs.size()));
+	auto elapsed = clock::now() - start;
+
+	return std::make_pair(i < 0 ? socket_handle() : c.release(i), elapsed);
+}
+
+void test_blackhole(int blackhole, int listener)
+{
+	auto [s, elapsed] = connect({ blackhole, listener });
+	std::printf("blackhole, listener: %lld ms\n", static_cast<long long>(to_ms(elapsed)));
+
+	check(s && get_peer_port(s.get()) == listener, "blackholed address is bypassed");
+	check(elapsed >= std::chrono::milliseconds(CONNECTION_ATTEMPT_DELAY) - 10ms && elapsed < 2s,
+	      "next attempt starts after CONNECTION_ATTEMPT_DELAY");
+}
+
+void test_refused(int refused, int listener)
+{
+	auto [s, elapsed] = connect({ refused, refused, listener });
+	std::printf("refused, refused, listener: %lld ms\n", static_cast<long long>(to_ms(elapsed)));
+
+	check(s && get_peer_port(s.get()) == listener, "refused addresses are skipped");
+	check(elapsed < std::chrono::milliseconds(CONNECTION_ATTEMPT_DELAY)/2, "failed attempt starts next one at once");
+
+	check(!connect({ refused }).first, "connect fails if all attempts fail");
+}
+
+} // namespace
+
+
+int main()
+{
+	test_race_schedule();
+	test_interleave_families();
+
+	auto listener = make_listener(SOMAXCONN);
+	auto blackhole = make_listener(0);
+	auto refused = get_refused_port();
+
+	if (!(listener && blackhole && refused)) {
+		std::fprintf(stderr, "can't create loopback listeners\n");
+		return EXIT_FAILURE;
+	}
+
+	auto port = get_local_port(listener.get());
+	test_refused(refused, port);
+
+	std::vector<socket_handle> queued;
+	if (fill_accept_queue(get_local_port(blackhole.get()), queued)) {
+		test_blackhole(get_local_port(blackhole.get()), port);
+	} else {
+		check(false, "accept queue of the blackhole is full");
+	}
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
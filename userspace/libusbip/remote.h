@@ -8,6 +8,8 @@
 #include "win_socket.h"
 
 #include <usbspec.h>
+
+#include <chrono>
 #include <string>
 
 namespace usbip
@@ -52,9 +54,12 @@ USBIP_API const char *get_tcp_port() noexcept;
 /**
  * @param hostname name or IP address of a host to connect to
  * @param service TCP/IP port number of symbolic name
+ * @param deadline of name resolution and connection, WSAETIMEDOUT is set if it has expired
  * @return call GetLastError() if returned handle is invalid
  */
-USBIP_API Socket connect(_In_ const char *hostname, _In_ const char *service);
+USBIP_API Socket connect(
+        _In_ const char *hostname, _In_ const char *service,
+        _In_ std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
 
 /**
  * @param idx zero-based index of usb device
@@ -1,15 +1,15 @@
-﻿#include <usbip\proto_op.h>
+﻿#include <usbip/proto_op.h> // is also built by tools/
 #include <intrin.h>
 
 void usbip_net_pack_uint32_t(int, UINT32 *num)
 {
-        static_assert(sizeof(*num) == sizeof(unsigned long));
+        static_assert(sizeof(*num) == sizeof(_byteswap_ulong(*num)));
         *num = _byteswap_ulong(*num);
 }
 
 void usbip_net_pack_uint16_t(int, UINT16 *num)
 {
-        static_assert(sizeof(*num) == sizeof(unsigned short));
+        static_assert(sizeof(*num) == sizeof(_byteswap_ushort(*num)));
         *num = _byteswap_ushort(*num);
 }
 
@@ -11,14 +11,24 @@
 #include "output.h"
 
 #include <usbip\proto_op.h>
+#include <usbip\happy_eyeballs.h>
 
 #include <ws2tcpip.h>
 #include <mstcpip.h>
 
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 namespace
 {
 
 using namespace usbip;
+using std::chrono::steady_clock;
 
 inline auto do_setsockopt(_In_ SOCKET s, _In_ int level, _In_ int optname, _In_ int optval)
 {
@@ -72,6 +82,343 @@ auto set_keepalive(_In_ SOCKET s, _In_ ULONG timeout, _In_ ULONG interval)
 	return !err;
 }
 
+auto set_nonblocking(_In_ SOCKET s, _In_ bool enable)
+{
+	u_long mode = enable;
+
+	auto err = ioctlsocket(s, FIONBIO, &mode);
+	if (err) {
+		wsa_set_last_error wsa;
+		libusbip::output("ioctlsocket(FIONBIO, {}) error {:#x}", mode, wsa.error);
+	}
+
+	return !err;
+}
+
+/*
+ * @param connected is set to true if connect has completed immediately
+ * @return non-blocking socket, connect is in progress if connected is false
+ */
+auto start_connect(_In_ const addrinfo &ai, _Out_ bool &connected)
+{
+	connected = false;
+
+	Socket sock(socket(ai.ai_family, ai.ai_socktype, ai.ai_protocol));
+	if (!sock) {
+		wsa_set_last_error wsa;
+		libusbip::output("socket() error {:#x}", wsa.error);
+		return sock;
+	}
+
+	using namespace std::chrono_literals;
+	enum { 
+		timeout = std::chrono::milliseconds(30s).count(),
+		interval = std::chrono::milliseconds(1s).count(),
+	};
+
+	if (auto h = sock.get(); !(set_nodelay(h) && set_keepalive(h, timeout, interval) && set_nonblocking(h, true))) {
+		set_last_error save; // close() can change last error
+		sock.close();
+	} else if (!connect(h, ai.ai_addr, int(ai.ai_addrlen))) {
+		connected = true;
+	} else if (auto err = WSAGetLastError(); err != WSAEWOULDBLOCK) {
+		set_last_error save(err);
+		libusbip::output("connect error {:#x}", err);
+		sock.close();
+	}
+
+	return sock;
+}
+
+/*
+ * Copy of getaddrinfo result.
+ */
+struct resolved
+{
+	std::chrono::steady_clock::time_point expires;
+	int error; // of getaddrinfo
+	std::vector<addrinfo> ai; // linked list
+	std::vector<sockaddr_storage> addrs;
+};
+
+/*
+ * Results of getaddrinfo are shared by connects to the same host, failed lookups are cached too.
+ * Windows does not provide TTL of DNS records, fixed lifetimes are used.
+ */
+class addrinfo_cache
+{
+public:
+	using value_type = std::shared_ptr<const resolved>;
+
+	value_type get(_In_ const std::string &key);
+	void put(_In_ const std::string &key, _In_ value_type r);
+	void erase(_In_ const std::string &key);
+
+private:
+	std::mutex m_mtx;
+	std::map<std::string, value_type> m_entries;
+};
+
+auto addrinfo_cache::get(_In_ const std::string &key) -> value_type
+{
+	std::lock_guard lck(m_mtx);
+
+	if (auto i = m_entries.find(key); i == m_entries.end()) {
+		return value_type();
+	} else if (auto &r = i->second; std::chrono::steady_clock::now() < r->expires) {
+		return r;
+	} else {
+		m_entries.erase(i);
+	}
+
+	return value_type();
+}
+
+void addrinfo_cache::put(_In_ const std::string &key, _In_ value_type r)
+{
+	std::lock_guard lck(m_mtx);
+	m_entries.insert_or_assign(key, std::move(r));
+}
+
+void addrinfo_cache::erase(_In_ const std::string &key)
+{
+	std::lock_guard lck(m_mtx);
+	m_entries.erase(key);
+}
+
+/*
+ * A lookup that is finished in background holds a copy, the cache can't be destroyed before it.
+ */
+auto get_addrinfo_cache()
+{
+	static auto cache = std::make_shared<addrinfo_cache>();
+	return cache;
+}
+
+auto make_resolved(_In_ int error, _In_opt_ const addrinfo *head)
+{
+	using namespace std::chrono_literals;
+	auto r = std::make_shared<resolved>();
+
+	r->error = error;
+	r->expires = std::chrono::steady_clock::now() + (error ? 10s : 60s);
+
+	for (auto ai = head; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen <= sizeof(sockaddr_storage)) {
+			auto &a = r->ai.emplace_back(*ai);
+			a.ai_canonname = nullptr;
+
+			auto &addr = r->addrs.emplace_back();
+			memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+		}
+	}
+
+	for (size_t i = 0; i < r->ai.size(); ++i) { // vectors will not be modified
+		auto &a = r->ai[i];
+		a.ai_addr = reinterpret_cast<sockaddr*>(&r->addrs[i]);
+		a.ai_next = i + 1 < r->ai.size() ? &r->ai[i + 1] : nullptr;
+	}
+
+	return r;
+}
+
+/*
+ * Can run in background, it must not use anything but its arguments.
+ * @return result is never empty if error is zero
+ */
+auto lookup(
+	_Inout_ addrinfo_cache &cache, _In_ const char *hostname, _In_ const char *service, 
+	_In_ const std::string &key)
+{
+	addrinfo hints{ .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	std::unique_ptr<addrinfo, decltype(freeaddrinfo)&> info(nullptr, freeaddrinfo);
+
+	int error{};
+
+	if (addrinfo *result; getaddrinfo(hostname, service, &hints, &result)) {
+		error = WSAGetLastError(); // see gai_strerror()
+	} else {
+		info.reset(result);
+	}
+
+	auto r = make_resolved(error, info.get());
+	if (!error && r->ai.empty()) {
+		r->error = WSAHOST_NOT_FOUND;
+	}
+
+	cache.put(key, r);
+	return addrinfo_cache::value_type(std::move(r));
+}
+
+/*
+ * getaddrinfo can't be canceled. If the deadline expires, the lookup is finished in background
+ * and its result is cached for the next attempt. The background thread owns copies of its arguments
+ * and a reference to the cache.
+ *
+ * @return nullptr if the deadline has expired
+ */
+auto resolve(
+	_In_ const char *hostname, _In_ const char *service, _In_ const std::string &key, 
+	_In_ steady_clock::time_point deadline)
+{
+	auto cache = get_addrinfo_cache();
+
+	if (auto r = cache->get(key)) {
+		return r;
+	}
+
+	addrinfo_cache::value_type r;
+
+	if (deadline == steady_clock::time_point::max()) {
+		r = lookup(*cache, hostname, service, key);
+	} else {
+		std::packaged_task<addrinfo_cache::value_type()> task(
+			[cache, host = std::string(hostname), svc = std::string(service), key]
+			{
+				return lookup(*cache, host.c_str(), svc.c_str(), key);
+			});
+
+		auto result = task.get_future();
+		std::thread(std::move(task)).detach();
+
+		if (result.wait_until(deadline) != std::future_status::ready) {
+			libusbip::output("getaddrinfo {} timed out", key);
+			return r;
+		}
+
+		r = result.get();
+	}
+
+	if (r->error) {
+		libusbip::output("getaddrinfo {} error {:#x}", key, r->error); // see gai_strerror()
+	}
+
+	return r;
+}
+
+/*
+ * @return timeout of wait_any, milliseconds::max() if infinite
+ */
+auto get_timeout(_In_ bool start_next, _In_ steady_clock::time_point deadline)
+{
+	using namespace std::chrono;
+	auto t = start_next ? milliseconds(CONNECTION_ATTEMPT_DELAY) : milliseconds::max();
+
+	if (deadline != steady_clock::time_point::max()) {
+		auto remaining = ceil<milliseconds>(deadline - steady_clock::now());
+		t = std::clamp(remaining, milliseconds::zero(), t);
+	}
+
+	return t;
+}
+
+enum { DELAY_EXPIRED = -1, SELECT_FAILED = -2 };
+
+/*
+ * Failed connection attempt is reported through exceptfds, its socket is closed.
+ * @param timeout wait infinitely if milliseconds::max(), @see get_timeout
+ * @param error is set if connection attempt or select has failed
+ * @return index of completed attempt or one of the values above
+ */
+auto wait_any(_Inout_ Socket *v, _In_ int cnt, _In_ std::chrono::milliseconds timeout, _Inout_ int &error)
+{
+	fd_set wr, ex;
+
+	FD_ZERO(&wr);
+	FD_ZERO(&ex);
+
+	for (int i = 0; i < cnt; ++i) {
+		if (auto s = v[i].get(); s != INVALID_SOCKET) {
+			FD_SET(s, &wr);
+			FD_SET(s, &ex);
+		}
+	}
+
+	auto infinite = timeout == timeout.max();
+	auto ms = infinite ? 0 : timeout.count();
+	timeval tv{ .tv_sec = long(ms/1000), .tv_usec = long(ms%1000*1000) };
+
+	if (select(0, nullptr, &wr, &ex, infinite ? nullptr : &tv) == SOCKET_ERROR) {
+		error = WSAGetLastError();
+		libusbip::output("select error {:#x}", error);
+		return int(SELECT_FAILED);
+	}
+
+	for (int i = 0; i < cnt; ++i) {
+		auto &sock = v[i];
+		auto s = sock.get();
+
+		if (s == INVALID_SOCKET) {
+			continue;
+		} else if (FD_ISSET(s, &wr)) {
+			return i;
+		} else if (FD_ISSET(s, &ex)) {
+			int len = sizeof(error);
+			getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &len);
+			libusbip::output("connect error {:#x}", error);
+			sock.close();
+			return i;
+		}
+	}
+
+	return int(DELAY_EXPIRED);
+}
+
+/*
+ * @see usbip::race
+ */
+class connector
+{
+public:
+	connector(_In_ const addrinfo* const *addrs, _In_ steady_clock::time_point deadline) :
+		m_addrs(addrs), m_deadline(deadline) {}
+
+	attempt_status start(_In_ int idx);
+	int wait(_In_ int started, _In_ bool start_next);
+	bool succeeded(_In_ int idx) const { return static_cast<bool>(m_v[idx]); }
+
+	auto release(_In_ int idx) { return std::move(m_v[idx]); }
+	auto error() const noexcept { return m_error; }
+
+private:
+	const addrinfo* const *m_addrs;
+	steady_clock::time_point m_deadline;
+
+	Socket m_v[MAX_CONNECTION_ATTEMPTS];
+	int m_error = WSAECONNREFUSED;
+};
+
+attempt_status connector::start(_In_ int idx)
+{
+	bool connected;
+	auto &s = m_v[idx] = start_connect(*m_addrs[idx], connected);
+
+	if (connected) {
+		return attempt_status::connected;
+	} else if (s) {
+		return attempt_status::pending;
+	}
+
+	m_error = GetLastError();
+	return attempt_status::failed;
+}
+
+int connector::wait(_In_ int started, _In_ bool start_next)
+{
+	switch (auto i = wait_any(m_v, started, get_timeout(start_next, m_deadline), m_error)) {
+	case DELAY_EXPIRED:
+		if (steady_clock::now() < m_deadline) {
+			return ATTEMPT_DELAY_EXPIRED;
+		}
+		m_error = WSAETIMEDOUT;
+		[[fallthrough]];
+	case SELECT_FAILED:
+		return ATTEMPTS_ABORTED;
+	default:
+		return i;
+	}
+}
+
 auto recv(_In_ SOCKET s, _In_ void *buf, _In_ size_t len, _Out_opt_ bool *eof = nullptr)
 {
 	assert(s != INVALID_SOCKET);
@@ -189,49 +536,41 @@ const char* usbip::get_tcp_port() noexcept
 	return tcp_port;
 }
 
-auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+/*
+ * Happy Eyeballs, RFC 8305. 
+ * A dual-stack host with a blackholed route for one of the families is connected without a TCP timeout.
+ */
+auto usbip::connect(_In_ const char *hostname, _In_ const char *service, _In_ steady_clock::time_point deadline) -> Socket
 {
 	Socket sock;
 
-	addrinfo hints{ .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
-	std::unique_ptr<addrinfo, decltype(freeaddrinfo)&> info(nullptr, freeaddrinfo);
+	auto key = std::string(hostname) + ':' + service;
 
-	if (addrinfo *result; getaddrinfo(hostname, service, &hints, &result)) {
-		wsa_set_last_error wsa; // see gai_strerror()
-		libusbip::output("getaddrinfo {}:{} error {:#x}", hostname, service, wsa.error);
+	auto info = resolve(hostname, service, key, deadline);
+	if (!info) {
+		SetLastError(WSAETIMEDOUT);
+		return sock;
+	} else if (info->error) {
+		SetLastError(info->error);
 		return sock;
-	} else {
-		info.reset(result);
 	}
 
-	for (auto r = info.get(); r; r = r->ai_next) {
-
-		sock.reset(socket(r->ai_family, r->ai_socktype, r->ai_protocol));
-		if (!sock) {
-			wsa_set_last_error wsa;
-			libusbip::output("socket() {}:{} error {:#x}", hostname, service, wsa.error);
-			continue;
-		}
+	const addrinfo *addrs[MAX_CONNECTION_ATTEMPTS];
+	auto cnt = interleave_families(addrs, info->ai.data());
 
-		using namespace std::chrono_literals;
-		enum { 
-		        timeout = std::chrono::milliseconds(30s).count(),
-			interval = std::chrono::milliseconds(1s).count(),
-		};
+	connector c(addrs, deadline);
 
-		if (auto h = sock.get(); !(set_nodelay(h) && set_keepalive(h, timeout, interval))) {
-			set_last_error save; // close() can change last error
-			sock.close();
-			break;
-		}
+	if (auto i = race(c, cnt); i >= 0) {
+		sock = c.release(i);
+	}
 
-		if (connect(sock.get(), r->ai_addr, int(r->ai_addrlen))) {
-			wsa_set_last_error wsa;
-			libusbip::output("connect {}:{} error {:#x}", hostname, service, wsa.error);
-			sock.close();
-		} else {
-			break;
-		}
+	if (!sock) {
+		set_last_error save(c.error());
+		libusbip::output("connect {} error {:#x}", key, c.error());
+		get_addrinfo_cache()->erase(key); // resolve again on next attempt
+	} else if (!set_nonblocking(sock.get(), false)) {
+		set_last_error save;
+		sock.close();
 	}
 
 	return sock;
@@ -10,6 +10,8 @@
 #include <resources\messages.h>
 #include <cfgmgr32.h>
 
+#include <algorithm>
+
 #include <initguid.h>
 #include <usbip\vhci.h>
 
@@ -75,6 +77,92 @@ void assign(_Out_ std::vector<imported_device> &dst, _In_ const vhci::imported_d
         }
 }
 
+void assign(_Out_ transfer_statistics &dst, _In_ const vhci::transfer_statistics &src)
+{
+        dst = transfer_statistics {
+                .submitted = src.submitted,
+                .completed = src.completed,
+                .cancelled = src.cancelled,
+                .failed = src.failed,
+                .bytes_out = src.bytes_out,
+                .bytes_in = src.bytes_in,
+                .unlinked = src.unlinked,
+                .drained = src.drained,
+                .inflight = src.inflight,
+                .peak_inflight = src.peak_inflight,
+        };
+}
+
+void assign(_Out_ latency_percentiles &dst, _In_ const vhci::latency_percentiles &src)
+{
+        dst = latency_percentiles {
+                .count = src.count,
+                .mean = src.mean,
+                .max = src.max,
+                .p50 = src.p50,
+                .p90 = src.p90,
+                .p99 = src.p99,
+                .p999 = src.p999,
+        };
+}
+
+void assign(_Out_ wsk_context_statistics &dst, _In_ const vhci::wsk_context_statistics &src)
+{
+        static_assert(ARRAYSIZE(dst.alloc) == ARRAYSIZE(src.alloc));
+
+        for (int i = 0; i < ARRAYSIZE(src.alloc); ++i) {
+                dst.alloc[i] = src.alloc[i];
+                dst.hit[i] = src.hit[i];
+                dst.miss[i] = src.miss[i];
+        }
+
+        dst.realloc = src.realloc;
+}
+
+/*
+ * Fields of usbip_header are 32-bit integers except the setup packet at the end.
+ */
+void to_network_byte_order(_Inout_ UCHAR (&header)[48])
+{
+        constexpr auto setup_offset = 40;
+        auto v = reinterpret_cast<UINT32*>(header);
+
+        for (int i = 0; i < setup_offset/sizeof(*v); ++i) {
+                v[i] = _byteswap_ulong(v[i]);
+        }
+}
+
+/*
+ * @return 100-nanosecond intervals since January 1, 1601 (UTC)
+ */
+auto get_time(_In_ const vhci::ioctl::get_flight_recorder &r, _In_ INT64 timestamp)
+{
+        constexpr INT64 hns = 10'000'000; // in one second
+
+        auto ticks = timestamp - r.timestamp; // negative, record was made before the snapshot
+        auto delta = ticks/r.frequency*hns + ticks % r.frequency*hns/r.frequency;
+
+        return UINT64(r.system_time + delta);
+}
+
+void assign(_Out_ flight_record &dst, _In_ const vhci::ioctl::get_flight_recorder &r, _In_ vhci::flight_record &src)
+{
+        to_network_byte_order(src.header);
+
+        dst = flight_record {
+                .time = get_time(r, src.timestamp),
+                .port = src.port,
+                .outgoing = bool(src.outgoing),
+                .length = src.length,
+        };
+
+        auto payload_len = std::min(size_t(src.payload_len), sizeof(src.payload));
+
+        dst.data.reserve(sizeof(src.header) + payload_len);
+        dst.data.assign(std::begin(src.header), std::end(src.header));
+        dst.data.insert(dst.data.end(), src.payload, src.payload + payload_len);
+}
+
 auto get_path()
 {
         auto guid = const_cast<GUID*>(&vhci::GUID_DEVINTERFACE_USB_HOST_CONTROLLER);
@@ -213,3 +301,108 @@ bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
         DWORD BytesReturned; // must be set if the last arg is NULL
         return DeviceIoControl(dev, ioctl::PLUGOUT_HARDWARE, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
 }
+
+auto usbip::vhci::get_device_statistics(_In_ HANDLE dev, _In_ int port, _Out_ bool &success) -> usbip::device_statistics
+{
+        success = false;
+        usbip::device_statistics result;
+
+        ioctl::get_device_statistics r{{ .size = sizeof(r) }, port };
+
+        if (DWORD BytesReturned; // must be set if the last arg is NULL
+            !DeviceIoControl(dev, ioctl::GET_DEVICE_STATISTICS, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return result;
+        } else if (BytesReturned != sizeof(r) || r.endpoint_cnt > ARRAYSIZE(r.endpoints)) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return result;
+        }
+
+        assign(result.device, r.device);
+        result.endpoints.reserve(r.endpoint_cnt);
+
+        for (ULONG i = 0; i < r.endpoint_cnt; ++i) {
+                auto &src = r.endpoints[i];
+                usbip::endpoint_statistics ep{ .address = src.address };
+                assign(ep.stats, src.stats);
+                result.endpoints.push_back(ep);
+        }
+
+        result.descriptor_hits = r.descriptor_hits;
+        result.descriptor_misses = r.descriptor_misses;
+
+        assign(result.wsk_context, r.wsk_context);
+
+        result.addrinfo_hits = r.addrinfo_hits;
+        result.addrinfo_misses = r.addrinfo_misses;
+
+        success = true;
+        return result;
+}
+
+auto usbip::vhci::get_device_latency(_In_ HANDLE dev, _In_ int port, _Out_ bool &success) -> usbip::device_latency
+{
+        success = false;
+        usbip::device_latency result{};
+
+        ioctl::get_device_latency r{{ .size = sizeof(r) }, port };
+
+        if (DWORD BytesReturned; // must be set if the last arg is NULL
+            !DeviceIoControl(dev, ioctl::GET_DEVICE_LATENCY, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return result;
+        } else if (BytesReturned != sizeof(r)) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return result;
+        }
+
+        static_assert(ARRAYSIZE(r.transfers) == 4); // USBD_PIPE_TYPE
+
+        assign(result.control, r.transfers[0]);
+        assign(result.isochronous, r.transfers[1]);
+        assign(result.bulk, r.transfers[2]);
+        assign(result.interrupt, r.transfers[3]);
+
+        success = true;
+        return result;
+}
+
+std::vector<usbip::flight_record> usbip::vhci::get_flight_records(_In_ HANDLE dev, _Out_ bool &success)
+{
+        success = false;
+        std::vector<usbip::flight_record> result;
+
+        ioctl::get_flight_recorder *r{};
+        std::vector<char> buf;
+
+        for (ULONG cnt = 1024; true; cnt <<= 1) {
+                buf.resize(ioctl::get_flight_recorder_size(cnt));
+
+                r = reinterpret_cast<ioctl::get_flight_recorder*>(buf.data());
+                r->size = sizeof(*r);
+
+                if (DWORD BytesReturned; // must be set if the last arg is NULL
+                    DeviceIoControl(dev, ioctl::GET_FLIGHT_RECORDER, r, sizeof(r->size), 
+                                    buf.data(), DWORD(buf.size()), &BytesReturned, nullptr)) {
+
+                        if (BytesReturned < offsetof(ioctl::get_flight_recorder, records) ||
+                            BytesReturned != ioctl::get_flight_recorder_size(r->record_cnt)) [[unlikely]] {
+                                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                                return result;
+                        }
+                        break;
+
+                } else if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                        return result;
+                }
+        }
+
+        result.resize(r->record_cnt);
+
+        for (ULONG i = 0; i < r->record_cnt; ++i) {
+                assign(result[i], *r, r->records[i]);
+        }
+
+        std::ranges::stable_sort(result, {}, &usbip::flight_record::time);
+
+        success = true;
+        return result;
+}
@@ -37,6 +37,91 @@ struct imported_device
         UINT16 product;
 };
 
+struct transfer_statistics
+{
+        UINT64 submitted; // URBs sent to a server
+        UINT64 completed; // successfully
+        UINT64 cancelled;
+        UINT64 failed;
+
+        UINT64 bytes_out;
+        UINT64 bytes_in;
+
+        UINT64 unlinked; // USBIP_CMD_UNLINK sent
+        UINT64 drained; // payload bytes of responses for unlinked URBs
+
+        UINT32 inflight; // URBs that are waiting for a response
+        UINT32 peak_inflight;
+};
+
+struct endpoint_statistics
+{
+        UCHAR address; // bEndpointAddress
+        transfer_statistics stats;
+};
+
+/*
+ * Lookaside lists of the driver's I/O contexts, they are shared by all devices.
+ * Indexed by size class of isoch descriptors buffer: 0, 8, 32, 128, 1024 packets.
+ */
+struct wsk_context_statistics
+{
+        enum { CLASS_CNT = 5 };
+        UINT64 alloc[CLASS_CNT];
+        UINT64 hit[CLASS_CNT]; // taken from the cache of a device
+        UINT64 miss[CLASS_CNT]; // allocated from the pool
+        UINT64 realloc; // isoch descriptors buffer grew beyond its size class
+};
+
+struct device_statistics
+{
+        transfer_statistics device; // sum of all endpoints
+        std::vector<endpoint_statistics> endpoints; // that were used
+
+        UINT64 descriptor_hits; // GET_DESCRIPTOR completed from the cache of the device
+        UINT64 descriptor_misses; // sent to a server
+
+        wsk_context_statistics wsk_context; // driver-wide
+
+        UINT64 addrinfo_hits; // driver-wide, name resolutions saved by the cache
+        UINT64 addrinfo_misses; // driver-wide, WskGetAddressInfo calls
+};
+
+/*
+ * Round-trip time of URBs in microseconds.
+ */
+struct latency_percentiles
+{
+        UINT64 count;
+        UINT64 mean;
+        UINT64 max;
+
+        UINT64 p50;
+        UINT64 p90;
+        UINT64 p99;
+        UINT64 p999;
+};
+
+struct device_latency
+{
+        latency_percentiles control;
+        latency_percentiles isochronous;
+        latency_percentiles bulk;
+        latency_percentiles interrupt;
+};
+
+/*
+ * USB/IP PDU that was recorded by the driver.
+ */
+struct flight_record
+{
+        UINT64 time; // 100-nanosecond intervals since January 1, 1601 (UTC), as FILETIME
+        int port; // hub port of the device
+        bool outgoing; // sent to a server
+        UINT32 length; // of the whole PDU, can be greater than data.size()
+        std::vector<UCHAR> data; // usbip_header in network byte order followed by a prefix of payload
+};
+
 } // namespace usbip
 
 
@@ -70,4 +155,28 @@ USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
  */
 USBIP_API bool detach(_In_ HANDLE dev, _In_ int port);
 
+/**
+ * @param dev handle of the driver device
+ * @param port hub port number, >= 1
+ * @param success call GetLastError() if false is returned
+ * @return counters of transfers of the device since it was attached
+ */
+USBIP_API device_statistics get_device_statistics(_In_ HANDLE dev, _In_ int port, _Out_ bool &success);
+
+/**
+ * @param dev handle of the driver device
+ * @param port hub port number, >= 1
+ * @param success call GetLastError() if false is returned
+ * @return percentiles of round-trip time of URBs by transfer type since the device was attached
+ */
+USBIP_API device_latency get_device_latency(_In_ HANDLE dev, _In_ int port, _Out_ bool &success);
+
+/**
+ * Recording of PDUs is always enabled, the driver keeps a number of recent PDUs of all devices.
+ * @param dev handle of the driver device
+ * @param success call GetLastError() if false is returned
+ * @return recent PDUs sorted by time
+ */
+USBIP_API std::vector<flight_record> get_flight_records(_In_ HANDLE dev, _Out_ bool &success);
+
 } // namespace usbip::vhci
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "usbip.h"
+
+#include <libusbip\vhci.h>
+#include <spdlog\spdlog.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * The driver does not see TCP/IP headers, they are synthesized for Wireshark's USB/IP dissector.
+ * Every hub port is a separate TCP stream between these addresses.
+ */
+enum : UINT32 { CLIENT_ADDR = 0x0A000001, SERVER_ADDR = 0x0A000002 }; // 10.0.0.1, 10.0.0.2
+enum : UINT16 { CLIENT_TCP_PORT = 50000, SERVER_TCP_PORT = 3240 };
+
+enum { LINKTYPE_IPV4 = 228 };
+constexpr UINT64 UNIX_EPOCH = 116'444'736'000'000'000; // January 1, 1970 as FILETIME
+
+#pragma pack(push, 1)
+
+struct pcap_file_header
+{
+	UINT32 magic = 0xA1B2C3D4; // microsecond resolution
+	UINT16 version_major = 2;
+	UINT16 version_minor = 4;
+	INT32 thiszone{};
+	UINT32 sigfigs{};
+	UINT32 snaplen = USHRT_MAX;
+	UINT32 linktype = LINKTYPE_IPV4;
+};
+static_assert(sizeof(pcap_file_header) == 24);
+
+struct pcap_record_header
+{
+	UINT32 ts_sec;
+	UINT32 ts_usec;
+	UINT32 caplen;
+	UINT32 len;
+};
+static_assert(sizeof(pcap_record_header) == 16);
+
+struct ip_header
+{
+	UINT8 version_ihl = 0x45; // IPv4, 20 bytes
+	UINT8 tos{};
+	UINT16 total_length;
+	UINT16 id{};
+	UINT16 flags_offset = htons(0x4000); // don't fragment
+	UINT8 ttl = 64;
+	UINT8 protocol = IPPROTO_TCP;
+	UINT16 checksum{};
+	UINT32 saddr;
+	UINT32 daddr;
+};
+static_assert(sizeof(ip_header) == 20);
+
+struct tcp_header
+{
+	UINT16 sport;
+	UINT16 dport;
+	UINT32 seq;
+	UINT32 ack_seq;
+	UINT8 data_offset = 0x50; // upper nibble, 5 32-bit words
+	UINT8 flags = 0x18; // PSH, ACK
+	UINT16 window = htons(USHRT_MAX);
+	UINT16 checksum{}; // is not validated by Wireshark by default
+	UINT16 urg_ptr{};
+};
+static_assert(sizeof(tcp_header) == 20);
+
+struct packet_headers
+{
+	ip_header ip;
+	tcp_header tcp;
+};
+
+#pragma pack(pop)
+
+auto checksum(_In_ const void *data, _In_ size_t len)
+{
+	UINT32 sum = 0;
+	auto v = static_cast<const UINT16*>(data);
+
+	for (size_t i = 0; i < len/sizeof(*v); ++i) {
+		sum += v[i];
+	}
+
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+
+	return UINT16(~sum);
+}
+
+/*
+ * Sequence numbers of both directions of a TCP stream.
+ */
+struct tcp_stream
+{
+	UINT32 client_seq = 1;
+	UINT32 server_seq = 1;
+};
+
+auto make_headers(_Inout_ tcp_stream &s, _In_ const flight_record &r, _In_ UINT16 payload_len)
+{
+	packet_headers h{};
+
+	h.ip.total_length = htons(UINT16(sizeof(h) + payload_len));
+	h.ip.saddr = htonl(r.outgoing ? CLIENT_ADDR : SERVER_ADDR);
+	h.ip.daddr = htonl(r.outgoing ? SERVER_ADDR : CLIENT_ADDR);
+	h.ip.checksum = checksum(&h.ip, sizeof(h.ip));
+
+	auto client_port = htons(UINT16(CLIENT_TCP_PORT + r.port));
+	auto server_port = htons(SERVER_TCP_PORT);
+
+	auto &seq = r.outgoing ? s.client_seq : s.server_seq;
+	auto &ack = r.outgoing ? s.server_seq : s.client_seq;
+
+	h.tcp.sport = r.outgoing ? client_port : server_port;
+	h.tcp.dport = r.outgoing ? server_port : client_port;
+	h.tcp.seq = htonl(seq);
+	h.tcp.ack_seq = htonl(ack);
+
+	seq += payload_len;
+	return h;
+}
+
+template<typename T>
+inline void write(_Inout_ std::ofstream &os, _In_ const T &val)
+{
+	os.write(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+/*
+ * A record holds a prefix of PDU only. The length of a packet is the length of PDU,
+ * so Wireshark shows the frames as truncated ("Packet size limited during capture").
+ */
+void write(_Inout_ std::ofstream &os, _Inout_ tcp_stream &s, _In_ const flight_record &r)
+{
+	constexpr UINT32 max_payload = USHRT_MAX - sizeof(packet_headers);
+	auto payload_len = UINT16(std::min(r.length, max_payload));
+
+	auto captured = std::min(r.data.size(), size_t(payload_len));
+	auto h = make_headers(s, r, payload_len);
+
+	auto usec = (r.time - UNIX_EPOCH)/10;
+
+	pcap_record_header rh {
+		.ts_sec = UINT32(usec/1'000'000),
+		.ts_usec = UINT32(usec % 1'000'000),
+		.caplen = UINT32(sizeof(h) + captured),
+		.len = UINT32(sizeof(h) + payload_len),
+	};
+
+	write(os, rh);
+	write(os, h);
+	os.write(reinterpret_cast<const char*>(r.data.data()), captured);
+}
+
+} // namespace
+
+
+bool usbip::cmd_capture(void *p)
+{
+	auto &args = *reinterpret_cast<capture_args*>(p);
+
+	auto dev = vhci::open();
+	if (!dev) {
+		spdlog::error(GetLastErrorMsg());
+		return false;
+	}
+
+	bool ok;
+	auto records = vhci::get_flight_records(dev.get(), ok);
+	if (!ok) {
+		spdlog::error(GetLastErrorMsg());
+		return false;
+	}
+
+	std::ofstream os(args.file, std::ios::binary | std::ios::trunc);
+	if (!os) {
+		spdlog::error("can't open '{}' for writing", args.file);
+		return false;
+	}
+
+	write(os, pcap_file_header{});
+
+	std::map<int, tcp_stream> streams; // by hub port
+	for (auto &r: records) {
+		write(os, streams[r.port], r);
+	}
+
+	if (!os.flush()) {
+		spdlog::error("write error '{}'", args.file);
+		return false;
+	}
+
+	printf("%zu PDU(s) written to '%s'\n", records.size(), args.file.c_str());
+	return true;
+}
@@ -10,11 +10,31 @@
 
 #include <spdlog\spdlog.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <vector>
+
 namespace
 {
 
 using namespace usbip;
 
+struct exported_device
+{
+	usb_device dev;
+	std::vector<usb_interface> intfs;
+};
+
+struct host_result
+{
+	std::string host;
+	DWORD error{}; // GetLastError() if enumeration has failed
+	std::vector<exported_device> devices;
+};
+
 void on_device_count(int count)
 {
 	if (count) {
@@ -57,6 +77,209 @@ void on_interface(int, const usb_device &d, int idx, const usb_interface &r)
 	printf(s.c_str());
 }
 
+/*
+ * Blocking socket I/O fails with WSAETIMEDOUT after the deadline.
+ */
+auto set_timeout(_In_ SOCKET s, _In_ std::chrono::steady_clock::time_point deadline)
+{
+	using namespace std::chrono;
+
+	auto remaining = ceil<milliseconds>(deadline - steady_clock::now());
+	auto ms = DWORD(std::max(remaining.count(), 1LL)); // zero means infinite
+	auto val = reinterpret_cast<const char*>(&ms);
+
+	return !(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, val, sizeof(ms)) || 
+		 setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, val, sizeof(ms)));
+}
+
+/*
+ * Name resolution, connection and enumeration are bounded by the timeout.
+ */
+void enum_host(_Inout_ host_result &r, _In_ int timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+
+	auto sock = connect(r.host.c_str(), global_args.tcp_port.c_str(), deadline);
+	if (!sock) {
+		r.error = GetLastError();
+		return;
+	}
+
+	spdlog::debug("connected to {}:{}", r.host, global_args.tcp_port);
+
+	auto on_dev = [&v = r.devices] (auto, auto &dev) { v.emplace_back(dev); };
+	auto on_intf = [&v = r.devices] (auto, auto&, auto, auto &intf) { v.back().intfs.push_back(intf); };
+
+	if (!(set_timeout(sock.get(), deadline) && enum_exportable_devices(sock.get(), on_dev, on_intf))) {
+		r.error = GetLastError();
+	}
+}
+
+/*
+ * Hosts are queried concurrently by a bounded number of workers, results are in the order of hosts.
+ */
+auto enum_hosts(_In_ const std::vector<std::string> &hosts, _In_ int jobs, _In_ int timeout)
+{
+	std::vector<host_result> v(hosts.size());
+	for (size_t i = 0; i < hosts.size(); ++i) {
+		v[i].host = hosts[i];
+	}
+
+	std::atomic<size_t> next{};
+	auto worker = [&v, &next, timeout] 
+	{
+		for (size_t i; (i = next++) < v.size(); ) {
+			enum_host(v[i], timeout);
+		}
+	};
+
+	std::vector<std::thread> workers(std::min(size_t(jobs), v.size()) - 1);
+	for (auto &t: workers) {
+		t = std::thread(worker);
+	}
+
+	worker();
+
+	for (auto &t: workers) {
+		t.join();
+	}
+
+	return v;
+}
+
+/*
+ * One host per line, empty lines and lines that start with '#' are ignored.
+ */
+auto read_hosts_file(_Inout_ std::vector<std::string> &hosts, _In_ const std::string &path)
+{
+	std::ifstream f(path);
+	if (!f) {
+		spdlog::error("can't open '{}'", path);
+		return false;
+	}
+
+	for (std::string line; std::getline(f, line); ) {
+		auto first = line.find_first_not_of(" \t\r");
+		if (first == line.npos || line[first] == '#') {
+			continue;
+		}
+
+		auto last = line.find_last_not_of(" \t\r");
+		hosts.push_back(line.substr(first, last - first + 1));
+	}
+
+	return true;
+}
+
+auto print_text(_In_ const std::vector<host_result> &results)
+{
+	bool ok = true;
+
+	for (auto &r: results) {
+		if (r.error) {
+			spdlog::error("{}: {}", r.host, GetLastErrorMsg(r.error));
+			ok = false;
+			continue;
+		}
+
+		if (results.size() > 1) {
+			printf(" - %s\n", r.host.c_str());
+		}
+
+		on_device_count(int(r.devices.size()));
+
+		for (int i = 0; auto &d: r.devices) {
+			on_device(i, d.dev);
+
+			for (int j = 0; auto &intf: d.intfs) {
+				on_interface(i, d.dev, j++, intf);
+			}
+			++i;
+		}
+	}
+
+	return ok;
+}
+
+auto json_string(_In_ std::string_view s)
+{
+	std::string r("\"");
+
+	for (unsigned char c: s) {
+		switch (c) {
+		case '"':
+		case '\\':
+			r += '\\';
+			r += c;
+			break;
+		default:
+			if (c < ' ') {
+				r += std::format("\\u{:04x}", c);
+			} else {
+				r += c;
+			}
+		}
+	}
+
+	r += '"';
+	return r;
+}
+
+auto print_json(_In_ const std::vector<host_result> &results)
+{
+	auto &ids = get_ids();
+	bool ok = true;
+
+	std::string out("[");
+
+	for (auto sep = ""; auto &r: results) {
+		out += std::format("{}\n  {{\"host\": {}, ", sep, json_string(r.host));
+		sep = ",";
+
+		if (r.error) {
+			out += std::format("\"error\": {}}}", json_string(GetLastErrorMsg(r.error)));
+			ok = false;
+			continue;
+		}
+
+		out += "\"devices\": [";
+
+		for (auto dsep = ""; auto &d: r.devices) {
+			auto &dev = d.dev;
+
+			out += std::format(
+				"{}\n    {{\"busid\": {}, \"path\": {}, \"busnum\": {}, \"devnum\": {}, \"speed\": {}, "
+				"\"idVendor\": {}, \"idProduct\": {}, \"bcdDevice\": {}, "
+				"\"bDeviceClass\": {}, \"bDeviceSubClass\": {}, \"bDeviceProtocol\": {}, "
+				"\"bConfigurationValue\": {}, \"bNumConfigurations\": {}, "
+				"\"product\": {}, \"interfaces\": [",
+				dsep, json_string(dev.busid), json_string(dev.path), dev.busnum, dev.devnum, int(dev.speed),
+				dev.idVendor, dev.idProduct, dev.bcdDevice, 
+				dev.bDeviceClass, dev.bDeviceSubClass, dev.bDeviceProtocol,
+				dev.bConfigurationValue, dev.bNumConfigurations,
+				json_string(get_product(ids, dev.idVendor, dev.idProduct)));
+
+			dsep = ",";
+
+			for (auto isep = ""; auto &i: d.intfs) {
+				out += std::format(
+					"{}{{\"bInterfaceClass\": {}, \"bInterfaceSubClass\": {}, \"bInterfaceProtocol\": {}}}",
+					isep, i.bInterfaceClass, i.bInterfaceSubClass, i.bInterfaceProtocol);
+				isep = ", ";
+			}
+
+			out += "]}";
+		}
+
+		out += r.devices.empty() ? "]}" : "\n  ]}";
+	}
+
+	out += results.empty() ? "]\n" : "\n]\n";
+	fputs(out.c_str(), stdout);
+
+	return ok;
+}
+
 auto list_stashed_devices()
 {
 	bool success{};
@@ -82,18 +305,16 @@ bool usbip::cmd_list(void *p)
 		return list_stashed_devices();
 	}
 
-	auto sock = connect(args.remote.c_str(), global_args.tcp_port.c_str());
-	if (!sock) {
-		spdlog::error(GetLastErrorMsg());
+	auto hosts = args.remotes;
+	if (!(args.hosts_file.empty() || read_hosts_file(hosts, args.hosts_file))) {
 		return false;
 	}
 
-	spdlog::debug("connected to {}:{}", args.remote, global_args.tcp_port);
-
-	if (!enum_exportable_devices(sock.get(), on_device, on_interface, on_device_count)) {
-		spdlog::error(GetLastErrorMsg());
+	if (hosts.empty()) {
+		spdlog::error("no hosts to query");
 		return false;
 	}
 
-	return true;
+	auto results = enum_hosts(hosts, args.jobs, args.timeout);
+	return args.json ? print_json(results) : print_text(results);
 }
@@ -37,6 +37,87 @@ void print(const imported_device &d)
         printf(msg.c_str());
 }
 
+auto format_stats(_In_ const transfer_statistics &s, _In_ std::string_view indent, _In_ bool drained)
+{
+        auto msg = std::format("{}URBs: submitted {}, completed {}, cancelled {}, failed {}, unlinked {}, "
+                               "in-flight {} (peak {})\n"
+                               "{}bytes: out {}, in {}",
+                                indent, s.submitted, s.completed, s.cancelled, s.failed, s.unlinked, 
+                                s.inflight, s.peak_inflight,
+                                indent, s.bytes_out, s.bytes_in);
+        if (drained) {
+                msg += std::format(", drained {}", s.drained);
+        }
+
+        msg += '\n';
+        return msg;
+}
+
+auto format_wsk_context(_In_ const wsk_context_statistics &s)
+{
+        auto join = [] (auto &v)
+        {
+                std::string str;
+                for (auto val: v) {
+                        str += std::format("{}{}", str.empty() ? "" : "/", val);
+                }
+                return str;
+        };
+
+        return std::format("              I/O contexts (driver-wide), by 0/8/32/128/1024 isoch packets: "
+                           "alloc {}, hit {}, miss {}, realloc {}\n",
+                           join(s.alloc), join(s.hit), join(s.miss), s.realloc);
+}
+
+auto format_latency(_In_ std::string_view transfer, _In_ const latency_percentiles &p)
+{
+        if (!p.count) {
+                return std::string();
+        }
+
+        return std::format("              {} latency, us: count {}, mean {}, p50 {}, p90 {}, p99 {}, p99.9 {}, max {}\n",
+                            transfer, p.count, p.mean, p.p50, p.p90, p.p99, p.p999, p.max);
+}
+
+auto print_statistics(_In_ HANDLE dev, _In_ int port)
+{
+        bool success;
+        auto st = vhci::get_device_statistics(dev, port, success);
+        if (!success) {
+                spdlog::error("port {}: {}", port, GetLastErrorMsg());
+                return false;
+        }
+
+        auto msg = format_stats(st.device, "              ", true);
+
+        for (auto &ep: st.endpoints) {
+                msg += std::format("              endpoint {:#04x}\n", ep.address);
+                msg += format_stats(ep.stats, "                ", false);
+        }
+
+        auto lat = vhci::get_device_latency(dev, port, success);
+        if (!success) {
+                spdlog::error("port {}: {}", port, GetLastErrorMsg());
+                return false;
+        }
+
+        msg += format_latency("control", lat.control);
+        msg += format_latency("isoch", lat.isochronous);
+        msg += format_latency("bulk", lat.bulk);
+        msg += format_latency("interrupt", lat.interrupt);
+
+        msg += std::format("              GET_DESCRIPTOR from cache: hits {}, misses {}\n", 
+                           st.descriptor_hits, st.descriptor_misses);
+
+        msg += format_wsk_context(st.wsk_context);
+
+        msg += std::format("              name resolution cache (driver-wide): lookups saved {}, misses {}\n", 
+                           st.addrinfo_hits, st.addrinfo_misses);
+
+        printf("           -> statistics\n%s", msg.c_str());
+        return true;
+}
+
 } // namespace
 
 
@@ -67,6 +148,7 @@ bool usbip::cmd_port(void *p)
 
         auto &ports = args.ports; 
         auto found = false;
+        auto stats_ok = true;
 
         for (auto &d: devices) {
                 assert(d.port);
@@ -77,13 +159,16 @@ bool usbip::cmd_port(void *p)
                                        "====================\n");
                         }
                         print(d);
+                        if (args.stats && !print_statistics(dev.get(), d.port)) {
+                                stats_ok = false;
+                        }
                         if (args.stash) {
                                 dl.push_back(std::move(d.location));
                         }
                 }
         }
 
-        success = found || ports.empty();
+        success = (found || ports.empty()) && stats_ok;
 
         if (args.stash && !vhci::set_persistent(dev.get(), dl)) {
                 spdlog::error(GetLastErrorMsg());
@@ -96,9 +96,22 @@ void add_cmd_list(CLI::App &app)
 		->callback(pack(cmd_list, &r))
 		->require_option(1);
 
-	cmd->add_option_group("remote", "List exportable USB devices")
-		->add_option("-r,--remote", r.remote, "List exportable devices on a remote")
-		->required();
+	auto rem = cmd->add_option_group("remote", "List exportable USB devices");
+
+	rem->add_option("-r,--remote", r.remotes, "List exportable devices on remote(s), can be repeated");
+
+	rem->add_option("-f,--hosts-file", r.hosts_file, "File with a hostname/IP per line, '#' starts a comment")
+		->check(CLI::ExistingFile);
+
+	rem->add_option("-j,--jobs", r.jobs, "Number of remotes queried concurrently")
+		->check(CLI::Range(1, 64))
+		->capture_default_str();
+
+	rem->add_option("-w,--timeout", r.timeout, "Timeout of name resolution, connection and I/O for each remote, seconds")
+		->check(CLI::Range(1, 600))
+		->capture_default_str();
+
+	rem->add_flag("--json", r.json, "Machine-readable output");
 
 	cmd->add_option_group("stashed", "List stashed USB devices")
 		->add_flag("-s,--stashed", r.stashed, "List devices stashed by 'port --stash'");
@@ -113,12 +126,25 @@ void add_cmd_port(CLI::App &app)
 
 	cmd->add_flag("-s,--stash", r.stash,
 		      "Devices listed by the command will be attached each time the driver is loaded");
+
+	cmd->add_flag("--stats", r.stats, "Show transfer statistics and latency of devices");
 	
 	cmd->add_option("number", r.ports, "Hub port number")
 		->check(CLI::Range(1, MAX_HUB_PORTS))
 		->expected(1, MAX_HUB_PORTS);
 }
 
+void add_cmd_capture(CLI::App &app)
+{
+	static capture_args r;
+
+	auto cmd = app.add_subcommand("capture", "Save recent USB/IP PDUs recorded by the driver")
+		->callback(pack(cmd_capture, &r));
+
+	cmd->add_option("-w,--write", r.file, "pcap file to write, open it with Wireshark")
+		->required();
+}
+
 void init(CLI::App &app, const wchar_t *program)
 {
 	app.set_version_flag("-V,--version", get_version(program));
@@ -141,7 +167,7 @@ auto& get_resource_module() noexcept
 
 void init_spdlog()
 {
-	set_default_logger(spdlog::stderr_color_st("stderr"));
+	set_default_logger(spdlog::stderr_color_mt("stderr")); // 'list' logs from several threads
 	spdlog::set_pattern("%^%l%$: %v");
 
 	using fn = void(const std::string&);
@@ -195,6 +221,7 @@ int wmain(int argc, wchar_t *argv[])
 	add_cmd_detach(app);
 	add_cmd_list(app);
 	add_cmd_port(app);
+	add_cmd_capture(app);
 
 	app.require_subcommand(1);
 	CLI11_PARSE(app, argc, argv);
@@ -6,6 +6,7 @@
 
 #include <string>
 #include <set>
+#include <vector>
 
 #include <libusbip\remote.h>
 
@@ -46,7 +47,11 @@ command_t cmd_detach;
 struct list_args
 {
         // --remote
-        std::string remote;
+        std::vector<std::string> remotes;
+        std::string hosts_file;
+        int jobs = 8; // concurrent queries
+        int timeout = 10; // seconds, per host
+        bool json{};
 
         // --stashed
         bool stashed;
@@ -57,7 +62,14 @@ struct port_args
 {
         std::set<int> ports;
         bool stash;
+        bool stats;
 };
 command_t cmd_port;
 
+struct capture_args
+{
+        std::string file;
+};
+command_t cmd_capture;
+
 } // namespace usbip